@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+
+#ifdef CAPTURE_FROM_MAPPED_FRAMEBUFFER
+
+#include "capture_sampler.h"
+#include "gpu.h"
+#include "util.h"
+#include "mem_alloc.h"
+
+// For each column and row of the captured frame, the column or row of the capture rectangle that it is sampled from
+static int *sourceColumns = 0, *sourceRows = 0;
+static bool unscaledColumns = false; // True if the columns of the captured frame are consecutive pixels of the source framebuffer
+
+// Byte offsets of the sampled pixels in the source framebuffer, and the layout of the source that they were computed for
+static uint32_t *columnOffsets = 0, *rowOffsets = 0;
+static uint32_t offsetsPitch = 0, offsetsOriginX = 0, offsetsOriginY = 0, offsetsWidth = 0, offsetsHeight = 0;
+static int offsetsBytesPerPixel = 0;
+static bool offsetsFit = false;
+
+static uint32_t *sourceRowHashes = 0;
+
+void SetCaptureRectangle(int left, int top, int width, int height)
+{
+  sourceColumns = (int*)Malloc(gpuFrameWidth*sizeof(int), "capture_sampler.cpp sourceColumns");
+  sourceRows = (int*)Malloc(gpuFrameHeight*sizeof(int), "capture_sampler.cpp sourceRows");
+  columnOffsets = (uint32_t*)Malloc(gpuFrameWidth*sizeof(uint32_t), "capture_sampler.cpp columnOffsets");
+  rowOffsets = (uint32_t*)Malloc(gpuFrameHeight*sizeof(uint32_t), "capture_sampler.cpp rowOffsets");
+  sourceRowHashes = (uint32_t*)Malloc(MAX(gpuFrameWidth, gpuFrameHeight)*sizeof(uint32_t), "capture_sampler.cpp sourceRowHashes");
+  memset(sourceRowHashes, 0, MAX(gpuFrameWidth, gpuFrameHeight)*sizeof(uint32_t));
+
+  // Nearest neighbor scaling: sample each captured pixel from the source pixel under its center
+  for(int x = 0; x < gpuFrameWidth; ++x)
+    sourceColumns[x] = left + (int)((2*x+1) * (int64_t)width / (2*gpuFrameWidth));
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    sourceRows[y] = top + (int)((2*y+1) * (int64_t)height / (2*gpuFrameHeight));
+#ifndef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  unscaledColumns = (width == gpuFrameWidth);
+#endif
+  printf("Capture rectangle is offset x=%d,y=%d, size w=%dxh=%d, scaled to %dx%d\n", left, top, width, height, gpuFrameWidth, gpuFrameHeight);
+}
+
+// Computes the byte offsets of the sampled pixels for the layout of the given source, or returns false if the capture rectangle does not fit in it
+static bool ComputeOffsets(const CaptureSource &source, uint32_t originX, uint32_t originY)
+{
+  if (source.pitch == offsetsPitch && source.bytesPerPixel == offsetsBytesPerPixel && originX == offsetsOriginX && originY == offsetsOriginY
+    && source.width == offsetsWidth && source.height == offsetsHeight) return offsetsFit;
+  offsetsPitch = source.pitch;
+  offsetsBytesPerPixel = source.bytesPerPixel;
+  offsetsOriginX = originX;
+  offsetsOriginY = originY;
+  offsetsWidth = source.width;
+  offsetsHeight = source.height;
+
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  // The captured frame is transposed: its columns are sampled from the rows of the source
+  const uint32_t columnBase = originY, rowBase = originX, columnStride = source.pitch, rowStride = source.bytesPerPixel, columnLimit = source.height, rowLimit = source.width;
+#else
+  const uint32_t columnBase = originX, rowBase = originY, columnStride = source.bytesPerPixel, rowStride = source.pitch, columnLimit = source.width, rowLimit = source.height;
+#endif
+  offsetsFit = columnBase + sourceColumns[gpuFrameWidth-1] < columnLimit && rowBase + sourceRows[gpuFrameHeight-1] < rowLimit;
+  if (!offsetsFit)
+  {
+    printf("The source framebuffer of size %ux%u is too small for the capture rectangle\n", source.width, source.height);
+    return false;
+  }
+  for(int x = 0; x < gpuFrameWidth; ++x)
+    columnOffsets[x] = (columnBase + sourceColumns[x]) * columnStride;
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    rowOffsets[y] = (rowBase + sourceRows[y]) * rowStride;
+  return true;
+}
+
+bool SampleCaptureSource(const CaptureSource &source, uint32_t originX, uint32_t originY, uint16_t *destination)
+{
+  if (!ComputeOffsets(source, originX, originY)) return false;
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  for(int y = 0; y < gpuFrameHeight; ++y)
+  {
+    const uint8_t *src = source.pixels + rowOffsets[y];
+    uint16_t *dst = destination + y*stride;
+    if (source.bytesPerPixel == 2)
+    {
+      if (source.bgr)
+        for(int x = 0; x < gpuFrameWidth; ++x)
+        {
+          uint16_t p = *(const uint16_t*)(src + columnOffsets[x]);
+          dst[x] = (p << 11) | (p & 0x07E0) | (p >> 11);
+        }
+      else if (unscaledColumns)
+        memcpy(dst, src + columnOffsets[0], gpuFrameWidth*2);
+      else
+        for(int x = 0; x < gpuFrameWidth; ++x)
+          dst[x] = *(const uint16_t*)(src + columnOffsets[x]);
+    }
+    else if (!source.bgr)
+      for(int x = 0; x < gpuFrameWidth; ++x)
+      {
+        uint32_t p = *(const uint32_t*)(src + columnOffsets[x]);
+        dst[x] = ((p >> 8) & 0xF800) | ((p >> 5) & 0x07E0) | ((p >> 3) & 0x001F);
+      }
+    else
+      for(int x = 0; x < gpuFrameWidth; ++x)
+      {
+        uint32_t p = *(const uint32_t*)(src + columnOffsets[x]);
+        dst[x] = ((p << 8) & 0xF800) | ((p >> 5) & 0x07E0) | ((p >> 19) & 0x001F);
+      }
+  }
+  return true;
+}
+
+bool CaptureSourceChanged(const CaptureSource &source, uint32_t originX, uint32_t originY)
+{
+  if (!ComputeOffsets(source, originX, originY)) return false;
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  // The columns of the captured frame are the sampled rows of the source
+  const uint32_t *sampledRowOffsets = columnOffsets, *sampledColumnOffsets = rowOffsets;
+  const int numSampledRows = gpuFrameWidth, numSampledColumns = gpuFrameHeight;
+#else
+  const uint32_t *sampledRowOffsets = rowOffsets, *sampledColumnOffsets = columnOffsets;
+  const int numSampledRows = gpuFrameHeight, numSampledColumns = gpuFrameWidth;
+#endif
+  // Hash the span of each sampled row that the capture rectangle covers. HashScanline() reads 32-bit words, so start from an aligned address.
+  const uint32_t spanStart = sampledColumnOffsets[0] & ~3u;
+  const uint32_t spanBytes = sampledColumnOffsets[numSampledColumns-1] + source.bytesPerPixel - spanStart;
+  bool changed = false;
+  for(int y = 0; y < numSampledRows; ++y)
+  {
+    const uint8_t *row = source.pixels + sampledRowOffsets[y] + spanStart;
+    uint32_t hash = HashScanline((const uint16_t*)((uintptr_t)row & ~(uintptr_t)3), (spanBytes + ((uintptr_t)row & 3)) >> 1);
+    if (hash != sourceRowHashes[y])
+    {
+      sourceRowHashes[y] = hash;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+#endif
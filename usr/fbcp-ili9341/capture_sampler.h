@@ -0,0 +1,31 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef CAPTURE_FROM_MAPPED_FRAMEBUFFER
+// The capture sources that map the source framebuffer to memory convert its pixels into the captured frames in software: the capture rectangle is
+// sampled nearest neighbor to gpuFrameWidth x gpuFrameHeight, transposed with DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE, and converted to RGB565.
+
+// A source framebuffer mapped to memory
+struct CaptureSource
+{
+  const uint8_t *pixels; // The top-left pixel of the framebuffer
+  uint32_t pitch; // Bytes from one row to the next
+  uint32_t width, height;
+  int bytesPerPixel; // 2 for RGB565, 4 for XRGB8888
+  bool bgr; // Red is in the low bits: BGR565 or XBGR8888
+};
+
+// Sets the rectangle of the source display to capture, in the orientation of the captured frames. Call after the size of the captured frames is known.
+void SetCaptureRectangle(int left, int top, int width, int height);
+
+// Converts the capture rectangle, positioned at (originX, originY) in the source framebuffer, into RGB565 pixels at destination, which has a stride of
+// gpuFramebufferScanlineStrideBytes. Returns false if the capture rectangle does not fit in the source framebuffer.
+bool SampleCaptureSource(const CaptureSource &source, uint32_t originX, uint32_t originY, uint16_t *destination);
+
+// Hashes the rows of the source framebuffer that the capture rectangle samples, and returns true if any of them changed since the previous call. Only
+// reads the source framebuffer, so a source that stays the same can be polled without copying it.
+bool CaptureSourceChanged(const CaptureSource &source, uint32_t originX, uint32_t originY);
+#endif
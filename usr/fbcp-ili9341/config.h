@@ -54,6 +54,67 @@
 
 #endif
 
+// If defined, frames are captured from the framebuffer that a DRM/KMS display driver scans out (dtoverlay=vc4-kms-v3d, where DispmanX is
+// not available), instead of snapshotting them via DispmanX. The GPU polling thread then sleeps until the vblanks that new frames are expected
+// at, instead of polling on a timer. This option is passed from CMake with -DCAPTURE_FROM_DRM=ON, which also links against libdrm.
+// #define CAPTURE_FROM_DRM
+
+#if defined(CAPTURE_FROM_DRM)
+// The path of the DRM device to capture, e.g. "/dev/dri/card1". If not defined, the first device that is showing something is captured.
+// #define DRM_CAPTURE_DEVICE "/dev/dri/card0"
+#endif
+
+// If defined, frames are captured from a Linux framebuffer device, e.g. one that an application draws to directly without X11 or a compositor.
+// The mapped framebuffer is compared in place, so polling it copies nothing until it changes. The GPU polling thread waits for the vsyncs of the
+// framebuffer device if its driver supports FBIO_WAITFORVSYNC. This option is passed from CMake with -DCAPTURE_FROM_FBDEV=ON.
+// #define CAPTURE_FROM_FBDEV
+
+#if defined(CAPTURE_FROM_FBDEV)
+// The path of the framebuffer device to capture.
+#define FBDEV_CAPTURE_DEVICE "/dev/fb0"
+#endif
+
+// If defined, frames are captured from the screen of an X server, e.g. a kiosk desktop. XDamage tells which areas of the screen changed, and only
+// those are read through MIT-SHM and diffed (the damage is passed on as damage hints, see USE_DAMAGE_HINTS). The GPU polling thread sleeps until
+// the X server reports damage, so an idle desktop costs no CPU time. This option is passed from CMake with -DCAPTURE_FROM_X11=ON, which also
+// links against libX11, libXext, libXfixes and libXdamage.
+// #define CAPTURE_FROM_X11
+
+#if defined(CAPTURE_FROM_X11)
+// The X display to capture. If not defined, the display in the DISPLAY environment variable is captured, or ":0" if it is not set.
+// #define X11_CAPTURE_DISPLAY ":0"
+#endif
+
+// If defined, frames are not captured at all, but handed over by an application that renders them itself, through the producer API in
+// producer/fbcp_producer.h: the application draws RGB565 frames into a triple buffer in shared memory, and rings a futex doorbell when a frame
+// is finished. The GPU polling thread sleeps on the doorbell, so each frame is taken as soon as it is finished, instead of when a poll happens
+// to find it, and no snapshot of the screen is taken. The rectangles that the application reports as changed are passed on as damage hints.
+// This option is passed from CMake with -DCAPTURE_FROM_PRODUCER=ON, which also builds the producer library and an example producer.
+// #define CAPTURE_FROM_PRODUCER
+
+#if defined(CAPTURE_FROM_PRODUCER)
+// The size of the frames that the producer renders. They are scaled to the display like captured frames, so rendering them at the size of the
+// drawable area of the display (in landscape orientation with DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) hands them over without any scaling.
+#define PRODUCER_FRAME_WIDTH 320
+#define PRODUCER_FRAME_HEIGHT 240
+#endif
+
+#if defined(CAPTURE_FROM_DRM) || defined(CAPTURE_FROM_FBDEV) || defined(CAPTURE_FROM_X11) || defined(CAPTURE_FROM_PRODUCER)
+// These capture sources map the source framebuffer to memory, and scale and convert it in software (capture_sampler.cpp)
+#define CAPTURE_FROM_MAPPED_FRAMEBUFFER
+
+// The GPU polling thread waits for the vblanks of the capture source itself, the DispmanX vsync callback is not available.
+#if defined(USE_GPU_VSYNC)
+#undef USE_GPU_VSYNC
+#endif
+#else
+#define CAPTURE_FROM_DISPMANX
+#endif
+
+// If defined, only this rectangle (x, y, width, height) of the source display is captured, e.g. the area of the window of a specific application.
+// The rectangle is then scaled or cropped to the SPI display like the full source display would be.
+// #define CAPTURE_SOURCE_RECTANGLE 0, 0, 640, 480
+
 // If enabled, the source video frame is not scaled to fit to the screen, but instead if the source frame
 // is bigger than the SPI display, then content is cropped away, i.e. the source is displayed "centered"
 // on the SPI screen:
@@ -77,10 +138,15 @@
 // If defined, all frames are always rendered as interlaced, and never use progressive rendering.
 // #define ALWAYS_INTERLACING
 
+// When the changed pixels do not fit on the SPI bus in the time available for a frame, interlacing first drops to
+// updating every second scanline per frame, and if even that is too much, every third or fourth. This sets the most
+// fields that a frame may be split into (2, 3 or 4). Set to 2 to only ever use even/odd field interlacing.
+#define MAX_INTERLACED_FIELDS 4
+
 // By default, if the SPI bus is idle after rendering an interlaced frame, but the GPU has not yet produced
 // a new application frame to be displayed, the same frame will be rendered again for its other field.
 // Define this option to disable this behavior, in which case when an interlaced frame is rendered, the 
-// remaining other field half of the image will never be uploaded.
+// remaining other fields of the image will never be uploaded.
 // #define THROTTLE_INTERLACING
 
 // The ILI9486 has to resort to interlacing as a rule rather than exception, and it works much smoother
@@ -93,6 +159,14 @@
 // DMA usage is tailored towards maximum performance.
 // #define ALL_TASKS_SHOULD_DMA
 
+// Fixed time in microseconds that each SPI task costs on top of the bus time of its bytes, used to decide when merging two spans into one saves bus
+// time (see MergeScanlineSpanList()). The logic analyzer measurement of the cursor commands in diff.h already includes the gaps between polled tasks,
+// so polled tasks cost nothing extra. The DMA value is not measured: it is an estimate that keeps spans merging across runs of up to 320 unchanged
+// pixels at a bus speed of 400MHz/6, as the fixed merge threshold of ALL_TASKS_SHOULD_DMA did before. fbcp-span-merge-benchmark in host/ shows
+// how the merge responds to these values on recorded frames.
+#define SPI_POLLED_TASK_OVERHEAD_USECS 0.0
+#define SPI_DMA_TASK_OVERHEAD_USECS 38.0
+
 // If defined, screen updates are performed in strictly one update rectangle per frame.
 // This reduces CPU consumption at the expense of sending more pixels. You can try enabling this
 // if your SPI display runs at a good high SPI bus MHz speed with respect to the screen resolution.
@@ -101,6 +175,12 @@
 // costs more CPU time). Enabling this requires that ALL_TASKS_SHOULD_DMA is also enabled.
 // #define UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF
 
+// If UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF is used, and this is defined, the changed pixels are covered with up to this
+// many rectangles instead of just one, so that e.g. two small widgets in opposite corners of the screen do not cause the
+// whole screen in between to be sent. Each rectangle is one task, so the number of tasks per frame stays bounded. Values
+// of 4-16 are reasonable; more rectangles send fewer pixels, but take more CPU time to find.
+// #define MAX_DIFF_RECTANGLES 8
+
 // If UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF is used, controls whether the generated tasks are aligned for
 // ARMv6 cache lines. This is good to be enabled for ARMv6 Pis, doesn't make much difference on ARMv7 and ARMv8 Pis.
 #define ALIGN_DIFF_TASKS_FOR_32B_CACHE_LINES
@@ -110,6 +190,16 @@
 // requires that ALL_TASKS_SHOULD_DMA is also enabled.
 // #define UPDATE_FRAMES_WITHOUT_DIFFING
 
+// If defined, the update method is chosen at runtime for each frame instead of at compile time, among sending the whole frame, sending the changed
+// rectangles (see MAX_DIFF_RECTANGLES), and diffing scanline spans with the coarse or with the precise method. The choice is made from the dirty tiles
+// of the frame: how much of the screen changed, and how tightly the changes cluster, weighed against the CPU time and the bus bytes per tile that each
+// method was measured to take on recent frames. Static and sparsely updating content ends up diffed by scanline spans, while full screen video, whose
+// diff would cost CPU time without saving bus bytes, ends up sent as rectangles or whole frames. Methods that send whole rectangles are only chosen if
+// the frame fits the time available without interlacing. With STATISTICS, the overlay shows the current method and the number of switches per second.
+// Not available if UPDATE_FRAMES_WITHOUT_DIFFING or UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF pin the update method, or with PERCEPTUAL_DIFF_TOLERANCE,
+// USE_ROLLING_REFRESH or ALWAYS_INTERLACING.
+// #define ADAPTIVE_DIFF_STRATEGY
+
 #if defined(SINGLE_CORE_BOARD) && defined(USE_DMA_TRANSFERS) && !defined(SPI_3WIRE_PROTOCOL) // TODO: 3-wire SPI displays are not yet compatible with ALL_TASKS_SHOULD_DMA option.
 // These are prerequisites for good performance on Pi Zero
 #ifndef ALL_TASKS_SHOULD_DMA
@@ -119,8 +209,8 @@
 #define NO_INTERLACING
 #endif
 // This saves a lot of CPU, but if you don't care and your SPI display does not have much bandwidth, try uncommenting this for more performant
-// screen updates
-#ifndef UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF
+// screen updates. With ADAPTIVE_DIFF_STRATEGY, the rectangle is one of the methods chosen from at runtime instead.
+#if !defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF) && !defined(ADAPTIVE_DIFF_STRATEGY)
 #define UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF
 #endif
 #endif
@@ -135,6 +225,183 @@
 #define FAST_BUT_COARSE_PIXEL_DIFF
 #endif
 
+// If defined, per-pixel diffing is performed with vectorized kernels (NEON on Pi 2/3/4, a 64-bit scalar
+// fallback on Pi Zero/Pi 1) that are selected at startup based on the features of the CPU. These produce
+// exactly the same spans as the precise method, at a speed that is on par or faster than the coarse
+// method, so this takes precedence over FAST_BUT_COARSE_PIXEL_DIFF.
+#define USE_SIMD_PIXEL_DIFF
+
+#ifndef UPDATE_FRAMES_WITHOUT_DIFFING
+// If defined, each frame is first divided into 16x16 pixel tiles, and a quick pass over the framebuffer
+// flags which tiles have any changed pixels in them. The diffing methods then only look at pixels inside
+// the dirty tiles, so that the cost of diffing is proportional to the area of the screen that changed,
+// rather than the size of the whole screen. Speeds up diffing when only small parts of the screen change.
+#define USE_DIRTY_TILE_PREPASS
+
+// If defined, a hash of each scanline is computed once when a new frame is captured, and scanlines whose hash
+// has not changed are skipped without reading the pixels of the previous frame. Roughly halves the memory
+// bandwidth spent on new frame detection and diffing when most of the screen is static. In the unlikely case of
+// a hash collision a changed scanline goes unnoticed, so every SCANLINE_HASH_VERIFY_USECS the scanlines whose hashes
+// are unchanged are compared pixel by pixel against the previous frame, even if the screen is otherwise static.
+#define USE_SCANLINE_HASHES
+#endif
+
+#define SCANLINE_HASH_VERIFY_USECS 1000000
+
+// If defined, a producer that knows which rectangles of the screen it repainted can send them as damage hints to a Unix
+// datagram socket at DAMAGE_HINT_SOCKET_PATH (see damage_hints.h for the format). While hints keep arriving, only the
+// dirty tiles under the hinted rectangles are compared, so diffing costs next to nothing when little is repainted. Every
+// DAMAGE_HINT_VERIFY_INTERVAL frames the whole frame is compared anyway, to catch changes that the producer failed to report.
+// If no hints arrive for DAMAGE_HINT_TIMEOUT_USECS, or some hints were lost, whole frames are compared as usual.
+// Requires USE_DIRTY_TILE_PREPASS.
+// #define USE_DAMAGE_HINTS
+
+#if (defined(CAPTURE_FROM_X11) || defined(CAPTURE_FROM_PRODUCER)) && !defined(USE_DAMAGE_HINTS)
+// The X11 and producer capture sources are told which areas changed, and pass them on as damage hints
+#define USE_DAMAGE_HINTS
+#endif
+
+#if defined(USE_DAMAGE_HINTS) && !defined(USE_DIRTY_TILE_PREPASS)
+#undef USE_DAMAGE_HINTS
+#endif
+
+#define DAMAGE_HINT_SOCKET_PATH "/tmp/fbcp-ili9341-damage"
+#define DAMAGE_HINT_VERIFY_INTERVAL 60
+#define DAMAGE_HINT_TIMEOUT_USECS 2000000
+
+// A hinted area is compared on this many captured frames, since the repainted content may reach the captured frames a
+// frame or two after the producer sent the hint.
+#define DAMAGE_HINT_LINGER_FRAMES 3
+
+// If defined, per-pixel diffing is split into NUM_DIFF_THREADS horizontal bands of the frame that are diffed in parallel,
+// one on the main thread and the rest on a pool of worker threads. Each band produces spans into its own array, and
+// the results are stitched together to the same spans that a single threaded diff would produce. The bands are sized
+// so that each gets an equal share of the scanlines that may have changed. On Pi 2/3/4 the main thread, the SPI thread
+// and the GPU polling thread leave a core or two idle, so this can cut the time spent diffing large frames. Costs some
+// CPU time to wake the worker threads, so only worth enabling for large display resolutions.
+// This option is incomplete: how the diff scales with 1-4 threads has not been measured on a Pi 2/3/4, so whether it pays
+// off at all, and the default of NUM_DIFF_THREADS, are unverified. Measure it on your board with fbcp-diff-thread-benchmark
+// from host/ (built on the Pi), or with BENCHMARK_DIFF_THREADS, before relying on it.
+#if !defined(SINGLE_CORE_BOARD) && !defined(UPDATE_FRAMES_WITHOUT_DIFFING)
+// #define USE_MULTITHREADED_DIFF
+#endif
+
+#if defined(USE_MULTITHREADED_DIFF) && !defined(NUM_DIFF_THREADS)
+#define NUM_DIFF_THREADS 2
+#endif
+
+// If defined, vertical scrolling of the screen contents (a terminal printing new lines, a scrolling list, etc.) is detected
+// by matching the scanline hashes of the new frame against those of the previous frame at candidate offsets. When the frame
+// is found to have scrolled, the display controller is told to scroll the contents that are already on the panel in hardware,
+// so that only the newly exposed scanlines, and whatever else changed, need to be sent instead of nearly the whole screen.
+// Requires USE_SCANLINE_HASHES and a display controller that supports hardware scrolling (ILI9340/ILI9341 and SSD1351).
+// The controller scrolls along the native vertical axis of the panel, so on a portrait panel that is used in landscape
+// orientation, this speeds up horizontal scrolling instead. Not available if the orientation is flipped by the controller
+// (use DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE instead), or with DISPLAY_ROTATE_180_DEGREES.
+// #define USE_HARDWARE_SCROLLING
+
+// If defined, frames are diffed lossily: a pixel whose color differs from what the display is already showing by at most
+// this many steps in each color channel (red and blue in 5 bit steps, green in 6 bit steps counted in pairs) is not sent on
+// its own. Video and scaled content flicker by an LSB or two from frame to frame in large areas, and each such pixel would
+// otherwise become a span. Tolerated pixels are sent along with any span that they fall inside, and are corrected exactly
+// after PERCEPTUAL_DIFF_DRIFT_CORRECTION_FRAMES updates. With STATISTICS, the overlay shows the share of bus bytes saved and
+// the PSNR of what the display shows versus the frames. Diffs on the main thread only, in place of USE_MULTITHREADED_DIFF.
+// #define PERCEPTUAL_DIFF_TOLERANCE 1
+
+#if defined(PERCEPTUAL_DIFF_TOLERANCE) && defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_WITHOUT_DIFFING) || defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF))
+#undef PERCEPTUAL_DIFF_TOLERANCE // These update methods do not diff individual pixels
+#endif
+
+// Right next to a visibly changed pixel, the tolerance is lowered by this many steps to keep the span going, so that
+// changed areas get sent with their edges, and do not leave a faint halo of tolerated pixels around them.
+#define PERCEPTUAL_DIFF_HYSTERESIS 1
+
+// After a scanline has shown tolerated pixels for this many updates, it is diffed exactly, so that the pixels that have
+// drifted off from the frame within the tolerance get corrected.
+#define PERCEPTUAL_DIFF_DRIFT_CORRECTION_FRAMES 30
+
+// If defined, when the changed pixels do not fit on the SPI bus in the time available for a frame, as many whole changed scanlines
+// are sent as fit, and the rest are carried over to the following updates, instead of interlacing. The changed scanlines that have
+// waited the longest are sent first, so the display is refreshed in a rolling manner at full vertical resolution, rather than at
+// half or less. With STATISTICS, the overlay shows the most updates that a changed scanline had to wait. Replaces interlacing, so
+// MAX_INTERLACED_FIELDS and ALWAYS_INTERLACING have no effect. Not available with PERCEPTUAL_DIFF_TOLERANCE.
+// #define USE_ROLLING_REFRESH
+
+#if defined(USE_ROLLING_REFRESH) && (defined(NO_INTERLACING) || defined(PERCEPTUAL_DIFF_TOLERANCE) || (defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_WITHOUT_DIFFING) || defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF))))
+#undef USE_ROLLING_REFRESH
+#endif
+
+// With USE_ROLLING_REFRESH, a changed scanline is sent at the latest on the update when it has waited for this many updates,
+// even if that takes longer than the time available.
+#define ROLLING_REFRESH_MAX_SCANLINE_AGE 6
+
+#if defined(ADAPTIVE_DIFF_STRATEGY) && (defined(UPDATE_FRAMES_WITHOUT_DIFFING) || defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF) || defined(PERCEPTUAL_DIFF_TOLERANCE) \
+  || defined(USE_ROLLING_REFRESH) || defined(ALWAYS_INTERLACING) || !defined(USE_DIRTY_TILE_PREPASS))
+#undef ADAPTIVE_DIFF_STRATEGY // The update method is pinned, or these select scanline spans on their own
+#endif
+
+// With ADAPTIVE_DIFF_STRATEGY, the method that was measured the longest ago is tried out once every this many diffed frames, so that its measured costs
+// keep up with changes in the content.
+#define DIFF_STRATEGY_PROBE_INTERVAL 60
+
+// With ADAPTIVE_DIFF_STRATEGY, the method is only switched when another one is estimated to cost less by this percentage, so that the choice does not
+// flip back and forth on every frame when two methods cost about the same.
+#define DIFF_STRATEGY_SWITCH_MARGIN_PERCENT 15
+
+// If defined, when a new frame arrives while the SPI thread is still behind on sending the pixels of the previous one, the queued pixel tasks that
+// it has not started on yet are rewritten in place with the pixels of the new frame, wherever the new frame has changed them. The diff of the new
+// frame then finds those pixels already on their way to the display, so the bus does not spend time sending pixels that are immediately overwritten.
+// Off by default, since this has not yet been validated on a Pi.
+// #define SUPERSEDE_QUEUED_PIXEL_TASKS
+
+// If defined, the main thread queues pixel tasks that only describe which span of which captured frame to send, and the SPI thread packs the
+// pixels of the span into the task just before it sends it. This saves the main thread from writing the pixels into the SPI task queue, and
+// together with SUPERSEDE_QUEUED_PIXEL_TASKS, a queued task is simply pointed to the newer frame when one arrives, so the pixels are fetched as
+// late as possible. The captured frames stay referenced until their pixels have been packed, so the frame pool holds more frames.
+// #define LATE_LATCH_PIXEL_TASKS
+
+// If defined, spans that are a single solid color, such as cleared areas and flat backgrounds, are queued as fill tasks that hold the color only
+// once. The SPI thread repeats the color on the bus, with DMA reading it over and over from a single word without incrementing the source address,
+// so the pixels of the span are not packed into the SPI task queue, nor copied to the DMA source buffer. ClearScreen() also clears with fill tasks.
+// Off by default, since the non-incrementing DMA source has not yet been verified on hardware.
+// #define SOLID_FILL_TASKS
+
+// Spans with fewer pixels than this are always sent as pixels, since checking whether a small span is solid saves little.
+#define SOLID_FILL_MIN_PIXELS 32
+
+// If defined, every frame is additionally diffed with each available diff kernel, and their results are
+// verified against the precise method. Timings in ns/frame are printed to the console every two seconds.
+// Used to debug/measure performance of the diffing kernels.
+// #define BENCHMARK_DIFF_KERNELS
+
+// If defined, the spans of each frame are additionally merged with the old greedy span merging method, and the bus
+// bytes/time needed to submit the spans, and the CPU time spent merging, are compared against the current method
+// and printed to the console every two seconds. Used to debug/measure performance of span merging.
+// #define BENCHMARK_SPAN_MERGE
+
+// If defined, the pixels of every frame are additionally packed with the old separate byte swap + memcpy() method, and
+// with each available fused pack kernel into scratch buffers, and the results are verified against each other. Timings in
+// ns/frame and the memory bandwidth saved by the fused kernels are printed to the console every two seconds. Used to
+// debug/measure performance of the pixel packing kernels.
+// #define BENCHMARK_PACK_KERNELS
+
+// If defined together with USE_MULTITHREADED_DIFF, every frame is additionally diffed split into 1, 2, ..., NUM_DIFF_THREADS
+// bands, and the results are verified against the single threaded diff. Timings in ns/frame and the speedup over a single band
+// are printed to the console every two seconds. Used to debug/measure the scaling of the multithreaded diff.
+// #define BENCHMARK_DIFF_THREADS
+
+// If defined together with USE_HARDWARE_SCROLLING, a model of the display memory of the panel is kept on the host: each command that
+// is queued to the display (the write windows, the pixels, and the scroll area and scroll start commands) is replayed onto it. After
+// each update, the rows that the modeled panel shows are compared against the scanlines that are considered up to date, and any
+// mismatches are printed to the console. Used to debug hardware scrolling without having to inspect the display by eye.
+// #define VERIFY_HARDWARE_SCROLLING
+
+// If defined, the new frames that are given to the differs, with the statistics overlay and the low battery icon drawn on them, are recorded to
+// the given file, so that the diff kernels, span merging and hardware scrolling can be replayed and checked against them off the device with the
+// tools in host/. Stops after RECORD_FRAME_TRACE_MAX_FRAMES frames. Used to capture real workloads to benchmark and debug against.
+// #define RECORD_FRAME_TRACE "/tmp/fbcp-ili9341.trace"
+#define RECORD_FRAME_TRACE_MAX_FRAMES 3600
+
 #if defined(ALL_TASKS_SHOULD_DMA)
 // This makes all submitted tasks go through DMA, and not use a hybrid Polled SPI + DMA approach.
 #define ALIGN_TASKS_FOR_DMA_TRANSFERS
@@ -152,6 +419,34 @@
 // to detect if an application uses a non-60Hz update rate, and synchronizes to that instead.
 #define SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES
 
+// If defined, captured frames pass through a presentation stage that hands them over to be diffed and sent on a steady clock, instead of as soon as
+// they are captured. Content that produces its frames unevenly, e.g. 50 Hz emulators or video decoders with bursty output, is then shown at an even
+// cadence, at the cost of holding frames for up to PRESENTATION_JITTER_BUFFER_FRAMES frame intervals. The clock ticks at the average interval of the
+// recently captured frames, but never faster than the frame rate that the frame arrival times are predicted at. With STATISTICS, the overlay shows the
+// standard deviation of the intervals that frames were captured at and were handed over at, in msecs. Not available with USE_GPU_VSYNC, which paces
+// the frames to the vsync signal.
+// #define USE_PRESENTATION_SCHEDULER
+
+#if defined(USE_PRESENTATION_SCHEDULER) && defined(USE_GPU_VSYNC)
+#undef USE_PRESENTATION_SCHEDULER
+#endif
+
+// With USE_PRESENTATION_SCHEDULER, the number of captured frames (0-2) that are held in addition to the frame waiting for its turn. If more frames
+// are captured than that, the oldest ones are dropped, which bounds the latency that is added.
+#define PRESENTATION_JITTER_BUFFER_FRAMES 1
+
+// With USE_PRESENTATION_SCHEDULER, if defined, the clock favors smoothness over latency: after the buffer runs dry, frames are handed over again only
+// once the buffer has filled up, so that the frames held in it cover for the next late frame. This adds PRESENTATION_JITTER_BUFFER_FRAMES frame
+// intervals of latency. If not defined, a late frame is handed over right away and the clock restarts from it, so only frames that arrive early wait.
+// #define PRESENTATION_SMOOTHNESS_FIRST
+
+#if defined(USE_PRESENTATION_SCHEDULER) && defined(USE_DAMAGE_HINTS)
+// Hints are received when the main thread takes a frame, and the frames held in the jitter buffer behind it may have been captured after the hinted
+// repaints, so hinted areas need to be compared on those frames as well.
+#undef DAMAGE_HINT_LINGER_FRAMES
+#define DAMAGE_HINT_LINGER_FRAMES (4 + PRESENTATION_JITTER_BUFFER_FRAMES)
+#endif
+
 // If defined, rotates the display 180 degrees. This might not rotate the panel scan order though,
 // so adding this can cause up to one vsync worth of extra display latency. It is best to avoid this and
 // install the display in its natural rotation order, if possible.
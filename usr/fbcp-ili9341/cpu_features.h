@@ -0,0 +1,52 @@
+#pragma once
+
+// Detects which SIMD instruction sets the pixel kernels (diff_kernels.cpp, pack_kernels.cpp) can be compiled for, and provides runtime checks for whether
+// the CPU we are running on supports them.
+
+#if defined(__arm__) && !defined(__aarch64__)
+#include <sys/auxv.h> // getauxval, AT_HWCAP
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#endif
+
+// ARM NEON: Always present on AArch64. On 32-bit ARM builds, the CMake script does not pass -mfpu=neon since the same binary layout is used
+// for ARMv6 Pis that do not have NEON, so enable NEON code generation only for the NEON kernels, and check at runtime whether it is safe to call them.
+// Wrap NEON kernels in NEON_KERNELS_BEGIN and NEON_KERNELS_END.
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS
+#elif defined(__arm__) && defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8
+#pragma GCC push_options
+#pragma GCC target("fpu=neon")
+#include <arm_neon.h>
+#pragma GCC pop_options
+#define HAVE_NEON_KERNELS
+#define NEON_KERNELS_NEED_TARGET_PRAGMA
+#endif
+
+#ifdef NEON_KERNELS_NEED_TARGET_PRAGMA
+#define NEON_KERNELS_BEGIN _Pragma("GCC push_options") _Pragma("GCC target(\"fpu=neon\")")
+#define NEON_KERNELS_END _Pragma("GCC pop_options")
+#else
+#define NEON_KERNELS_BEGIN
+#define NEON_KERNELS_END
+#endif
+
+// x86 kernels are present for running the kernels on a host PC, e.g. to profile them.
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_SSE2_KERNELS
+#define HAVE_AVX2_KERNELS
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+static inline bool CpuHasNeon()
+{
+#if defined(__arm__) && !defined(__aarch64__)
+  return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+  return true;
+#endif
+}
+#endif
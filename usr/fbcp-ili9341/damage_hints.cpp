@@ -0,0 +1,259 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "damage_hints.h"
+#include "diff.h"
+#include "gpu.h"
+#include "tick.h"
+#include "util.h"
+#include "mem_alloc.h"
+
+#ifdef USE_DAMAGE_HINTS
+
+// The statistics overlay text and the low battery icon are drawn on top of the captured frames within this many scanlines from the top, so that area
+// changes without the producer knowing about it.
+#define OVERLAY_HEIGHT 32
+
+// Tiles that the verification sweeps find changed without a hint are reported at most this often, summed over the sweeps in between, so that a
+// producer that keeps missing changes does not flood the output from the main loop.
+#define MISSED_HINTS_REPORT_INTERVAL_USECS 10000000
+
+static int hintSocket = -1;
+static uint8_t *hintTileFrames = 0; // For each tile, the number of captured frames that it still needs to be compared on because of a hint
+static uint8_t *candidateTiles = 0; // The tiles to compare on the current frame
+static bool haveSequence = false; // True after the first hint has been received
+static uint32_t nextSequence = 0; // The sequence number that the next hint should have
+static uint64_t lastHintTime = 0;
+static bool diffWholeNextFrame = true; // Set when hints were lost, so what changed is not known
+static int framesUntilVerification = DAMAGE_HINT_VERIFY_INTERVAL;
+static bool verifyingThisFrame = false;
+static bool hintedSinceWholeFrame = false; // True if frames have been compared only on the hinted tiles since the last whole frame comparison
+static uint64_t lastMissedHintsReportTime = 0;
+static int numMissedTilesSinceReport = 0, numSweepsWithMissesSinceReport = 0;
+
+// The damage reported by the capture source, passed from the GPU polling thread. Only held for a few instructions, so the lock is a spinlock.
+static volatile int capturedDamageLock = 0;
+static DamageHintRect capturedDamage[DAMAGE_HINT_MAX_RECTS];
+static int numCapturedDamageRects = 0;
+static bool capturedDamageOverflowed = false; // More rectangles were reported than fit, so what changed is not known
+static bool capturedDamagePending = false; // True if damage has been reported since it was last received
+static bool haveCapturedDamage = false; // True after damage from the capture source has been received
+
+void InitDamageHints()
+{
+  const int numTiles = numDirtyTilesX * numDirtyTilesY;
+  hintTileFrames = (uint8_t*)Malloc(numTiles, "InitDamageHints() hint tiles");
+  candidateTiles = (uint8_t*)Malloc(numTiles, "InitDamageHints() candidate tiles");
+  memset(hintTileFrames, 0, numTiles);
+
+  hintSocket = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (hintSocket < 0) FATAL_ERROR("Failed to create damage hint socket!");
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, DAMAGE_HINT_SOCKET_PATH, sizeof(addr.sun_path)-1);
+  unlink(DAMAGE_HINT_SOCKET_PATH); // Left behind if the previous run did not quit gracefully
+  if (bind(hintSocket, (sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    printf("Failed to bind damage hint socket to %s (%s), diffing whole frames\n", DAMAGE_HINT_SOCKET_PATH, strerror(errno));
+    close(hintSocket);
+    hintSocket = -1;
+    return;
+  }
+  chmod(DAMAGE_HINT_SOCKET_PATH, 0666); // Let producers that do not run as root send hints
+  printf("Receiving damage hints at %s\n", DAMAGE_HINT_SOCKET_PATH);
+}
+
+void DeinitDamageHints()
+{
+  if (hintSocket < 0) return;
+  close(hintSocket);
+  hintSocket = -1;
+  unlink(DAMAGE_HINT_SOCKET_PATH);
+}
+
+// Sets the flags of the tiles that overlap the framebuffer area [x0, x1[ x [y0, y1[ to the given value.
+static void MarkTiles(uint8_t *tiles, int x0, int y0, int x1, int y1, uint8_t value)
+{
+  x0 = MAX(x0, 0);
+  y0 = MAX(y0, 0);
+  x1 = MIN(x1, gpuFrameWidth);
+  y1 = MIN(y1, gpuFrameHeight);
+  if (x0 >= x1 || y0 >= y1) return;
+  for(int ty = y0 >> DIRTY_TILE_SIZE_LOG2; ty <= (y1-1) >> DIRTY_TILE_SIZE_LOG2; ++ty)
+    memset(tiles + ty*numDirtyTilesX + (x0 >> DIRTY_TILE_SIZE_LOG2), value, ((x1-1) >> DIRTY_TILE_SIZE_LOG2) - (x0 >> DIRTY_TILE_SIZE_LOG2) + 1);
+}
+
+static void MarkHintedRect(const DamageHintRect &rect)
+{
+  int x0 = rect.x, y0 = rect.y, x1 = rect.x + rect.width, y1 = rect.y + rect.height;
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  // The captured frames are transposed from the orientation of the source display
+  int tmp = x0; x0 = y0; y0 = tmp;
+  tmp = x1; x1 = y1; y1 = tmp;
+#endif
+  // Scale from source display pixels to the pixels of the captured resource, which extends past the framebuffer by the overscan that was cropped away.
+  // The GPU filters when scaling, and the scaled sizes are rounded, so grow the area by a couple of pixels to cover everything that the rectangle affects.
+  const int resourceWidth = gpuFrameWidth + excessPixelsLeft + excessPixelsRight;
+  const int resourceHeight = gpuFrameHeight + excessPixelsTop + excessPixelsBottom;
+  x0 = (int)((int64_t)x0 * resourceWidth / gpuDisplayWidth) - excessPixelsLeft - 2;
+  y0 = (int)((int64_t)y0 * resourceHeight / gpuDisplayHeight) - excessPixelsTop - 2;
+  x1 = (int)(((int64_t)x1 * resourceWidth + gpuDisplayWidth - 1) / gpuDisplayWidth) - excessPixelsLeft + 2;
+  y1 = (int)(((int64_t)y1 * resourceHeight + gpuDisplayHeight - 1) / gpuDisplayHeight) - excessPixelsTop + 2;
+  MarkTiles(hintTileFrames, x0, y0, x1, y1, DAMAGE_HINT_LINGER_FRAMES);
+}
+
+static void ReceiveDamageHints()
+{
+  static uint8_t datagram[sizeof(DamageHintHeader) + DAMAGE_HINT_MAX_RECTS*sizeof(DamageHintRect)];
+  const DamageHintHeader *header = (const DamageHintHeader *)datagram;
+  const DamageHintRect *rects = (const DamageHintRect *)(header + 1);
+  for(;;)
+  {
+    ssize_t size = recv(hintSocket, datagram, sizeof(datagram), MSG_TRUNC); // With MSG_TRUNC, returns the full size of datagrams that did not fit
+    if (size < 0) break; // No more pending hints
+
+    if (size < (ssize_t)sizeof(DamageHintHeader) || header->magic != DAMAGE_HINT_MAGIC || header->numRects > DAMAGE_HINT_MAX_RECTS
+      || size != (ssize_t)(sizeof(DamageHintHeader) + header->numRects*sizeof(DamageHintRect)))
+    {
+      diffWholeNextFrame = true; // Not a valid hint, so some changes may go unreported
+      continue;
+    }
+    if (haveSequence && header->sequence != nextSequence) diffWholeNextFrame = true; // Hints were lost in between
+    haveSequence = true;
+    nextSequence = header->sequence + 1;
+    lastHintTime = tick();
+    for(uint32_t i = 0; i < header->numRects; ++i)
+      MarkHintedRect(rects[i]);
+  }
+}
+
+void AddCapturedDamage(const DamageHintRect *rects, int numRects)
+{
+  while(__sync_lock_test_and_set(&capturedDamageLock, 1))
+    ;
+  if (numCapturedDamageRects + numRects <= DAMAGE_HINT_MAX_RECTS)
+  {
+    memcpy(capturedDamage + numCapturedDamageRects, rects, numRects*sizeof(DamageHintRect));
+    numCapturedDamageRects += numRects;
+  }
+  else
+    capturedDamageOverflowed = true;
+  capturedDamagePending = true;
+  __sync_lock_release(&capturedDamageLock);
+}
+
+static void ReceiveCapturedDamage()
+{
+  static DamageHintRect rects[DAMAGE_HINT_MAX_RECTS];
+  while(__sync_lock_test_and_set(&capturedDamageLock, 1))
+    ;
+  if (!capturedDamagePending)
+  {
+    __sync_lock_release(&capturedDamageLock);
+    return;
+  }
+  int numRects = numCapturedDamageRects;
+  memcpy(rects, capturedDamage, numRects*sizeof(DamageHintRect));
+  if (capturedDamageOverflowed) diffWholeNextFrame = true;
+  numCapturedDamageRects = 0;
+  capturedDamageOverflowed = false;
+  capturedDamagePending = false;
+  __sync_lock_release(&capturedDamageLock);
+
+  // The capture source reports damage with each frame that it captures, so the damage stays in use however long the source display sits idle
+  haveCapturedDamage = true;
+  lastHintTime = tick();
+  for(int i = 0; i < numRects; ++i)
+    MarkHintedRect(rects[i]);
+}
+
+// Returns null to compare the whole frame. Frames that were compared only on the hinted tiles still updated the previous scanline hashes of all
+// scanlines, so a change that was not hinted would be hidden from the whole frame comparison behind an unchanged scanline hash. Rehash the previous
+// frame to make the hashes reflect what is actually on the display.
+static const uint8_t *DiffWholeFrame(const uint16_t *prevFramebuffer)
+{
+#ifdef USE_SCANLINE_HASHES
+  if (hintedSinceWholeFrame) ComputeScanlineHashes(prevFramebuffer, prevScanlineHashes);
+#endif
+  hintedSinceWholeFrame = false;
+  return 0;
+}
+
+const uint8_t *DamageHintTilesToDiff(const uint16_t *prevFramebuffer)
+{
+  verifyingThisFrame = false;
+  if (hintSocket >= 0) ReceiveDamageHints();
+  ReceiveCapturedDamage();
+
+  // Compare the tiles that were hinted on this or the few previous frames (the hinted content may not have been captured yet when the hint arrived),
+  // and the tiles that were left dirty after the previous frame.
+  const int numTiles = numDirtyTilesX * numDirtyTilesY;
+  for(int i = 0; i < numTiles; ++i)
+  {
+    candidateTiles[i] = hintTileFrames[i] | dirtyTiles[i];
+    if (hintTileFrames[i]) --hintTileFrames[i];
+  }
+#if defined(STATISTICS) || defined(LOW_BATTERY_PIN)
+  MarkTiles(candidateTiles, 0, 0, gpuFrameWidth, OVERLAY_HEIGHT, 1);
+#if defined(STATISTICS) && defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE)
+  MarkTiles(candidateTiles, 0, 0, OVERLAY_HEIGHT, gpuFrameHeight, 1); // The statistics text runs down the columns of the transposed frames
+#endif
+#endif
+#if defined(STATISTICS) && defined(FRAME_COMPLETION_TIME_STATISTICS)
+  MarkTiles(candidateTiles, 0, 0, gpuFrameWidth, gpuFrameHeight, 1); // The frame interval graph is drawn across the whole frame
+#endif
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+  // The scanlines that the display shows tolerated pixels on need to be diffed until their drift gets corrected, whether or not they were hinted
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    if (scanlineDriftAge[y] > 0)
+      MarkTiles(candidateTiles, 0, y, gpuFrameWidth, y+1, 1);
+#endif
+
+  if ((!haveSequence && !haveCapturedDamage) || tick() - lastHintTime >= DAMAGE_HINT_TIMEOUT_USECS) return DiffWholeFrame(prevFramebuffer); // No producer is sending hints
+  if (diffWholeNextFrame)
+  {
+    diffWholeNextFrame = false;
+    return DiffWholeFrame(prevFramebuffer);
+  }
+  if (--framesUntilVerification <= 0)
+  {
+    framesUntilVerification = DAMAGE_HINT_VERIFY_INTERVAL;
+    verifyingThisFrame = true;
+    return DiffWholeFrame(prevFramebuffer);
+  }
+  hintedSinceWholeFrame = true;
+  return candidateTiles;
+}
+
+void VerifyDamageHints()
+{
+  if (!verifyingThisFrame) return;
+  int numMissedTiles = 0;
+  const int numTiles = numDirtyTilesX * numDirtyTilesY;
+  for(int i = 0; i < numTiles; ++i)
+    if (dirtyTiles[i] && !candidateTiles[i])
+      ++numMissedTiles;
+  if (numMissedTiles == 0) return;
+  numMissedTilesSinceReport += numMissedTiles;
+  ++numSweepsWithMissesSinceReport;
+  uint64_t now = tick();
+  if (lastMissedHintsReportTime != 0 && now - lastMissedHintsReportTime < MISSED_HINTS_REPORT_INTERVAL_USECS) return;
+  printf("Damage hints did not cover changes in %d tiles over %d verification sweeps\n", numMissedTilesSinceReport, numSweepsWithMissesSinceReport);
+  lastMissedHintsReportTime = now;
+  numMissedTilesSinceReport = numSweepsWithMissesSinceReport = 0;
+}
+
+void InvalidateDamageHints()
+{
+  diffWholeNextFrame = true;
+}
+
+#endif
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef USE_DAMAGE_HINTS
+// A producer that knows which areas of the screen it has repainted can tell about them by sending datagrams to the Unix datagram socket at
+// DAMAGE_HINT_SOCKET_PATH. Each datagram is a DamageHintHeader followed by numRects DamageHintRects, in the native byte order of the Pi:
+//  - Rectangles are in pixels of the source (HDMI) display that frames are captured from.
+//  - sequence is incremented by one for each datagram sent. If a datagram is lost, the whole next frame is diffed.
+//  - Send a hint after each repaint, and while idle, a hint with no rectangles at least every DAMAGE_HINT_TIMEOUT_USECS to keep the hints in use.
+// Only one producer at a time is supported.
+#define DAMAGE_HINT_MAGIC 0x48444246 // "FBDH"
+#define DAMAGE_HINT_MAX_RECTS 256
+
+struct DamageHintHeader
+{
+  uint32_t magic; // DAMAGE_HINT_MAGIC
+  uint32_t sequence;
+  uint32_t numRects;
+};
+
+struct DamageHintRect
+{
+  uint16_t x, y, width, height;
+};
+
+// Creates the damage hint socket.
+void InitDamageHints(void);
+
+// Closes and removes the damage hint socket.
+void DeinitDamageHints(void);
+
+// Receives the pending damage hints, and returns the tiles that need to be compared to find the changed pixels of the newly captured frame, in the
+// layout of dirtyTiles, or null if the whole frame needs to be compared. Call once for each captured frame, before recomputing dirtyTiles, since
+// the tiles that were dirty after the previous frame are always included: not all of their changes may have been sent yet. prevFramebuffer is the
+// framebuffer that holds what is currently on the display.
+const uint8_t *DamageHintTilesToDiff(const uint16_t *prevFramebuffer);
+
+// After dirtyTiles has been recomputed, checks on frames that were compared in full as a verification sweep that all dirty tiles were hinted.
+void VerifyDamageHints(void);
+
+// Makes the next frame get compared in full, e.g. when the previous framebuffer was changed without sending anything to the display.
+void InvalidateDamageHints(void);
+
+// Capture sources that are told which areas of the source display changed (e.g. by XDamage) report them as hints here, from the GPU polling
+// thread, before handing over the frame that they captured them to. Rectangles are in the same coordinates as the hints of the socket.
+void AddCapturedDamage(const DamageHintRect *rects, int numRects);
+#endif
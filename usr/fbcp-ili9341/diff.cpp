@@ -4,24 +4,240 @@
 #include "display.h"
 #include "gpu.h"
 #include "spi.h"
+#include "diff_kernels.h"
+#include "mem_alloc.h"
+#include "tick.h"
 
-Span *spans = 0;
+#include <stdio.h>
+#include <stdlib.h> // exit
+#include <syslog.h> // syslog, LOG_ERR
+#include <string.h> // memset, memcpy, memmove, memcmp
+#include <pthread.h> // pthread_create, pthread_join
+#include <linux/futex.h> // FUTEX_WAIT, FUTEX_WAKE
+#include <sys/syscall.h> // SYS_futex
+#include <unistd.h> // syscall
 
-#ifdef UPDATE_FRAMES_WITHOUT_DIFFING
+SpanArray frameSpans = {};
+
+void GrowSpanArray(SpanArray &spanArray, int capacity)
+{
+  capacity = MAX(capacity, spanArray.capacity*2);
+  Span *spans = (Span*)Malloc(capacity*sizeof(Span), "GrowSpanArray() spans");
+  // The differs only update numSpans once they are done, so carry over the whole old array and not just numSpans spans.
+  memcpy(spans, spanArray.spans, spanArray.capacity*sizeof(Span));
+  Free(spanArray.spans, spanArray.capacity*sizeof(Span));
+  spanArray.spans = spans;
+  spanArray.capacity = capacity;
+}
+
+int MaxSpansPerScanline()
+{
+  return (gpuFrameWidth + SPAN_MERGE_THRESHOLD + 1) / (SPAN_MERGE_THRESHOLD + 2);
+}
+
+#ifdef USE_DIRTY_TILE_PREPASS
+uint8_t *dirtyTiles = 0;
+uint8_t *dirtyTileRows = 0;
+int numDirtyTilesX = 0, numDirtyTilesY = 0;
+int dirtyTilesMinX = 0, dirtyTilesMaxX = -1, dirtyTilesMinY = 0, dirtyTilesMaxY = -1;
+
+#define DIRTY_TILE_ROW(y) (dirtyTiles + ((y) >> DIRTY_TILE_SIZE_LOG2) * numDirtyTilesX)
+#define IS_DIRTY_TILE_ROW(y) (dirtyTileRows[(y) >> DIRTY_TILE_SIZE_LOG2])
+#else
+#define IS_DIRTY_TILE_ROW(y) 1
+#endif
+
+#ifdef USE_SCANLINE_HASHES
+uint32_t *scanlineHashes = 0, *prevScanlineHashes = 0;
+
+#define SCANLINE_HASH_CHANGED(y) (scanlineHashes[(y)] != prevScanlineHashes[(y)])
+#else
+#define SCANLINE_HASH_CHANGED(y) 1
+#endif
+
+// True if scanline y needs to be diffed pixel by pixel
+#define SCANLINE_MAY_HAVE_CHANGED(y) (IS_DIRTY_TILE_ROW(y) && SCANLINE_HASH_CHANGED(y))
+
+static inline void ClearDiffStats(DiffStats &stats)
+{
+  stats.numChangedPixels = 0;
+  memset(stats.scanlineClassBytes, 0, sizeof(stats.scanlineClassBytes));
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+  stats.numToleratedPixels = 0;
+  stats.toleratedSquaredError[0] = stats.toleratedSquaredError[1] = stats.toleratedSquaredError[2] = 0;
+#endif
+}
+
+// Accounts the bus bytes of a newly generated single scanline span to the class of the scanline it is on.
+static inline void AddSpanToDiffStats(DiffStats &stats, const Span *span, bool firstSpanOnScanline)
+{
+  stats.scanlineClassBytes[span->y % NUM_SCANLINE_CLASSES] += span->Size()*SPI_BYTESPERPIXEL + SPAN_START_OVERHEAD_BYTES + (firstSpanOnScanline ? SCANLINE_CHANGE_OVERHEAD_BYTES : 0);
+}
+
+void SelectInterlacedFieldSpans(SpanArray &spanArray, int numFields, int field)
+{
+  int numSpans = 0;
+  for(int i = 0; i < spanArray.numSpans; ++i)
+    if (spanArray.spans[i].y % numFields == field)
+      spanArray.spans[numSpans++] = spanArray.spans[i];
+  spanArray.numSpans = numSpans;
+}
+
+bool SpanIsSolidColor(const uint16_t *framebuffer, const Span &span, uint16_t *color)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  const uint16_t c = framebuffer[span.y*stride + span.x];
+  for(int y = span.y; y < span.endY; ++y)
+  {
+    const uint16_t *scanline = framebuffer + y*stride;
+    const int endX = (y + 1 == span.endY) ? span.lastScanEndX : span.endX;
+    for(int x = span.x; x < endX; ++x)
+      if (scanline[x] != c)
+        return false;
+  }
+  *color = c;
+  return true;
+}
+
+#ifdef USE_SCANLINE_HASHES
+void InitScanlineHashes(uint16_t *framebuffer, uint16_t *prevFramebuffer)
+{
+  scanlineHashes = (uint32_t*)Malloc(gpuFrameHeight*sizeof(uint32_t), "InitScanlineHashes() scanline hashes");
+  prevScanlineHashes = (uint32_t*)Malloc(gpuFrameHeight*sizeof(uint32_t), "InitScanlineHashes() prev scanline hashes");
+  ComputeScanlineHashes(framebuffer, scanlineHashes);
+  ComputeScanlineHashes(prevFramebuffer, prevScanlineHashes);
+}
+
+void UpdatePrevScanlineHashes(int numInterlacedFields, int interlacedField)
+{
+  if (numInterlacedFields > 1)
+  {
+    for(int y = interlacedField; y < gpuFrameHeight; y += numInterlacedFields)
+      prevScanlineHashes[y] = scanlineHashes[y];
+  }
+  else
+    memcpy(prevScanlineHashes, scanlineHashes, gpuFrameHeight*sizeof(uint32_t));
+}
+
+void VerifyScanlineHashes(const uint16_t *framebuffer, const uint16_t *prevFramebuffer)
+{
+  static uint64_t lastVerificationTime = 0;
+  uint64_t now = tick();
+  if (now - lastVerificationTime < SCANLINE_HASH_VERIFY_USECS) return;
+  lastVerificationTime = now;
+
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    if (scanlineHashes[y] == prevScanlineHashes[y] && memcmp(framebuffer + y*stride, prevFramebuffer + y*stride, gpuFrameWidth*2))
+      prevScanlineHashes[y] = ~scanlineHashes[y];
+}
+#endif
+
+#ifdef USE_DIRTY_TILE_PREPASS
+void InitDirtyTiles()
+{
+  numDirtyTilesX = (gpuFrameWidth + DIRTY_TILE_SIZE - 1) >> DIRTY_TILE_SIZE_LOG2;
+  numDirtyTilesY = (gpuFrameHeight + DIRTY_TILE_SIZE - 1) >> DIRTY_TILE_SIZE_LOG2;
+  dirtyTiles = (uint8_t*)Malloc(numDirtyTilesX * numDirtyTilesY, "InitDirtyTiles() dirty tiles");
+  dirtyTileRows = (uint8_t*)Malloc(numDirtyTilesY, "InitDirtyTiles() dirty tile rows");
+  // Until the first frame is diffed, conservatively treat everything as changed
+  memset(dirtyTiles, 1, numDirtyTilesX * numDirtyTilesY);
+  memset(dirtyTileRows, 1, numDirtyTilesY);
+  dirtyTilesMinX = dirtyTilesMinY = 0;
+  dirtyTilesMaxX = numDirtyTilesX-1;
+  dirtyTilesMaxY = numDirtyTilesY-1;
+}
+
+// Returns true if any of the numPixels pixels differ. Tiles start at 32 byte aligned offsets from the beginning of a scanline, so full tile width
+// comparisons can use aligned 64-bit loads.
+static inline bool TileScanlineChanged(const uint16_t *scanline, const uint16_t *prevScanline, int numPixels)
+{
+  if (numPixels == DIRTY_TILE_SIZE)
+  {
+    const uint64_t *s = (const uint64_t *)scanline, *p = (const uint64_t *)prevScanline;
+    return ((s[0] ^ p[0]) | (s[1] ^ p[1]) | (s[2] ^ p[2]) | (s[3] ^ p[3])) != 0;
+  }
+  for(int x = 0; x < numPixels; ++x)
+    if (scanline[x] != prevScanline[x])
+      return true;
+  return false;
+}
+
+int ComputeDirtyTiles(uint16_t *framebuffer, uint16_t *prevFramebuffer, const uint8_t *candidateTiles)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes>>1; // Stride as uint16 elements.
+  int numDirtyTiles = 0;
+  dirtyTilesMinX = numDirtyTilesX;
+  dirtyTilesMaxX = -1;
+  dirtyTilesMinY = numDirtyTilesY;
+  dirtyTilesMaxY = -1;
+
+  for(int ty = 0; ty < numDirtyTilesY; ++ty)
+  {
+    uint8_t *tileRow = dirtyTiles + ty * numDirtyTilesX;
+    memset(tileRow, 0, numDirtyTilesX);
+    int numDirtyTilesOnRow = 0;
+    const int endY = MIN(gpuFrameHeight, (ty+1) << DIRTY_TILE_SIZE_LOG2);
+
+    const uint8_t *candidateRow = candidateTiles ? candidateTiles + ty * numDirtyTilesX : 0;
+    int numCandidateTilesOnRow = numDirtyTilesX;
+    if (candidateRow)
+    {
+      numCandidateTilesOnRow = 0;
+      for(int tx = 0; tx < numDirtyTilesX; ++tx)
+        numCandidateTilesOnRow += (candidateRow[tx] != 0);
+    }
+
+    // Walk the scanlines in memory order, and once a tile has been found dirty, skip comparing the rest of its pixels. Finish early if all tiles on the row are dirty.
+    for(int y = ty << DIRTY_TILE_SIZE_LOG2; y < endY && numDirtyTilesOnRow < numCandidateTilesOnRow; ++y)
+    {
+      if (!SCANLINE_HASH_CHANGED(y)) continue;
+      const uint16_t *scanline = framebuffer + y*stride;
+      const uint16_t *prevScanline = prevFramebuffer + y*stride; // (same scanline from previous frame, not preceding scanline)
+      for(int tx = 0; tx < numDirtyTilesX; ++tx)
+      {
+        if (tileRow[tx] || (candidateRow && !candidateRow[tx])) continue;
+        const int x = tx << DIRTY_TILE_SIZE_LOG2;
+        if (TileScanlineChanged(scanline + x, prevScanline + x, MIN(DIRTY_TILE_SIZE, gpuFrameWidth - x)))
+        {
+          tileRow[tx] = 1;
+          ++numDirtyTilesOnRow;
+        }
+      }
+    }
+
+    dirtyTileRows[ty] = (numDirtyTilesOnRow > 0);
+    if (numDirtyTilesOnRow > 0)
+    {
+      dirtyTilesMinY = MIN(dirtyTilesMinY, ty);
+      dirtyTilesMaxY = ty;
+      int minX = 0, maxX = numDirtyTilesX-1;
+      while(!tileRow[minX]) ++minX;
+      while(!tileRow[maxX]) --maxX;
+      dirtyTilesMinX = MIN(dirtyTilesMinX, minX);
+      dirtyTilesMaxX = MAX(dirtyTilesMaxX, maxX);
+      numDirtyTiles += numDirtyTilesOnRow;
+    }
+  }
+  return numDirtyTiles;
+}
+#endif
+
+#if defined(UPDATE_FRAMES_WITHOUT_DIFFING) || defined(ADAPTIVE_DIFF_STRATEGY)
 // Naive non-diffing functionality: just submit the whole display contents
-void NoDiffChangedRectangle(Span *&head)
+void NoDiffChangedRectangle(SpanArray &spanArray)
 {
-  head = spans;
-  head->x = 0;
-  head->endX = head->lastScanEndX = gpuFrameWidth;
-  head->y = 0;
-  head->endY = gpuFrameHeight;
-  head->size = gpuFrameWidth*gpuFrameHeight;
-  head->next = 0;
+  ReserveSpans(spanArray, 1);
+  Span *span = spanArray.spans;
+  span->x = 0;
+  span->endX = span->lastScanEndX = gpuFrameWidth;
+  span->y = 0;
+  span->endY = gpuFrameHeight;
+  spanArray.numSpans = 1;
 }
 #endif
 
-#ifdef UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF
+#if defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF) || defined(ADAPTIVE_DIFF_STRATEGY)
 // Coarse diffing of two framebuffers with tight stride, 16 pixels at a time
 // Finds the first changed pixel, coarse result aligned down to 8 pixels boundary
 static int coarse_linear_diff(uint16_t *framebuffer, uint16_t *prevFramebuffer, uint16_t *framebufferEnd)
@@ -118,23 +334,55 @@ static int coarse_backwards_linear_diff(uint16_t *framebuffer, uint16_t *prevFra
   return endPtr - framebuffer;
 }
 
-void DiffFramebuffersToSingleChangedRectangle(uint16_t *framebuffer, uint16_t *prevFramebuffer, Span *&head)
+void DiffFramebuffersToSingleChangedRectangle(uint16_t *framebuffer, uint16_t *prevFramebuffer, SpanArray &spanArray)
 {
-  int minY = 0;
+  spanArray.numSpans = 0;
+#ifdef USE_DIRTY_TILE_PREPASS
+  if (dirtyTilesMaxY < dirtyTilesMinY)
+    return; // No pixels changed, nothing to do.
+
+  // All changed pixels lie inside the bounding box of the dirty tiles, so only search for the rectangle edges within it.
+  const int searchMinX = dirtyTilesMinX << DIRTY_TILE_SIZE_LOG2;
+  const int searchMaxX = MIN(gpuFrameWidth, (dirtyTilesMaxX+1) << DIRTY_TILE_SIZE_LOG2) - 1;
+  int searchMinY = dirtyTilesMinY << DIRTY_TILE_SIZE_LOG2;
+  int searchMaxY = MIN(gpuFrameHeight, (dirtyTilesMaxY+1) << DIRTY_TILE_SIZE_LOG2) - 1;
+#else
+  const int searchMinX = 0, searchMaxX = gpuFrameWidth-1;
+  int searchMinY = 0, searchMaxY = gpuFrameHeight-1;
+#endif
+
+  static const bool framebufferSizeCompatibleWithCoarseDiff = gpuFramebufferScanlineStrideBytes == gpuFrameWidth*2 && gpuFramebufferScanlineStrideBytes*gpuFrameHeight % 32 == 0;
+#ifdef USE_SCANLINE_HASHES
+  // Skip the scanlines at the top and bottom whose hashes show that they have not changed.
+  while(searchMinY <= searchMaxY && !SCANLINE_HASH_CHANGED(searchMinY)) ++searchMinY;
+  while(searchMaxY >= searchMinY && !SCANLINE_HASH_CHANGED(searchMaxY)) --searchMaxY;
+  if (searchMinY > searchMaxY)
+    return; // No pixels changed, nothing to do.
+
+  if (framebufferSizeCompatibleWithCoarseDiff)
+  {
+    // The coarse diff processes 32 bytes at a time, so widen the search range to start and end at multiples of 32 bytes (or at the end of the framebuffer).
+    while((searchMinY*gpuFramebufferScanlineStrideBytes) % 32 != 0) --searchMinY;
+    while(((searchMaxY+1)*gpuFramebufferScanlineStrideBytes) % 32 != 0 && searchMaxY+1 < gpuFrameHeight) ++searchMaxY;
+  }
+#endif
+
+  int minY = searchMinY;
   int minX = -1;
 
   const int stride = gpuFramebufferScanlineStrideBytes>>1; // Stride as uint16 elements.
   const int WidthAligned4 = (uint32_t)gpuFrameWidth & ~3u;
 
-  uint16_t *scanline = framebuffer;
-  uint16_t *prevScanline = prevFramebuffer;
+  uint16_t *scanline = framebuffer + searchMinY*stride;
+  uint16_t *prevScanline = prevFramebuffer + searchMinY*stride;
 
-  static const bool framebufferSizeCompatibleWithCoarseDiff = gpuFramebufferScanlineStrideBytes == gpuFrameWidth*2 && gpuFramebufferScanlineStrideBytes*gpuFrameHeight % 32 == 0;
+  // The search range starts and ends at multiples of 32 bytes (tile rows are 16 scanlines tall), or at the end of the framebuffer, so it is compatible with the coarse diff as well.
+  const int searchStart = searchMinY*gpuFrameWidth;
+  const int searchEnd = (searchMaxY+1)*gpuFrameWidth;
   if (framebufferSizeCompatibleWithCoarseDiff)
   {
-    int numPixels = gpuFrameWidth*gpuFrameHeight;
-    int firstDiff = coarse_linear_diff(framebuffer, prevFramebuffer, framebuffer + numPixels);
-    if (firstDiff == numPixels)
+    int firstDiff = searchStart + coarse_linear_diff(framebuffer + searchStart, prevFramebuffer + searchStart, framebuffer + searchEnd);
+    if (firstDiff == searchEnd)
       return; // No pixels changed, nothing to do.
     // Coarse diff computes a diff at 8 adjacent pixels at a time, and returns the point to the 8-pixel aligned coordinate where the pixels began to differ.
     // Compute the precise diff position here.
@@ -144,7 +392,7 @@ void DiffFramebuffersToSingleChangedRectangle(uint16_t *framebuffer, uint16_t *p
   }
   else
   {
-    while(minY < gpuFrameHeight)
+    while(minY <= searchMaxY)
     {
       int x = 0;
       // diff 4 pixels at a time
@@ -176,12 +424,11 @@ void DiffFramebuffersToSingleChangedRectangle(uint16_t *framebuffer, uint16_t *p
 found_top:
 
   int maxX = -1;
-  int maxY = gpuFrameHeight-1;
+  int maxY = searchMaxY;
 
   if (framebufferSizeCompatibleWithCoarseDiff)
   {
-    int numPixels = gpuFrameWidth*gpuFrameHeight;
-    int firstDiff = coarse_backwards_linear_diff(framebuffer, prevFramebuffer, framebuffer + numPixels);
+    int firstDiff = searchStart + coarse_backwards_linear_diff(framebuffer + searchStart, prevFramebuffer + searchStart, framebuffer + searchEnd);
     // Coarse diff computes a diff at 8 adjacent pixels at a time, and returns the point to the 8-pixel aligned coordinate where the pixels began to differ.
     // Compute the precise diff position here.
     while(firstDiff > 0 && framebuffer[firstDiff] == prevFramebuffer[firstDiff]) --firstDiff;
@@ -190,8 +437,8 @@ found_top:
   }
   else
   {
-    scanline = framebuffer + (gpuFrameHeight - 1)*stride;
-    prevScanline = prevFramebuffer + (gpuFrameHeight - 1)*stride; // (same scanline from previous frame, not preceding scanline)
+    scanline = framebuffer + searchMaxY*stride;
+    prevScanline = prevFramebuffer + searchMaxY*stride; // (same scanline from previous frame, not preceding scanline)
 
     while(maxY >= minY)
     {
@@ -227,7 +474,7 @@ found_bottom:
   prevScanline = prevFramebuffer + minY*stride;
   int lastScanEndX = maxX;
   if (minX > maxX) SWAPU32(minX, maxX);
-  int leftX = 0;
+  int leftX = searchMinX;
   while(leftX < minX)
   {
     uint16_t *s = scanline + leftX;
@@ -243,7 +490,7 @@ found_bottom:
   }
 found_left:
 
-  int rightX = gpuFrameWidth-1;
+  int rightX = searchMaxX;
   while(rightX > maxX)
   {
     uint16_t *s = scanline + rightX;
@@ -259,30 +506,277 @@ found_left:
   }
 found_right:
 
-  head = spans;
-  head->x = leftX;
-  head->endX = rightX+1;
-  head->lastScanEndX = lastScanEndX+1;
-  head->y = minY;
-  head->endY = maxY+1;
+  ReserveSpans(spanArray, 1);
+  Span *span = spanArray.spans;
+  span->x = leftX;
+  span->endX = rightX+1;
+  span->lastScanEndX = lastScanEndX+1;
+  span->y = minY;
+  span->endY = maxY+1;
 
 #if defined(ALIGN_DIFF_TASKS_FOR_32B_CACHE_LINES) && defined(ALL_TASKS_SHOULD_DMA)
   // Make sure the task is a multiple of 32 bytes wide so we can use a fast DMA copy
   // algorithm later on. Currently this is only exploited in dma.cpp if ALL_TASKS_SHOULD_DMA
   // option is enabled, so only enable it there.
-  head->x = MAX(0, ALIGN_DOWN(head->x, 16));
-  head->endX = MIN(gpuFrameWidth, ALIGN_UP(head->endX, 16));
-  head->lastScanEndX = ALIGN_UP(head->lastScanEndX, 16);
+  span->x = MAX(0, ALIGN_DOWN(span->x, 16));
+  span->endX = MIN(gpuFrameWidth, ALIGN_UP(span->endX, 16));
+  span->lastScanEndX = ALIGN_UP(span->lastScanEndX, 16);
+#endif
+  spanArray.numSpans = 1;
+}
+
+#ifdef MAX_DIFF_RECTANGLES
+// Rectangle [x, endX[ x [y, endY[ of the framebuffer
+struct DiffRectangle
+{
+  int x, endX, y, endY;
+  int Area() const { return (endX - x) * (endY - y); }
+};
+
+// A rectangle that tightly bounds the changed pixels inside it, along with the best cut found to split it into two rectangles that tightly bound the changed
+// pixels on either side of the cut.
+struct CutDiffRectangle
+{
+  DiffRectangle rect, halves[2];
+  int savedPixels; // Number of pixels that replacing rect with the two halves saves from being sent, 0 if no cut saves anything
+};
+
+// Row and column profiles of the changed pixels inside the rectangle that was scanned last: the horizontal extent [rowMinX[y], rowEndX[y][ of the changes on each
+// scanline, and the vertical extent [colMinY[x], colEndY[x][ of the changes on each column. A scanline or a column without changes has an empty extent.
+static uint16_t *rowMinX = 0, *rowEndX = 0, *colMinY = 0, *colEndY = 0;
+
+// Extents of the changed pixels on the first side of each candidate cut, accumulated from the profiles.
+static uint16_t *cutMin = 0, *cutEnd = 0, *cutLast = 0;
+
+// Reads the pixels inside the given rectangle once in memory order, and records the row and column profiles of the changes in it. Keeping the running extent of each
+// column in a small array avoids walking the framebuffer column by column to find the left and right edges. Shrinks the rectangle to tightly bound the changed
+// pixels, and returns false if there are none.
+static bool ScanChangeProfiles(uint16_t *framebuffer, uint16_t *prevFramebuffer, DiffRectangle &r)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes>>1; // Stride as uint16 elements.
+  for(int x = r.x; x < r.endX; ++x)
+  {
+    colMinY[x] = r.endY;
+    colEndY[x] = r.y;
+  }
+  DiffRectangle changes = { r.endX, r.x, r.endY, r.y };
+  for(int y = r.y; y < r.endY; ++y)
+  {
+    int minX = r.endX, endX = r.x;
+    if (SCANLINE_MAY_HAVE_CHANGED(y))
+    {
+#ifdef USE_DIRTY_TILE_PREPASS
+      const uint8_t *tileRow = DIRTY_TILE_ROW(y);
+#endif
+      const uint16_t *scanline = framebuffer + y*stride;
+      const uint16_t *prevScanline = prevFramebuffer + y*stride; // (same scanline from previous frame, not preceding scanline)
+      for(int x = r.x; x < r.endX; ++x)
+      {
+#ifdef USE_DIRTY_TILE_PREPASS
+        if (!tileRow[x >> DIRTY_TILE_SIZE_LOG2])
+        {
+          x |= DIRTY_TILE_SIZE-1;
+          continue;
+        }
+#endif
+        // Skip over four unchanged pixels at a time when aligned
+        if ((x & 3) == 0 && x + 4 <= r.endX && *(const uint64_t*)(scanline+x) == *(const uint64_t*)(prevScanline+x))
+        {
+          x += 3;
+          continue;
+        }
+        if (scanline[x] == prevScanline[x]) continue;
+        minX = MIN(minX, x);
+        endX = x+1;
+        colMinY[x] = MIN(colMinY[x], y);
+        colEndY[x] = y+1;
+      }
+    }
+    rowMinX[y] = minX;
+    rowEndX[y] = endX;
+    if (minX < endX)
+    {
+      changes.x = MIN(changes.x, minX);
+      changes.endX = MAX(changes.endX, endX);
+      changes.y = MIN(changes.y, y);
+      changes.endY = y+1;
+    }
+  }
+  if (changes.y >= changes.endY)
+    return false;
+  r = changes;
+  return true;
+}
+
+// Finds the cut of the given tight rectangle between two scanlines or two columns that minimizes the total area of the two halves, using the profiles that
+// ScanChangeProfiles() recorded for it. Each side of every cut is accumulated in one sweep, so this takes time linear in the width and height of the rectangle.
+static void FindBestCut(CutDiffRectangle &c)
+{
+  const DiffRectangle &r = c.rect;
+  c.savedPixels = 0;
+
+  // Cuts between scanlines y-1 and y: sweep down accumulating the extent of the top halves, then sweep up accumulating the bottom halves and compare.
+  int minX = r.endX, endX = r.x, lastY = r.y;
+  for(int y = r.y; y < r.endY; ++y)
+  {
+    if (rowMinX[y] < rowEndX[y])
+    {
+      minX = MIN(minX, rowMinX[y]);
+      endX = MAX(endX, rowEndX[y]);
+      lastY = y+1;
+    }
+    cutMin[y] = minX;
+    cutEnd[y] = endX;
+    cutLast[y] = lastY;
+  }
+  minX = r.endX;
+  endX = r.x;
+  int firstY = r.endY;
+  for(int y = r.endY-1; y > r.y; --y)
+  {
+    if (rowMinX[y] >= rowEndX[y]) continue; // The same halves as cutting at the next changed scanline below
+    minX = MIN(minX, rowMinX[y]);
+    endX = MAX(endX, rowEndX[y]);
+    firstY = y;
+    DiffRectangle top = { cutMin[y-1], cutEnd[y-1], r.y, cutLast[y-1] }, bottom = { minX, endX, firstY, r.endY };
+    int savedPixels = r.Area() - top.Area() - bottom.Area();
+    if (savedPixels > c.savedPixels)
+    {
+      c.savedPixels = savedPixels;
+      c.halves[0] = top;
+      c.halves[1] = bottom;
+    }
+  }
+
+  // Cuts between columns x-1 and x, in the same way.
+  int minY = r.endY, endY = r.y, lastX = r.x;
+  for(int x = r.x; x < r.endX; ++x)
+  {
+    if (colMinY[x] < colEndY[x])
+    {
+      minY = MIN(minY, colMinY[x]);
+      endY = MAX(endY, colEndY[x]);
+      lastX = x+1;
+    }
+    cutMin[x] = minY;
+    cutEnd[x] = endY;
+    cutLast[x] = lastX;
+  }
+  minY = r.endY;
+  endY = r.y;
+  int firstX = r.endX;
+  for(int x = r.endX-1; x > r.x; --x)
+  {
+    if (colMinY[x] >= colEndY[x]) continue;
+    minY = MIN(minY, colMinY[x]);
+    endY = MAX(endY, colEndY[x]);
+    firstX = x;
+    DiffRectangle left = { r.x, cutLast[x-1], cutMin[x-1], cutEnd[x-1] }, right = { firstX, r.endX, minY, endY };
+    int savedPixels = r.Area() - left.Area() - right.Area();
+    if (savedPixels > c.savedPixels)
+    {
+      c.savedPixels = savedPixels;
+      c.halves[0] = left;
+      c.halves[1] = right;
+    }
+  }
+}
+
+void DiffFramebuffersToChangedRectangles(uint16_t *framebuffer, uint16_t *prevFramebuffer, SpanArray &spanArray)
+{
+  spanArray.numSpans = 0;
+  if (!rowMinX)
+  {
+    rowMinX = (uint16_t*)Malloc(gpuFrameHeight*sizeof(uint16_t), "DiffFramebuffersToChangedRectangles() row profile");
+    rowEndX = (uint16_t*)Malloc(gpuFrameHeight*sizeof(uint16_t), "DiffFramebuffersToChangedRectangles() row profile");
+    colMinY = (uint16_t*)Malloc(gpuFrameWidth*sizeof(uint16_t), "DiffFramebuffersToChangedRectangles() column profile");
+    colEndY = (uint16_t*)Malloc(gpuFrameWidth*sizeof(uint16_t), "DiffFramebuffersToChangedRectangles() column profile");
+    const int maxSize = MAX(gpuFrameWidth, gpuFrameHeight);
+    cutMin = (uint16_t*)Malloc(maxSize*sizeof(uint16_t), "DiffFramebuffersToChangedRectangles() cut extents");
+    cutEnd = (uint16_t*)Malloc(maxSize*sizeof(uint16_t), "DiffFramebuffersToChangedRectangles() cut extents");
+    cutLast = (uint16_t*)Malloc(maxSize*sizeof(uint16_t), "DiffFramebuffersToChangedRectangles() cut extents");
+  }
+
+  CutDiffRectangle rects[MAX_DIFF_RECTANGLES];
+#ifdef USE_DIRTY_TILE_PREPASS
+  if (dirtyTilesMaxY < dirtyTilesMinY)
+    return; // No pixels changed, nothing to do.
+  // All changed pixels lie inside the bounding box of the dirty tiles
+  DiffRectangle searchArea = { dirtyTilesMinX << DIRTY_TILE_SIZE_LOG2, MIN(gpuFrameWidth, (dirtyTilesMaxX+1) << DIRTY_TILE_SIZE_LOG2),
+                               dirtyTilesMinY << DIRTY_TILE_SIZE_LOG2, MIN(gpuFrameHeight, (dirtyTilesMaxY+1) << DIRTY_TILE_SIZE_LOG2) };
+#else
+  DiffRectangle searchArea = { 0, gpuFrameWidth, 0, gpuFrameHeight };
 #endif
+  rects[0].rect = searchArea;
+  if (!ScanChangeProfiles(framebuffer, prevFramebuffer, rects[0].rect))
+    return; // No pixels changed, nothing to do.
+  int numRects = 1;
+  FindBestCut(rects[0]);
+
+  // Recursively bisect the rectangles, always cutting the one whose best cut saves the most pixels, for as long as the saved pixels take longer to send
+  // than the cursor commands of the additional rectangle. Each cut rescans only the two halves to find how they could be cut further.
+  const int minSavedPixels = (SPAN_START_OVERHEAD_BYTES + SCANLINE_CHANGE_OVERHEAD_BYTES) / SPI_BYTESPERPIXEL;
+  while(numRects < MAX_DIFF_RECTANGLES)
+  {
+    int best = 0;
+    for(int i = 1; i < numRects; ++i)
+      if (rects[i].savedPixels > rects[best].savedPixels)
+        best = i;
+    if (rects[best].savedPixels <= minSavedPixels)
+      break;
+
+    CutDiffRectangle &first = rects[best], &second = rects[numRects++];
+    second.rect = first.halves[1];
+    first.rect = first.halves[0];
+    first.savedPixels = second.savedPixels = 0;
+    if (numRects < MAX_DIFF_RECTANGLES) // (no need to look for further cuts if there is no room for them)
+    {
+      ScanChangeProfiles(framebuffer, prevFramebuffer, first.rect);
+      FindBestCut(first);
+      ScanChangeProfiles(framebuffer, prevFramebuffer, second.rect);
+      FindBestCut(second);
+    }
+  }
 
-  head->size = (head->endX-head->x)*(head->endY-head->y-1) + (head->lastScanEndX - head->x);
-  head->next = 0;
+  // Submit the rectangles in top to bottom order, so that the display write cursor mostly moves forward
+  for(int i = 1; i < numRects; ++i)
+    for(int j = i; j > 0 && (rects[j].rect.y < rects[j-1].rect.y || (rects[j].rect.y == rects[j-1].rect.y && rects[j].rect.x < rects[j-1].rect.x)); --j)
+    {
+      DiffRectangle tmp = rects[j].rect;
+      rects[j].rect = rects[j-1].rect;
+      rects[j-1].rect = tmp;
+    }
+
+  ReserveSpans(spanArray, numRects);
+  for(int i = 0; i < numRects; ++i)
+  {
+    Span *span = spanArray.spans + i;
+    span->x = rects[i].rect.x;
+    span->endX = span->lastScanEndX = rects[i].rect.endX;
+    span->y = rects[i].rect.y;
+    span->endY = rects[i].rect.endY;
+#if defined(ALIGN_DIFF_TASKS_FOR_32B_CACHE_LINES) && defined(ALL_TASKS_SHOULD_DMA)
+    // Make each task a multiple of 32 bytes wide for the fast DMA copy, like in DiffFramebuffersToSingleChangedRectangle().
+    span->x = MAX(0, ALIGN_DOWN(span->x, 16));
+    span->endX = span->lastScanEndX = MIN(gpuFrameWidth, ALIGN_UP(span->endX, 16));
+#endif
+  }
+  spanArray.numSpans = numRects;
 }
 #endif
+#endif
 
-void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+// Returns the number of 16-bit pixels that are nonzero in the XOR of four pixels.
+static inline int NumChangedPixelsIn4(uint64_t diff)
+{
+  return ((diff & 0xFFFFull) != 0) + ((diff & 0xFFFF0000ull) != 0) + ((diff & 0xFFFF00000000ull) != 0) + ((diff & 0xFFFF000000000000ull) != 0);
+}
+
+void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, SpanArray &spanArray, DiffStats &stats)
 {
   int numSpans = 0;
+  int numChangedPixels = 0;
+  ClearDiffStats(stats);
   int y = interlacedDiff ? interlacedFieldParity : 0;
   int yInc = interlacedDiff ? 2 : 1;
   // If doing an interlaced update, skip over every second scanline.
@@ -291,17 +785,31 @@ void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, ui
   uint64_t *prevScanline = (uint64_t *)(prevFramebuffer + y*(gpuFramebufferScanlineStrideBytes>>1)); // (same scanline from previous frame, not preceding scanline)
 
   const int W = gpuFrameWidth>>2;
+  const int maxSpansPerScanline = (W+1)/2; // Spans on a scanline are separated by at least one unchanged group of 4 pixels
 
-  Span *span = spans;
-  while(y < gpuFrameHeight)
+  for(; y < gpuFrameHeight; y += yInc, scanline += scanlineInc, prevScanline += scanlineInc)
   {
+    if (!SCANLINE_MAY_HAVE_CHANGED(y)) continue;
+    ReserveSpans(spanArray, numSpans + maxSpansPerScanline);
     uint16_t *scanlineStart = (uint16_t *)scanline;
+#ifdef USE_DIRTY_TILE_PREPASS
+    const uint8_t *tileRow = DIRTY_TILE_ROW(y);
+#endif
 
     for(int x = 0; x < W;)
     {
+#ifdef USE_DIRTY_TILE_PREPASS
+      // Skip over clean tiles, DIRTY_TILE_SIZE/4 groups of 4 pixels at a time
+      if (!tileRow[x >> (DIRTY_TILE_SIZE_LOG2-2)])
+      {
+        x = ((x >> (DIRTY_TILE_SIZE_LOG2-2)) + 1) << (DIRTY_TILE_SIZE_LOG2-2);
+        continue;
+      }
+#endif
       if (scanline[x] != prevScanline[x])
       {
         uint16_t *spanStart = (uint16_t *)(scanline + x) + (__builtin_ctzll(scanline[x] ^ prevScanline[x]) >> 4);
+        numChangedPixels += NumChangedPixelsIn4(scanline[x] ^ prevScanline[x]);
         ++x;
 
         // We've found a start of a span of different pixels on this scanline, now find where this span ends
@@ -312,6 +820,7 @@ void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, ui
           {
             if (scanline[x] != prevScanline[x])
             {
+              numChangedPixels += NumChangedPixelsIn4(scanline[x] ^ prevScanline[x]);
               ++x;
               continue;
             }
@@ -330,13 +839,12 @@ void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, ui
         }
 
         // Submit the span update task
+        Span *span = spanArray.spans + numSpans;
         span->x = spanStart - scanlineStart;
         span->endX = span->lastScanEndX = spanEnd - scanlineStart;
         span->y = y;
         span->endY = y+1;
-        span->size = spanEnd - spanStart;
-        span->next = span+1;
-        ++span;
+        AddSpanToDiffStats(stats, span, numSpans == 0 || span[-1].y != y);
         ++numSpans;
       }
       else
@@ -344,23 +852,16 @@ void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, ui
         ++x;
       }
     }
-    y += yInc;
-    scanline += scanlineInc;
-    prevScanline += scanlineInc;
-  }
-
-  if (numSpans > 0)
-  {
-    head = &spans[0];
-    spans[numSpans-1].next = 0;
   }
-  else
-    head = 0;
+  stats.numChangedPixels = numChangedPixels;
+  spanArray.numSpans = numSpans;
 }
 
-void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head)
+void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, SpanArray &spanArray, DiffStats &stats)
 {
   int numSpans = 0;
+  int numChangedPixels = 0;
+  ClearDiffStats(stats);
   int y = interlacedDiff ? interlacedFieldParity : 0;
   int yInc = interlacedDiff ? 2 : 1;
   // If doing an interlaced update, skip over every second scanline.
@@ -368,17 +869,40 @@ void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevF
   int scanlineEndInc = scanlineInc - gpuFrameWidth;
   uint16_t *scanline = framebuffer + y*(gpuFramebufferScanlineStrideBytes>>1);
   uint16_t *prevScanline = prevFramebuffer + y*(gpuFramebufferScanlineStrideBytes>>1); // (same scanline from previous frame, not preceding scanline)
+  const int maxSpansPerScanline = MaxSpansPerScanline();
 
   while(y < gpuFrameHeight)
   {
     uint16_t *scanlineStart = scanline;
     uint16_t *scanlineEnd = scanline + gpuFrameWidth;
+    if (!SCANLINE_MAY_HAVE_CHANGED(y))
+    {
+      scanline = scanlineEnd;
+      prevScanline += gpuFrameWidth;
+    }
+    else
+      ReserveSpans(spanArray, numSpans + maxSpansPerScanline);
+#ifdef USE_DIRTY_TILE_PREPASS
+    const uint8_t *tileRow = DIRTY_TILE_ROW(y);
+#endif
     while(scanline < scanlineEnd)
     {
       uint16_t *spanStart;
       uint16_t *spanEnd;
       int numConsecutiveUnchangedPixels = 0;
 
+#ifdef USE_DIRTY_TILE_PREPASS
+      // Skip over clean tiles, they do not contain any pixels that could start a new span
+      int tileX = (scanline - scanlineStart) >> DIRTY_TILE_SIZE_LOG2;
+      if (!tileRow[tileX])
+      {
+        int skip = MIN(gpuFrameWidth, (tileX+1) << DIRTY_TILE_SIZE_LOG2) - (scanline - scanlineStart);
+        scanline += skip;
+        prevScanline += skip;
+        continue;
+      }
+#endif
+
       if (scanline + 1 < scanlineEnd)
       {
         uint32_t diff = (*(uint32_t *)scanline) ^ (*(uint32_t *)prevScanline);
@@ -388,10 +912,11 @@ void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevF
         if (diff == 0) // Both 1st and 2nd pixels are the same
           continue;
 
-        if (diff & 0xFFFF == 0) // 1st pixels are the same, 2nd pixels are not
+        if ((diff & 0xFFFF) == 0) // 1st pixels are the same, 2nd pixels are not
         {
           spanStart = scanline - 1;
           spanEnd = scanline;
+          ++numChangedPixels;
         }
         else // 1st pixels are different
         {
@@ -399,11 +924,13 @@ void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevF
           if ((diff & 0xFFFF0000u) != 0) // 2nd pixels are different?
           {
             spanEnd = scanline;
+            numChangedPixels += 2;
           }
           else
           {
             spanEnd = scanline - 1;
             numConsecutiveUnchangedPixels = 1;
+            ++numChangedPixels;
           }
         }
 
@@ -414,6 +941,7 @@ void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevF
           {
             spanEnd = scanline;
             numConsecutiveUnchangedPixels = 0;
+            ++numChangedPixels;
           }
           else
           {
@@ -429,35 +957,174 @@ void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevF
 
         spanStart = scanline - 1;
         spanEnd = scanline;
+        ++numChangedPixels;
       }
 
       // Submit the span update task
-      Span *span = spans + numSpans;
+      Span *span = spanArray.spans + numSpans;
       span->x = spanStart - scanlineStart;
       span->endX = span->lastScanEndX = spanEnd - scanlineStart;
       span->y = y;
       span->endY = y+1;
-      span->size = spanEnd - spanStart;
-      if (numSpans > 0) span[-1].next = span;
-      else head = span;
-      span->next = 0;
+      AddSpanToDiffStats(stats, span, numSpans == 0 || span[-1].y != y);
       ++numSpans;
     }
     y += yInc;
     scanline += scanlineEndInc;
     prevScanline += scanlineEndInc;
   }
+  stats.numChangedPixels = numChangedPixels;
+  spanArray.numSpans = numSpans;
+}
+
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+uint8_t *scanlineDriftAge = 0;
+static uint8_t *scanlineHasToleratedPixels = 0; // Set by the last diff for each scanline that it left tolerated pixels on
+static int numDriftedScanlines = 0;
+
+void InitPerceptualDiff()
+{
+  scanlineDriftAge = (uint8_t*)Malloc(gpuFrameHeight, "InitPerceptualDiff() scanline drift ages");
+  scanlineHasToleratedPixels = (uint8_t*)Malloc(gpuFrameHeight, "InitPerceptualDiff() tolerated scanlines");
+  memset(scanlineDriftAge, 0, gpuFrameHeight);
+  memset(scanlineHasToleratedPixels, 0, gpuFrameHeight);
+  numDriftedScanlines = 0;
+}
+
+// Returns how many steps two pixels differ by in the color channel that differs the most. Green is halved to 5 bits, so that a step is about the same
+// amount of light in each channel.
+static inline int PixelDifference(uint16_t a, uint16_t b)
+{
+  int dr = abs((a >> 11) - (b >> 11));
+  int dg = (abs(((a >> 5) & 0x3F) - ((b >> 5) & 0x3F)) + 1) >> 1;
+  int db = abs((a & 0x1F) - (b & 0x1F));
+  return MAX(dr, MAX(dg, db));
+}
+
+static inline void AddToleratedPixelToDiffStats(DiffStats &stats, uint16_t a, uint16_t b)
+{
+  int dr = (a >> 11) - (b >> 11);
+  int dg = ((a >> 5) & 0x3F) - ((b >> 5) & 0x3F);
+  int db = (a & 0x1F) - (b & 0x1F);
+  ++stats.numToleratedPixels;
+  stats.toleratedSquaredError[0] += dr*dr;
+  stats.toleratedSquaredError[1] += dg*dg;
+  stats.toleratedSquaredError[2] += db*db;
+}
+
+void DiffFramebuffersToScanlineSpansWithTolerance(uint16_t *framebuffer, uint16_t *prevFramebuffer, SpanArray &spanArray, DiffStats &stats)
+{
+  int numSpans = 0;
+  int numChangedPixels = 0;
+  ClearDiffStats(stats);
+  const int stride = gpuFramebufferScanlineStrideBytes>>1; // Stride as uint16 elements.
+  const int W = gpuFrameWidth;
+  const int maxSpansPerScanline = MaxSpansPerScanline();
+
+  for(int y = 0; y < gpuFrameHeight; ++y)
+  {
+    scanlineHasToleratedPixels[y] = 0;
+    if (!SCANLINE_MAY_HAVE_CHANGED(y)) continue;
+    ReserveSpans(spanArray, numSpans + maxSpansPerScanline);
+#ifdef USE_DIRTY_TILE_PREPASS
+    const uint8_t *tileRow = DIRTY_TILE_ROW(y);
+#endif
+    const uint16_t *scanline = framebuffer + y*stride;
+    const uint16_t *prevScanline = prevFramebuffer + y*stride; // (same scanline from previous frame, not preceding scanline)
+    const bool correctDrift = (scanlineDriftAge[y] >= PERCEPTUAL_DIFF_DRIFT_CORRECTION_FRAMES);
+    const int startTolerance = correctDrift ? 0 : PERCEPTUAL_DIFF_TOLERANCE;
+    const int continueTolerance = correctDrift ? 0 : MAX(0, PERCEPTUAL_DIFF_TOLERANCE - PERCEPTUAL_DIFF_HYSTERESIS);
+
+    for(int x = 0; x < W; ++x)
+    {
+#ifdef USE_DIRTY_TILE_PREPASS
+      // Skip over clean tiles, they do not contain any pixels that could start a new span
+      if (!tileRow[x >> DIRTY_TILE_SIZE_LOG2])
+      {
+        x |= DIRTY_TILE_SIZE-1;
+        continue;
+      }
+#endif
+      if (scanline[x] == prevScanline[x]) continue;
+      if (PixelDifference(scanline[x], prevScanline[x]) <= startTolerance)
+      {
+        AddToleratedPixelToDiffStats(stats, scanline[x], prevScanline[x]);
+        scanlineHasToleratedPixels[y] = 1;
+        continue;
+      }
+
+      // We've found a start of a span of visibly different pixels on this scanline, now find where this span ends: span ends when more than
+      // SPAN_MERGE_THRESHOLD consecutive pixels are unchanged or within the lowered tolerance, or when the scanline ends. All changed pixels
+      // inside the span get sent, tolerated or not.
+      int spanStart = x, spanEnd = x+1;
+      int numChangedPixelsSinceSpanEnd = 0;
+      ++numChangedPixels;
+      for(++x; x < W && x - spanEnd <= SPAN_MERGE_THRESHOLD; ++x)
+      {
+        if (scanline[x] == prevScanline[x]) continue;
+        ++numChangedPixelsSinceSpanEnd;
+        if (PixelDifference(scanline[x], prevScanline[x]) > continueTolerance)
+        {
+          spanEnd = x+1;
+          numChangedPixels += numChangedPixelsSinceSpanEnd;
+          numChangedPixelsSinceSpanEnd = 0;
+        }
+      }
+      x = spanEnd - 1; // The pixels after the span end are either unchanged or tolerated, go through them again to account for the tolerated ones
+
+      // Submit the span update task
+      Span *span = spanArray.spans + numSpans;
+      span->x = spanStart;
+      span->endX = span->lastScanEndX = spanEnd;
+      span->y = y;
+      span->endY = y+1;
+      AddSpanToDiffStats(stats, span, numSpans == 0 || span[-1].y != y);
+      ++numSpans;
+    }
+  }
+  stats.numChangedPixels = numChangedPixels;
+  spanArray.numSpans = numSpans;
+}
+
+void UpdateToleratedScanlines(uint16_t *prevFramebuffer, int numInterlacedFields, int interlacedField)
+{
+  numDriftedScanlines = 0;
+  for(int y = 0; y < gpuFrameHeight; ++y)
+  {
+    if (y % numInterlacedFields == interlacedField)
+    {
+      if (scanlineHasToleratedPixels[y])
+      {
+        scanlineDriftAge[y] = MIN(scanlineDriftAge[y] + 1, PERCEPTUAL_DIFF_DRIFT_CORRECTION_FRAMES);
+#ifdef USE_SCANLINE_HASHES
+        prevScanlineHashes[y] = HashScanline(prevFramebuffer + y*(gpuFramebufferScanlineStrideBytes>>1), gpuFrameWidth);
+#endif
+      }
+      else
+        scanlineDriftAge[y] = 0;
+    }
+    if (scanlineDriftAge[y] > 0) ++numDriftedScanlines;
+  }
 }
 
-void MergeScanlineSpanList(Span *listHead)
+bool DisplayHasDriftedScanlines()
 {
-  for(Span *i = listHead; i; i = i->next)
+  return numDriftedScanlines > 0;
+}
+#endif
+
+#ifdef BENCHMARK_SPAN_MERGE
+void MergeScanlineSpanListGreedy(SpanArray &spanArray)
+{
+  Span *spans = spanArray.spans, *end = spanArray.spans + spanArray.numSpans;
+  for(Span *i = spans; i < end; ++i)
   {
-    Span *prev = i;
-    for(Span *j = i->next; j; j = j->next)
+    if (i->endY == i->y) continue; // Already merged to an earlier span
+    for(Span *j = i+1; j < end; ++j)
     {
+      if (j->endY == j->y) continue;
       // If the spans i and j are vertically apart, don't attempt to merge span i any further, since all spans >= j will also be farther vertically apart.
-      // (the list is nondecreasing with respect to Span::y)
+      // (the array is nondecreasing with respect to Span::y)
       if (j->y > i->endY) break;
 
       // Merge the spans i and j, and figure out the wastage of doing so
@@ -467,7 +1134,7 @@ void MergeScanlineSpanList(Span *listHead)
       int endY = MAX(i->endY, j->endY);
       int lastScanEndX = (endY > i->endY) ? j->lastScanEndX : ((endY > j->endY) ? i->lastScanEndX : MAX(i->lastScanEndX, j->lastScanEndX));
       int newSize = (endX-x)*(endY-y-1) + (lastScanEndX - x);
-      int wastedPixels = newSize - i->size - j->size;
+      int wastedPixels = newSize - i->Size() - j->Size();
       if (wastedPixels <= SPAN_MERGE_THRESHOLD
 #ifdef MAX_SPI_TASK_SIZE
         && newSize*SPI_BYTESPERPIXEL <= MAX_SPI_TASK_SIZE
@@ -479,12 +1146,565 @@ void MergeScanlineSpanList(Span *listHead)
         i->endX = endX;
         i->endY = endY;
         i->lastScanEndX = lastScanEndX;
-        i->size = newSize;
-        prev->next = j->next;
-        j = prev;
+        j->endY = j->y; // Mark j as merged, it is dropped below
+      }
+    }
+  }
+
+  int numSpans = 0;
+  for(Span *i = spans; i < end; ++i)
+    if (i->endY != i->y)
+      spans[numSpans++] = *i;
+  spanArray.numSpans = numSpans;
+}
+#endif
+
+// Computes the span that covers both i and j, and returns the number of pixels in it that were in neither i nor j.
+static inline int MergeSpans(const Span *i, const Span *j, Span &merged)
+{
+  merged.x = MIN(i->x, j->x);
+  merged.y = MIN(i->y, j->y);
+  merged.endX = MAX(i->endX, j->endX);
+  merged.endY = MAX(i->endY, j->endY);
+  merged.lastScanEndX = (merged.endY > i->endY) ? j->lastScanEndX : ((merged.endY > j->endY) ? i->lastScanEndX : MAX(i->lastScanEndX, j->lastScanEndX));
+  return merged.Size() - i->Size() - j->Size();
+}
+
+static inline bool MergeFitsInTask(const Span &merged)
+{
+#ifdef MAX_SPI_TASK_SIZE
+  return merged.Size()*SPI_BYTESPERPIXEL <= MAX_SPI_TASK_SIZE;
+#else
+  return true;
+#endif
+}
+
+void MergeScanlineSpanList(SpanArray &spanArray)
+{
+  if (spanArray.numSpans == 0) return;
+
+  // Cost model: sending the pixels of a span costs SPI_BYTESPERPIXEL bytes per pixel of bus time, and starting a new span costs the bus time of the
+  // cursor X and write pixels commands plus the fixed cost of their two tasks, and if the span starts a new scanline, also the bus time and the task
+  // of a cursor Y command. Merging two spans is worth it if the bus time spent on the wasted pixels of the merged span is less than the time of the
+  // commands it saves. The fixed task cost does not scale with the bus speed, so the faster the bus, the more pixels are worth wasting to save a task.
+  const double usecsPerPixel = SPI_BYTESPERPIXEL * spiUsecsPerByte;
+  const double spanStartUsecs = SPAN_START_COMMAND_BYTES * spiUsecsPerByte + 2 * SPI_TASK_OVERHEAD_USECS;
+  const double scanlineChangeUsecs = SCANLINE_CHANGE_COMMAND_BYTES * spiUsecsPerByte + SPI_TASK_OVERHEAD_USECS;
+  const double maxWastedPixelsOnSameScanline = spanStartUsecs / usecsPerPixel;
+  const double maxWastedPixelsOnScanlineChange = (spanStartUsecs + scanlineChangeUsecs) / usecsPerPixel;
+
+  // Sweep the scanlines top to bottom. openSpans holds the merged spans that ended on the previous scanline (and can be extended down to the current
+  // one), and nextOpenSpans collects the spans that end on the current scanline. Each span only needs to be tested against the spans that are near
+  // it horizontally, so the merge runs in near linear time in the number of spans. Spans that are not merged to an earlier span are compacted
+  // in place towards the start of the array, so the open spans point to where the spans end up.
+  static Span **openSpans = 0, **nextOpenSpans = 0;
+  if (!openSpans)
+  {
+    const int maxSpansOnScanline = gpuFrameWidth/2 + 1; // Spans on one scanline are separated by at least one unchanged pixel
+    openSpans = (Span**)Malloc(maxSpansOnScanline*sizeof(Span*), "MergeScanlineSpanList() open spans");
+    nextOpenSpans = (Span**)Malloc(maxSpansOnScanline*sizeof(Span*), "MergeScanlineSpanList() next open spans");
+  }
+  int numOpenSpans = 0, numNextOpenSpans = 0, firstCandidate = 0;
+  Span *spans = spanArray.spans, *end = spanArray.spans + spanArray.numSpans;
+  int y = spans->y;
+  bool spanStartsOnScanline = false; // True if a span that was not merged to any earlier span starts on the current scanline
+
+  Span *dst = spans;
+  for(Span *s = spans; s < end; ++s)
+  {
+    if (s->y != y)
+    {
+      // Moving on to a new scanline: spans that ended on the current scanline can only be extended if the new scanline is the one right below.
+      if (s->y == y+1)
+      {
+        Span **tmp = openSpans; openSpans = nextOpenSpans; nextOpenSpans = tmp;
+        numOpenSpans = numNextOpenSpans;
+      }
+      else
+        numOpenSpans = 0;
+      numNextOpenSpans = 0;
+      firstCandidate = 0;
+      y = s->y;
+      spanStartsOnScanline = false;
+    }
+
+    // Extending a span from the previous scanline down to s saves the cursor Y command of this scanline, but only if no other span will start on this scanline.
+    const double maxWastedPixelsOnNextScanline = (spanStartsOnScanline || (s+1 < end && s[1].y == y)) ? maxWastedPixelsOnSameScanline : maxWastedPixelsOnScanlineChange;
+
+    // Find the merge that saves the most bus time: either extending a span that ends on the same scanline to the right, or extending a span from
+    // the previous scanline downwards.
+    Span *target = 0;
+    int targetOpenSpanIndex = -1, targetNextOpenSpanIndex = -1;
+    double bestSavedPixels = 0;
+    Span merged, bestMerged;
+    if (s->endY == s->y + 1) // Only single scanline spans are produced by the differs, but be safe if some other span shape were to appear here
+    {
+      // nextOpenSpans is ordered by where the spans end on this scanline, so the search can stop at the first span that ends too far to the left of s.
+      for(int i = numNextOpenSpans-1; i >= 0 && s->x - nextOpenSpans[i]->lastScanEndX <= maxWastedPixelsOnSameScanline; --i)
+      {
+        Span *candidate = nextOpenSpans[i];
+        double savedPixels = maxWastedPixelsOnSameScanline - MergeSpans(candidate, s, merged);
+        if (savedPixels >= 0 && MergeFitsInTask(merged) && (!target || savedPixels > bestSavedPixels))
+        {
+          target = candidate;
+          targetNextOpenSpanIndex = i;
+          bestSavedPixels = savedPixels;
+          bestMerged = merged;
+        }
+      }
+
+      // Spans that start further than maxWastedPixelsOnScanlineChange to the left of s cannot merge with it, nor with any of the later spans on this
+      // scanline, since those are all further to the right.
+      while(firstCandidate < numOpenSpans && (!openSpans[firstCandidate] || openSpans[firstCandidate]->x + maxWastedPixelsOnScanlineChange < s->x)) ++firstCandidate;
+      for(int i = firstCandidate; i < numOpenSpans; ++i)
+      {
+        Span *candidate = openSpans[i];
+        if (!candidate) continue; // Already extended down to this scanline by an earlier span
+        if (candidate->x > s->endX + maxWastedPixelsOnNextScanline) break;
+        double savedPixels = maxWastedPixelsOnNextScanline - MergeSpans(candidate, s, merged);
+        if (savedPixels >= 0 && MergeFitsInTask(merged) && (!target || savedPixels > bestSavedPixels))
+        {
+          target = candidate;
+          targetOpenSpanIndex = i;
+          targetNextOpenSpanIndex = -1;
+          bestSavedPixels = savedPixels;
+          bestMerged = merged;
+        }
+      }
+
+      // The merged span now ends at the end of s, i.e. furthest right of all spans on this scanline, so (re)insert it last in nextOpenSpans.
+      if (targetOpenSpanIndex >= 0)
+      {
+        openSpans[targetOpenSpanIndex] = 0;
+        nextOpenSpans[numNextOpenSpans++] = target;
+      }
+      else if (targetNextOpenSpanIndex >= 0)
+      {
+        memmove(nextOpenSpans + targetNextOpenSpanIndex, nextOpenSpans + targetNextOpenSpanIndex + 1, (numNextOpenSpans - targetNextOpenSpanIndex - 1)*sizeof(Span*));
+        nextOpenSpans[numNextOpenSpans-1] = target;
+      }
+    }
+
+    if (target)
+    {
+      // Grow the target span to cover s, and drop s (target precedes s, so it has already been compacted to its final place)
+      *target = bestMerged;
+    }
+    else
+    {
+      *dst = *s;
+      nextOpenSpans[numNextOpenSpans++] = dst++;
+      spanStartsOnScanline = true;
+    }
+  }
+  spanArray.numSpans = dst - spans;
+}
+
+#ifdef BENCHMARK_SPAN_MERGE
+double EstimateSpanArrayUsecs(const SpanArray &spanArray)
+{
+  uint64_t bytes = 0;
+  int numTasks = 0;
+  int spiY = -1;
+  for(const Span *i = spanArray.spans; i < spanArray.spans + spanArray.numSpans; ++i)
+  {
+    if (i->y != spiY)
+    {
+      bytes += SCANLINE_CHANGE_COMMAND_BYTES;
+      ++numTasks;
+    }
+    spiY = i->y;
+    bytes += SPAN_START_COMMAND_BYTES + i->Size()*SPI_BYTESPERPIXEL;
+    numTasks += 2;
+  }
+  return bytes * spiUsecsPerByte + numTasks * SPI_TASK_OVERHEAD_USECS;
+}
+
+static void CopySpanArray(const SpanArray &src, SpanArray &dst)
+{
+  ReserveSpans(dst, src.numSpans);
+  memcpy(dst.spans, src.spans, src.numSpans*sizeof(Span));
+  dst.numSpans = src.numSpans;
+}
+
+void BenchmarkSpanMerge(const SpanArray &spanArray)
+{
+  static SpanArray greedySpans = {}, costModelSpans = {};
+  static uint64_t greedyUsecs = 0, costModelUsecs = 0;
+  static double greedyBusUsecs = 0, costModelBusUsecs = 0, unmergedBusUsecs = 0;
+  static int numFrames = 0;
+  static uint64_t lastPrint = 0;
+  if (!lastPrint) lastPrint = tick();
+
+  unmergedBusUsecs += EstimateSpanArrayUsecs(spanArray);
+
+  CopySpanArray(spanArray, greedySpans);
+  uint64_t t0 = tick();
+  MergeScanlineSpanListGreedy(greedySpans);
+  greedyUsecs += tick() - t0;
+  greedyBusUsecs += EstimateSpanArrayUsecs(greedySpans);
+
+  CopySpanArray(spanArray, costModelSpans);
+  t0 = tick();
+  MergeScanlineSpanList(costModelSpans);
+  costModelUsecs += tick() - t0;
+  costModelBusUsecs += EstimateSpanArrayUsecs(costModelSpans);
+  ++numFrames;
+
+  if (tick() - lastPrint >= 2000000)
+  {
+    printf("Span merge over %d frames: unmerged: %.2f msecs bus time/frame, greedy: %.2f msecs bus time/frame in %llu usecs/frame, cost model: %.2f msecs bus time/frame in %llu usecs/frame\n",
+      numFrames, unmergedBusUsecs / numFrames / 1000.0,
+      greedyBusUsecs / numFrames / 1000.0, (unsigned long long)(greedyUsecs / numFrames),
+      costModelBusUsecs / numFrames / 1000.0, (unsigned long long)(costModelUsecs / numFrames));
+    greedyUsecs = costModelUsecs = 0;
+    greedyBusUsecs = costModelBusUsecs = unmergedBusUsecs = 0;
+    numFrames = 0;
+    lastPrint = tick();
+  }
+}
+#endif
+
+#ifdef USE_DIRTY_TILE_PREPASS
+// Like DiffKernel::FindFirstChangedPixel(), but only runs the kernel over dirty tiles, since clean tiles cannot contain changed pixels.
+static inline int FindFirstChangedPixelInDirtyTiles(const DiffKernel &kernel, const uint8_t *tileRow, const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+  while(x < endX)
+  {
+    int tileX = x >> DIRTY_TILE_SIZE_LOG2;
+    if (!tileRow[tileX])
+    {
+      x = (tileX+1) << DIRTY_TILE_SIZE_LOG2;
+      continue;
+    }
+    int runEndTileX = tileX+1;
+    while(runEndTileX < numDirtyTilesX && tileRow[runEndTileX]) ++runEndTileX;
+    int runEnd = MIN(endX, runEndTileX << DIRTY_TILE_SIZE_LOG2);
+    x = kernel.FindFirstChangedPixel(scanline, prevScanline, x, runEnd);
+    if (x < runEnd) return x;
+  }
+  return endX;
+}
+
+// Like DiffKernel::FindFirstUnchangedPixel(), but stops at the first clean tile, since all pixels in a clean tile are unchanged.
+static inline int FindFirstUnchangedPixelInDirtyTiles(const DiffKernel &kernel, const uint8_t *tileRow, const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+  int tileX = x >> DIRTY_TILE_SIZE_LOG2;
+  if (!tileRow[tileX]) return x;
+  int runEndTileX = tileX+1;
+  while(runEndTileX < numDirtyTilesX && tileRow[runEndTileX]) ++runEndTileX;
+  return kernel.FindFirstUnchangedPixel(scanline, prevScanline, x, MIN(endX, runEndTileX << DIRTY_TILE_SIZE_LOG2));
+}
+
+#define FIND_FIRST_CHANGED_PIXEL(x, endX) FindFirstChangedPixelInDirtyTiles(kernel, tileRow, scanline, prevScanline, (x), (endX))
+#define FIND_FIRST_UNCHANGED_PIXEL(x, endX) FindFirstUnchangedPixelInDirtyTiles(kernel, tileRow, scanline, prevScanline, (x), (endX))
+#else
+#define FIND_FIRST_CHANGED_PIXEL(x, endX) kernel.FindFirstChangedPixel(scanline, prevScanline, (x), (endX))
+#define FIND_FIRST_UNCHANGED_PIXEL(x, endX) kernel.FindFirstUnchangedPixel(scanline, prevScanline, (x), (endX))
+#endif
+
+void DiffFramebuffersToScanlineSpansWithKernel(const DiffKernel &kernel, uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, int startY, int endY, SpanArray &spanArray, DiffStats &stats)
+{
+  int numSpans = 0;
+  int numChangedPixels = 0;
+  ClearDiffStats(stats);
+  int y = startY;
+  if (interlacedDiff && (y & 1) != interlacedFieldParity) ++y;
+  int yInc = interlacedDiff ? 2 : 1;
+  const int stride = gpuFramebufferScanlineStrideBytes>>1; // Stride as uint16 elements.
+  const int W = gpuFrameWidth;
+  const int maxSpansPerScanline = MaxSpansPerScanline();
+
+  for(; y < endY; y += yInc)
+  {
+    if (!SCANLINE_MAY_HAVE_CHANGED(y)) continue;
+    ReserveSpans(spanArray, numSpans + maxSpansPerScanline);
+#ifdef USE_DIRTY_TILE_PREPASS
+    const uint8_t *tileRow = DIRTY_TILE_ROW(y);
+#endif
+    const uint16_t *scanline = framebuffer + y*stride;
+    const uint16_t *prevScanline = prevFramebuffer + y*stride; // (same scanline from previous frame, not preceding scanline)
+    int x = 0;
+    for(;;)
+    {
+      int spanStart = FIND_FIRST_CHANGED_PIXEL(x, W);
+      if (spanStart >= W) break;
+
+      // We've found a start of a span of different pixels on this scanline, now find where this span ends: span ends when more than
+      // SPAN_MERGE_THRESHOLD consecutive pixels are unchanged, or when the scanline ends.
+      int spanEnd;
+      for(x = spanStart;;)
+      {
+        spanEnd = FIND_FIRST_UNCHANGED_PIXEL(x, W);
+        numChangedPixels += spanEnd - x;
+        if (spanEnd >= W) { x = W; break; }
+        int mergeEnd = MIN(W, spanEnd + SPAN_MERGE_THRESHOLD + 1);
+        x = FIND_FIRST_CHANGED_PIXEL(spanEnd, mergeEnd);
+        if (x >= mergeEnd) break;
       }
-      else // Not merging - travel to next node remembering where we came from
-        prev = j;
+
+      // Submit the span update task
+      Span *span = spanArray.spans + numSpans;
+      span->x = spanStart;
+      span->endX = span->lastScanEndX = spanEnd;
+      span->y = y;
+      span->endY = y+1;
+      AddSpanToDiffStats(stats, span, numSpans == 0 || span[-1].y != y);
+      ++numSpans;
+    }
+  }
+  stats.numChangedPixels = numChangedPixels;
+  spanArray.numSpans = numSpans;
+}
+
+void DiffFramebuffersToScanlineSpansSIMD(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, SpanArray &spanArray, DiffStats &stats)
+{
+  DiffFramebuffersToScanlineSpansWithKernel(diffKernel, framebuffer, prevFramebuffer, interlacedDiff, interlacedFieldParity, 0, gpuFrameHeight, spanArray, stats);
+}
+
+#if defined(BENCHMARK_DIFF_KERNELS) || defined(BENCHMARK_DIFF_THREADS)
+static bool SpanArraysEqual(const SpanArray &a, const SpanArray &b)
+{
+  return a.numSpans == b.numSpans && !memcmp(a.spans, b.spans, a.numSpans*sizeof(Span));
+}
+
+static bool DiffStatsEqual(const DiffStats &a, const DiffStats &b)
+{
+  return a.numChangedPixels == b.numChangedPixels && !memcmp(a.scanlineClassBytes, b.scanlineClassBytes, sizeof(a.scanlineClassBytes));
+}
+#endif
+
+#ifdef USE_MULTITHREADED_DIFF
+// If fewer scanlines than this per band would need diffing, it is faster to diff them on fewer threads than to wake up more worker threads.
+#define MIN_SCANLINES_PER_DIFF_BAND 8
+
+// A horizontal band of the frame that is diffed by one thread. Band 0 is diffed by the main thread directly into the resulting span array, and
+// the rest by worker threads into their own span arrays. Aligned to a cache line so that threads do not contend on each other's bands.
+struct __attribute__((aligned(64))) DiffBand
+{
+  int startY, endY; // Scanlines [startY, endY[ of the frame
+  SpanArray spans; // Resulting spans in this band. Bands other than band 0 are allocated up front to hold the spans of MaxDiffBandScanlines() scanlines, so they never grow on the worker threads
+  DiffStats stats; // Changed pixels and bus bytes of the spans in this band
+  pthread_t thread;
+  volatile int jobGeneration; // Incremented by the main thread to hand a new band to the worker thread, which sleeps on this as a futex
+};
+
+static DiffBand diffBands[NUM_DIFF_THREADS];
+
+// The frame that is currently being diffed, shared by all bands
+static uint16_t *diffJobFramebuffer, *diffJobPrevFramebuffer;
+static bool diffJobInterlaced;
+static int diffJobFieldParity;
+static volatile int numPendingDiffBands = 0; // Number of worker threads that have not yet finished their band. The main thread sleeps on this as a futex
+static volatile bool diffThreadsRunning = false;
+
+// Band i is only ever used when the frame is split into at least i+1 bands, and the bands are balanced by the number of scanlines that may have
+// changed, so band i never needs to hold spans for more than ceil(height/(i+1)) scanlines.
+static int MaxDiffBandScanlines(int band)
+{
+  return (gpuFrameHeight + band) / (band + 1);
+}
+
+static void DiffBandToScanlineSpans(DiffBand *band)
+{
+  DiffFramebuffersToScanlineSpansWithKernel(diffKernel, diffJobFramebuffer, diffJobPrevFramebuffer, diffJobInterlaced, diffJobFieldParity, band->startY, band->endY, band->spans, band->stats);
+}
+
+static void *diff_thread(void *arg)
+{
+  DiffBand *band = (DiffBand*)arg;
+#ifdef RUN_WITH_REALTIME_THREAD_PRIORITY
+  SetRealtimeThreadPriority();
+#endif
+  int generation = 0;
+  for(;;)
+  {
+    int newGeneration = __atomic_load_n(&band->jobGeneration, __ATOMIC_ACQUIRE);
+    if (newGeneration == generation)
+    {
+      syscall(SYS_futex, &band->jobGeneration, FUTEX_WAIT, generation, 0, 0, 0); // Sleep until the main thread hands out a new band
+      continue;
     }
+    if (!diffThreadsRunning) break;
+    generation = newGeneration;
+    DiffBandToScanlineSpans(band);
+    if (__atomic_sub_fetch(&numPendingDiffBands, 1, __ATOMIC_ACQ_REL) == 0)
+      syscall(SYS_futex, &numPendingDiffBands, FUTEX_WAKE, 1, 0, 0, 0); // Wake the main thread if it is waiting for the bands to finish
+  }
+  pthread_exit(0);
+}
+
+void InitDiffThreads()
+{
+  diffThreadsRunning = true;
+  for(int i = 1; i < NUM_DIFF_THREADS; ++i)
+  {
+    diffBands[i].spans = (SpanArray){};
+    ReserveSpans(diffBands[i].spans, MaxDiffBandScanlines(i) * MaxSpansPerScanline());
+    diffBands[i].jobGeneration = 0;
+    int rc = pthread_create(&diffBands[i].thread, NULL, diff_thread, &diffBands[i]);
+    if (rc != 0) FATAL_ERROR("Failed to create diff thread!");
+  }
+  printf("Diffing frames in %d bands in parallel\n", NUM_DIFF_THREADS);
+}
+
+void DeinitDiffThreads()
+{
+  diffThreadsRunning = false;
+  for(int i = 1; i < NUM_DIFF_THREADS; ++i)
+  {
+    __atomic_add_fetch(&diffBands[i].jobGeneration, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &diffBands[i].jobGeneration, FUTEX_WAKE, 1, 0, 0, 0);
+    pthread_join(diffBands[i].thread, NULL);
+    diffBands[i].thread = (pthread_t)0;
+  }
+}
+
+// Splits the frame into at most maxBands bands so that each band has the same number of scanlines that may have changed (after the dirty tile
+// and scanline hash checks) to diff, rather than the same height, so that e.g. a small changing area of the screen is spread across all threads.
+// Returns the number of bands that the frame was split into.
+static int AssignDiffBands(int maxBands, bool interlacedDiff, int interlacedFieldParity)
+{
+  int firstY = interlacedDiff ? interlacedFieldParity : 0;
+  int yInc = interlacedDiff ? 2 : 1;
+  int numScanlines = 0;
+  for(int y = firstY; y < gpuFrameHeight; y += yInc)
+    if (SCANLINE_MAY_HAVE_CHANGED(y)) ++numScanlines;
+
+  int numBands = MAX(1, MIN(maxBands, numScanlines / MIN_SCANLINES_PER_DIFF_BAND));
+  int y = firstY, scanlines = 0;
+  for(int i = 0; i < numBands; ++i)
+  {
+    diffBands[i].startY = (i == 0) ? 0 : y;
+    int bandEnd = (i+1) * numScanlines / numBands;
+    for(; y < gpuFrameHeight && scanlines < bandEnd; y += yInc)
+      if (SCANLINE_MAY_HAVE_CHANGED(y)) ++scanlines;
+    diffBands[i].endY = (i == numBands-1) ? gpuFrameHeight : y;
+  }
+  return numBands;
+}
+
+void DiffFramebuffersToScanlineSpansInBands(int maxBands, uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, SpanArray &spanArray, DiffStats &stats)
+{
+  diffJobFramebuffer = framebuffer;
+  diffJobPrevFramebuffer = prevFramebuffer;
+  diffJobInterlaced = interlacedDiff;
+  diffJobFieldParity = interlacedFieldParity;
+  int numBands = AssignDiffBands(maxBands, interlacedDiff, interlacedFieldParity);
+
+  __atomic_store_n(&numPendingDiffBands, numBands-1, __ATOMIC_RELEASE);
+  for(int i = 1; i < numBands; ++i)
+  {
+    __atomic_add_fetch(&diffBands[i].jobGeneration, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &diffBands[i].jobGeneration, FUTEX_WAKE, 1, 0, 0, 0);
+  }
+  // Band 0 borrows the resulting array, so that its spans are already in place
+  diffBands[0].spans = spanArray;
+  DiffBandToScanlineSpans(&diffBands[0]);
+  spanArray = diffBands[0].spans;
+
+  int pending;
+  while((pending = __atomic_load_n(&numPendingDiffBands, __ATOMIC_ACQUIRE)) != 0)
+    syscall(SYS_futex, &numPendingDiffBands, FUTEX_WAIT, pending, 0, 0, 0); // Sleep until the worker threads have finished their bands
+
+  // Append the spans of the other bands in top-to-bottom order, which gives the same spans that a single threaded diff would produce.
+  stats = diffBands[0].stats;
+  for(int i = 1; i < numBands; ++i)
+  {
+    stats.numChangedPixels += diffBands[i].stats.numChangedPixels;
+    for(int c = 0; c < NUM_SCANLINE_CLASSES; ++c)
+      stats.scanlineClassBytes[c] += diffBands[i].stats.scanlineClassBytes[c];
+    const SpanArray &band = diffBands[i].spans;
+    ReserveSpans(spanArray, spanArray.numSpans + band.numSpans);
+    memcpy(spanArray.spans + spanArray.numSpans, band.spans, band.numSpans*sizeof(Span));
+    spanArray.numSpans += band.numSpans;
+  }
+}
+
+void DiffFramebuffersToScanlineSpansMultithreaded(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, SpanArray &spanArray, DiffStats &stats)
+{
+  DiffFramebuffersToScanlineSpansInBands(NUM_DIFF_THREADS, framebuffer, prevFramebuffer, interlacedDiff, interlacedFieldParity, spanArray, stats);
+}
+
+#ifdef BENCHMARK_DIFF_THREADS
+void BenchmarkDiffThreads(uint16_t *framebuffer, uint16_t *prevFramebuffer)
+{
+  static uint64_t usecs[NUM_DIFF_THREADS] = {};
+  static int numFrames = 0, numMismatches[NUM_DIFF_THREADS] = {};
+  static uint64_t lastPrint = 0;
+  static SpanArray referenceSpans = {}, bandSpans = {};
+  if (!lastPrint) lastPrint = tick();
+
+  DiffStats referenceStats;
+  DiffFramebuffersToScanlineSpansWithKernel(diffKernel, framebuffer, prevFramebuffer, false, 0, 0, gpuFrameHeight, referenceSpans, referenceStats);
+
+  for(int i = 0; i < NUM_DIFF_THREADS; ++i)
+  {
+    DiffStats stats;
+    uint64_t t0 = tick();
+    DiffFramebuffersToScanlineSpansInBands(i+1, framebuffer, prevFramebuffer, false, 0, bandSpans, stats);
+    usecs[i] += tick() - t0;
+    if (!SpanArraysEqual(referenceSpans, bandSpans) || !DiffStatsEqual(referenceStats, stats)) ++numMismatches[i];
+  }
+  ++numFrames;
+
+  if (tick() - lastPrint >= 2000000)
+  {
+    printf("Diff threads over %d frames at %dx%d:", numFrames, gpuFrameWidth, gpuFrameHeight);
+    for(int i = 0; i < NUM_DIFF_THREADS; ++i)
+      printf(" %d: %llu ns/frame (%.2fx, %d mismatches)", i+1, (unsigned long long)(usecs[i] * 1000 / numFrames), (double)usecs[0] / MAX(usecs[i], 1), numMismatches[i]);
+    printf("\n");
+    for(int i = 0; i < NUM_DIFF_THREADS; ++i) usecs[i] = numMismatches[i] = 0;
+    numFrames = 0;
+    lastPrint = tick();
+  }
+}
+#endif
+
+#endif // ~USE_MULTITHREADED_DIFF
+
+#ifdef BENCHMARK_DIFF_KERNELS
+
+void BenchmarkDiffKernels(uint16_t *framebuffer, uint16_t *prevFramebuffer)
+{
+#define MAX_BENCHMARKED_KERNELS 4
+  static DiffKernel kernels[MAX_BENCHMARKED_KERNELS];
+  static int numKernels = 0;
+  static SpanArray referenceSpans = {}, kernelSpans = {};
+  static uint64_t exactUsecs = 0, kernelUsecs[MAX_BENCHMARKED_KERNELS] = {};
+  static int numFrames = 0, numMismatches[MAX_BENCHMARKED_KERNELS] = {};
+  static uint64_t lastPrint = 0;
+  if (!lastPrint)
+  {
+    numKernels = GetSupportedDiffKernels(kernels, MAX_BENCHMARKED_KERNELS);
+    lastPrint = tick();
+  }
+
+  DiffStats referenceStats;
+  uint64_t t0 = tick();
+  DiffFramebuffersToScanlineSpansExact(framebuffer, prevFramebuffer, false, 0, referenceSpans, referenceStats);
+  exactUsecs += tick() - t0;
+
+  for(int i = 0; i < numKernels; ++i)
+  {
+    DiffStats stats;
+    t0 = tick();
+    DiffFramebuffersToScanlineSpansWithKernel(kernels[i], framebuffer, prevFramebuffer, false, 0, 0, gpuFrameHeight, kernelSpans, stats);
+    kernelUsecs[i] += tick() - t0;
+    if (!SpanArraysEqual(referenceSpans, kernelSpans) || !DiffStatsEqual(referenceStats, stats)) ++numMismatches[i];
+  }
+  ++numFrames;
+
+  if (tick() - lastPrint >= 2000000)
+  {
+    printf("Diff kernels over %d frames: exact: %llu ns/frame", numFrames, (unsigned long long)(exactUsecs * 1000 / numFrames));
+    for(int i = 0; i < numKernels; ++i)
+      printf(", %s: %llu ns/frame (%d mismatches)", kernels[i].name, (unsigned long long)(kernelUsecs[i] * 1000 / numFrames), numMismatches[i]);
+    printf("\n");
+    exactUsecs = 0;
+    for(int i = 0; i < numKernels; ++i) kernelUsecs[i] = numMismatches[i] = 0;
+    numFrames = 0;
+    lastPrint = tick();
   }
 }
+#endif
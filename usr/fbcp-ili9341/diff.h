@@ -5,12 +5,58 @@
 // Spans track dirty rectangular areas on screen
 struct Span
 {
-  uint16_t x, endX, y, endY, lastScanEndX;
-  uint32_t size; // Specifies a box of width [x, endX[ * [y, endY[, where scanline endY-1 can be partial, and ends in lastScanEndX.
-  Span *next; // Maintain a linked skip list inside the array for fast seek to next active element when pruning
+  uint16_t x, endX, y, endY, lastScanEndX; // Specifies a box of width [x, endX[ * [y, endY[, where scanline endY-1 can be partial, and ends in lastScanEndX.
+
+  int Size() const { return (endX - x)*(endY - y - 1) + (lastScanEndX - x); } // Number of pixels in the span
+};
+
+// The spans of a frame, stored back to back in the order that they are submitted in. The differs produce them in nondecreasing order of Span::y.
+// Spans are only 10 bytes each, so a frame worth of spans takes few cache lines to walk through. The array grows on demand, which moves the spans
+// in memory, so spans are only referred to by their index in the array across calls that may add spans.
+// The fields of a span are kept together rather than split into an array per field: the differs, the merging and the submit loop all read or write
+// every field of each span they touch, so separate arrays would cost the same cache lines, spread over five streams instead of one.
+// fbcp-span-merge-benchmark in host/ prints how large the array grows on a trace. The cache misses of this layout have not been measured on a Pi.
+struct SpanArray
+{
+  Span *spans;
+  int numSpans;
+  int capacity;
 };
 
-extern Span *spans;
+// The spans that are submitted to the display each frame
+extern SpanArray frameSpans;
+
+// Grows the array to hold at least the given number of spans.
+void GrowSpanArray(SpanArray &spanArray, int capacity);
+
+// Makes sure that the array has room for at least the given total number of spans. The existing spans are kept, but pointers to them are invalidated if the array grows.
+static inline void ReserveSpans(SpanArray &spanArray, int numSpans)
+{
+  if (numSpans > spanArray.capacity) GrowSpanArray(spanArray, numSpans);
+}
+
+// Upper bound for the number of spans that the scanline differs produce on one scanline: spans on a scanline are separated by more than
+// SPAN_MERGE_THRESHOLD unchanged pixels.
+int MaxSpansPerScanline(void);
+
+#ifdef USE_DIRTY_TILE_PREPASS
+// The framebuffer is divided into square tiles of DIRTY_TILE_SIZE x DIRTY_TILE_SIZE pixels, and before diffing, each tile is flagged whether any pixel in it has changed.
+// The span differs then only need to look at the scanlines and columns that fall inside dirty tiles.
+#define DIRTY_TILE_SIZE_LOG2 4
+#define DIRTY_TILE_SIZE (1 << DIRTY_TILE_SIZE_LOG2)
+
+extern uint8_t *dirtyTiles; // numDirtyTilesX*numDirtyTilesY flags in row-major order, nonzero if the tile contains a changed pixel
+extern uint8_t *dirtyTileRows; // numDirtyTilesY flags, nonzero if any tile on that row of tiles is dirty
+extern int numDirtyTilesX, numDirtyTilesY;
+extern int dirtyTilesMinX, dirtyTilesMaxX, dirtyTilesMinY, dirtyTilesMaxY; // Bounding box of all dirty tiles, inclusive, in units of tiles. Max < Min if no tiles are dirty.
+
+// Allocates the dirty tile bitmap, and marks all tiles dirty.
+void InitDirtyTiles(void);
+
+// Recomputes the dirty tile bitmap between the two given framebuffers, and returns the number of dirty tiles. If candidateTiles is not null, only the
+// tiles that it flags (in the same layout as dirtyTiles) are compared, and the rest are taken to be unchanged.
+int ComputeDirtyTiles(uint16_t *framebuffer, uint16_t *prevFramebuffer, const uint8_t *candidateTiles);
+#endif
 
 // Looking at SPI communication in a logic analyzer, it is observed that waiting for the finish of an SPI command FIFO causes pretty exactly one byte of delay to the command stream.
 // Therefore the time/bandwidth cost of ending the current span and starting a new span is as follows:
@@ -23,22 +69,176 @@ extern Span *spans;
 // +1 byte to wait for that FIFO to flush,
 // after which the communication is ready to start pushing pixels. This totals to 8 bytes, or 4 pixels, meaning that if there are 4 unchanged pixels or less between two adjacent dirty
 // spans, it is all the same to just update through those pixels as well to not have to wait to flush the FIFO.
+#if defined(DISPLAY_SPI_BUS_IS_16BITS_WIDE)
+#define SPAN_START_COMMAND_PIXELS 10
+#elif defined(HX8357D)
+#define SPAN_START_COMMAND_PIXELS 6
+#else
+#define SPAN_START_COMMAND_PIXELS 4
+#endif
+
+// Bus bytes of the cursor X and write pixels commands that start a new span, i.e. the 8 bytes above.
+#define SPAN_START_COMMAND_BYTES (SPAN_START_COMMAND_PIXELS*SPI_BYTESPERPIXEL)
+
+// Bus bytes of the cursor Y command that a span starting on a new scanline needs in addition: the command byte, the FIFO wait, the two coordinate bytes
+// and the FIFO wait after them, i.e. 5 of the 8 bytes above.
+#define SCANLINE_CHANGE_COMMAND_BYTES (SPAN_START_COMMAND_BYTES*5/8)
+
+// With ALL_TASKS_SHOULD_DMA, setting up the DMA transfers of a task costs far more than sending the few bytes of a cursor command, so the differs
+// only split spans at long runs of unchanged pixels.
 #if defined(ALL_TASKS_SHOULD_DMA)
 #define SPAN_MERGE_THRESHOLD 320
-#elif defined(DISPLAY_SPI_BUS_IS_16BITS_WIDE)
-#define SPAN_MERGE_THRESHOLD 10
-#elif defined(HX8357D)
-#define SPAN_MERGE_THRESHOLD 6
 #else
-#define SPAN_MERGE_THRESHOLD 4
+#define SPAN_MERGE_THRESHOLD SPAN_START_COMMAND_PIXELS
+#endif
+
+// Bus time cost of starting a new span on the same scanline, in bytes, as counted against the bus byte budgets of a frame. The span needs a cursor X
+// task and a pixels task; with ALL_TASKS_SHOULD_DMA, the cost beyond SPAN_START_COMMAND_BYTES stands in for the setup of those two tasks.
+#define SPAN_START_OVERHEAD_BYTES (SPAN_MERGE_THRESHOLD*SPI_BYTESPERPIXEL)
+
+// Additional bus time cost of a span that starts on a new scanline, in bytes: one more task, for the cursor Y command.
+#define SCANLINE_CHANGE_OVERHEAD_BYTES ((SPAN_START_OVERHEAD_BYTES - SPAN_START_COMMAND_BYTES)/2 + SCANLINE_CHANGE_COMMAND_BYTES)
+
+// Fixed time that each SPI task costs on top of the bus time of its bytes, in microseconds (see SPI_POLLED_TASK_OVERHEAD_USECS in config.h).
+#if defined(ALL_TASKS_SHOULD_DMA)
+#define SPI_TASK_OVERHEAD_USECS SPI_DMA_TASK_OVERHEAD_USECS
+#else
+#define SPI_TASK_OVERHEAD_USECS SPI_POLLED_TASK_OVERHEAD_USECS
 #endif
 
-void DiffFramebuffersToSingleChangedRectangle(uint16_t *framebuffer, uint16_t *prevFramebuffer, Span *&head);
+#ifdef USE_SCANLINE_HASHES
+// Hashes of each scanline of the current framebuffer and the previous framebuffer (what the display is currently showing) that are being diffed.
+// Scanlines with equal hashes are skipped without reading their pixels.
+extern uint32_t *scanlineHashes, *prevScanlineHashes;
+
+// Allocates the hash arrays for the two given framebuffers and hashes their current contents.
+void InitScanlineHashes(uint16_t *framebuffer, uint16_t *prevFramebuffer);
+
+// After the spans of the previous diff have been copied over to the previous framebuffer, all the diffed scanlines are equal in both framebuffers,
+// so carries their hashes over to prevScanlineHashes. If numInterlacedFields > 1, only the scanlines y with y % numInterlacedFields == interlacedField were sent.
+void UpdatePrevScanlineHashes(int numInterlacedFields, int interlacedField);
 
-void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head);
+// If SCANLINE_HASH_VERIFY_USECS has passed since the previous verification, compares the scanlines that have equal hashes pixel by pixel, and
+// marks the ones that differ after all (hash collisions) as changed by invalidating their prevScanlineHashes.
+void VerifyScanlineHashes(const uint16_t *framebuffer, const uint16_t *prevFramebuffer);
+#endif
 
-void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head);
+// Scanlines are grouped into classes by y % NUM_SCANLINE_CLASSES. This is divisible by every supported number of interlaced fields (2, 3 and 4),
+// so after a progressive diff, the bytes that any field would take to send can be summed up from the classes that make up that field.
+#define NUM_SCANLINE_CLASSES 12
 
-void NoDiffChangedRectangle(Span *&head);
+// Statistics that the scanline span differs gather in the same pass that they generate the spans, so that the frame does not need to be read again
+// to decide how to submit it.
+struct DiffStats
+{
+  int numChangedPixels; // Exact number of pixels that differ between the two framebuffers on the diffed scanlines
+  uint32_t scanlineClassBytes[NUM_SCANLINE_CLASSES]; // Estimated SPI bus bytes needed to submit the (unmerged) spans on each class of scanlines, including the cursor commands
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+  int numToleratedPixels; // Number of changed pixels that were left unsent since they were within tolerance
+  uint32_t toleratedSquaredError[3]; // Sum of squared differences of the red, green and blue channels of the tolerated pixels, in 5, 6 and 5 bit steps
+#endif
+};
 
-void MergeScanlineSpanList(Span *listHead);
+// Returns the estimated SPI bus bytes needed to submit the scanlines y with y % numFields == field.
+static inline uint32_t InterlacedFieldBytes(const DiffStats &stats, int numFields, int field)
+{
+  uint32_t bytes = 0;
+  for(int c = field; c < NUM_SCANLINE_CLASSES; c += numFields)
+    bytes += stats.scanlineClassBytes[c];
+  return bytes;
+}
+
+// Drops all spans from the given array of unmerged single scanline spans that are not on scanlines y with y % numFields == field.
+void SelectInterlacedFieldSpans(SpanArray &spanArray, int numFields, int field);
+
+// Returns true if all the pixels of the span in the given framebuffer are of the same color, and stores that color to color. Stops reading at the first
+// pixel that differs from the first one, so spans that are not solid are usually rejected after only a few pixels.
+bool SpanIsSolidColor(const uint16_t *framebuffer, const Span &span, uint16_t *color);
+
+void DiffFramebuffersToSingleChangedRectangle(uint16_t *framebuffer, uint16_t *prevFramebuffer, SpanArray &spanArray);
+
+#ifdef MAX_DIFF_RECTANGLES
+// Covers the changed pixels with at most MAX_DIFF_RECTANGLES rectangles, found by recursively cutting the bounding rectangle of the changes in two along the
+// scanline or column that saves the most pixels from being sent. Each rectangle becomes one task.
+void DiffFramebuffersToChangedRectangles(uint16_t *framebuffer, uint16_t *prevFramebuffer, SpanArray &spanArray);
+#endif
+
+void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, SpanArray &spanArray, DiffStats &stats);
+
+void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, SpanArray &spanArray, DiffStats &stats);
+
+// Produces exactly the same spans as DiffFramebuffersToScanlineSpansExact(), but compares pixels using the widest SIMD kernel that the CPU supports (see diff_kernels.h)
+void DiffFramebuffersToScanlineSpansSIMD(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, SpanArray &spanArray, DiffStats &stats);
+
+struct DiffKernel;
+// Generates the same spans as DiffFramebuffersToScanlineSpansExact(), but leaves the pixel comparisons to the given kernel, which can skip
+// over long stretches of unchanged (or changed) pixels many pixels at a time.
+// Only scanlines [startY, endY[ are diffed. The array only grows if it does not have room for MaxSpansPerScanline() more spans on each
+// scanline that may have changed.
+void DiffFramebuffersToScanlineSpansWithKernel(const DiffKernel &kernel, uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, int startY, int endY, SpanArray &spanArray, DiffStats &stats);
+
+#ifdef USE_MULTITHREADED_DIFF
+// Allocates a span array for each band other than the first, and starts NUM_DIFF_THREADS-1 worker threads to diff them.
+void InitDiffThreads(void);
+
+// Stops and joins the worker threads.
+void DeinitDiffThreads(void);
+
+// Produces exactly the same spans as DiffFramebuffersToScanlineSpansSIMD(), but splits the frame into up to NUM_DIFF_THREADS horizontal bands that are
+// diffed in parallel, one on the calling thread and the rest on the worker threads. The spans of the bands are gathered together in order.
+void DiffFramebuffersToScanlineSpansMultithreaded(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, SpanArray &spanArray, DiffStats &stats);
+
+// Like DiffFramebuffersToScanlineSpansMultithreaded(), but splits the frame into at most maxBands bands, 1 <= maxBands <= NUM_DIFF_THREADS.
+void DiffFramebuffersToScanlineSpansInBands(int maxBands, uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, SpanArray &spanArray, DiffStats &stats);
+#endif
+
+void NoDiffChangedRectangle(SpanArray &spanArray);
+
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+// For each scanline, the number of consecutive updates that the display has shown tolerated pixels on it, up to PERCEPTUAL_DIFF_DRIFT_CORRECTION_FRAMES.
+extern uint8_t *scanlineDriftAge;
+
+// Allocates the per scanline drift tracking. Call after InitGPU().
+void InitPerceptualDiff(void);
+
+// Like DiffFramebuffersToScanlineSpansExact(), but a pixel only starts a span if it differs by more than PERCEPTUAL_DIFF_TOLERANCE steps in a color channel,
+// and once started, a span only keeps going over pixels that differ by more than PERCEPTUAL_DIFF_TOLERANCE-PERCEPTUAL_DIFF_HYSTERESIS steps. Scanlines that
+// have shown tolerated pixels for PERCEPTUAL_DIFF_DRIFT_CORRECTION_FRAMES updates are diffed exactly.
+void DiffFramebuffersToScanlineSpansWithTolerance(uint16_t *framebuffer, uint16_t *prevFramebuffer, SpanArray &spanArray, DiffStats &stats);
+
+// After the spans of the previous tolerant diff have been sent, updates the drift age of the scanlines that were sent, and with USE_SCANLINE_HASHES, rehashes
+// the scanlines of the previous framebuffer that were left showing tolerated pixels, since they do not match the hashes that UpdatePrevScanlineHashes() carried over.
+void UpdateToleratedScanlines(uint16_t *prevFramebuffer, int numInterlacedFields, int interlacedField);
+
+// Returns true if the display is showing tolerated pixels on any scanline, so they still need to be corrected even if no new frames arrive.
+bool DisplayHasDriftedScanlines(void);
+#endif
+
+// Merges spans on adjacent scanlines (and on the same scanline) into rectangles whenever that reduces the total SPI bus time needed to submit them,
+// based on the bus time of the pixel data vs the bus time of the cursor commands and the fixed cost of the tasks needed to start each span. Runs in
+// near linear time in the number of spans.
+void MergeScanlineSpanList(SpanArray &spanArray);
+
+#ifdef BENCHMARK_SPAN_MERGE
+// The previous merging method, kept around to compare against: greedily merges each span with all the following spans on the same or next scanline
+// for as long as the merge wastes at most SPAN_MERGE_THRESHOLD pixels. Quadratic in the number of spans.
+void MergeScanlineSpanListGreedy(SpanArray &spanArray);
+
+// Estimates the time in microseconds that submitting the given spans takes: the bus time of their pixels and cursor commands, plus the fixed cost of
+// each of their tasks.
+double EstimateSpanArrayUsecs(const SpanArray &spanArray);
+
+// Runs both the cost model based span merging and the old greedy span merging on copies of the given spans, and periodically prints the
+// estimated bus time and bytes of the resulting spans, along with the CPU time taken by each merging method.
+void BenchmarkSpanMerge(const SpanArray &spanArray);
+#endif
+
+#ifdef BENCHMARK_DIFF_KERNELS
+// Runs the exact differ and each supported diff kernel on the given frame, verifies that they all agree, and periodically prints their timings.
+void BenchmarkDiffKernels(uint16_t *framebuffer, uint16_t *prevFramebuffer);
+#endif
+
+#ifdef BENCHMARK_DIFF_THREADS
+// Diffs the given frame split into 1, 2, ..., NUM_DIFF_THREADS bands, verifies that they all agree, and periodically prints their timings.
+void BenchmarkDiffThreads(uint16_t *framebuffer, uint16_t *prevFramebuffer);
+#endif
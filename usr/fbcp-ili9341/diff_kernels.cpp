@@ -0,0 +1,176 @@
+#include <stdio.h> // printf
+
+#include "config.h"
+#include "diff_kernels.h"
+#include "cpu_features.h"
+#include "util.h"
+
+// Scalar fallback for CPUs without SIMD (Pi Zero/Pi 1 ARMv6): compares 4 pixels at a time via 64-bit loads.
+static int FindFirstChangedPixelScalar(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+  // The two framebuffers share the same stride and alignment, so if the current scanline is 8-byte aligned, then so is the previous scanline.
+  if ((((uintptr_t)scanline ^ (uintptr_t)prevScanline) & 7) == 0)
+  {
+    while(x < endX && ((uintptr_t)(scanline+x) & 7))
+    {
+      if (scanline[x] != prevScanline[x]) return x;
+      ++x;
+    }
+    for(; x + 4 <= endX; x += 4)
+    {
+      uint64_t diff = *(const uint64_t*)(scanline+x) ^ *(const uint64_t*)(prevScanline+x);
+      if (diff) return x + (__builtin_ctzll(diff) >> 4);
+    }
+  }
+  while(x < endX && scanline[x] == prevScanline[x]) ++x;
+  return x;
+}
+
+static int FindFirstUnchangedPixelScalar(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+  while(x < endX && scanline[x] != prevScanline[x]) ++x;
+  return x;
+}
+
+#ifdef HAVE_NEON_KERNELS
+
+NEON_KERNELS_BEGIN
+
+// Returns true if any 16-bit lane of v is nonzero.
+static inline bool AnyLaneNonzeroNEON(uint16x8_t v)
+{
+  uint64x2_t v64 = vreinterpretq_u64_u16(v);
+  return (vgetq_lane_u64(v64, 0) | vgetq_lane_u64(v64, 1)) != 0;
+}
+
+// Locates the index of the first nonzero 16-bit lane of v, which must have at least one nonzero lane.
+static inline int FirstNonzeroLaneNEON(uint16x8_t v)
+{
+  uint64x2_t v64 = vreinterpretq_u64_u16(v);
+  uint64_t lo = vgetq_lane_u64(v64, 0);
+  return lo ? (__builtin_ctzll(lo) >> 4) : 4 + (__builtin_ctzll(vgetq_lane_u64(v64, 1)) >> 4);
+}
+
+static int FindFirstChangedPixelNEON(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+  // Compare 16 pixels (one 32 byte cache line on ARMv6/ARMv7) at a time
+  for(; x + 16 <= endX; x += 16)
+  {
+    uint16x8_t d0 = veorq_u16(vld1q_u16(scanline+x), vld1q_u16(prevScanline+x));
+    uint16x8_t d1 = veorq_u16(vld1q_u16(scanline+x+8), vld1q_u16(prevScanline+x+8));
+    if (AnyLaneNonzeroNEON(vorrq_u16(d0, d1)))
+      return AnyLaneNonzeroNEON(d0) ? x + FirstNonzeroLaneNEON(d0) : x + 8 + FirstNonzeroLaneNEON(d1);
+  }
+  for(; x + 8 <= endX; x += 8)
+  {
+    uint16x8_t d = veorq_u16(vld1q_u16(scanline+x), vld1q_u16(prevScanline+x));
+    if (AnyLaneNonzeroNEON(d)) return x + FirstNonzeroLaneNEON(d);
+  }
+  while(x < endX && scanline[x] == prevScanline[x]) ++x;
+  return x;
+}
+
+static int FindFirstUnchangedPixelNEON(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+  for(; x + 8 <= endX; x += 8)
+  {
+    uint16x8_t eq = vceqq_u16(vld1q_u16(scanline+x), vld1q_u16(prevScanline+x));
+    if (AnyLaneNonzeroNEON(eq)) return x + FirstNonzeroLaneNEON(eq);
+  }
+  while(x < endX && scanline[x] != prevScanline[x]) ++x;
+  return x;
+}
+
+NEON_KERNELS_END
+
+#endif // ~HAVE_NEON_KERNELS
+
+#ifdef HAVE_SSE2_KERNELS
+
+// _mm_movemask_epi8() produces two mask bits per 16-bit pixel, so the pixel index is the bit index divided by two.
+__attribute__((target("sse2"))) static int FindFirstChangedPixelSSE2(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+  for(; x + 8 <= endX; x += 8)
+  {
+    __m128i eq = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(scanline+x)), _mm_loadu_si128((const __m128i*)(prevScanline+x)));
+    uint32_t changed = ~(uint32_t)_mm_movemask_epi8(eq) & 0xFFFFu;
+    if (changed) return x + (__builtin_ctz(changed) >> 1);
+  }
+  while(x < endX && scanline[x] == prevScanline[x]) ++x;
+  return x;
+}
+
+__attribute__((target("sse2"))) static int FindFirstUnchangedPixelSSE2(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+  for(; x + 8 <= endX; x += 8)
+  {
+    __m128i eq = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(scanline+x)), _mm_loadu_si128((const __m128i*)(prevScanline+x)));
+    uint32_t unchanged = (uint32_t)_mm_movemask_epi8(eq);
+    if (unchanged) return x + (__builtin_ctz(unchanged) >> 1);
+  }
+  while(x < endX && scanline[x] != prevScanline[x]) ++x;
+  return x;
+}
+
+#endif // ~HAVE_SSE2_KERNELS
+
+#ifdef HAVE_AVX2_KERNELS
+
+__attribute__((target("avx2"))) static int FindFirstChangedPixelAVX2(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+  for(; x + 16 <= endX; x += 16)
+  {
+    __m256i eq = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(scanline+x)), _mm256_loadu_si256((const __m256i*)(prevScanline+x)));
+    uint32_t changed = ~(uint32_t)_mm256_movemask_epi8(eq);
+    if (changed) return x + (__builtin_ctz(changed) >> 1);
+  }
+  return FindFirstChangedPixelSSE2(scanline, prevScanline, x, endX);
+}
+
+__attribute__((target("avx2"))) static int FindFirstUnchangedPixelAVX2(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX)
+{
+  for(; x + 16 <= endX; x += 16)
+  {
+    __m256i eq = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(scanline+x)), _mm256_loadu_si256((const __m256i*)(prevScanline+x)));
+    uint32_t unchanged = (uint32_t)_mm256_movemask_epi8(eq);
+    if (unchanged) return x + (__builtin_ctz(unchanged) >> 1);
+  }
+  return FindFirstUnchangedPixelSSE2(scanline, prevScanline, x, endX);
+}
+
+#endif // ~HAVE_AVX2_KERNELS
+
+DiffKernel diffKernel = { "scalar", FindFirstChangedPixelScalar, FindFirstUnchangedPixelScalar };
+
+int GetSupportedDiffKernels(DiffKernel *kernels, int maxKernels)
+{
+  int numKernels = 0;
+#define ADD_KERNEL(kernelName, changed, unchanged) do { \
+    if (numKernels < maxKernels) { DiffKernel k = { (kernelName), (changed), (unchanged) }; kernels[numKernels++] = k; } \
+  } while(0)
+
+  ADD_KERNEL("scalar", FindFirstChangedPixelScalar, FindFirstUnchangedPixelScalar);
+
+#ifdef HAVE_NEON_KERNELS
+  if (CpuHasNeon()) ADD_KERNEL("NEON", FindFirstChangedPixelNEON, FindFirstUnchangedPixelNEON);
+#endif
+
+#ifdef HAVE_SSE2_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) ADD_KERNEL("SSE2", FindFirstChangedPixelSSE2, FindFirstUnchangedPixelSSE2);
+#endif
+#ifdef HAVE_AVX2_KERNELS
+  if (__builtin_cpu_supports("avx2")) ADD_KERNEL("AVX2", FindFirstChangedPixelAVX2, FindFirstUnchangedPixelAVX2);
+#endif
+
+#undef ADD_KERNEL
+  return numKernels;
+}
+
+void InitDiffKernels()
+{
+  DiffKernel kernels[4];
+  int numKernels = GetSupportedDiffKernels(kernels, sizeof(kernels)/sizeof(kernels[0]));
+  diffKernel = kernels[numKernels-1];
+  printf("Using %s pixel diffing kernel\n", diffKernel.name);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Pixel comparison kernels used by the span differs. Each kernel scans a pair of scanlines and locates either the first pixel that differs between them,
+// or the first pixel that is the same in both. The kernels differ only in how many pixels they can compare at once, so all of them produce identical results.
+
+// Returns the index of the first pixel in range [x, endX[ that differs between scanline and prevScanline, or endX if all pixels are the same.
+typedef int (*FindFirstChangedPixelFunc)(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX);
+
+// Returns the index of the first pixel in range [x, endX[ that is equal in both scanline and prevScanline, or endX if all pixels differ.
+typedef int (*FindFirstUnchangedPixelFunc)(const uint16_t *scanline, const uint16_t *prevScanline, int x, int endX);
+
+struct DiffKernel
+{
+  const char *name;
+  FindFirstChangedPixelFunc FindFirstChangedPixel;
+  FindFirstUnchangedPixelFunc FindFirstUnchangedPixel;
+};
+
+// The best kernel for the CPU we are running on, chosen by InitDiffKernels().
+extern DiffKernel diffKernel;
+
+// Detects the CPU features available at runtime (NEON on ARM, SSE2/AVX2 on x86), and chooses the widest supported kernel to use.
+void InitDiffKernels(void);
+
+// Returns all the kernels that are supported on the current CPU, the scalar fallback first, and the widest kernel last.
+int GetSupportedDiffKernels(DiffKernel *kernels, int maxKernels);
@@ -0,0 +1,245 @@
+#include "config.h"
+#include "diff_strategy.h"
+#include "display.h"
+#include "gpu.h"
+#include "spi.h"
+#include "tick.h"
+#include "util.h"
+
+#ifdef ADAPTIVE_DIFF_STRATEGY
+
+// The costs of each strategy are measured per byte of the pixels that it has to look at on a frame: the bounding box of the dirty tiles for the
+// rectangles, the dirty tiles for the scanline differs, and the whole frame for the full frame. This makes the measurements of one frame carry over
+// to frames where more or less of the screen changed.
+struct DiffStrategyCost
+{
+  double cpuUsecsPerByte; // CPU time taken to diff and merge the spans
+  double busBytesPerByte; // Bus bytes of the spans that were sent, including the cursor commands of each span
+  bool measured; // False while the costs are still the initial guesses
+  uint32_t lastMeasuredFrame;
+};
+
+// Initial guesses of the costs, replaced by the first measurement of each strategy. Diffing scanline spans reads both frames and sends about half of
+// the pixels of the dirty tiles, while the rectangles are found reading only a part of the pixels and send all of them.
+static const DiffStrategyCost initialCosts[NUM_DIFF_STRATEGIES] =
+{
+  { 0.0, 1.0, false, 0 }, // DIFF_FULL_FRAME
+  { 0.002, 1.0, false, 0 }, // DIFF_CHANGED_RECTANGLES
+  { 0.003, 0.6, false, 0 }, // DIFF_COARSE_SCANLINES
+  { 0.004, 0.5, false, 0 } // DIFF_EXACT_SCANLINES
+};
+
+// Weight of the latest measurement in the running averages of the costs
+#define COST_AVERAGE_WEIGHT 0.25
+
+static DiffStrategyCost costs[NUM_DIFF_STRATEGIES];
+static DiffStrategy currentStrategy = DIFF_EXACT_SCANLINES; // The strategy chosen on the recent frames
+static DiffStrategy usedStrategy = DIFF_EXACT_SCANLINES; // The strategy that the latest frame was diffed with, differs from currentStrategy on probes
+static bool coarseDiffAvailable = false;
+static uint32_t numFramesChosen = 0;
+static double usedStrategyPixelBytes = 0; // The pixel bytes that the strategy of the latest frame had to look at
+static uint64_t diffStartTime = 0;
+static bool costPending = false; // True if the latest frame has been diffed, but its cost not yet recorded
+#ifdef STATISTICS
+static int numSwitches = 0;
+#endif
+
+void InitDiffStrategy()
+{
+  for(int i = 0; i < NUM_DIFF_STRATEGIES; ++i)
+    costs[i] = initialCosts[i];
+  // The coarse differ reads the scanlines 4 pixels at a time
+  coarseDiffAvailable = gpuFrameWidth % 4 == 0 && gpuFramebufferScanlineStrideBytes % 8 == 0;
+  currentStrategy = usedStrategy = DIFF_EXACT_SCANLINES;
+}
+
+// Returns the bytes of pixels that each strategy needs to look at on the current frame, given its dirty tiles.
+static void ComputeStrategyPixelBytes(double *pixelBytes)
+{
+  int numDirtyTiles = 0;
+  for(int y = dirtyTilesMinY; y <= dirtyTilesMaxY; ++y)
+    if (dirtyTileRows[y])
+      for(int x = dirtyTilesMinX; x <= dirtyTilesMaxX; ++x)
+        numDirtyTiles += dirtyTiles[y*numDirtyTilesX + x] ? 1 : 0;
+  const int boundingBoxWidth = MIN(gpuFrameWidth, (dirtyTilesMaxX+1) << DIRTY_TILE_SIZE_LOG2) - (dirtyTilesMinX << DIRTY_TILE_SIZE_LOG2);
+  const int boundingBoxHeight = MIN(gpuFrameHeight, (dirtyTilesMaxY+1) << DIRTY_TILE_SIZE_LOG2) - (dirtyTilesMinY << DIRTY_TILE_SIZE_LOG2);
+  pixelBytes[DIFF_FULL_FRAME] = (double)gpuFrameWidth * gpuFrameHeight * SPI_BYTESPERPIXEL;
+  pixelBytes[DIFF_CHANGED_RECTANGLES] = (double)boundingBoxWidth * boundingBoxHeight * SPI_BYTESPERPIXEL;
+  pixelBytes[DIFF_COARSE_SCANLINES] = pixelBytes[DIFF_EXACT_SCANLINES] = (double)numDirtyTiles * DIRTY_TILE_SIZE * DIRTY_TILE_SIZE * SPI_BYTESPERPIXEL;
+}
+
+DiffStrategy ChooseDiffStrategy(double maxBytesToSend)
+{
+  if (dirtyTilesMaxY < dirtyTilesMinY)
+  {
+    // Nothing changed, so any of the strategies produces no spans. Stick with the current one, without counting this frame towards the measurements.
+    usedStrategy = currentStrategy;
+    usedStrategyPixelBytes = 0;
+    return usedStrategy;
+  }
+  ++numFramesChosen;
+
+  double pixelBytes[NUM_DIFF_STRATEGIES];
+  ComputeStrategyPixelBytes(pixelBytes);
+
+  // Estimate the time that each strategy takes to update the frame, as the CPU time taken to produce the spans plus the bus time taken to send them.
+  // The exact scanline differ is always available, and can fall back to interlacing if the frame does not fit in the time available.
+  bool available[NUM_DIFF_STRATEGIES];
+  double estimatedUsecs[NUM_DIFF_STRATEGIES];
+  for(int i = 0; i < NUM_DIFF_STRATEGIES; ++i)
+  {
+    const double busBytes = pixelBytes[i] * costs[i].busBytesPerByte;
+    estimatedUsecs[i] = pixelBytes[i] * costs[i].cpuUsecsPerByte + busBytes * spiUsecsPerByte;
+    available[i] = true;
+#ifndef NO_INTERLACING
+    if (!IsScanlineDiffStrategy((DiffStrategy)i) && busBytes > maxBytesToSend) available[i] = false;
+#endif
+  }
+  if (!coarseDiffAvailable) available[DIFF_COARSE_SCANLINES] = false;
+  available[DIFF_EXACT_SCANLINES] = true;
+
+  DiffStrategy best = DIFF_EXACT_SCANLINES;
+  for(int i = 0; i < NUM_DIFF_STRATEGIES; ++i)
+    if (available[i] && estimatedUsecs[i] < estimatedUsecs[best])
+      best = (DiffStrategy)i;
+
+  // Only switch if the best strategy is clearly cheaper than the current one, or if the current one is no longer available.
+  if (best != currentStrategy && (!available[currentStrategy] || estimatedUsecs[best] < estimatedUsecs[currentStrategy] * (100 - DIFF_STRATEGY_SWITCH_MARGIN_PERCENT) / 100.0))
+  {
+    currentStrategy = best;
+#ifdef STATISTICS
+    ++numSwitches;
+#endif
+  }
+  usedStrategy = currentStrategy;
+
+  // Now and then, try out the strategy that was measured the longest ago, so that its costs keep up with the content. The full frame is not probed,
+  // since its costs do not depend on the content.
+  if (numFramesChosen % DIFF_STRATEGY_PROBE_INTERVAL == 0)
+  {
+    DiffStrategy probe = currentStrategy;
+    for(int i = DIFF_CHANGED_RECTANGLES; i < NUM_DIFF_STRATEGIES; ++i)
+      if (available[i] && i != currentStrategy && (probe == currentStrategy || costs[i].lastMeasuredFrame < costs[probe].lastMeasuredFrame))
+        probe = (DiffStrategy)i;
+    usedStrategy = probe;
+  }
+  usedStrategyPixelBytes = pixelBytes[usedStrategy];
+  return usedStrategy;
+}
+
+#ifdef MAX_SPI_TASK_SIZE
+// Splits the rectangles in the given span array into bands of whole scanlines that each fit in a single task.
+static void SplitSpansToTaskSize(SpanArray &spanArray)
+{
+  int numSpans = 0;
+  for(int i = 0; i < spanArray.numSpans; ++i)
+  {
+    const Span &s = spanArray.spans[i];
+    const int bandHeight = MAX(1, MAX_SPI_TASK_SIZE / ((s.endX - s.x) * SPI_BYTESPERPIXEL));
+    numSpans += (s.endY - s.y + bandHeight - 1) / bandHeight;
+  }
+  if (numSpans == spanArray.numSpans) return;
+
+  // Split from the back, so that the bands of each rectangle only overwrite rectangles that have already been split.
+  ReserveSpans(spanArray, numSpans);
+  Span *out = spanArray.spans + numSpans;
+  for(int i = spanArray.numSpans-1; i >= 0; --i)
+  {
+    const Span s = spanArray.spans[i];
+    const int bandHeight = MAX(1, MAX_SPI_TASK_SIZE / ((s.endX - s.x) * SPI_BYTESPERPIXEL));
+    for(int y = s.y + (s.endY - s.y - 1) / bandHeight * bandHeight; y >= s.y; y -= bandHeight)
+    {
+      Span *band = --out;
+      band->x = s.x;
+      band->endX = s.endX;
+      band->y = y;
+      band->endY = MIN(s.endY, y + bandHeight);
+      band->lastScanEndX = (band->endY == s.endY) ? s.lastScanEndX : s.endX;
+    }
+  }
+  spanArray.numSpans = numSpans;
+}
+#endif
+
+void DiffFramebuffersWithStrategy(DiffStrategy strategy, uint16_t *framebuffer, uint16_t *prevFramebuffer, SpanArray &spanArray, DiffStats &stats)
+{
+  diffStartTime = tick();
+  costPending = (usedStrategyPixelBytes > 0);
+  switch(strategy)
+  {
+  case DIFF_FULL_FRAME:
+    spanArray.numSpans = 0;
+    if (dirtyTilesMaxY >= dirtyTilesMinY)
+      NoDiffChangedRectangle(spanArray);
+    break;
+  case DIFF_CHANGED_RECTANGLES:
+#ifdef MAX_DIFF_RECTANGLES
+    DiffFramebuffersToChangedRectangles(framebuffer, prevFramebuffer, spanArray);
+#else
+    DiffFramebuffersToSingleChangedRectangle(framebuffer, prevFramebuffer, spanArray);
+#endif
+    break;
+  case DIFF_COARSE_SCANLINES:
+    DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(framebuffer, prevFramebuffer, false, 0, spanArray, stats);
+    return;
+  default:
+#if defined(USE_MULTITHREADED_DIFF)
+    DiffFramebuffersToScanlineSpansMultithreaded(framebuffer, prevFramebuffer, false, 0, spanArray, stats);
+#elif defined(USE_SIMD_PIXEL_DIFF)
+    DiffFramebuffersToScanlineSpansSIMD(framebuffer, prevFramebuffer, false, 0, spanArray, stats);
+#else
+    DiffFramebuffersToScanlineSpansExact(framebuffer, prevFramebuffer, false, 0, spanArray, stats);
+#endif
+    return;
+  }
+
+  // The rectangles do not count the changed pixels, so take all their pixels as changed.
+#ifdef MAX_SPI_TASK_SIZE
+  SplitSpansToTaskSize(spanArray);
+#endif
+  for(int i = 0; i < spanArray.numSpans; ++i)
+    stats.numChangedPixels += spanArray.spans[i].Size();
+}
+
+void RecordDiffStrategyCost(const SpanArray &spanArray)
+{
+  if (!costPending) return;
+  costPending = false;
+
+  uint64_t busBytes = 0;
+  for(int i = 0; i < spanArray.numSpans; ++i)
+    busBytes += spanArray.spans[i].Size() * SPI_BYTESPERPIXEL + SPAN_START_OVERHEAD_BYTES;
+  const double cpuUsecsPerByte = (tick() - diffStartTime) / usedStrategyPixelBytes;
+  const double busBytesPerByte = busBytes / usedStrategyPixelBytes;
+
+  DiffStrategyCost &cost = costs[usedStrategy];
+  if (cost.measured)
+  {
+    cost.cpuUsecsPerByte += (cpuUsecsPerByte - cost.cpuUsecsPerByte) * COST_AVERAGE_WEIGHT;
+    cost.busBytesPerByte += (busBytesPerByte - cost.busBytesPerByte) * COST_AVERAGE_WEIGHT;
+  }
+  else
+  {
+    cost.cpuUsecsPerByte = cpuUsecsPerByte;
+    cost.busBytesPerByte = busBytesPerByte;
+    cost.measured = true;
+  }
+  cost.lastMeasuredFrame = numFramesChosen;
+}
+
+#ifdef STATISTICS
+const char *CurrentDiffStrategyName()
+{
+  static const char * const names[NUM_DIFF_STRATEGIES] = { "full", "rect", "coarse", "exact" };
+  return names[currentStrategy];
+}
+
+int TakeDiffStrategySwitches()
+{
+  int switches = numSwitches;
+  numSwitches = 0;
+  return switches;
+}
+#endif
+
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "config.h"
+#include "diff.h"
+
+#ifdef ADAPTIVE_DIFF_STRATEGY
+
+// The methods that ADAPTIVE_DIFF_STRATEGY chooses from to turn a frame into spans.
+enum DiffStrategy
+{
+  DIFF_FULL_FRAME, // Send the whole frame without reading its pixels
+  DIFF_CHANGED_RECTANGLES, // Send the rectangles that bound the changes (see MAX_DIFF_RECTANGLES)
+  DIFF_COARSE_SCANLINES, // Diff scanline spans 4 pixels at a time
+  DIFF_EXACT_SCANLINES, // Diff scanline spans pixel exact, with the fastest configured differ
+  NUM_DIFF_STRATEGIES
+};
+
+// Returns true if the strategy produces unmerged single scanline spans, which need to be merged or interlaced before they are submitted.
+static inline bool IsScanlineDiffStrategy(DiffStrategy strategy)
+{
+  return strategy == DIFF_COARSE_SCANLINES || strategy == DIFF_EXACT_SCANLINES;
+}
+
+// Resets the measured costs of the strategies. Call after InitDirtyTiles().
+void InitDiffStrategy(void);
+
+// Picks the strategy to update the current frame with, from the dirty tiles of the frame and the costs that the strategies were measured to take on
+// the recent frames. Strategies that send whole rectangles are only picked if their bytes are estimated to fit in maxBytesToSend, since the changes
+// that they send cannot be interlaced.
+DiffStrategy ChooseDiffStrategy(double maxBytesToSend);
+
+// Produces the spans of the frame with the given strategy, and starts timing the update for RecordDiffStrategyCost(). The rectangle strategies only
+// estimate the number of changed pixels in stats, and leave the per scanline class bytes at zero, so the frame is never interlaced.
+void DiffFramebuffersWithStrategy(DiffStrategy strategy, uint16_t *framebuffer, uint16_t *prevFramebuffer, SpanArray &spanArray, DiffStats &stats);
+
+// After the spans produced by the last call to DiffFramebuffersWithStrategy() have been merged, records the CPU time taken since the diff started and
+// the bus bytes of the spans as the latest cost of that strategy. Call only on progressive updates, where all the spans are sent.
+void RecordDiffStrategyCost(const SpanArray &spanArray);
+
+#ifdef STATISTICS
+// Returns the short name of the strategy that was used last, for the statistics overlay.
+const char *CurrentDiffStrategyName(void);
+
+// The number of times that the chosen strategy changed since the last call. Resets the count.
+int TakeDiffStrategySwitches(void);
+#endif
+
+#endif
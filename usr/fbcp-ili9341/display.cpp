@@ -18,9 +18,16 @@ void ClearScreen()
     SPI_TRANSFER(DISPLAY_SET_CURSOR_X, 0, 0, (DISPLAY_WIDTH-1) >> 8, (DISPLAY_WIDTH-1) & 0xFF);
     SPI_TRANSFER(DISPLAY_SET_CURSOR_Y, (uint8_t)(y >> 8), (uint8_t)(y & 0xFF), (DISPLAY_HEIGHT-1) >> 8, (DISPLAY_HEIGHT-1) & 0xFF);
 #endif
+#ifdef SOLID_FILL_TASKS
+    SPITask *clearLine = AllocTask(4);
+    clearLine->cmd = DISPLAY_WRITE_PIXELS;
+    clearLine->fillSize = DISPLAY_WIDTH*SPI_BYTESPERPIXEL;
+    SetFillTaskColor(clearLine, 0);
+#else
     SPITask *clearLine = AllocTask(DISPLAY_WIDTH*SPI_BYTESPERPIXEL);
     clearLine->cmd = DISPLAY_WRITE_PIXELS;
     memset(clearLine->data, 0, clearLine->size);
+#endif
     CommitTask(clearLine);
     RunSPITask(clearLine);
     DoneTask(clearLine);
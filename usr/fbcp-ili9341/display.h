@@ -48,6 +48,16 @@
 #undef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
 #endif
 
+// Hardware scrolling moves the display memory rows along the native vertical axis of the panel, which only matches the vertical axis of the
+// framebuffer if the controller does not flip or rotate the image.
+#if defined(USE_HARDWARE_SCROLLING) && (!defined(DISPLAY_SET_SCROLL_START) || !defined(USE_SCANLINE_HASHES) || defined(DISPLAY_FLIP_ORIENTATION_IN_HARDWARE) || defined(DISPLAY_ROTATE_180_DEGREES))
+#undef USE_HARDWARE_SCROLLING
+#endif
+
+#if defined(VERIFY_HARDWARE_SCROLLING) && (!defined(USE_HARDWARE_SCROLLING) || defined(KERNEL_MODULE_CLIENT) || defined(KERNEL_MODULE) || defined(DISPLAY_SPI_BUS_IS_16BITS_WIDE))
+#undef VERIFY_HARDWARE_SCROLLING
+#endif
+
 #ifndef DISPLAY_NATIVE_COVERED_LEFT_SIDE
 #define DISPLAY_NATIVE_COVERED_LEFT_SIDE 0
 #endif
@@ -98,6 +108,23 @@
 #define OFFLOAD_PIXEL_COPY_TO_DMA_CPP
 #endif
 
+#if defined(SUPERSEDE_QUEUED_PIXEL_TASKS) && (!defined(USE_SPI_THREAD) || defined(KERNEL_MODULE_CLIENT) || defined(KERNEL_MODULE) || defined(SPI_3WIRE_PROTOCOL) || defined(VERIFY_HARDWARE_SCROLLING))
+// Without a SPI thread, tasks are run as soon as they are queued, so there are never queued tasks to supersede. The kernel module runs the tasks
+// without the handshake that rewriting needs, and 3-wire SPI tasks are interleaved to 9 bits in place, so their pixels cannot be rewritten.
+// The panel model of VERIFY_HARDWARE_SCROLLING replays the pixels of the tasks as they were queued.
+#undef SUPERSEDE_QUEUED_PIXEL_TASKS
+#endif
+
+#if defined(LATE_LATCH_PIXEL_TASKS) && (!defined(USE_SPI_THREAD) || defined(KERNEL_MODULE_CLIENT) || defined(KERNEL_MODULE) || defined(SPI_3WIRE_PROTOCOL))
+// The pixels are packed by the SPI thread of this program. Single threaded builds have OFFLOAD_PIXEL_COPY_TO_DMA_CPP for the same purpose.
+#undef LATE_LATCH_PIXEL_TASKS
+#endif
+
+#if defined(SOLID_FILL_TASKS) && (defined(KERNEL_MODULE_CLIENT) || defined(KERNEL_MODULE) || defined(SPI_3WIRE_PROTOCOL) || SPI_BYTESPERPIXEL != 2)
+// The kernel module does not know about fill tasks, 3-wire SPI tasks are interleaved to 9 bits, and a 3 byte pixel does not repeat in a 32-bit word.
+#undef SOLID_FILL_TASKS
+#endif
+
 void ClearScreen(void);
 
 void TurnBacklightOn(void);
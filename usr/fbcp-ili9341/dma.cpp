@@ -13,6 +13,9 @@
 #include "gpu.h"
 #include "util.h"
 #include "mailbox.h"
+#ifndef KERNEL_MODULE
+#include "pack_kernels.h"
+#endif
 
 #ifdef USE_DMA_TRANSFERS
 
@@ -456,23 +459,24 @@ static void memcpy_to_dma_and_prev_framebuffer(uint16_t *dstDma, uint16_t **dstP
   *dstPrevFramebuffer = Dst1;
 }
 
+// Used when the task size and framebuffer width are not compatible with the tight assembly loop above. Packs the pixels one scanline run at a time
+// with the fused pack kernel.
 static void memcpy_to_dma_and_prev_framebuffer_in_c(uint16_t *dstDma, uint16_t **dstPrevFramebuffer, uint16_t **srcFramebuffer, int numBytes, int *taskStartX, int width, int stride)
 {
-  static bool performanceWarningPrinted = false;
-  if (!performanceWarningPrinted)
-  {
-    printf("Performance warning: using slow memcpy_to_dma_and_prev_framebuffer_in_c() function. Check conditions in display.h that enable OFFLOAD_PIXEL_COPY_TO_DMA_CPP and configure to use that instead.\n");
-    performanceWarningPrinted = true;
-  }
   int numPixels = numBytes>>1;
   int endStridePixels = (stride>>1) - width;
   uint16_t *prevData = *dstPrevFramebuffer;
   uint16_t *data = *srcFramebuffer;
-  for(int i = 0; i < numPixels; ++i)
+  uint8_t *dst = (uint8_t*)dstDma;
+  while(numPixels > 0)
   {
-    *prevData++ = *data;
-    dstDma[i] = __builtin_bswap16(*data++);
-    if (++*taskStartX >= width)
+    int runPixels = MIN(numPixels, width - *taskStartX);
+    dst = packKernel.PackPixels(dst, data, prevData, runPixels);
+    data += runPixels;
+    prevData += runPixels;
+    numPixels -= runPixels;
+    *taskStartX += runPixels;
+    if (*taskStartX >= width)
     {
       *taskStartX = 0;
       data += endStridePixels;
@@ -501,13 +505,20 @@ void SPIDMATransfer(SPITask *task)
 // and chain them together. This should be a multiple of 32 bytes to keep tasks cache aligned on ARMv6.
 #define MAX_DMA_SPI_TASK_SIZE 65504
 
-  const int numDMASendTasks = (task->PayloadSize() + MAX_DMA_SPI_TASK_SIZE - 1) / MAX_DMA_SPI_TASK_SIZE;
+#ifdef SOLID_FILL_TASKS
+  // A solid fill task only needs its fill color word in the DMA source buffer for each send, read by an extra control block that does not increment
+  // the source address.
+  const bool fill = task->fillSize != 0;
+#else
+  const bool fill = false;
+#endif
+  const int numDMASendTasks = (task->BusSize() + MAX_DMA_SPI_TASK_SIZE - 1) / MAX_DMA_SPI_TASK_SIZE;
 
-  volatile uint32_t *dmaData = (volatile uint32_t *)GrabFreeDMASourceBytes(4*(numDMASendTasks-1)+4*numDMASendTasks+task->PayloadSize());
+  volatile uint32_t *dmaData = (volatile uint32_t *)GrabFreeDMASourceBytes(4*(numDMASendTasks-1)+4*numDMASendTasks+(fill ? 4*numDMASendTasks : task->PayloadSize()));
   volatile uint32_t *setDMATxAddressData = dmaData;
   volatile uint32_t *txData = dmaData+numDMASendTasks-1;
 
-  volatile DMAControlBlock *cb = GrabFreeCBs(numDMASendTasks*5-3);
+  volatile DMAControlBlock *cb = GrabFreeCBs(numDMASendTasks*5-3 + (fill ? numDMASendTasks : 0));
 
   volatile DMAControlBlock *rxTail = 0;
   volatile DMAControlBlock *tx0 = &cb[0];
@@ -521,7 +532,7 @@ void SPIDMATransfer(SPITask *task)
   uint8_t *data = task->PayloadStart();
 #endif
 
-  int bytesLeft = task->PayloadSize();
+  int bytesLeft = task->BusSize();
   int taskStartX = 0;
 
   while(bytesLeft > 0)
@@ -541,6 +552,9 @@ void SPIDMATransfer(SPITask *task)
 
     // If task->prevFb is present, the DMA backend is responsible for streaming pixel data from current framebuffer to old framebuffer, and the DMA task buffer.
     // If not present, then that preparation has been already done by the caller.
+    if (fill)
+      memcpy(txPtr, task->data, 4);
+    else
 #ifdef OFFLOAD_PIXEL_COPY_TO_DMA_CPP
     if (prevData)
     {
@@ -560,9 +574,8 @@ void SPIDMATransfer(SPITask *task)
     tx->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_TX) | BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_SRC_INC | BCM2835_DMA_TI_WAIT_RESP;
     tx->src = VIRT_TO_BUS(dmaSourceBuffer, txData);
     tx->dst = DMA_SPI_FIFO_PHYS_ADDRESS; // Write out to the SPI peripheral
-    tx->len = 4+sendSize;
+    tx->len = fill ? 4 : 4+sendSize;
     tx->next = 0;
-    txData += 1+sendSize/4;
 
     volatile DMAControlBlock *rx = cb++;
     rx->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_RX) | BCM2835_DMA_TI_SRC_DREQ | BCM2835_DMA_TI_DEST_IGNORE;
@@ -571,6 +584,21 @@ void SPIDMATransfer(SPITask *task)
     rx->len = sendSize;
     rx->next = 0;
 
+    if (fill)
+    {
+      // After the header word, keep writing the fill color word to the SPI peripheral
+      volatile DMAControlBlock *fillTx = cb++;
+      tx->next = VIRT_TO_BUS(dmaCb, fillTx);
+      fillTx->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_TX) | BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_WAIT_RESP;
+      fillTx->src = VIRT_TO_BUS(dmaSourceBuffer, txData+1);
+      fillTx->dst = DMA_SPI_FIFO_PHYS_ADDRESS;
+      fillTx->len = sendSize;
+      fillTx->next = 0;
+      txData += 2;
+    }
+    else
+      txData += 1+sendSize/4;
+
     if (rxTail)
     {
       volatile DMAControlBlock *setDMATxAddress = cb++;
@@ -635,7 +663,7 @@ void SPIDMATransfer(SPITask *task)
   }
   if (!programRunning) return;
 
-  pendingTaskBytes = task->PayloadSize();
+  pendingTaskBytes = task->BusSize();
 
   // First send the SPI command byte in Polled SPI mode
   spi->cs = BCM2835_SPI0_CS_TA | BCM2835_SPI0_CS_CLEAR | DISPLAY_SPI_DRIVE_SETTINGS;
@@ -674,7 +702,7 @@ void SPIDMATransfer(SPITask *task)
   // Transition the SPI peripheral to enable the use of DMA
   spi->cs = BCM2835_SPI0_CS_DMAEN | BCM2835_SPI0_CS_CLEAR | DISPLAY_SPI_DRIVE_SETTINGS;
   uint32_t *headerAddr = task->DmaSpiHeaderAddress();
-  *headerAddr = BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS | (task->PayloadSize() << 16); // The first four bytes written to the SPI data register control the DLEN and CS,CPOL,CPHA settings.
+  *headerAddr = BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS | (task->BusSize() << 16); // The first four bytes written to the SPI data register control the DLEN and CS,CPOL,CPHA settings.
 
   // TODO: Ideally we would be able to directly perform the DMA from the SPI ring buffer from 'task' pointer. However
   // that pointer is shared to userland, and it is proving troublesome to make it both userland-writable as well as cache-bypassing DMA coherent.
@@ -692,13 +720,31 @@ void SPIDMATransfer(SPITask *task)
   txcb->next = 0;
   txcb->debug = 0;
   txcb->reserved = 0;
+#ifdef SOLID_FILL_TASKS
+  if (task->fillSize)
+  {
+    // The header word is followed in the source buffer by the fill color word of the task, which a second control block writes to the SPI peripheral
+    // over and over, without incrementing the source address.
+    volatile DMAControlBlock *fillcb = &cb[2];
+    txcb->len = 4;
+    txcb->next = dmaCb.busAddress + 2*sizeof(DMAControlBlock);
+    fillcb->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_TX) | BCM2835_DMA_TI_DEST_DREQ | BCM2835_DMA_TI_WAIT_RESP;
+    fillcb->src = dmaSourceBuffer.busAddress + 4;
+    fillcb->dst = DMA_SPI_FIFO_PHYS_ADDRESS;
+    fillcb->len = task->fillSize;
+    fillcb->stride = 0;
+    fillcb->next = 0;
+    fillcb->debug = 0;
+    fillcb->reserved = 0;
+  }
+#endif
   dmaTx->cbAddr = dmaCb.busAddress;
 
   volatile DMAControlBlock *rxcb = &cb[1];
   rxcb->ti = BCM2835_DMA_TI_PERMAP(BCM2835_DMA_TI_PERMAP_SPI_RX) | BCM2835_DMA_TI_SRC_DREQ | BCM2835_DMA_TI_DEST_IGNORE;
   rxcb->src = DMA_SPI_FIFO_PHYS_ADDRESS;
   rxcb->dst = 0;
-  rxcb->len = task->PayloadSize();
+  rxcb->len = task->BusSize();
   rxcb->stride = 0;
   rxcb->next = 0;
   rxcb->debug = 0;
@@ -710,7 +756,7 @@ void SPIDMATransfer(SPITask *task)
   dmaRx->cs = BCM2835_DMA_CS_ACTIVE;
   __sync_synchronize();
 
-  double pendingTaskUSecs = task->PayloadSize() * spiUsecsPerByte;
+  double pendingTaskUSecs = task->BusSize() * spiUsecsPerByte;
   if (pendingTaskUSecs > 70)
     usleep(pendingTaskUSecs-70);
 
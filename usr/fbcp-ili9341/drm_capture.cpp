@@ -0,0 +1,319 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/dma-buf.h> // DMA_BUF_IOCTL_SYNC
+
+#include "config.h"
+
+#ifdef CAPTURE_FROM_DRM
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "drm_capture.h"
+#include "capture_sampler.h"
+#include "gpu.h"
+#include "tick.h"
+#include "util.h"
+
+// Compositors flip between two or three framebuffers, so keep that many mapped to avoid mapping a framebuffer again on each flip
+#define MAX_MAPPED_FRAMEBUFFERS 4
+
+struct MappedFramebuffer
+{
+  uint32_t fbId;
+  ino_t bufferInode; // Identifies the buffer behind a framebuffer id, since the ids of removed framebuffers get reused. 0 if not mapped via dma-buf
+  int dmabufFd; // -1 if mapped as a dumb buffer
+  uint8_t *map;
+  size_t mapSize;
+  CaptureSource source;
+  uint64_t lastUsedTime;
+};
+
+static int drmFd = -1;
+static uint32_t crtcId = 0;
+static uint32_t vblankPipeBits = 0; // Selects the CRTC in drmWaitVBlank() requests
+static uint64_t vblankInterval = 1000000/60;
+
+static MappedFramebuffer mappedFramebuffers[MAX_MAPPED_FRAMEBUFFERS] = {};
+static int numMappedFramebuffers = 0;
+static uint32_t currentFbId = 0;
+static MappedFramebuffer *currentFb = 0;
+
+static bool haveVblank = false, vblankFailed = false;
+static uint32_t lastVblankSequence = 0;
+static uint64_t lastVblankTime = 0;
+
+static bool FindActiveCrtc(int fd, drmModeModeInfo *mode, int *pipe)
+{
+  drmModeRes *res = drmModeGetResources(fd);
+  if (!res) return false;
+  bool found = false;
+  for(int i = 0; i < res->count_crtcs && !found; ++i)
+  {
+    drmModeCrtc *crtc = drmModeGetCrtc(fd, res->crtcs[i]);
+    if (!crtc) continue;
+    if (crtc->mode_valid && crtc->buffer_id)
+    {
+      crtcId = crtc->crtc_id;
+      *mode = crtc->mode;
+      *pipe = i;
+      found = true;
+    }
+    drmModeFreeCrtc(crtc);
+  }
+  drmModeFreeResources(res);
+  return found;
+}
+
+void InitDrmCapture(int *displayWidth, int *displayHeight)
+{
+  drmModeModeInfo mode;
+  int pipe = 0;
+#ifdef DRM_CAPTURE_DEVICE
+  drmFd = open(DRM_CAPTURE_DEVICE, O_RDWR | O_CLOEXEC);
+  if (drmFd < 0) FATAL_ERROR("Failed to open DRM_CAPTURE_DEVICE!");
+  if (!FindActiveCrtc(drmFd, &mode, &pipe)) FATAL_ERROR("DRM_CAPTURE_DEVICE does not have an active display to capture!");
+  printf("Capturing DRM device %s\n", DRM_CAPTURE_DEVICE);
+#else
+  // The card number of the display driver depends on the order that the drivers were probed in, e.g. the Pi 4 has v3d and vc4 as separate cards
+  for(int card = 0; card < 8 && drmFd < 0; ++card)
+  {
+    char path[32];
+    snprintf(path, sizeof(path), "/dev/dri/card%d", card);
+    drmFd = open(path, O_RDWR | O_CLOEXEC);
+    if (drmFd < 0) continue;
+    if (FindActiveCrtc(drmFd, &mode, &pipe)) printf("Capturing DRM device %s\n", path);
+    else
+    {
+      close(drmFd);
+      drmFd = -1;
+    }
+  }
+  if (drmFd < 0) FATAL_ERROR("Did not find a DRM device with an active display to capture! (Is the KMS driver enabled with dtoverlay=vc4-kms-v3d in /boot/config.txt?)");
+#endif
+
+  if (pipe == 1) vblankPipeBits = DRM_VBLANK_SECONDARY;
+  else if (pipe > 1) vblankPipeBits = (pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+  if (mode.clock && mode.htotal && mode.vtotal) vblankInterval = (uint64_t)mode.htotal * mode.vtotal * 1000 / mode.clock;
+
+  *displayWidth = mode.hdisplay;
+  *displayHeight = mode.vdisplay;
+  printf("DRM CRTC %u is %dx%d, with a vblank every %llu usecs\n", crtcId, mode.hdisplay, mode.vdisplay, (unsigned long long)vblankInterval);
+}
+
+static void UnmapFramebuffer(MappedFramebuffer *fb)
+{
+  munmap(fb->map, fb->mapSize);
+  if (fb->dmabufFd >= 0) close(fb->dmabufFd);
+}
+
+void DeinitDrmCapture()
+{
+  for(int i = 0; i < numMappedFramebuffers; ++i)
+    UnmapFramebuffer(&mappedFramebuffers[i]);
+  numMappedFramebuffers = 0;
+  currentFb = 0;
+  if (drmFd >= 0)
+  {
+    close(drmFd);
+    drmFd = -1;
+  }
+}
+
+void WaitForDrmVblank(uint64_t earliestTime)
+{
+  drmVBlank vbl = {};
+  if (haveVblank)
+  {
+    // Vblanks occur at lastVblankTime + k*vblankInterval: wait for the one nearest to the requested time, since new frames are flipped to the screen
+    // at vblanks, and the predicted frame arrival times are measured at the vblanks that frames were captured at.
+    uint64_t numVblanks = 1;
+    if (earliestTime > lastVblankTime) numVblanks = MAX(1, (earliestTime - lastVblankTime + vblankInterval/2) / vblankInterval);
+    vbl.request.type = (drmVBlankSeqType)(DRM_VBLANK_ABSOLUTE | vblankPipeBits);
+    vbl.request.sequence = lastVblankSequence + (uint32_t)numVblanks; // If this vblank has already passed, returns right away
+  }
+  else
+  {
+    vbl.request.type = (drmVBlankSeqType)(DRM_VBLANK_RELATIVE | vblankPipeBits);
+    vbl.request.sequence = 1;
+  }
+
+  if (drmWaitVBlank(drmFd, &vbl) == 0)
+  {
+    lastVblankSequence = vbl.reply.sequence;
+    lastVblankTime = tick();
+    haveVblank = true;
+    vblankFailed = false;
+  }
+  else
+  {
+    // The CRTC is off, or the driver does not deliver vblanks: fall back to pacing the captures at the refresh rate
+    if (!vblankFailed) printf("drmWaitVBlank() failed (%s), polling at the refresh rate instead\n", strerror(errno));
+    haveVblank = false;
+    vblankFailed = true;
+    uint64_t now = tick();
+    usleep((earliestTime > now) ? MIN(earliestTime - now, 1000000) : vblankInterval);
+  }
+}
+
+static void CloseGemHandles(const drmModeFB2 *fb2)
+{
+  for(int i = 0; i < 4; ++i)
+  {
+    if (!fb2->handles[i]) continue;
+    bool closed = false;
+    for(int j = 0; j < i; ++j)
+      if (fb2->handles[j] == fb2->handles[i]) closed = true;
+    if (closed) continue;
+    drm_gem_close gemClose = {};
+    gemClose.handle = fb2->handles[i];
+    drmIoctl(drmFd, DRM_IOCTL_GEM_CLOSE, &gemClose);
+  }
+}
+
+// Maps the given framebuffer for reading, or returns the existing mapping of its buffer. Returns null if the framebuffer cannot be captured.
+static MappedFramebuffer *MapFramebuffer(uint32_t fbId)
+{
+  drmModeFB2 *fb2 = drmModeGetFB2(drmFd, fbId);
+  if (!fb2) return 0;
+  if (!fb2->handles[0])
+  {
+    drmModeFreeFB2(fb2);
+    FATAL_ERROR("Did not get access to the DRM framebuffer! Capturing the framebuffer of another DRM client requires running as root.");
+  }
+
+  int bytesPerPixel = 0;
+  bool bgr = false;
+  switch(fb2->pixel_format)
+  {
+  case DRM_FORMAT_RGB565: bytesPerPixel = 2; break;
+  case DRM_FORMAT_XRGB8888: case DRM_FORMAT_ARGB8888: bytesPerPixel = 4; break;
+  case DRM_FORMAT_XBGR8888: case DRM_FORMAT_ABGR8888: bytesPerPixel = 4; bgr = true; break;
+  }
+  // Tiled layouts, e.g. the Broadcom T-tiled and SAND layouts that the GPU renders to, are not linear in memory
+  const bool linear = !(fb2->flags & DRM_MODE_FB_MODIFIERS) || fb2->modifier == DRM_FORMAT_MOD_LINEAR;
+  if (!bytesPerPixel || !linear)
+  {
+    printf("DRM framebuffer %u has pixel format 0x%08X and modifier 0x%llX, only linear RGB565, XRGB8888 and XBGR8888 framebuffers can be captured\n", fbId, fb2->pixel_format, (unsigned long long)fb2->modifier);
+    CloseGemHandles(fb2);
+    drmModeFreeFB2(fb2);
+    return 0;
+  }
+
+  MappedFramebuffer fb = {};
+  fb.fbId = fbId;
+  fb.dmabufFd = -1;
+  fb.source.pitch = fb2->pitches[0];
+  fb.source.width = fb2->width;
+  fb.source.height = fb2->height;
+  fb.source.bytesPerPixel = bytesPerPixel;
+  fb.source.bgr = bgr;
+
+  // Map the buffer by exporting it as a dma-buf, which works for buffers of any driver that supports mapping dma-bufs
+  int dmabufFd = -1;
+  if (drmPrimeHandleToFD(drmFd, fb2->handles[0], DRM_CLOEXEC, &dmabufFd) == 0)
+  {
+    struct stat st;
+    if (fstat(dmabufFd, &st) == 0)
+    {
+      for(int i = 0; i < numMappedFramebuffers; ++i)
+        if (mappedFramebuffers[i].bufferInode == st.st_ino)
+        {
+          // Already mapped, though the new framebuffer may describe its layout differently
+          MappedFramebuffer *mapped = &mappedFramebuffers[i];
+          fb.bufferInode = mapped->bufferInode;
+          fb.dmabufFd = mapped->dmabufFd;
+          fb.map = mapped->map;
+          fb.mapSize = mapped->mapSize;
+          fb.source.pixels = fb.map + fb2->offsets[0];
+          *mapped = fb;
+          close(dmabufFd);
+          CloseGemHandles(fb2);
+          drmModeFreeFB2(fb2);
+          return mapped;
+        }
+      fb.bufferInode = st.st_ino;
+    }
+    fb.mapSize = lseek(dmabufFd, 0, SEEK_END);
+    fb.map = (uint8_t*)mmap(0, fb.mapSize, PROT_READ, MAP_SHARED, dmabufFd, 0);
+    if (fb.map != MAP_FAILED) fb.dmabufFd = dmabufFd;
+    else close(dmabufFd);
+  }
+  if (fb.dmabufFd < 0)
+  {
+    // Fall back to mapping the buffer as a dumb buffer, which e.g. the framebuffer console emulation uses
+    fb.bufferInode = 0;
+    fb.mapSize = fb2->offsets[0] + (size_t)fb.source.pitch * fb.source.height;
+    drm_mode_map_dumb mapDumb = {};
+    mapDumb.handle = fb2->handles[0];
+    fb.map = (uint8_t*)MAP_FAILED;
+    if (drmIoctl(drmFd, DRM_IOCTL_MODE_MAP_DUMB, &mapDumb) == 0)
+      fb.map = (uint8_t*)mmap(0, fb.mapSize, PROT_READ, MAP_SHARED, drmFd, mapDumb.offset);
+  }
+  CloseGemHandles(fb2); // The mapping keeps the buffer alive
+  const uint32_t offset = fb2->offsets[0];
+  drmModeFreeFB2(fb2);
+  if (fb.map == MAP_FAILED)
+  {
+    printf("Failed to map DRM framebuffer %u for reading (%s)\n", fbId, strerror(errno));
+    return 0;
+  }
+  fb.source.pixels = fb.map + offset;
+
+  // Evict the mapping that was used the longest time ago
+  int slot = numMappedFramebuffers;
+  if (numMappedFramebuffers == MAX_MAPPED_FRAMEBUFFERS)
+  {
+    slot = 0;
+    for(int i = 1; i < numMappedFramebuffers; ++i)
+      if (mappedFramebuffers[i].lastUsedTime < mappedFramebuffers[slot].lastUsedTime) slot = i;
+    UnmapFramebuffer(&mappedFramebuffers[slot]);
+  }
+  else ++numMappedFramebuffers;
+  mappedFramebuffers[slot] = fb;
+  return &mappedFramebuffers[slot];
+}
+
+static void SyncDmabuf(const MappedFramebuffer *fb, uint64_t flags)
+{
+  if (fb->dmabufFd < 0) return;
+  dma_buf_sync sync = {};
+  sync.flags = flags | DMA_BUF_SYNC_READ;
+  ioctl(fb->dmabufFd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+bool SnapshotDrmFramebuffer(uint16_t *destination)
+{
+  // The CRTC is asked for its framebuffer on each capture: a new framebuffer means that the client flipped a new frame to the screen. (Page flip
+  // events are only delivered to the client that flipped.) A client that draws to the framebuffer on the screen keeps the same framebuffer, so
+  // its pixels are captured regardless.
+  drmModeCrtc *crtc = drmModeGetCrtc(drmFd, crtcId);
+  if (!crtc) return false;
+  const uint32_t fbId = crtc->buffer_id, crtcX = crtc->x, crtcY = crtc->y;
+  drmModeFreeCrtc(crtc);
+  if (!fbId) return false; // The display is off
+
+  if (fbId != currentFbId)
+  {
+    currentFbId = fbId;
+    currentFb = MapFramebuffer(fbId);
+  }
+  if (!currentFb) return false;
+  currentFb->lastUsedTime = tick();
+
+  SyncDmabuf(currentFb, DMA_BUF_SYNC_START);
+  bool sampled = SampleCaptureSource(currentFb->source, crtcX, crtcY, destination);
+  SyncDmabuf(currentFb, DMA_BUF_SYNC_END);
+  return sampled;
+}
+
+#endif
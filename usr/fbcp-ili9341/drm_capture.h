@@ -0,0 +1,23 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef CAPTURE_FROM_DRM
+// Captures frames from the framebuffer that a DRM/KMS display driver (e.g. vc4-kms-v3d, or vkms for testing) is scanning out on a CRTC, by mapping the
+// framebuffer to memory. The GPU polling thread is woken up on the vblanks of the CRTC, instead of polling on a timer. Reading the framebuffer of
+// another DRM client needs root (CAP_SYS_ADMIN).
+
+// Opens the DRM device and finds the CRTC to capture, and returns the size of its display mode.
+void InitDrmCapture(int *displayWidth, int *displayHeight);
+
+void DeinitDrmCapture(void);
+
+// Blocks until the vblank that is nearest to the given time, but at least until the next vblank.
+void WaitForDrmVblank(uint64_t earliestTime);
+
+// Samples the capture rectangle (see SetCaptureRectangle()) of the framebuffer that is currently scanned out into destination. Returns false if
+// nothing could be captured, e.g. if the display is off.
+bool SnapshotDrmFramebuffer(uint16_t *destination);
+#endif
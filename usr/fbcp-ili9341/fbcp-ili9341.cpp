@@ -26,24 +26,61 @@
 #include "util.h"
 #include "mailbox.h"
 #include "diff.h"
+#include "diff_kernels.h"
+#include "diff_strategy.h"
+#include "pack_kernels.h"
 #include "mem_alloc.h"
 #include "keyboard.h"
 #include "low_battery.h"
-
+#include "scroll.h"
+#include "panel_model.h"
+#include "interlace.h"
+#include "rolling_refresh.h"
+#include "supersede.h"
+#include "damage_hints.h"
+#include "frame_trace.h"
+#include "frame_pool.h"
+#include "presentation.h"
+
+#if defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_WITHOUT_DIFFING) || defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF))
+// The scanline span differs count changed pixels while diffing, but the single rectangle update methods need to count them separately.
 int CountNumChangedPixels(uint16_t *framebuffer, uint16_t *prevFramebuffer)
 {
   int changedPixels = 0;
   for(int y = 0; y < gpuFrameHeight; ++y)
   {
+#ifdef USE_SCANLINE_HASHES
+    if (scanlineHashes[y] == prevScanlineHashes[y])
+    {
+      framebuffer += gpuFramebufferScanlineStrideBytes >> 1;
+      prevFramebuffer += gpuFramebufferScanlineStrideBytes >> 1;
+      continue;
+    }
+#endif
+#ifdef USE_DIRTY_TILE_PREPASS
+    // Only count inside dirty tiles, the rest of the pixels are known to be unchanged
+    const uint8_t *tileRow = dirtyTiles + (y >> DIRTY_TILE_SIZE_LOG2) * numDirtyTilesX;
+    if (dirtyTileRows[y >> DIRTY_TILE_SIZE_LOG2])
+      for(int tx = 0; tx < numDirtyTilesX; ++tx)
+      {
+        if (!tileRow[tx]) continue;
+        const int endX = MIN(gpuFrameWidth, (tx+1) << DIRTY_TILE_SIZE_LOG2);
+        for(int x = tx << DIRTY_TILE_SIZE_LOG2; x < endX; ++x)
+          if (framebuffer[x] != prevFramebuffer[x])
+            ++changedPixels;
+      }
+#else
     for(int x = 0; x < gpuFrameWidth; ++x)
       if (framebuffer[x] != prevFramebuffer[x])
         ++changedPixels;
+#endif
 
     framebuffer += gpuFramebufferScanlineStrideBytes >> 1;
     prevFramebuffer += gpuFramebufferScanlineStrideBytes >> 1;
   }
   return changedPixels;
 }
+#endif
 
 uint64_t displayContentsLastChanged = 0;
 bool displayOff = false;
@@ -111,32 +148,51 @@ int main()
   int spiEndX = DISPLAY_WIDTH;
 
   InitGPU();
+  InitDiffKernels();
+  InitPackKernels();
 
-  spans = (Span*)Malloc((gpuFrameWidth * gpuFrameHeight / 2) * sizeof(Span), "main() task spans");
-  int size = gpuFramebufferSizeBytes;
-#ifdef USE_GPU_VSYNC
-  // BUG in vc_dispmanx_resource_read_data(!!): If one is capturing a small subrectangle of a large screen resource rectangle, the destination pointer 
-  // is in vc_dispmanx_resource_read_data() incorrectly still taken to point to the top-left corner of the large screen resource, instead of the top-left
-  // corner of the subrectangle to capture. Therefore do dirty pointer arithmetic to adjust for this. To make this safe, videoCoreFramebuffer is allocated
-  // double its needed size so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
-  // to randomly fail and then subsequently hang if called a second time)
-  size *= 2;
-#endif
-  uint16_t *framebuffer[2] = { (uint16_t *)Malloc(size, "main() framebuffer0"), (uint16_t *)Malloc(gpuFramebufferSizeBytes, "main() framebuffer1") };
-  memset(framebuffer[0], 0, size); // Doublebuffer received GPU memory contents, first buffer contains current GPU memory,
-  memset(framebuffer[1], 0, gpuFramebufferSizeBytes); // second buffer contains whatever the display is currently showing. This allows diffing pixels between the two.
-#ifdef USE_GPU_VSYNC
-  // Due to the above bug. In USE_GPU_VSYNC mode, we directly snapshot to framebuffer[0], so it has to be prepared specially to work around the
-  // dispmanx bug.
-  framebuffer[0] += (gpuFramebufferSizeBytes>>1);
+  ReserveSpans(frameSpans, gpuFrameHeight); // Grows on demand if a frame has more spans than this
+#ifdef USE_DIRTY_TILE_PREPASS
+  InitDirtyTiles();
+#endif
+#ifdef USE_DAMAGE_HINTS
+  InitDamageHints();
+#endif
+#ifdef ADAPTIVE_DIFF_STRATEGY
+  InitDiffStrategy();
+#endif
+#ifdef USE_MULTITHREADED_DIFF
+  InitDiffThreads();
+#endif
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+  InitPerceptualDiff();
+#endif
+#ifdef USE_ROLLING_REFRESH
+  InitRollingRefresh();
+#endif
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+  InitQueuedPixelTaskTracking();
+#endif
+#ifdef USE_HARDWARE_SCROLLING
+  InitHardwareScrolling();
+#endif
+  // Doublebuffer received GPU memory contents, first buffer contains current GPU memory, second buffer contains whatever the display is currently showing.
+  // This allows diffing pixels between the two. Both are frames from the frame pool (zeroed initially), and after a frame has been sent in full, both
+  // refer to the same frame.
+  Frame *currentFrame = AcquireFreeFrame();
+  Frame *displayedFrame = AcquireFreeFrame();
+  if (!currentFrame || !displayedFrame) FATAL_ERROR("No free frames in the frame pool for the main thread!");
+  uint16_t *framebuffer[2] = { currentFrame->pixels, displayedFrame->pixels };
+#ifdef USE_SCANLINE_HASHES
+  InitScanlineHashes(framebuffer[0], framebuffer[1]);
 #endif
 
   uint32_t curFrameEnd = spiTaskMemory->queueTail;
   uint32_t prevFrameEnd = spiTaskMemory->queueTail;
 
   bool prevFrameWasInterlacedUpdate = false;
-  bool interlacedUpdate = false; // True if the previous update we did was an interlaced half field update.
-  int frameParity = 0; // For interlaced frame updates, this is either 0 or 1 to denote evens or odds.
+  bool interlacedUpdate = false; // True if the previous update we did only sent one interlaced field of the changed scanlines.
+  bool dirtyTilesCoverAllChanges = true; // False if the dirty tiles were last computed only on the tiles that the damage hints reported
   OpenKeyboard();
   printf("All initialized, now running main loop...\n");
   while(programRunning)
@@ -157,10 +213,29 @@ int main()
       // If THROTTLE_INTERLACING is not defined, we'll fall right through and immediately submit the rest of the remaining content on screen to attempt to minimize the visual
       // observable effect of interlacing, although at the expense of smooth animation (falling through here causes jitter)
     }
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+    else if (DisplayHasDriftedScanlines())
+    {
+      // The display is showing pixels that were within tolerance of the frame, and those need correcting after a bounded number of updates even if
+      // no new frames arrive, so sleep at most one frame interval.
+      timespec timeout = {};
+      timeout.tv_nsec = 1000000000 / TARGET_FRAME_RATE;
+      if (programRunning) syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAIT, 0, &timeout, 0, 0);
+    }
+#endif
     else
     {
       uint64_t waitStart = tick();
+#ifdef USE_PRESENTATION_SCHEDULER
+      // Captured frames wait in the jitter buffer until they are due on the presentation clock. The count of captured frames is read before looking
+      // at the buffer, so that a frame captured in between changes it and the futex wait below returns right away.
+      int numCapturedFrames;
+      int64_t usecsUntilPresentation;
+      while(numCapturedFrames = __atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST), (usecsUntilPresentation = UsecsUntilNextPresentation()) != 0 && programRunning)
+#else
+      const int numCapturedFrames = 0;
       while(__atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST) == 0)
+#endif
       {
 #if defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY)
         if (!displayOff && tick() - waitStart > TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY)
@@ -171,14 +246,28 @@ int main()
 
         if (!displayOff)
         {
+          uint64_t timeoutUsecs = TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY;
+#ifdef USE_PRESENTATION_SCHEDULER
+          if (usecsUntilPresentation > 0) timeoutUsecs = MIN(timeoutUsecs, (uint64_t)usecsUntilPresentation);
+#endif
           timespec timeout = {};
-          timeout.tv_sec = ((uint64_t)TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY * 1000) / 1000000000;
-          timeout.tv_nsec = ((uint64_t)TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY * 1000) % 1000000000;
-          if (programRunning) syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAIT, 0, &timeout, 0, 0); // Sleep until the next frame arrives
+          timeout.tv_sec = (timeoutUsecs * 1000) / 1000000000;
+          timeout.tv_nsec = (timeoutUsecs * 1000) % 1000000000;
+          if (programRunning) syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAIT, numCapturedFrames, &timeout, 0, 0); // Sleep until the next frame arrives
         }
         else
 #endif
-          if (programRunning) syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAIT, 0, 0, 0, 0); // Sleep until the next frame arrives
+#ifdef USE_PRESENTATION_SCHEDULER
+        if (usecsUntilPresentation > 0)
+        {
+          timespec timeout = {};
+          timeout.tv_sec = usecsUntilPresentation / 1000000;
+          timeout.tv_nsec = (usecsUntilPresentation % 1000000) * 1000;
+          if (programRunning) syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAIT, numCapturedFrames, &timeout, 0, 0); // Sleep until the next frame is due
+        }
+        else
+#endif
+          if (programRunning) syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAIT, numCapturedFrames, 0, 0, 0); // Sleep until the next frame arrives
       }
     }
 
@@ -242,6 +331,22 @@ int main()
 #endif
 
     int numNewFrames = __atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST);
+#ifdef USE_PRESENTATION_SCHEDULER
+    // Take the oldest captured frame if it is due. The frames that are still waiting in the jitter buffer stay counted in numNewGpuFrames, so
+    // only the taken frame and the frames dropped from the buffer before it are counted off.
+    int numFramesDropped;
+    Frame *newFrame = TakePresentableFrame(&numFramesDropped);
+    numNewFrames = newFrame ? 1 + numFramesDropped : 0;
+#elif !defined(USE_GPU_VSYNC)
+    // If the GPU polling thread published another frame right after the previous one was taken, that frame may have been taken already on the
+    // previous round, before it was counted.
+    Frame *newFrame = (numNewFrames > 0) ? TakeNewestGpuFrame() : 0;
+    if (numNewFrames > 0 && !newFrame)
+    {
+      __atomic_fetch_sub(&numNewGpuFrames, numNewFrames, __ATOMIC_SEQ_CST);
+      numNewFrames = 0;
+    }
+#endif
     bool gotNewFramebuffer = (numNewFrames > 0);
     bool framebufferHasNewChangedPixels = true;
     uint64_t frameObtainedTime;
@@ -262,22 +367,58 @@ int main()
       usleep(timeToSleep);
 #endif
 
+      // The display may be showing framebuffer[0], so snapshot to a frame of its own.
+#ifdef LATE_LATCH_PIXEL_TASKS
+      // Queued pixel tasks may also still be fetching their pixels from it.
+      if (__atomic_load_n(&currentFrame->refCount, __ATOMIC_SEQ_CST) > 1)
+#else
+      if (currentFrame == displayedFrame)
+#endif
+      {
+        ReleaseFrame(currentFrame);
+        while(!(currentFrame = AcquireFreeFrame()))
+          usleep(100); // The SPI thread frees up the frames of the queued pixel tasks as it sends them
+        framebuffer[0] = currentFrame->pixels;
+      }
+#ifdef USE_SCANLINE_HASHES
+      framebufferHasNewChangedPixels = SnapshotFramebufferAndHashes(framebuffer[0], scanlineHashes);
+      // A frame swapped in above still holds the pixels of some older snapshot, which the hashes need to match even if there was nothing to snapshot
+      if (!framebufferHasNewChangedPixels) ComputeScanlineHashes(framebuffer[0], scanlineHashes);
+#else
       framebufferHasNewChangedPixels = SnapshotFramebuffer(framebuffer[0]);
+#endif
 #else
-      memcpy(framebuffer[0], videoCoreFramebuffer[1], gpuFramebufferSizeBytes);
+      // Take over the reference to the captured frame instead of copying its pixels. Nothing else references it, so the overlays can be drawn on it.
+      ReleaseFrame(currentFrame);
+      currentFrame = newFrame;
+      framebuffer[0] = currentFrame->pixels;
+#ifdef USE_SCANLINE_HASHES
+      memcpy(scanlineHashes, currentFrame->scanlineHashes, gpuFrameHeight*sizeof(uint32_t));
+#endif
+#ifdef STATISTICS
+      __atomic_fetch_add(&statsFrameCopyBytesSaved, gpuFramebufferSizeBytes, __ATOMIC_RELAXED);
+#endif
 #endif
 
       PollLowBattery();
 
 #ifdef STATISTICS
+      ++statsNewFramesProcessed;
       uint64_t now = tick();
       for(int i = 0; i < numNewFrames - 1 && frameSkipTimeHistorySize < FRAMERATE_HISTORY_LENGTH; ++i)
         frameSkipTimeHistory[frameSkipTimeHistorySize++] = now;
 #endif
       __atomic_fetch_sub(&numNewGpuFrames, numNewFrames, __ATOMIC_SEQ_CST);
 
-      DrawStatisticsOverlay(framebuffer[0]);
-      DrawLowBatteryIcon(framebuffer[0]);
+      int overlayStartY = gpuFrameHeight, overlayEndY = 0;
+      DrawStatisticsOverlay(framebuffer[0], overlayStartY, overlayEndY);
+      DrawLowBatteryIcon(framebuffer[0], overlayStartY, overlayEndY);
+#ifdef USE_SCANLINE_HASHES
+      // The hashes were computed when the frame was captured, so only the scanlines that the overlays were drawn on need rehashing.
+      ComputeScanlineHashesInRange(framebuffer[0], scanlineHashes, overlayStartY, overlayEndY);
+      // Every now and then, make sure that no changed scanline is being skipped because of a hash collision
+      VerifyScanlineHashes(framebuffer[0], framebuffer[1]);
+#endif
 
 #ifdef USE_GPU_VSYNC
 
@@ -289,16 +430,31 @@ int main()
       // Therefore even while we do get a smooth 16.666.. msec interval vsync signal, we have no idea whether the application has actually produced a new frame at that time. Therefore
       // we must keep polling for frames until we find one that it has produced.
 #ifdef SELF_SYNCHRONIZE_TO_GPU_VSYNC_PRODUCED_NEW_FRAMES
+#ifdef USE_SCANLINE_HASHES
+      framebufferHasNewChangedPixels = framebufferHasNewChangedPixels && ScanlineHashesDiffer(scanlineHashes, prevScanlineHashes);
+#else
       framebufferHasNewChangedPixels = framebufferHasNewChangedPixels && IsNewFramebuffer(framebuffer[0], framebuffer[1]);
+#endif
       uint64_t timeToGiveUpThereIsNotGoingToBeANewFrame = framePollingStartTime + 1000000/TARGET_FRAME_RATE/2;
       while(!framebufferHasNewChangedPixels && tick() < timeToGiveUpThereIsNotGoingToBeANewFrame)
       {
         usleep(2000);
         frameObtainedTime = tick();
+#ifdef USE_SCANLINE_HASHES
+        framebufferHasNewChangedPixels = SnapshotFramebufferAndHashes(framebuffer[0], scanlineHashes);
+#else
         framebufferHasNewChangedPixels = SnapshotFramebuffer(framebuffer[0]);
-        DrawStatisticsOverlay(framebuffer[0]);
-        DrawLowBatteryIcon(framebuffer[0]);
+#endif
+        overlayStartY = gpuFrameHeight;
+        overlayEndY = 0;
+        DrawStatisticsOverlay(framebuffer[0], overlayStartY, overlayEndY);
+        DrawLowBatteryIcon(framebuffer[0], overlayStartY, overlayEndY);
+#ifdef USE_SCANLINE_HASHES
+        ComputeScanlineHashesInRange(framebuffer[0], scanlineHashes, overlayStartY, overlayEndY);
+        framebufferHasNewChangedPixels = framebufferHasNewChangedPixels && ScanlineHashesDiffer(scanlineHashes, prevScanlineHashes);
+#else
         framebufferHasNewChangedPixels = framebufferHasNewChangedPixels && IsNewFramebuffer(framebuffer[0], framebuffer[1]);
+#endif
       }
 #else
       framebufferHasNewChangedPixels = true;
@@ -322,6 +478,25 @@ int main()
 #endif
     }
 
+#ifdef RECORD_FRAME_TRACE
+    if (gotNewFramebuffer && framebufferHasNewChangedPixels)
+      RecordFrameTrace(framebuffer[0]);
+#endif
+
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+    // If the SPI thread has not yet started sending the pixels of the previous updates, send the pixels of the new frame in their place. This brings
+    // framebuffer[1] up to date on those spans, so the diff below does not queue them again.
+    if (gotNewFramebuffer && framebuffer[0] != framebuffer[1])
+    {
+      int bytesSuperseded = SupersedeQueuedPixelTasks(currentFrame, framebuffer[1]);
+#ifdef STATISTICS
+      statsBytesSuperseded += bytesSuperseded;
+#else
+      (void)bytesSuperseded;
+#endif
+    }
+#endif
+
     // If too many pixels have changed on screen, drop adaptively to interlaced updating to keep up the frame rate.
     double inputDataFps = 1000000.0 / EstimateFrameRateInterval();
     double desiredTargetFps = MAX(1, MIN(inputDataFps, TARGET_FRAME_RATE));
@@ -334,47 +509,177 @@ int main()
 #endif
     const double tooMuchToUpdateUsecs = timesliceToUseForScreenUpdates / desiredTargetFps; // If updating the current and new frame takes too many frames worth of allotted time, drop to interlacing.
 
-#if !defined(NO_INTERLACING) || (defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY))
-    int numChangedPixels = framebufferHasNewChangedPixels ? CountNumChangedPixels(framebuffer[0], framebuffer[1]) : 0;
+#ifdef USE_HARDWARE_SCROLLING
+    // If the new frame is a vertically scrolled version of what is on the display, scroll the display contents in hardware. This shifts framebuffer[1]
+    // to match, so that the diff below only picks up the newly exposed scanlines and whatever else changed.
+    if (framebufferHasNewChangedPixels && !displayOff)
+    {
+      int scroll = DetectVerticalScroll();
+      if (scroll != 0)
+      {
+#ifdef LATE_LATCH_PIXEL_TASKS
+        // Queued pixel tasks may still be packing their pixels from framebuffer[1], at the scanlines that they were queued for, so shift a copy of it.
+        if (__atomic_load_n(&displayedFrame->refCount, __ATOMIC_SEQ_CST) > 1)
+        {
+          Frame *scrolledFrame;
+          while(!(scrolledFrame = AcquireFreeFrame()))
+            usleep(100); // The SPI thread frees up the frames of the queued pixel tasks as it sends them
+          memcpy(scrolledFrame->pixels, framebuffer[1], gpuFramebufferSizeBytes);
+          ReleaseFrame(displayedFrame);
+          displayedFrame = scrolledFrame;
+          framebuffer[1] = displayedFrame->pixels;
+        }
+#endif
+        ApplyHardwareScroll(scroll, framebuffer[0], framebuffer[1]);
+        spiY = -1; // The display memory rows of all scanlines changed
+#ifdef USE_DAMAGE_HINTS
+        InvalidateDamageHints(); // The scanlines of framebuffer[1] moved, so the changed pixels are no longer where the producer repainted
+#endif
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+        ForgetQueuedPixelTasks(); // The queued tasks write to display rows that no longer hold the same scanlines of framebuffer[1]
+#endif
+      }
+    }
 #endif
 
-#ifdef NO_INTERLACING
-    interlacedUpdate = false;
-#elif defined(ALWAYS_INTERLACING)
-    interlacedUpdate = (numChangedPixels > 0);
+#ifdef USE_DIRTY_TILE_PREPASS
+    // If framebuffer[0] has not been written to, the previously computed dirty tiles still cover all changed pixels, since framebuffer[1] only
+    // ever gets updated towards framebuffer[0].
+    if (gotNewFramebuffer || framebufferHasNewChangedPixels)
+    {
+#ifdef USE_DAMAGE_HINTS
+      // If the producer reports what it repainted, only the hinted tiles need to be compared.
+      const uint8_t *hintedTiles = DamageHintTilesToDiff(framebuffer[1]);
+      ComputeDirtyTiles(framebuffer[0], framebuffer[1], hintedTiles);
+      VerifyDamageHints();
+      dirtyTilesCoverAllChanges = !hintedTiles;
 #else
-    uint32_t bytesToSend = numChangedPixels * SPI_BYTESPERPIXEL + (DISPLAY_DRAWABLE_HEIGHT<<1);
-    interlacedUpdate = ((bytesToSend + spiTaskMemory->spiBytesQueued) * spiUsecsPerByte > tooMuchToUpdateUsecs); // Decide whether to do interlacedUpdate - only updates half of the screen
+      ComputeDirtyTiles(framebuffer[0], framebuffer[1], 0);
+#endif
+    }
 #endif
 
-    if (interlacedUpdate) frameParity = 1-frameParity; // Swap even-odd fields every second time we do an interlaced update (progressive updates ignore field order)
     int bytesTransferred = 0;
-    Span *head = 0;
+    frameSpans.numSpans = 0;
+    bool scanlinesDiffed = false; // If true, the scanlines were diffed this frame, and the ones selected by numInterlacedFields and interlacedField sent
 
-#if defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING)
-    NoDiffChangedRectangle(head);
-#elif defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF)
-    DiffFramebuffersToSingleChangedRectangle(framebuffer[0], framebuffer[1], head);
+#if defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_WITHOUT_DIFFING) || defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF))
+    // These update methods do not look at individual pixels, so the changed pixels need to be counted separately.
+#if !defined(NO_INTERLACING) || (defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY))
+    int numChangedPixels = framebufferHasNewChangedPixels ? CountNumChangedPixels(framebuffer[0], framebuffer[1]) : 0;
+#endif
+#if !defined(NO_INTERLACING) && !defined(ALWAYS_INTERLACING)
+    uint32_t bytesToSend = numChangedPixels * SPI_BYTESPERPIXEL + (DISPLAY_DRAWABLE_HEIGHT<<1);
+#endif
+
+#ifdef UPDATE_FRAMES_WITHOUT_DIFFING
+    NoDiffChangedRectangle(frameSpans);
+#elif defined(MAX_DIFF_RECTANGLES)
+    DiffFramebuffersToChangedRectangles(framebuffer[0], framebuffer[1], frameSpans);
+    scanlinesDiffed = true;
+#else
+    DiffFramebuffersToSingleChangedRectangle(framebuffer[0], framebuffer[1], frameSpans);
+    scanlinesDiffed = true;
+#endif
 #else
-    // Collect all spans in this image
-    if (framebufferHasNewChangedPixels || prevFrameWasInterlacedUpdate)
+    // Collect all spans in this image. The whole frame is diffed progressively, and the differ counts the changed pixels and the bytes that each
+    // interlaced field would take to send in the same pass, so the decision whether to interlace can be made afterwards without reading the frame again.
+    DiffStats diffStats = {};
+#ifdef ADAPTIVE_DIFF_STRATEGY
+    DiffStrategy diffStrategy = DIFF_EXACT_SCANLINES;
+#endif
+    bool diffScanlines = framebufferHasNewChangedPixels || prevFrameWasInterlacedUpdate;
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+    diffScanlines = diffScanlines || DisplayHasDriftedScanlines(); // The tolerated pixels on the display get corrected by the diff even if nothing changed
+#endif
+    if (diffScanlines)
     {
+      scanlinesDiffed = true;
+#ifdef BENCHMARK_DIFF_KERNELS
+      if (framebufferHasNewChangedPixels) BenchmarkDiffKernels(framebuffer[0], framebuffer[1]);
+#endif
+#ifdef BENCHMARK_DIFF_THREADS
+      if (framebufferHasNewChangedPixels) BenchmarkDiffThreads(framebuffer[0], framebuffer[1]);
+#endif
+#if defined(PERCEPTUAL_DIFF_TOLERANCE)
+      DiffFramebuffersToScanlineSpansWithTolerance(framebuffer[0], framebuffer[1], frameSpans, diffStats);
+#elif defined(ADAPTIVE_DIFF_STRATEGY)
+      // Pick the cheapest way to update this frame based on how much of it changed, and what the ways were measured to cost on the recent frames
+      diffStrategy = ChooseDiffStrategy(tooMuchToUpdateUsecs / spiUsecsPerByte - spiTaskMemory->spiBytesQueued);
+      DiffFramebuffersWithStrategy(diffStrategy, framebuffer[0], framebuffer[1], frameSpans, diffStats);
+#elif defined(USE_MULTITHREADED_DIFF)
+      DiffFramebuffersToScanlineSpansMultithreaded(framebuffer[0], framebuffer[1], false, 0, frameSpans, diffStats);
+#elif defined(USE_SIMD_PIXEL_DIFF)
+      DiffFramebuffersToScanlineSpansSIMD(framebuffer[0], framebuffer[1], false, 0, frameSpans, diffStats);
+#else
       // If possible, utilize a faster 4-wide pixel diffing method
 #ifdef FAST_BUT_COARSE_PIXEL_DIFF
       if (gpuFrameWidth % 4 == 0 && gpuFramebufferScanlineStrideBytes % 8 == 0)
-        DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(framebuffer[0], framebuffer[1], interlacedUpdate, frameParity, head);
+        DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(framebuffer[0], framebuffer[1], false, 0, frameSpans, diffStats);
       else
 #endif
-        DiffFramebuffersToScanlineSpansExact(framebuffer[0], framebuffer[1], interlacedUpdate, frameParity, head); // If disabled, or framebuffer width is not compatible, use the exact method
+        DiffFramebuffersToScanlineSpansExact(framebuffer[0], framebuffer[1], false, 0, frameSpans, diffStats); // If disabled, or framebuffer width is not compatible, use the exact method
+#endif
     }
 
-    // Merge spans together on adjacent scanlines - works only if doing a progressive update
-    if (!interlacedUpdate)
-      MergeScanlineSpanList(head);
+    // If the previous frame was interlaced, the diff above also picks up the remaining field of that frame, but does not count as new activity.
+#if defined(ALWAYS_INTERLACING) || (defined(BACKLIGHT_CONTROL) && defined(TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY))
+    int numChangedPixels = framebufferHasNewChangedPixels ? diffStats.numChangedPixels : 0;
+#endif
+#endif
+
+    int numInterlacedFields = 1, interlacedField = 0; // The scanlines y with y % numInterlacedFields == interlacedField are sent in this update
+    int numScanlinesLeftPending = 0; // With rolling refresh, the number of changed scanlines carried over to the next updates
+#ifdef NO_INTERLACING
+    interlacedUpdate = false;
+#elif defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_WITHOUT_DIFFING) || defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF))
+    // The changed rectangle covers all scanlines regardless of interlacing, so here an interlaced update only paces the main loop.
+#ifdef ALWAYS_INTERLACING
+    interlacedUpdate = (numChangedPixels > 0);
+#else
+    interlacedUpdate = ((bytesToSend + spiTaskMemory->spiBytesQueued) * spiUsecsPerByte > tooMuchToUpdateUsecs);
+#endif
+#elif defined(USE_ROLLING_REFRESH)
+    // Send the changed scanlines that have waited the longest, as many as fit in the time available. Like with interlacing, the main loop then continues
+    // without waiting for a new frame, so the scanlines left pending are picked up by the next diff.
+    numScanlinesLeftPending = SelectRollingRefreshSpans(frameSpans, tooMuchToUpdateUsecs / spiUsecsPerByte - spiTaskMemory->spiBytesQueued);
+    interlacedUpdate = (numScanlinesLeftPending > 0);
+#else
+    // Send every second, third or fourth scanline in this update if sending all changes would not fit in the time available. The diff has already
+    // counted the bytes on each scanline class, so this picks the fewest fields that fit, and the field whose changes have waited the longest.
+#ifdef ALWAYS_INTERLACING
+    const int minNumInterlacedFields = (numChangedPixels > 0) ? 2 : 1;
+#else
+    const int minNumInterlacedFields = 1;
+#endif
+    numInterlacedFields = ChooseInterlacedFields(diffStats, tooMuchToUpdateUsecs / spiUsecsPerByte - spiTaskMemory->spiBytesQueued, minNumInterlacedFields, interlacedField);
+    interlacedUpdate = (numInterlacedFields > 1);
+#endif
+
+#if !(defined(ALL_TASKS_SHOULD_DMA) && (defined(UPDATE_FRAMES_WITHOUT_DIFFING) || defined(UPDATE_FRAMES_IN_SINGLE_RECTANGULAR_DIFF)))
+    if (numInterlacedFields > 1)
+    {
+      // Send only the spans of the current field, the other fields are picked up by the next diffs
+      SelectInterlacedFieldSpans(frameSpans, numInterlacedFields, interlacedField);
+    }
+    else
+    {
+      // Merge spans together on adjacent scanlines - works only if doing a progressive update
+#ifdef BENCHMARK_SPAN_MERGE
+      if (frameSpans.numSpans > 0) BenchmarkSpanMerge(frameSpans);
+#endif
+#ifdef ADAPTIVE_DIFF_STRATEGY
+      if (IsScanlineDiffStrategy(diffStrategy)) // Rectangles do not merge any further
+#endif
+      MergeScanlineSpanList(frameSpans);
+#ifdef ADAPTIVE_DIFF_STRATEGY
+      if (scanlinesDiffed) RecordDiffStrategyCost(frameSpans);
+#endif
+    }
 #endif
 
 #ifdef USE_GPU_VSYNC
-    if (head) // do we have a new frame?
+    if (frameSpans.numSpans > 0) // do we have a new frame?
     {
       // If using vsync, this main thread is responsible for maintaining the frame histogram. If not using vsync,
       // but instead are using a dedicated GPU thread, then that dedicated thread maintains the frame histogram,
@@ -387,18 +692,34 @@ int main()
     }
 #endif
 
+#ifdef BENCHMARK_PACK_KERNELS
+    if (!displayOff && frameSpans.numSpans > 0) BenchmarkPackKernels(frameSpans, framebuffer[0]);
+#endif
+
+#ifdef USE_HARDWARE_SCROLLING
+    SplitSpansAtScrollWrap(frameSpans);
+#endif
+
+    // If all changes of a diffed frame are sent in a single progressive update, the display shows framebuffer[0] afterwards, so rather than copying the
+    // sent pixels over to framebuffer[1], the frame of framebuffer[0] takes over its role. Partial and interlaced updates copy the sent pixels over.
+    bool swapPrevFramebuffer = !displayOff && scanlinesDiffed && numInterlacedFields == 1 && numScanlinesLeftPending == 0 && frameSpans.numSpans > 0 && dirtyTilesCoverAllChanges;
+#if defined(PERCEPTUAL_DIFF_TOLERANCE) || defined(OFFLOAD_PIXEL_COPY_TO_DMA_CPP)
+    // The display keeps showing the tolerated pixels of framebuffer[1], or dma.cpp copies the pixels over in the same pass as it prepares the transfer
+    swapPrevFramebuffer = false;
+#endif
+    int numPixelsSent = 0;
+
     // Submit spans
     if (!displayOff)
-    for(Span *i = head; i; i = i->next)
+    for(Span *i = frameSpans.spans, *end = frameSpans.spans + frameSpans.numSpans; i < end; ++i)
     {
 #ifdef ALIGN_TASKS_FOR_DMA_TRANSFERS
       // DMA transfers smaller than 4 bytes are causing trouble, so in order to ensure smooth DMA operation,
       // make sure each message is at least 4 bytes in size, hence one pixel spans are forbidden:
-      if (i->size == 1)
+      if (i->Size() == 1)
       {
         if (i->endX < DISPLAY_DRAWABLE_WIDTH) { ++i->endX; ++i->lastScanEndX; }
         else --i->x;
-        ++i->size;
       }
 #endif
       // Update the write cursor if needed
@@ -407,9 +728,9 @@ int main()
 #endif
       {
 #if defined(MUST_SEND_FULL_CURSOR_WINDOW) || defined(ALIGN_TASKS_FOR_DMA_TRANSFERS)
-        QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_Y, displayYOffset + i->y, displayYOffset + gpuFrameHeight - 1);
+        QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_Y, DISPLAY_SCANLINE_Y(i->y), DISPLAY_SCANLINE_END_Y);
 #else
-        QUEUE_MOVE_CURSOR_TASK(DISPLAY_SET_CURSOR_Y, displayYOffset + i->y);
+        QUEUE_MOVE_CURSOR_TASK(DISPLAY_SET_CURSOR_Y, DISPLAY_SCANLINE_Y(i->y));
 #endif
         IN_SINGLE_THREADED_MODE_RUN_TASK();
         spiY = i->y;
@@ -438,7 +759,7 @@ int main()
           // We are doing a single line span and need to increase the X window. If possible,
           // peek ahead to cater to the next multiline span update if that will be compatible.
           int nextEndX = gpuFrameWidth;
-          for(Span *j = i->next; j; j = j->next)
+          for(Span *j = i+1; j < end; ++j)
             if (j->endY > j->y+1)
             {
               if (j->endX >= i->endX) nextEndX = j->endX;
@@ -465,11 +786,42 @@ int main()
 #endif
       }
 
+#ifdef SOLID_FILL_TASKS
+      uint16_t fillColor;
+      if (i->Size() >= SOLID_FILL_MIN_PIXELS && SpanIsSolidColor(framebuffer[0], *i, &fillColor))
+      {
+        // Submit the span as a solid fill, which holds the color only once
+        SPITask *task = AllocTask(4);
+        task->cmd = DISPLAY_WRITE_PIXELS;
+        task->fillSize = i->Size()*SPI_BYTESPERPIXEL;
+        SetFillTaskColor(task, fillColor);
+
+        bytesTransferred += task->BusSize()+1;
+        numPixelsSent += i->Size();
+#if !(defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING)) // If not diffing, no need to maintain prev frame.
+        if (!swapPrevFramebuffer)
+        {
+          uint16_t *prevScanline = framebuffer[1] + i->y * (gpuFramebufferScanlineStrideBytes>>1);
+          for(int y = i->y; y < i->endY; ++y, prevScanline += gpuFramebufferScanlineStrideBytes>>1)
+            for(int x = i->x, endX = (y + 1 == i->endY) ? i->lastScanEndX : i->endX; x < endX; ++x)
+              prevScanline[x] = fillColor;
+        }
+#endif
+        CommitTask(task);
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+        TrackQueuedPixelTask(task, *i);
+#endif
+        IN_SINGLE_THREADED_MODE_RUN_TASK();
+        continue;
+      }
+#endif
+
       // Submit the span pixels
-      SPITask *task = AllocTask(i->size*SPI_BYTESPERPIXEL);
+      SPITask *task = AllocTask(i->Size()*SPI_BYTESPERPIXEL);
       task->cmd = DISPLAY_WRITE_PIXELS;
 
       bytesTransferred += task->PayloadSize()+1;
+      numPixelsSent += i->Size();
       uint16_t *scanline = framebuffer[0] + i->y * (gpuFramebufferScanlineStrideBytes>>1);
       uint16_t *prevScanline = framebuffer[1] + i->y * (gpuFramebufferScanlineStrideBytes>>1);
 
@@ -482,45 +834,70 @@ int main()
       task->fb = (uint8_t*)(scanline + i->x);
       task->prevFb = (uint8_t*)(prevScanline + i->x);
       task->width = i->endX - i->x;
+#elif defined(LATE_LATCH_PIXEL_TASKS)
+      // The SPI thread packs the pixels from the frame when it gets to the task, so here they only need copying over to the previous framebuffer.
+      AddFrameRef(currentFrame);
+      task->frame = currentFrame;
+      task->x = i->x;
+      task->endX = i->endX;
+      task->y = i->y;
+      task->endY = i->endY;
+      task->lastScanEndX = i->lastScanEndX;
+#if !(defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING)) // If not diffing, no need to maintain prev frame.
+      if (!swapPrevFramebuffer)
+        for(int y = i->y; y < i->endY; ++y, scanline += gpuFramebufferScanlineStrideBytes>>1, prevScanline += gpuFramebufferScanlineStrideBytes>>1)
+          memcpy(prevScanline + i->x, scanline + i->x, (((y + 1 == i->endY) ? i->lastScanEndX : i->endX) - i->x)*sizeof(uint16_t));
+#endif
 #else
-      uint16_t *data = (uint16_t*)task->data;
+      // Pack the pixels to the task and copy them over to the previous framebuffer in one pass, so that each pixel is read only once.
+      uint8_t *data = task->data;
       for(int y = i->y; y < i->endY; ++y, scanline += gpuFramebufferScanlineStrideBytes>>1, prevScanline += gpuFramebufferScanlineStrideBytes>>1)
       {
         int endX = (y + 1 == i->endY) ? i->lastScanEndX : i->endX;
-        int x = i->x;
-#ifdef DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
-        // Convert from R5G6B5 to R6X2G6X2B6X2 on the fly
-        while(x < endX)
-        {
-          uint16_t pixel = scanline[x++];
-          uint16_t r = (pixel >> 8) & 0xF8;
-          uint16_t g = (pixel >> 3) & 0xFC;
-          uint16_t b = (pixel << 3) & 0xF8;
-          ((uint8_t*)data)[0] = r | (r >> 5); // On red and blue color channels, need to expand 5 bits to 6 bits. Do that by duplicating the highest bit as lowest bit.
-          ((uint8_t*)data)[1] = g;
-          ((uint8_t*)data)[2] = b | (b >> 5);
-          data = (uint16_t*)((uintptr_t)data + 3);
-        }
-#else
-        while(x < endX && (x&1)) *data++ = __builtin_bswap16(scanline[x++]);
-        while(x < (endX&~1U))
-        {
-          uint32_t u = *(uint32_t*)(scanline+x);
-          *(uint32_t*)data = ((u & 0xFF00FF00U) >> 8) | ((u & 0x00FF00FFU) << 8);
-          data += 2;
-          x += 2;
-        }
-        while(x < endX) *data++ = __builtin_bswap16(scanline[x++]);
-#endif
 #if !(defined(ALL_TASKS_SHOULD_DMA) && defined(UPDATE_FRAMES_WITHOUT_DIFFING)) // If not diffing, no need to maintain prev frame.
-        memcpy(prevScanline+i->x, scanline+i->x, (endX - i->x)*FRAMEBUFFER_BYTESPERPIXEL);
+        data = packKernel.PackPixels(data, scanline + i->x, swapPrevFramebuffer ? 0 : prevScanline + i->x, endX - i->x);
+#else
+        data = packKernel.PackPixels(data, scanline + i->x, 0, endX - i->x);
 #endif
       }
 #endif
       CommitTask(task);
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+      TrackQueuedPixelTask(task, *i);
+#endif
       IN_SINGLE_THREADED_MODE_RUN_TASK();
     }
 
+    if (swapPrevFramebuffer)
+    {
+      AddFrameRef(currentFrame);
+      ReleaseFrame(displayedFrame);
+      displayedFrame = currentFrame;
+      framebuffer[1] = framebuffer[0];
+#ifdef STATISTICS
+      __atomic_fetch_add(&statsFrameCopyBytesSaved, numPixelsSent * FRAMEBUFFER_BYTESPERPIXEL, __ATOMIC_RELAXED);
+#endif
+    }
+
+#ifdef USE_SCANLINE_HASHES
+    // All changed pixels on the diffed scanlines have now been copied over to framebuffer[1], so those scanlines are equal in both framebuffers.
+    if (!displayOff && scanlinesDiffed)
+#ifdef USE_ROLLING_REFRESH
+      UpdateRollingRefreshScanlineHashes();
+#else
+      UpdatePrevScanlineHashes(numInterlacedFields, interlacedField);
+#endif
+#endif
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+    // Must come after UpdatePrevScanlineHashes(), since it fixes up the hashes of the scanlines that were left showing tolerated pixels.
+    if (!displayOff && scanlinesDiffed)
+      UpdateToleratedScanlines(framebuffer[1], numInterlacedFields, interlacedField);
+#endif
+#ifdef VERIFY_HARDWARE_SCROLLING
+    if (!displayOff)
+      VerifyPanelModel(framebuffer[1]);
+#endif
+
 #ifdef KERNEL_MODULE_CLIENT
     // Wake the kernel module up to run tasks. TODO: This might not be best placed here, we could pre-empt
     // to start running tasks already half-way during task submission above.
@@ -568,9 +945,27 @@ int main()
       AddFrameCompletionTimeMarker();
     }
     statsBytesTransferred += bytesTransferred;
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+    if (scanlinesDiffed)
+    {
+      statsToleratedPixels += diffStats.numToleratedPixels;
+      for(int c = 0; c < 3; ++c)
+        statsToleratedSquaredError[c] += diffStats.toleratedSquaredError[c];
+      statsToleranceDiffedPixels += gpuFrameWidth * gpuFrameHeight;
+    }
+#endif
 #endif
   }
 
+#ifdef USE_MULTITHREADED_DIFF
+  DeinitDiffThreads();
+#endif
+#ifdef USE_DAMAGE_HINTS
+  DeinitDamageHints();
+#endif
+#ifdef RECORD_FRAME_TRACE
+  DeinitFrameTrace();
+#endif
   DeinitGPU();
   DeinitSPI();
   CloseMailbox();
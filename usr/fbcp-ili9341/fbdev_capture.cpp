@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/fb.h> // FBIOGET_VSCREENINFO, FBIO_WAITFORVSYNC
+
+#include "config.h"
+
+#ifdef CAPTURE_FROM_FBDEV
+
+#include "fbdev_capture.h"
+#include "capture_sampler.h"
+#include "util.h"
+
+static int fbFd = -1;
+static uint8_t *fbMemory = 0;
+static size_t fbMemorySize = 0;
+static CaptureSource source = {};
+static bool sourceValid = false;
+static fb_var_screeninfo sourceVar = {}; // The mode that source was set up for
+static bool vsyncSupported = true;
+
+// Sets up the source to read the framebuffer in the given mode, and maps the framebuffer memory again if its size changed.
+static bool SetupSource(const fb_var_screeninfo &var)
+{
+  sourceVar = var;
+  fb_fix_screeninfo fix;
+  if (ioctl(fbFd, FBIOGET_FSCREENINFO, &fix) < 0) return false;
+
+  int bytesPerPixel = 0;
+  if (fix.type == FB_TYPE_PACKED_PIXELS && fix.visual == FB_VISUAL_TRUECOLOR)
+  {
+    if (var.bits_per_pixel == 16 && var.green.offset == 5 && var.green.length == 6) bytesPerPixel = 2;
+    else if (var.bits_per_pixel == 32 && var.green.offset == 8 && var.green.length == 8) bytesPerPixel = 4;
+  }
+  if (!bytesPerPixel)
+  {
+    printf("%s has an unsupported pixel format: %u bits per pixel, with red at bit %u, green at bit %u and blue at bit %u. Only 16bpp RGB565 and 32bpp XRGB8888 framebuffers (or BGR of either) can be captured\n",
+      FBDEV_CAPTURE_DEVICE, var.bits_per_pixel, var.red.offset, var.green.offset, var.blue.offset);
+    return false;
+  }
+
+  if (fix.smem_len != fbMemorySize)
+  {
+    if (fbMemory) munmap(fbMemory, fbMemorySize);
+    fbMemory = (uint8_t*)mmap(0, fix.smem_len, PROT_READ, MAP_SHARED, fbFd, 0);
+    if (fbMemory == MAP_FAILED)
+    {
+      printf("Failed to map %s for reading (%s)\n", FBDEV_CAPTURE_DEVICE, strerror(errno));
+      fbMemory = 0;
+      fbMemorySize = 0;
+      return false;
+    }
+    fbMemorySize = fix.smem_len;
+  }
+
+  source.pixels = fbMemory;
+  source.pitch = fix.line_length;
+  source.width = var.xres_virtual;
+  source.height = MIN(var.yres_virtual, fix.line_length ? fix.smem_len / fix.line_length : 0);
+  source.bytesPerPixel = bytesPerPixel;
+  source.bgr = (var.red.offset == 0);
+  return true;
+}
+
+void InitFbdevCapture(int *displayWidth, int *displayHeight)
+{
+  fbFd = open(FBDEV_CAPTURE_DEVICE, O_RDONLY | O_CLOEXEC);
+  if (fbFd < 0) FATAL_ERROR("Failed to open FBDEV_CAPTURE_DEVICE!");
+  fb_var_screeninfo var;
+  if (ioctl(fbFd, FBIOGET_VSCREENINFO, &var) < 0) FATAL_ERROR("FBDEV_CAPTURE_DEVICE is not a framebuffer device!");
+  sourceValid = SetupSource(var);
+  if (!sourceValid) FATAL_ERROR("Cannot capture FBDEV_CAPTURE_DEVICE!");
+  *displayWidth = var.xres;
+  *displayHeight = var.yres;
+  printf("Capturing framebuffer device %s: %ux%u visible of %ux%u, %u bits per pixel\n", FBDEV_CAPTURE_DEVICE, var.xres, var.yres, var.xres_virtual, var.yres_virtual, var.bits_per_pixel);
+}
+
+void DeinitFbdevCapture()
+{
+  if (fbMemory)
+  {
+    munmap(fbMemory, fbMemorySize);
+    fbMemory = 0;
+    fbMemorySize = 0;
+  }
+  if (fbFd >= 0)
+  {
+    close(fbFd);
+    fbFd = -1;
+  }
+}
+
+void WaitForFbdevVsync()
+{
+  if (!vsyncSupported) return;
+  uint32_t crtc = 0;
+  if (ioctl(fbFd, FBIO_WAITFORVSYNC, &crtc) < 0 && errno != EINTR)
+  {
+    printf("%s does not support FBIO_WAITFORVSYNC (%s), polling for new frames instead\n", FBDEV_CAPTURE_DEVICE, strerror(errno));
+    vsyncSupported = false;
+  }
+}
+
+bool SnapshotFbdevFramebuffer(uint16_t *destination)
+{
+  // The visible area is asked for on each capture, since applications that double buffer pan it between two halves of the virtual framebuffer
+  fb_var_screeninfo var;
+  if (ioctl(fbFd, FBIOGET_VSCREENINFO, &var) < 0) return false;
+  if (var.bits_per_pixel != sourceVar.bits_per_pixel || var.xres_virtual != sourceVar.xres_virtual || var.yres_virtual != sourceVar.yres_virtual
+    || var.red.offset != sourceVar.red.offset || var.green.offset != sourceVar.green.offset)
+    sourceValid = SetupSource(var); // The mode was changed, e.g. with fbset
+  if (!sourceValid) return false;
+
+  // Compare the framebuffer in place, so that nothing is copied if it has not changed
+  if (!CaptureSourceChanged(source, var.xoffset, var.yoffset)) return false;
+  return SampleCaptureSource(source, var.xoffset, var.yoffset, destination);
+}
+
+#endif
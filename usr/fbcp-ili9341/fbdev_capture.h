@@ -0,0 +1,24 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef CAPTURE_FROM_FBDEV
+// Captures frames from a Linux framebuffer device (FBDEV_CAPTURE_DEVICE), e.g. one that an application renders to directly without a compositor,
+// or vfb for testing. The framebuffer memory is mapped, and compared in place against what was captured before, so polling a framebuffer that has
+// not changed copies nothing. 16bpp (RGB565/BGR565) and 32bpp (XRGB8888/XBGR8888) framebuffers are supported.
+
+// Opens and maps the framebuffer device, and returns the size of its visible area.
+void InitFbdevCapture(int *displayWidth, int *displayHeight);
+
+void DeinitFbdevCapture(void);
+
+// Blocks until the next vsync of the framebuffer device, if its driver supports FBIO_WAITFORVSYNC. Otherwise returns right away, and the captures
+// are only paced by the frame arrival time predictions.
+void WaitForFbdevVsync(void);
+
+// Samples the capture rectangle (see SetCaptureRectangle()) of the visible area of the framebuffer into destination. Returns false if the sampled
+// pixels of the framebuffer have not changed since the last capture, or nothing could be captured.
+bool SnapshotFbdevFramebuffer(uint16_t *destination);
+#endif
@@ -0,0 +1,49 @@
+#include <stdio.h> // fprintf
+#include <stdlib.h> // exit
+#include <string.h> // memset
+#include <syslog.h> // syslog
+
+#include "config.h"
+#include "frame_pool.h"
+#include "gpu.h"
+#include "util.h"
+#include "mem_alloc.h"
+
+static Frame frames[FRAME_POOL_SIZE] = {};
+
+void InitFramePool()
+{
+  for(int i = 0; i < FRAME_POOL_SIZE; ++i)
+  {
+    // BUG in vc_dispmanx_resource_read_data(!!): The destination pointer passed to it is adjusted to point before the captured subrectangle (see
+    // SnapshotFramebuffer()), so allocate double the needed size and place the pixels in the second half, for that pointer to stay within the allocation.
+    uint16_t *pixels = (uint16_t *)Malloc(gpuFramebufferSizeBytes*2, "InitFramePool() frame");
+    memset(pixels, 0, gpuFramebufferSizeBytes*2);
+    frames[i].pixels = pixels + (gpuFramebufferSizeBytes>>1);
+#ifdef USE_SCANLINE_HASHES
+    frames[i].scanlineHashes = (uint32_t *)Malloc(gpuFrameHeight*sizeof(uint32_t), "InitFramePool() scanline hashes");
+    ComputeScanlineHashes(frames[i].pixels, frames[i].scanlineHashes);
+#endif
+    frames[i].refCount = 0;
+  }
+}
+
+Frame *AcquireFreeFrame()
+{
+  // The GPU polling thread and the main thread may both be looking for a free frame, so claim it atomically.
+  for(int i = 0; i < FRAME_POOL_SIZE; ++i)
+    if (__sync_bool_compare_and_swap(&frames[i].refCount, 0, 1))
+      return &frames[i];
+  return 0;
+}
+
+void AddFrameRef(Frame *frame)
+{
+  __atomic_fetch_add(&frame->refCount, 1, __ATOMIC_SEQ_CST);
+}
+
+void ReleaseFrame(Frame *frame)
+{
+  int refCount = __atomic_sub_fetch(&frame->refCount, 1, __ATOMIC_SEQ_CST);
+  if (refCount < 0) FATAL_ERROR("ReleaseFrame() called on a frame that was not referenced!");
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+#include "display.h"
+
+// Captured frames are handed between the GPU polling thread and the main thread, and between the roles of the current and the previous framebuffer
+// on the main thread, by passing references to them instead of copying their pixels. A frame is only captured to when nothing references it.
+// The pool holds enough frames for a frame being captured, a captured frame waiting to be taken by the main thread, and the current and the
+// previous framebuffer of the main thread.
+#ifdef LATE_LATCH_PIXEL_TASKS
+// Queued pixel tasks also reference the frames to fetch their pixels from, so leave room for a few frames worth of them. If they run out, capturing
+// waits for the SPI thread to free some up.
+#define FRAME_POOL_MAIN_SIZE 8
+#else
+#define FRAME_POOL_MAIN_SIZE 4
+#endif
+
+#ifdef USE_PRESENTATION_SCHEDULER
+// The presentation stage holds more captured frames waiting to be taken by the main thread
+#define FRAME_POOL_SIZE (FRAME_POOL_MAIN_SIZE + PRESENTATION_JITTER_BUFFER_FRAMES)
+#else
+#define FRAME_POOL_SIZE FRAME_POOL_MAIN_SIZE
+#endif
+
+struct Frame
+{
+  uint16_t *pixels; // gpuFramebufferSizeBytes of pixels, laid out like the frames captured from the GPU
+#ifdef USE_SCANLINE_HASHES
+  uint32_t *scanlineHashes; // Hashes of the scanlines of the captured pixels, computed by the thread that captured them
+#endif
+  volatile int refCount;
+};
+
+// Allocates the frames of the pool, with all their pixels zeroed. Call after the size of the GPU frames is known.
+void InitFramePool(void);
+
+// Returns a frame that nothing references, with a single reference to it held by the caller, or null if all frames are in use.
+Frame *AcquireFreeFrame(void);
+
+void AddFrameRef(Frame *frame);
+
+// Drops a reference to the frame. When the last reference is dropped, the frame becomes free to be captured to again.
+void ReleaseFrame(Frame *frame);
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <string.h> // memcmp, memcpy, memset
+#include <syslog.h> // syslog, LOG_ERR
+
+#include "config.h"
+#include "frame_trace.h"
+#include "gpu.h"
+#include "tick.h"
+#include "mem_alloc.h"
+
+bool OpenFrameTraceWriter(FrameTraceWriter &writer, const char *filename, int width, int height)
+{
+  memset(&writer, 0, sizeof(writer));
+  writer.file = fopen(filename, "wb");
+  if (!writer.file) return false;
+  writer.width = width;
+  writer.height = height;
+  FrameTraceHeader header = { FRAME_TRACE_MAGIC, FRAME_TRACE_VERSION, (uint32_t)width, (uint32_t)height };
+  fwrite(&header, sizeof(header), 1, writer.file);
+
+  writer.prevFrame = (uint16_t*)Malloc(width*height*sizeof(uint16_t), "FrameTraceWriter::prevFrame");
+  writer.prevHashes = (uint32_t*)Malloc(height*sizeof(uint32_t), "FrameTraceWriter::prevHashes");
+  writer.hashes = (uint32_t*)Malloc(height*sizeof(uint32_t), "FrameTraceWriter::hashes");
+  writer.hashTableSize = 1;
+  while(writer.hashTableSize < 2*height) writer.hashTableSize <<= 1;
+  writer.hashTable = (int16_t*)Malloc(writer.hashTableSize*sizeof(int16_t), "FrameTraceWriter::hashTable");
+  return true;
+}
+
+// Returns the scanline of the previously written frame that is equal to the given scanline, or -1 if there is none.
+static int FindEqualPrevScanline(const FrameTraceWriter &writer, const uint16_t *scanline, uint32_t hash, int y)
+{
+  if (writer.numFrames == 0) return -1;
+  const size_t scanlineBytes = writer.width*sizeof(uint16_t);
+  // Most scanlines are unchanged, so try the same scanline first before looking for a moved one
+  if (writer.prevHashes[y] == hash && !memcmp(writer.prevFrame + y*writer.width, scanline, scanlineBytes)) return y;
+  for(int slot = hash & (writer.hashTableSize-1); writer.hashTable[slot] >= 0; slot = (slot + 1) & (writer.hashTableSize-1))
+  {
+    int prevY = writer.hashTable[slot];
+    if (writer.prevHashes[prevY] == hash && !memcmp(writer.prevFrame + prevY*writer.width, scanline, scanlineBytes)) return prevY;
+  }
+  return -1;
+}
+
+void WriteFrameTraceFrame(FrameTraceWriter &writer, const uint16_t *framebuffer, int strideBytes, uint32_t usecsSincePrevFrame)
+{
+  fwrite(&usecsSincePrevFrame, sizeof(usecsSincePrevFrame), 1, writer.file);
+  // All scanlines refer to the previous frame, so build the lookup table for it before overwriting it
+  memset(writer.hashTable, 0xFF, writer.hashTableSize*sizeof(int16_t));
+  for(int y = 0; y < writer.height && writer.numFrames > 0; ++y)
+  {
+    int slot = writer.prevHashes[y] & (writer.hashTableSize-1);
+    while(writer.hashTable[slot] >= 0) slot = (slot + 1) & (writer.hashTableSize-1);
+    writer.hashTable[slot] = y;
+  }
+
+  for(int y = 0; y < writer.height; ++y)
+  {
+    const uint16_t *scanline = framebuffer + y*(strideBytes>>1);
+    writer.hashes[y] = HashScanline(scanline, writer.width);
+    int prevY = FindEqualPrevScanline(writer, scanline, writer.hashes[y], y);
+    uint16_t ref = (prevY >= 0) ? (uint16_t)prevY : FRAME_TRACE_NEW_SCANLINE;
+    fwrite(&ref, sizeof(ref), 1, writer.file);
+    if (prevY < 0) fwrite(scanline, sizeof(uint16_t), writer.width, writer.file);
+  }
+
+  for(int y = 0; y < writer.height; ++y)
+    memcpy(writer.prevFrame + y*writer.width, framebuffer + y*(strideBytes>>1), writer.width*sizeof(uint16_t));
+  uint32_t *prevHashes = writer.prevHashes;
+  writer.prevHashes = writer.hashes;
+  writer.hashes = prevHashes;
+  ++writer.numFrames;
+}
+
+void CloseFrameTraceWriter(FrameTraceWriter &writer)
+{
+  if (!writer.file) return;
+  fclose(writer.file);
+  writer.file = 0;
+  Free(writer.prevFrame, writer.width*writer.height*sizeof(uint16_t));
+  Free(writer.prevHashes, writer.height*sizeof(uint32_t));
+  Free(writer.hashes, writer.height*sizeof(uint32_t));
+  Free(writer.hashTable, writer.hashTableSize*sizeof(int16_t));
+}
+
+#ifdef RECORD_FRAME_TRACE
+
+static FrameTraceWriter frameTrace = {};
+static bool frameTraceDone = false;
+static uint64_t prevRecordedFrameTime = 0;
+
+void RecordFrameTrace(const uint16_t *framebuffer)
+{
+  if (frameTraceDone) return;
+  if (!frameTrace.file)
+  {
+    if (!OpenFrameTraceWriter(frameTrace, RECORD_FRAME_TRACE, gpuFrameWidth, gpuFrameHeight))
+    {
+      syslog(LOG_ERR, "Failed to create frame trace file " RECORD_FRAME_TRACE "\n");
+      printf("Failed to create frame trace file " RECORD_FRAME_TRACE "\n");
+      frameTraceDone = true;
+      return;
+    }
+    printf("Recording %d frames to frame trace file " RECORD_FRAME_TRACE "\n", RECORD_FRAME_TRACE_MAX_FRAMES);
+  }
+
+  uint64_t now = tick();
+  WriteFrameTraceFrame(frameTrace, framebuffer, gpuFramebufferScanlineStrideBytes, prevRecordedFrameTime ? (uint32_t)(now - prevRecordedFrameTime) : 0);
+  prevRecordedFrameTime = now;
+
+  if (frameTrace.numFrames >= RECORD_FRAME_TRACE_MAX_FRAMES)
+  {
+    CloseFrameTraceWriter(frameTrace);
+    printf("Finished recording frame trace file " RECORD_FRAME_TRACE "\n");
+    frameTraceDone = true;
+  }
+}
+
+void DeinitFrameTrace()
+{
+  CloseFrameTraceWriter(frameTrace);
+}
+
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "config.h"
+
+// A frame trace is a recording of the frames that the differs were given, for replaying them off the device with the tools in host/. The file is a
+// FrameTraceHeader followed by the frames, each of which is:
+//  - a uint32_t of microseconds since the previous frame,
+//  - then for each scanline a uint16_t, which is FRAME_TRACE_NEW_SCANLINE if width uint16_t pixels of the scanline follow, or else the index of the
+//    scanline of the previous frame that this scanline is equal to. Unchanged and scrolled scanlines therefore take two bytes each.
+// All fields are in the native byte order of the machine that wrote the trace.
+#define FRAME_TRACE_MAGIC 0x52544246 // "FBTR"
+#define FRAME_TRACE_VERSION 1
+#define FRAME_TRACE_NEW_SCANLINE 0xFFFF
+
+struct FrameTraceHeader
+{
+  uint32_t magic; // FRAME_TRACE_MAGIC
+  uint32_t version; // FRAME_TRACE_VERSION
+  uint32_t width, height;
+};
+
+struct FrameTraceWriter
+{
+  FILE *file;
+  int width, height;
+  int numFrames;
+  uint16_t *prevFrame; // The previously written frame, width*height pixels
+  uint32_t *prevHashes; // Hashes of the scanlines of prevFrame
+  uint32_t *hashes; // Hashes of the scanlines of the frame being written
+  int16_t *hashTable; // Open addressed table from the hashes of prevFrame to its scanlines, -1 for empty slots
+  int hashTableSize;
+};
+
+// Creates the given trace file and writes its header. Returns false if the file could not be created.
+bool OpenFrameTraceWriter(FrameTraceWriter &writer, const char *filename, int width, int height);
+
+// Appends a frame of writer.width x writer.height pixels, stored with the given stride, to the trace.
+void WriteFrameTraceFrame(FrameTraceWriter &writer, const uint16_t *framebuffer, int strideBytes, uint32_t usecsSincePrevFrame);
+
+void CloseFrameTraceWriter(FrameTraceWriter &writer);
+
+#ifdef RECORD_FRAME_TRACE
+// Appends the given frame to the RECORD_FRAME_TRACE file, until RECORD_FRAME_TRACE_MAX_FRAMES frames have been recorded.
+void RecordFrameTrace(const uint16_t *framebuffer);
+
+// Finishes writing the trace file, if one is being recorded.
+void DeinitFrameTrace(void);
+#endif
@@ -5,6 +5,7 @@
 #include <syslog.h> // syslog, LOG_ERR
 #include <stdio.h> // fprintf
 #include <math.h> // floor
+#include <string.h> // memcpy, memcmp
 
 #include "config.h"
 #include "gpu.h"
@@ -13,6 +14,13 @@
 #include "util.h"
 #include "statistics.h"
 #include "mem_alloc.h"
+#include "frame_pool.h"
+#include "presentation.h"
+#include "drm_capture.h"
+#include "fbdev_capture.h"
+#include "x11_capture.h"
+#include "producer_capture.h"
+#include "capture_sampler.h"
 
 bool MarkProgramQuitting(void);
 
@@ -24,15 +32,25 @@ bool MarkProgramQuitting(void);
 
 #define RANDOM_TEST_PATTERN_FRAME_RATE 120
 
+#ifdef CAPTURE_FROM_DISPMANX
 DISPMANX_DISPLAY_HANDLE_T display;
 DISPMANX_RESOURCE_HANDLE_T screen_resource;
 VC_RECT_T rect;
+#endif
 
 int frameTimeHistorySize = 0;
 
 FrameHistory frameTimeHistory[FRAME_HISTORY_MAX_SIZE] = {};
 
-uint16_t *videoCoreFramebuffer[2] = {};
+#ifndef USE_GPU_VSYNC
+static Frame *newestGpuFrame = 0; // The most recent new frame captured by the GPU polling thread that the main thread has not yet taken
+#ifdef USE_SCANLINE_HASHES
+static uint32_t *publishedScanlineHashes = 0; // Hashes of the scanlines of the most recent new frame, to tell if a snapshot is a new frame
+#else
+static uint16_t *publishedFramebuffer = 0; // Copy of the most recent new frame, to tell if a snapshot is a new frame. The main thread draws
+                                           // the overlays on the frames it takes, so this cannot be compared against the frame itself.
+#endif
+#endif
 volatile int numNewGpuFrames = 0;
 
 int displayXOffset = 0;
@@ -47,6 +65,9 @@ int excessPixelsRight = 0;
 int excessPixelsTop = 0;
 int excessPixelsBottom = 0;
 
+int gpuDisplayWidth = 0;
+int gpuDisplayHeight = 0;
+
 // If one first runs content that updates at e.g. 24fps, a video perhaps, the frame rate histogram will lock to that update
 // rate and frame snapshots are done at 24fps. Later when user quits watching the video, and returns to e.g. 60fps updated
 // launcher menu, there needs to be some mechanism that detects that update rate has now increased, and synchronizes to the
@@ -113,6 +134,14 @@ bool SnapshotFramebuffer(uint16_t *destination)
     newfb += gpuFramebufferScanlineStrideBytes>>2;
   }
   barY = (barY + 1) % gpuFrameHeight;
+#elif defined(CAPTURE_FROM_DRM)
+  if (!SnapshotDrmFramebuffer(destination)) return false;
+#elif defined(CAPTURE_FROM_FBDEV)
+  if (!SnapshotFbdevFramebuffer(destination)) return false;
+#elif defined(CAPTURE_FROM_X11)
+  if (!SnapshotX11Framebuffer(destination)) return false;
+#elif defined(CAPTURE_FROM_PRODUCER)
+  if (!SnapshotProducerFramebuffer(destination)) return false;
 #else
   // Grab a new frame from the GPU. TODO: Figure out a way to get a frame callback for each GPU-rendered frame,
   // that would be vastly superior for lower latency, reduced stuttering and lighter processing overhead.
@@ -130,8 +159,8 @@ bool SnapshotFramebuffer(uint16_t *destination)
   }
   // BUG in vc_dispmanx_resource_read_data(!!): If one is capturing a small subrectangle of a large screen resource rectangle, the destination pointer 
   // is in vc_dispmanx_resource_read_data() incorrectly still taken to point to the top-left corner of the large screen resource, instead of the top-left
-  // corner of the subrectangle to capture. Therefore do dirty pointer arithmetic to adjust for this. To make this safe, videoCoreFramebuffer is allocated
-  // double its needed size so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
+  // corner of the subrectangle to capture. Therefore do dirty pointer arithmetic to adjust for this. To make this safe, the frames of the frame pool are allocated
+  // double their needed size so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
   // to randomly fail and then subsequently hang if called a second time)
 #ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
   static uint16_t *tempTransposeBuffer = 0; // Allocate as static here to keep the number of #ifdefs down a bit
@@ -168,6 +197,15 @@ bool SnapshotFramebuffer(uint16_t *destination)
   return true;
 }
 
+#ifdef USE_SCANLINE_HASHES
+bool SnapshotFramebufferAndHashes(uint16_t *destination, uint32_t *scanlineHashes)
+{
+  if (!SnapshotFramebuffer(destination)) return false;
+  ComputeScanlineHashes(destination, scanlineHashes);
+  return true;
+}
+#endif
+
 #ifdef USE_GPU_VSYNC
 
 void VsyncCallback(DISPMANX_UPDATE_HANDLE_T u, void *arg)
@@ -186,11 +224,47 @@ void VsyncCallback(DISPMANX_UPDATE_HANDLE_T u, void *arg)
 
 extern volatile bool programRunning;
 
+Frame *TakeNewestGpuFrame()
+{
+  return __atomic_exchange_n(&newestGpuFrame, (Frame*)0, __ATOMIC_SEQ_CST);
+}
+
 void *gpu_polling_thread(void*)
 {
+  Frame *captureFrame = 0;
   uint64_t lastNewFrameReceivedTime = tick();
+#ifdef USE_SCANLINE_HASHES
+  uint64_t lastFramePublishedTime = lastNewFrameReceivedTime;
+#endif
   while(programRunning)
   {
+#ifdef CAPTURE_FROM_DRM
+    // Instead of sleeping until the predicted time and polling, block until the vblank that the next frame is predicted to be flipped to the screen at
+    uint64_t captureTime = tick();
+#ifdef SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
+    captureTime = MAX(captureTime, lastNewFrameReceivedTime + 1000000/TARGET_FRAME_RATE);
+#endif
+#if defined(SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES) || defined(SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE)
+    captureTime = MAX(captureTime, PredictNextFrameArrivalTime());
+#endif
+    WaitForDrmVblank(captureTime);
+#elif defined(CAPTURE_FROM_X11)
+    // Instead of polling, sleep until the X server reports damage. The content is not flipped to the screen on any schedule, so the frame arrival
+    // time predictions would only delay the capture.
+    uint64_t captureTime = 0;
+#ifdef SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
+    captureTime = lastNewFrameReceivedTime + 1000000/TARGET_FRAME_RATE;
+#endif
+    WaitForX11Damage(captureTime);
+#elif defined(CAPTURE_FROM_PRODUCER)
+    // Instead of polling, sleep on the doorbell until the producer hands over a finished frame
+    uint64_t captureTime = 0;
+#ifdef SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
+    captureTime = lastNewFrameReceivedTime + 1000000/TARGET_FRAME_RATE;
+#endif
+    WaitForProducerFrame(captureTime);
+#else
+
 #ifdef SAVE_BATTERY_BY_SLEEPING_UNTIL_TARGET_FRAME
     const int64_t earlyFramePrediction = 500;
     uint64_t earliestNextFrameArrivaltime = lastNewFrameReceivedTime + 1000000/TARGET_FRAME_RATE - earlyFramePrediction;
@@ -207,11 +281,41 @@ void *gpu_polling_thread(void*)
       usleep(timeToSleep - minimumSleepTime);
 #endif
 
+#ifdef CAPTURE_FROM_FBDEV
+    // Capture right after a vsync, when an application that pans between two buffers has switched to its new frame
+    WaitForFbdevVsync();
+#endif
+
+#endif // ~CAPTURE_FROM_DRM || CAPTURE_FROM_X11 || CAPTURE_FROM_PRODUCER
+
+    // Snapshot to a frame that nobody references. The pool has room for one, except momentarily while the main thread is swapping in a new frame.
+    if (!captureFrame)
+    {
+      captureFrame = AcquireFreeFrame();
+      if (!captureFrame)
+      {
+        usleep(100);
+        continue;
+      }
+    }
+
     uint64_t t0 = tick();
 
-    bool gotNewFramebuffer = SnapshotFramebuffer(videoCoreFramebuffer[0]);
+    bool publishToVerifyHashes = false;
     // Check the pixel contents of the snapshot to see if we actually received a new frame to render
-    gotNewFramebuffer = gotNewFramebuffer && IsNewFramebuffer(videoCoreFramebuffer[0], videoCoreFramebuffer[1]);
+#ifdef USE_SCANLINE_HASHES
+    // Hash the snapshot while it is fresh, so that neither this check nor the main thread needs to read through the previous frame to find what changed.
+    bool gotNewFramebuffer = SnapshotFramebufferAndHashes(captureFrame->pixels, captureFrame->scanlineHashes);
+    if (gotNewFramebuffer)
+    {
+      gotNewFramebuffer = ScanlineHashesDiffer(captureFrame->scanlineHashes, publishedScanlineHashes);
+      // A scanline that changed to a colliding hash would stay wrong on the display for as long as the screen stays static, so publish an unchanged
+      // snapshot every now and then anyway, for the main thread to compare its pixels (see VerifyScanlineHashes()).
+      publishToVerifyHashes = !gotNewFramebuffer && t0 - lastFramePublishedTime >= SCANLINE_HASH_VERIFY_USECS;
+    }
+#else
+    bool gotNewFramebuffer = SnapshotFramebuffer(captureFrame->pixels) && IsNewFramebuffer(captureFrame->pixels, publishedFramebuffer);
+#endif
     if (gotNewFramebuffer)
     {
       lastNewFrameReceivedTime = t0;
@@ -219,7 +323,7 @@ void *gpu_polling_thread(void*)
     }
 
     uint64_t t1 = tick();
-    if (!gotNewFramebuffer)
+    if (!gotNewFramebuffer && !publishToVerifyHashes)
     {
 #ifdef STATISTICS
       __atomic_fetch_add(&timeWastedPollingGPU, t1-t0, __ATOMIC_RELAXED);
@@ -233,8 +337,25 @@ void *gpu_polling_thread(void*)
     {
       // We got a new framebuffer, so linearly increase the driving rate to snapshot next framebuffer a bit earlier, in case
       // our update rate is too slow for the content.
-      ++eagerFastTrackToSnapshottingFramesEarlierFactor;
-      memcpy(videoCoreFramebuffer[1], videoCoreFramebuffer[0], gpuFramebufferSizeBytes);
+      if (gotNewFramebuffer) ++eagerFastTrackToSnapshottingFramesEarlierFactor;
+#ifdef USE_SCANLINE_HASHES
+      lastFramePublishedTime = t0;
+      memcpy(publishedScanlineHashes, captureFrame->scanlineHashes, gpuFrameHeight*sizeof(uint32_t));
+#ifdef STATISTICS
+      __atomic_fetch_add(&statsFrameCopyBytesSaved, gpuFramebufferSizeBytes, __ATOMIC_RELAXED); // Publishing used to copy the frame to a second buffer
+#endif
+#else
+      memcpy(publishedFramebuffer, captureFrame->pixels, gpuFramebufferSizeBytes);
+#endif
+#ifdef USE_PRESENTATION_SCHEDULER
+      // Queue the captured frame for the main thread to take when it is due to be presented. If the jitter buffer is full, its oldest frame is dropped.
+      QueueFrameForPresentation(captureFrame, t0);
+#else
+      // Hand the reference to the captured frame over to the main thread. If it did not take the previously published frame yet, that frame is dropped.
+      Frame *droppedFrame = __atomic_exchange_n(&newestGpuFrame, captureFrame, __ATOMIC_SEQ_CST);
+      if (droppedFrame) ReleaseFrame(droppedFrame);
+#endif
+      captureFrame = 0;
       __atomic_fetch_add(&numNewGpuFrames, 1, __ATOMIC_SEQ_CST);
       syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAKE, 1, 0, 0, 0); // Wake the main thread if it was sleeping to get a new frame
     }
@@ -338,12 +459,25 @@ uint64_t PredictNextFrameArrivalTime()
 void InitGPU()
 {
   // Initialize GPU frame grabbing subsystem
+#ifdef CAPTURE_FROM_MAPPED_FRAMEBUFFER
+  struct { int32_t width, height; } display_info;
+#if defined(CAPTURE_FROM_DRM)
+  InitDrmCapture(&display_info.width, &display_info.height);
+#elif defined(CAPTURE_FROM_FBDEV)
+  InitFbdevCapture(&display_info.width, &display_info.height);
+#elif defined(CAPTURE_FROM_X11)
+  InitX11Capture(&display_info.width, &display_info.height);
+#elif defined(CAPTURE_FROM_PRODUCER)
+  InitProducerCapture(&display_info.width, &display_info.height);
+#endif
+#else
   bcm_host_init();
   display = vc_dispmanx_display_open(0);
   if (!display) FATAL_ERROR("vc_dispmanx_display_open failed! Make sure to have hdmi_force_hotplug=1 setting in /boot/config.txt");
   DISPMANX_MODEINFO_T display_info;
   int ret = vc_dispmanx_display_get_info(display, &display_info);
   if (ret) FATAL_ERROR("vc_dispmanx_display_get_info failed!");
+#endif
 
 #ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
   // Pretend that the display framebuffer would be in portrait mode for the purposes of size computation etc.
@@ -351,6 +485,9 @@ void InitGPU()
   SWAPU32(display_info.width, display_info.height);
   printf("DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE: Swapping width/height to update display in portrait mode to minimize tearing.\n");
 #endif
+  gpuDisplayWidth = display_info.width;
+  gpuDisplayHeight = display_info.height;
+
   // We may need to scale the main framebuffer to fit the native pixel size of the display. Always want to do such scaling in aspect ratio fixed mode to not stretch the image.
   // (For non-square pixels or similar, could apply a correction factor here to fix aspect ratio)
 
@@ -389,18 +526,38 @@ void InitGPU()
   double overscanTop = 0.00;
   double overscanBottom = 0.00;
 
+#ifdef CAPTURE_SOURCE_RECTANGLE
+  // Crop away everything outside the source rectangle as overscan
+  int sourceRectangle[4] = { CAPTURE_SOURCE_RECTANGLE };
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  SWAPU32(sourceRectangle[0], sourceRectangle[1]);
+  SWAPU32(sourceRectangle[2], sourceRectangle[3]);
+#endif
+  if (sourceRectangle[0] < 0 || sourceRectangle[1] < 0 || sourceRectangle[2] <= 0 || sourceRectangle[3] <= 0
+    || sourceRectangle[0] + sourceRectangle[2] > display_info.width || sourceRectangle[1] + sourceRectangle[3] > display_info.height)
+    FATAL_ERROR("CAPTURE_SOURCE_RECTANGLE does not fit in the source display!");
+  overscanLeft = (double)sourceRectangle[0] / display_info.width;
+  overscanRight = (double)(display_info.width - sourceRectangle[0] - sourceRectangle[2]) / display_info.width;
+  overscanTop = (double)sourceRectangle[1] / display_info.height;
+  overscanBottom = (double)(display_info.height - sourceRectangle[1] - sourceRectangle[3]) / display_info.height;
+#endif
+
   // If specified, computes overscan that crops away equally much content from all sides of the source frame
   // to display the center of the source frame pixel perfect.
 #ifdef DISPLAY_CROPPED_INSTEAD_OF_SCALING
-  if (DISPLAY_DRAWABLE_WIDTH < display_info.width)
+  const double uncroppedWidth = display_info.width * (1.0 - overscanLeft - overscanRight);
+  const double uncroppedHeight = display_info.height * (1.0 - overscanTop - overscanBottom);
+  if (DISPLAY_DRAWABLE_WIDTH < uncroppedWidth)
   {
-    overscanLeft = (display_info.width - DISPLAY_DRAWABLE_WIDTH) * 0.5 / display_info.width;
-    overscanRight = overscanLeft;
+    const double crop = (uncroppedWidth - DISPLAY_DRAWABLE_WIDTH) * 0.5 / display_info.width;
+    overscanLeft += crop;
+    overscanRight += crop;
   }
-  if (DISPLAY_DRAWABLE_HEIGHT < display_info.height)
+  if (DISPLAY_DRAWABLE_HEIGHT < uncroppedHeight)
   {
-    overscanTop = (display_info.height - DISPLAY_DRAWABLE_HEIGHT) * 0.5 / display_info.height;
-    overscanBottom = overscanTop;
+    const double crop = (uncroppedHeight - DISPLAY_DRAWABLE_HEIGHT) * 0.5 / display_info.height;
+    overscanTop += crop;
+    overscanBottom += crop;
   }
 #endif
 
@@ -443,21 +600,26 @@ void InitGPU()
   gpuFramebufferScanlineStrideBytes = RoundUpToMultipleOf((gpuFrameWidth + excessPixelsLeft + excessPixelsRight) * 2, 32);
   gpuFramebufferSizeBytes = gpuFramebufferScanlineStrideBytes * (gpuFrameHeight + excessPixelsTop + excessPixelsBottom);
 
-  // BUG in vc_dispmanx_resource_read_data(!!): If one is capturing a small subrectangle of a large screen resource rectangle, the destination pointer 
-  // is in vc_dispmanx_resource_read_data() incorrectly still taken to point to the top-left corner of the large screen resource, instead of the top-left
-  // corner of the subrectangle to capture. Therefore do dirty pointer arithmetic to adjust for this. To make this safe, videoCoreFramebuffer is allocated
-  // double its needed size so that this adjusted pointer does not reference outside allocated memory (if it did, vc_dispmanx_resource_read_data() was seen
-  // to randomly fail and then subsequently hang if called a second time)
-  videoCoreFramebuffer[0] = (uint16_t *)Malloc(gpuFramebufferSizeBytes*2, "gpu.cpp framebuffer0");
-  videoCoreFramebuffer[1] = (uint16_t *)Malloc(gpuFramebufferSizeBytes*2, "gpu.cpp framebuffer1");
-  memset(videoCoreFramebuffer[0], 0, gpuFramebufferSizeBytes*2);
-  memset(videoCoreFramebuffer[1], 0, gpuFramebufferSizeBytes*2);
-  videoCoreFramebuffer[0] += (gpuFramebufferSizeBytes>>1);
-  videoCoreFramebuffer[1] += (gpuFramebufferSizeBytes>>1);
+  InitFramePool();
+#ifndef USE_GPU_VSYNC
+  // Until the first frame is captured, the display shows the zeroed frames of the pool
+#ifdef USE_SCANLINE_HASHES
+  publishedScanlineHashes = (uint32_t *)Malloc(gpuFrameHeight*sizeof(uint32_t), "gpu.cpp published scanline hashes");
+  Frame *blankFrame = AcquireFreeFrame();
+  memcpy(publishedScanlineHashes, blankFrame->scanlineHashes, gpuFrameHeight*sizeof(uint32_t));
+  ReleaseFrame(blankFrame);
+#else
+  publishedFramebuffer = (uint16_t *)Malloc(gpuFramebufferSizeBytes, "gpu.cpp published framebuffer");
+  memset(publishedFramebuffer, 0, gpuFramebufferSizeBytes);
+#endif
+#endif
 
   syslog(LOG_INFO, "GPU display is %dx%d. SPI display is %dx%d with drawable area of %dx%d. Applying scaling factor horiz=%.2fx & vert=%.2fx, xOffset: %d, yOffset: %d, scaledWidth: %d, scaledHeight: %d", display_info.width, display_info.height, DISPLAY_WIDTH, DISPLAY_HEIGHT, DISPLAY_DRAWABLE_WIDTH, DISPLAY_DRAWABLE_HEIGHT, scalingFactorWidth, scalingFactorHeight, displayXOffset, displayYOffset, scaledWidth, scaledHeight);
   printf("Source GPU display is %dx%d. Output SPI display is %dx%d with a drawable area of %dx%d. Applying scaling factor horiz=%.2fx & vert=%.2fx, xOffset: %d, yOffset: %d, scaledWidth: %d, scaledHeight: %d\n", display_info.width, display_info.height, DISPLAY_WIDTH, DISPLAY_HEIGHT, DISPLAY_DRAWABLE_WIDTH, DISPLAY_DRAWABLE_HEIGHT, scalingFactorWidth, scalingFactorHeight, displayXOffset, displayYOffset, scaledWidth, scaledHeight);
 
+#ifdef CAPTURE_FROM_MAPPED_FRAMEBUFFER
+  SetCaptureRectangle(ROUND_TO_NEAREST_INT(display_info.width * overscanLeft), ROUND_TO_NEAREST_INT(display_info.height * overscanTop), relevantDisplayWidth, relevantDisplayHeight);
+#else
   uint32_t image_prt;
   printf("Creating dispmanX resource of size %dx%d (aspect ratio=%f).\n", scaledWidth + excessPixelsLeft + excessPixelsRight, scaledHeight + excessPixelsTop + excessPixelsBottom, (double)(scaledWidth + excessPixelsLeft + excessPixelsRight) / (scaledHeight + excessPixelsTop + excessPixelsBottom));
 #ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
@@ -469,6 +631,7 @@ void InitGPU()
 #endif
   if (!screen_resource) FATAL_ERROR("vc_dispmanx_resource_create failed!");
   printf("GPU grab rectangle is offset x=%d,y=%d, size w=%dxh=%d, aspect ratio=%f\n", excessPixelsLeft, excessPixelsTop, scaledWidth, scaledHeight, (double)scaledWidth / scaledHeight);
+#endif
 
 #ifdef USE_GPU_VSYNC
   // Register to receive vsync notifications. This is a heuristic, since the application might not be locked at vsync, and even
@@ -494,6 +657,15 @@ void DeinitGPU()
   gpuPollingThread = (pthread_t)0;
 #endif
 
+#if defined(CAPTURE_FROM_DRM)
+  DeinitDrmCapture();
+#elif defined(CAPTURE_FROM_FBDEV)
+  DeinitFbdevCapture();
+#elif defined(CAPTURE_FROM_X11)
+  DeinitX11Capture();
+#elif defined(CAPTURE_FROM_PRODUCER)
+  DeinitProducerCapture();
+#else
   if (screen_resource)
   {
     vc_dispmanx_resource_delete(screen_resource);
@@ -507,4 +679,5 @@ void DeinitGPU()
   }
 
   bcm_host_deinit();
+#endif
 }
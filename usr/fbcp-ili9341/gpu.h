@@ -2,6 +2,12 @@
 
 #include <inttypes.h>
 
+#include "config.h"
+
+#if (defined(CAPTURE_FROM_DRM) + defined(CAPTURE_FROM_FBDEV) + defined(CAPTURE_FROM_X11) + defined(CAPTURE_FROM_PRODUCER)) > 1
+#error Only one of CAPTURE_FROM_DRM, CAPTURE_FROM_FBDEV, CAPTURE_FROM_X11 and CAPTURE_FROM_PRODUCER can be defined!
+#endif
+
 void InitGPU(void);
 void DeinitGPU(void);
 void AddHistogramSample(uint64_t t);
@@ -10,7 +16,26 @@ bool IsNewFramebuffer(uint16_t *possiblyNewFramebuffer, uint16_t *oldFramebuffer
 uint64_t EstimateFrameRateInterval(void);
 uint64_t PredictNextFrameArrivalTime(void);
 
-extern uint16_t *videoCoreFramebuffer[2];
+#ifndef USE_GPU_VSYNC
+struct Frame;
+// Returns the most recent new frame captured by the GPU polling thread, along with the reference to it, or null if it was already taken.
+Frame *TakeNewestGpuFrame(void);
+#endif
+
+// Hashes width 16-bit pixels, starting at a 4-byte aligned address.
+uint32_t HashScanline(const uint16_t *scanline, int width);
+
+#ifdef USE_SCANLINE_HASHES
+// Scanline hashes are computed when a frame is captured. Identical hashes are taken to mean identical scanlines, so only scanlines with
+// different hashes need to be compared pixel by pixel.
+void ComputeScanlineHashes(const uint16_t *framebuffer, uint32_t *scanlineHashes);
+// Recomputes the hashes of scanlines [startY, endY[ only, e.g. of the scanlines that an overlay was drawn on.
+void ComputeScanlineHashesInRange(const uint16_t *framebuffer, uint32_t *scanlineHashes, int startY, int endY);
+// Snapshots a frame like SnapshotFramebuffer(), and hashes it right away, while its pixels are still in the cache. The hashes are left
+// unchanged if there was no frame to snapshot.
+bool SnapshotFramebufferAndHashes(uint16_t *destination, uint32_t *scanlineHashes);
+bool ScanlineHashesDiffer(const uint32_t *scanlineHashes, const uint32_t *prevScanlineHashes);
+#endif
 extern volatile int numNewGpuFrames;
 extern int displayXOffset;
 extern int displayYOffset;
@@ -24,6 +49,10 @@ extern int excessPixelsRight;
 extern int excessPixelsTop;
 extern int excessPixelsBottom;
 
+// Size of the source (HDMI) display that frames are captured from, in the orientation of the captured frames
+extern int gpuDisplayWidth;
+extern int gpuDisplayHeight;
+
 #define FRAME_HISTORY_MAX_SIZE 240
 extern int frameTimeHistorySize;
 
@@ -0,0 +1,179 @@
+// fbcp-damage-hint-replay: replays frame traces with USE_DAMAGE_HINTS, as if the capture source reported the areas of each frame that changed from the
+// previous one. Each frame goes through the same steps as in the main loop: take the hinted tiles from DamageHintTilesToDiff(), compute the dirty
+// tiles over them, verify the hints, diff, and send the spans. After each frame, the tool checks whether the display would show any stale pixels,
+// and prints what fraction of the tiles had to be compared. Exits with 1 if the display showed stale pixels.
+//
+// -m n leaves out the hints of every n'th frame that has changes, like a producer that forgets to report some of its repaints. The changes are then
+// only caught by the verification sweep that compares a whole frame every DAMAGE_HINT_VERIFY_INTERVAL frames, so the display shows stale pixels for
+// a while. The tool then exits with 1 if some tile of the display stayed stale for longer than the verification interval.
+//
+// Usage: fbcp-damage-hint-replay [-m n] <trace> [<trace> ...]
+
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h> // memcpy, strcmp
+
+#include "config.h"
+#include "display.h"
+#include "diff.h"
+#include "gpu.h"
+#include "damage_hints.h"
+#include "util.h"
+#include "host_stubs.h"
+#include "frame_trace_reader.h"
+
+// Collects the bounding box of the changed pixels of each band of DIRTY_TILE_SIZE scanlines between two packed frames, as the capture source
+// would report them: in the coordinates of the source display, which the captured frames are transposed from with DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE.
+// Returns the number of rectangles written.
+static int ChangedRects(const uint16_t *frame, const uint16_t *prevFrame, DamageHintRect *rects)
+{
+  int numRects = 0;
+  for(int bandY = 0; bandY < gpuFrameHeight; bandY += DIRTY_TILE_SIZE)
+  {
+    const int bandEndY = MIN(bandY + DIRTY_TILE_SIZE, gpuFrameHeight);
+    int minX = gpuFrameWidth, endX = 0;
+    for(int y = bandY; y < bandEndY; ++y)
+      for(int x = 0; x < gpuFrameWidth; ++x)
+        if (frame[y*gpuFrameWidth + x] != prevFrame[y*gpuFrameWidth + x])
+        {
+          minX = MIN(minX, x);
+          endX = MAX(endX, x+1);
+        }
+    if (minX >= endX) continue;
+    DamageHintRect &r = rects[numRects++];
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+    r.x = bandY;
+    r.y = minX;
+    r.width = bandEndY - bandY;
+    r.height = endX - minX;
+#else
+    r.x = minX;
+    r.y = bandY;
+    r.width = endX - minX;
+    r.height = bandEndY - bandY;
+#endif
+  }
+  return numRects;
+}
+
+// Flags the tiles where the display shows something else than the frame, and updates for each tile the frame since which it has shown stale pixels
+// (-1 if it shows none). Returns the number of frames that the longest stale tile has been stale for, 0 if none is.
+static int UpdateStaleTiles(const uint16_t *framebuffer, const uint16_t *prevFramebuffer, uint8_t *staleTiles, int *staleSinceFrame, int frame)
+{
+  const int numTiles = numDirtyTilesX * numDirtyTilesY;
+  memset(staleTiles, 0, numTiles);
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    for(int x = 0; x < gpuFrameWidth; ++x)
+      if (framebuffer[y*stride + x] != prevFramebuffer[y*stride + x])
+        staleTiles[(y >> DIRTY_TILE_SIZE_LOG2)*numDirtyTilesX + (x >> DIRTY_TILE_SIZE_LOG2)] = 1;
+  int longestStale = 0;
+  for(int i = 0; i < numTiles; ++i)
+  {
+    if (!staleTiles[i]) staleSinceFrame[i] = -1;
+    else if (staleSinceFrame[i] < 0) staleSinceFrame[i] = frame;
+    if (staleSinceFrame[i] >= 0) longestStale = MAX(longestStale, frame - staleSinceFrame[i] + 1);
+  }
+  return longestStale;
+}
+
+int main(int argc, char **argv)
+{
+  int missEveryNthFrame = 0;
+  int firstTrace = 1;
+  if (argc > 2 && !strcmp(argv[1], "-m"))
+  {
+    missEveryNthFrame = atoi(argv[2]);
+    firstTrace = 3;
+  }
+  if (firstTrace >= argc || missEveryNthFrame < 0)
+  {
+    printf("Usage: %s [-m n] <trace> [<trace> ...]\n", argv[0]);
+    return 1;
+  }
+
+  bool failed = false;
+  for(int t = firstTrace; t < argc; ++t)
+  {
+    FrameTraceReader trace;
+    if (!OpenFrameTraceReader(trace, argv[t])) return 1;
+    InitHostFrameSize(trace.header.width, trace.header.height);
+    uint16_t *packedFrame = new uint16_t[gpuFrameWidth*gpuFrameHeight], *prevPackedFrame = new uint16_t[gpuFrameWidth*gpuFrameHeight];
+    uint16_t *framebuffer = AllocHostFramebuffer(), *prevFramebuffer = AllocHostFramebuffer();
+    InitScanlineHashes(framebuffer, prevFramebuffer);
+    InitDirtyTiles();
+    InitDamageHints();
+    const int numTiles = numDirtyTilesX * numDirtyTilesY;
+    DamageHintRect *rects = new DamageHintRect[(gpuFrameHeight + DIRTY_TILE_SIZE - 1) / DIRTY_TILE_SIZE];
+    uint8_t *staleTiles = new uint8_t[numTiles];
+    int *staleSinceFrame = new int[numTiles];
+    for(int i = 0; i < numTiles; ++i) staleSinceFrame[i] = -1;
+
+    SpanArray spans = {};
+    int numFrames = 0, numFramesWithChanges = 0, numFramesMissed = 0, numFramesStale = 0, longestStale = 0;
+    uint64_t numTilesCompared = 0;
+    uint32_t usecs;
+    for(int f = 0; ReadFrameTraceFrame(trace, packedFrame, &usecs); ++f, ++numFrames)
+    {
+      hostClock += usecs;
+      int numRects;
+      if (f == 0) // The first frame is taken to be the whole frame repainted over the cleared display
+      {
+        rects[0].x = rects[0].y = 0;
+        rects[0].width = rects[0].height = MAX(gpuFrameWidth, gpuFrameHeight);
+        numRects = 1;
+      }
+      else
+        numRects = ChangedRects(packedFrame, prevPackedFrame, rects);
+      if (numRects > 0)
+      {
+        ++numFramesWithChanges;
+        if (missEveryNthFrame && numFramesWithChanges % missEveryNthFrame == 0)
+        {
+          numRects = 0; // Forget to report this repaint
+          ++numFramesMissed;
+        }
+      }
+      AddCapturedDamage(rects, numRects);
+      memcpy(prevPackedFrame, packedFrame, gpuFrameWidth*gpuFrameHeight*sizeof(uint16_t));
+
+      CopyToHostFramebuffer(framebuffer, packedFrame);
+      ComputeScanlineHashes(framebuffer, scanlineHashes);
+      const uint8_t *hintedTiles = DamageHintTilesToDiff(prevFramebuffer);
+      if (hintedTiles)
+        for(int i = 0; i < numTiles; ++i) numTilesCompared += hintedTiles[i] ? 1 : 0;
+      else
+        numTilesCompared += numTiles;
+      ComputeDirtyTiles(framebuffer, prevFramebuffer, hintedTiles);
+      VerifyDamageHints();
+
+      DiffStats stats;
+      DiffFramebuffersToScanlineSpansExact(framebuffer, prevFramebuffer, false, 0, spans, stats);
+      const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+      for(const Span *s = spans.spans; s < spans.spans + spans.numSpans; ++s)
+        for(int y = s->y; y < s->endY; ++y)
+          memcpy(prevFramebuffer + y*stride + s->x, framebuffer + y*stride + s->x, ((y + 1 == s->endY) ? s->lastScanEndX - s->x : s->endX - s->x)*sizeof(uint16_t));
+      UpdatePrevScanlineHashes(1, 0);
+
+      const int stale = UpdateStaleTiles(framebuffer, prevFramebuffer, staleTiles, staleSinceFrame, f);
+      if (stale > 0) ++numFramesStale;
+      longestStale = MAX(longestStale, stale);
+    }
+
+    printf("%s: %d frames of %dx%d, %d with changes, hints left out on %d. Compared %.1f%% of the tiles. The display showed stale pixels on %d frames, "
+      "and the same tile for at most %d frames in a row\n", argv[t], numFrames, gpuFrameWidth, gpuFrameHeight, numFramesWithChanges, numFramesMissed,
+      100.0 * numTilesCompared / MAX(1, (uint64_t)numFrames*numTiles), numFramesStale, longestStale);
+    if (missEveryNthFrame ? longestStale > DAMAGE_HINT_VERIFY_INTERVAL : numFramesStale > 0) failed = true;
+
+    DeinitDamageHints();
+    CloseFrameTraceReader(trace);
+    delete[] packedFrame;
+    delete[] prevPackedFrame;
+    delete[] rects;
+    delete[] staleTiles;
+    delete[] staleSinceFrame;
+    free(framebuffer);
+    free(prevFramebuffer);
+  }
+  return failed ? 1 : 0;
+}
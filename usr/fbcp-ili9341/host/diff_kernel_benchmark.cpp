@@ -0,0 +1,130 @@
+// fbcp-diff-kernel-benchmark: replays frame traces through the span differ with each diff kernel that the CPU supports, checks that every kernel
+// produces exactly the same spans and statistics as DiffFramebuffersToScanlineSpansExact(), and prints how long each of them took. Each consecutive
+// pair of frames of a trace is diffed progressively, and as both fields of an interlaced update. Exits with 1 if any kernel disagrees with the exact differ.
+//
+// Usage: fbcp-diff-kernel-benchmark [-r repeats] <trace> [<trace> ...]
+// On a PC, this runs the SSE2 and AVX2 kernels. Built on a Pi, the same tool runs the NEON kernels.
+
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h> // memcmp, strcmp
+
+#include "config.h"
+#include "diff.h"
+#include "diff_kernels.h"
+#include "gpu.h"
+#include "util.h"
+#include "host_stubs.h"
+#include "frame_trace_reader.h"
+
+#define MAX_KERNELS 4
+#define NUM_DIFF_MODES 3 // Progressive, and both fields of an interlaced update
+
+static const char *diffModeNames[NUM_DIFF_MODES] = { "progressive", "even field", "odd field" };
+
+static bool SpanArraysEqual(const SpanArray &a, const SpanArray &b)
+{
+  return a.numSpans == b.numSpans && !memcmp(a.spans, b.spans, a.numSpans*sizeof(Span));
+}
+
+static bool DiffStatsEqual(const DiffStats &a, const DiffStats &b)
+{
+  return a.numChangedPixels == b.numChangedPixels && !memcmp(a.scanlineClassBytes, b.scanlineClassBytes, sizeof(a.scanlineClassBytes));
+}
+
+int main(int argc, char **argv)
+{
+  int repeats = 5;
+  int firstTrace = 1;
+  if (argc > 2 && !strcmp(argv[1], "-r"))
+  {
+    repeats = MAX(1, atoi(argv[2]));
+    firstTrace = 3;
+  }
+  if (firstTrace >= argc)
+  {
+    printf("Usage: %s [-r repeats] <trace> [<trace> ...]\n", argv[0]);
+    return 1;
+  }
+
+  InitDiffKernels();
+  DiffKernel kernels[MAX_KERNELS];
+  const int numKernels = GetSupportedDiffKernels(kernels, MAX_KERNELS);
+  int totalMismatches = 0;
+
+  for(int t = firstTrace; t < argc; ++t)
+  {
+    FrameTraceReader trace;
+    if (!OpenFrameTraceReader(trace, argv[t])) return 1;
+    InitHostFrameSize(trace.header.width, trace.header.height);
+    uint16_t *packedFrame = new uint16_t[gpuFrameWidth*gpuFrameHeight];
+    uint16_t *framebuffer = AllocHostFramebuffer(), *prevFramebuffer = AllocHostFramebuffer();
+    InitScanlineHashes(framebuffer, prevFramebuffer);
+    InitDirtyTiles();
+
+    SpanArray referenceSpans = {}, kernelSpans = {};
+    uint64_t exactNsecs = 0, kernelNsecs[MAX_KERNELS] = {};
+    int numMismatches[MAX_KERNELS] = {};
+    int numFramePairs = 0, numSpans = 0, numChangedPixels = 0;
+    uint32_t usecs;
+    for(int f = 0; ReadFrameTraceFrame(trace, packedFrame, &usecs); ++f)
+    {
+      uint16_t *tmp = prevFramebuffer; prevFramebuffer = framebuffer; framebuffer = tmp;
+      CopyToHostFramebuffer(framebuffer, packedFrame);
+      if (f == 0) continue;
+
+      // Like the main loop: the new frame is hashed, and the dirty tiles computed, before it is diffed
+      ComputeScanlineHashes(framebuffer, scanlineHashes);
+      ComputeScanlineHashes(prevFramebuffer, prevScanlineHashes);
+      ComputeDirtyTiles(framebuffer, prevFramebuffer, 0);
+      ++numFramePairs;
+
+      for(int mode = 0; mode < NUM_DIFF_MODES; ++mode)
+      {
+        const bool interlaced = (mode > 0);
+        const int parity = interlaced ? mode - 1 : 0;
+        DiffStats referenceStats, stats;
+        uint64_t t0 = HostNsecs();
+        for(int r = 0; r < repeats; ++r)
+          DiffFramebuffersToScanlineSpansExact(framebuffer, prevFramebuffer, interlaced, parity, referenceSpans, referenceStats);
+        exactNsecs += HostNsecs() - t0;
+        if (mode == 0)
+        {
+          numSpans += referenceSpans.numSpans;
+          numChangedPixels += referenceStats.numChangedPixels;
+        }
+
+        for(int k = 0; k < numKernels; ++k)
+        {
+          t0 = HostNsecs();
+          for(int r = 0; r < repeats; ++r)
+            DiffFramebuffersToScanlineSpansWithKernel(kernels[k], framebuffer, prevFramebuffer, interlaced, parity, 0, gpuFrameHeight, kernelSpans, stats);
+          kernelNsecs[k] += HostNsecs() - t0;
+          if (!SpanArraysEqual(referenceSpans, kernelSpans) || !DiffStatsEqual(referenceStats, stats))
+          {
+            if (numMismatches[k]++ == 0)
+              printf("%s: kernel %s disagrees with the exact differ on frame %d (%s): %d spans vs %d, %d changed pixels vs %d\n", argv[t], kernels[k].name,
+                f, diffModeNames[mode], kernelSpans.numSpans, referenceSpans.numSpans, stats.numChangedPixels, referenceStats.numChangedPixels);
+          }
+        }
+      }
+    }
+
+    const uint64_t numDiffs = (uint64_t)MAX(1, numFramePairs) * NUM_DIFF_MODES * repeats;
+    printf("%s: %d frame pairs of %dx%d, %.1f spans and %.0f changed pixels per frame\n", argv[t], numFramePairs, gpuFrameWidth, gpuFrameHeight,
+      (double)numSpans / MAX(1, numFramePairs), (double)numChangedPixels / MAX(1, numFramePairs));
+    printf("  exact: %llu ns/diff\n", (unsigned long long)(exactNsecs / numDiffs));
+    for(int k = 0; k < numKernels; ++k)
+    {
+      printf("  %s: %llu ns/diff, %.2fx the speed of exact, %d mismatches\n", kernels[k].name, (unsigned long long)(kernelNsecs[k] / numDiffs),
+        (double)exactNsecs / MAX(1, kernelNsecs[k]), numMismatches[k]);
+      totalMismatches += numMismatches[k];
+    }
+
+    CloseFrameTraceReader(trace);
+    delete[] packedFrame;
+    free(framebuffer);
+    free(prevFramebuffer);
+  }
+  return totalMismatches ? 1 : 0;
+}
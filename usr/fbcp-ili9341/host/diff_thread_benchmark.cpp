@@ -0,0 +1,108 @@
+// fbcp-diff-thread-benchmark: replays frame traces through the multithreaded diff of USE_MULTITHREADED_DIFF, split into 1, 2, ..., NUM_DIFF_THREADS
+// bands, checks that every split produces exactly the same spans and statistics as diffing the whole frame on one thread, and prints how long each
+// split took. Exits with 1 if any split disagrees. The speedup only means something on a machine with at least NUM_DIFF_THREADS idle cores, so build
+// and run this on the Pi that the driver runs on.
+//
+// Usage: fbcp-diff-thread-benchmark [-r repeats] <trace> [<trace> ...]
+
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h> // memcmp, strcmp
+
+#include "config.h"
+#include "diff.h"
+#include "diff_kernels.h"
+#include "gpu.h"
+#include "util.h"
+#include "host_stubs.h"
+#include "frame_trace_reader.h"
+
+static bool SpanArraysEqual(const SpanArray &a, const SpanArray &b)
+{
+  return a.numSpans == b.numSpans && !memcmp(a.spans, b.spans, a.numSpans*sizeof(Span));
+}
+
+static bool DiffStatsEqual(const DiffStats &a, const DiffStats &b)
+{
+  return a.numChangedPixels == b.numChangedPixels && !memcmp(a.scanlineClassBytes, b.scanlineClassBytes, sizeof(a.scanlineClassBytes));
+}
+
+int main(int argc, char **argv)
+{
+  int repeats = 5;
+  int firstTrace = 1;
+  if (argc > 2 && !strcmp(argv[1], "-r"))
+  {
+    repeats = MAX(1, atoi(argv[2]));
+    firstTrace = 3;
+  }
+  if (firstTrace >= argc)
+  {
+    printf("Usage: %s [-r repeats] <trace> [<trace> ...]\n", argv[0]);
+    return 1;
+  }
+
+  InitDiffKernels();
+  int totalMismatches = 0;
+  for(int t = firstTrace; t < argc; ++t)
+  {
+    FrameTraceReader trace;
+    if (!OpenFrameTraceReader(trace, argv[t])) return 1;
+    InitHostFrameSize(trace.header.width, trace.header.height);
+    // The worker threads size their span arrays by the frame size
+    InitDiffThreads();
+    uint16_t *packedFrame = new uint16_t[gpuFrameWidth*gpuFrameHeight];
+    uint16_t *framebuffer = AllocHostFramebuffer(), *prevFramebuffer = AllocHostFramebuffer();
+    InitScanlineHashes(framebuffer, prevFramebuffer);
+    InitDirtyTiles();
+
+    SpanArray referenceSpans = {}, bandSpans = {};
+    uint64_t nsecs[NUM_DIFF_THREADS] = {};
+    int numMismatches[NUM_DIFF_THREADS] = {};
+    int numFramePairs = 0;
+    uint32_t usecs;
+    for(int f = 0; ReadFrameTraceFrame(trace, packedFrame, &usecs); ++f)
+    {
+      uint16_t *tmp = prevFramebuffer; prevFramebuffer = framebuffer; framebuffer = tmp;
+      CopyToHostFramebuffer(framebuffer, packedFrame);
+      if (f == 0) continue;
+
+      ComputeScanlineHashes(framebuffer, scanlineHashes);
+      ComputeScanlineHashes(prevFramebuffer, prevScanlineHashes);
+      ComputeDirtyTiles(framebuffer, prevFramebuffer, 0);
+      ++numFramePairs;
+
+      DiffStats referenceStats, stats;
+      DiffFramebuffersToScanlineSpansSIMD(framebuffer, prevFramebuffer, false, 0, referenceSpans, referenceStats);
+      for(int i = 0; i < NUM_DIFF_THREADS; ++i)
+      {
+        uint64_t t0 = HostNsecs();
+        for(int r = 0; r < repeats; ++r)
+          DiffFramebuffersToScanlineSpansInBands(i+1, framebuffer, prevFramebuffer, false, 0, bandSpans, stats);
+        nsecs[i] += HostNsecs() - t0;
+        if (!SpanArraysEqual(referenceSpans, bandSpans) || !DiffStatsEqual(referenceStats, stats))
+        {
+          if (numMismatches[i]++ == 0)
+            printf("%s: diffing in %d bands disagrees with a single threaded diff on frame %d: %d spans vs %d, %d changed pixels vs %d\n", argv[t], i+1, f,
+              bandSpans.numSpans, referenceSpans.numSpans, stats.numChangedPixels, referenceStats.numChangedPixels);
+        }
+      }
+    }
+
+    const uint64_t numDiffs = (uint64_t)MAX(1, numFramePairs) * repeats;
+    printf("%s: %d frame pairs of %dx%d\n", argv[t], numFramePairs, gpuFrameWidth, gpuFrameHeight);
+    for(int i = 0; i < NUM_DIFF_THREADS; ++i)
+    {
+      printf("  %d band%s: %llu ns/diff, %.2fx the speed of 1 band, %d mismatches\n", i+1, i ? "s" : "", (unsigned long long)(nsecs[i] / numDiffs),
+        (double)nsecs[0] / MAX(1, nsecs[i]), numMismatches[i]);
+      totalMismatches += numMismatches[i];
+    }
+
+    DeinitDiffThreads();
+    CloseFrameTraceReader(trace);
+    delete[] packedFrame;
+    free(framebuffer);
+    free(prevFramebuffer);
+  }
+  return totalMismatches ? 1 : 0;
+}
@@ -0,0 +1,413 @@
+// fbcp-drm-capture-check: runs the DRM capture of CAPTURE_FROM_DRM against the fake DRM device of fake_drm_device.cpp, and checks that it captures
+// what the device scans out, and waits for the vblanks that it should:
+//  - formats: each pixel format that can be captured, unscaled, scaled down, and from a framebuffer that is larger than the mode and panned, against
+//    pixels that are sampled and converted independently of capture_sampler.cpp
+//  - unsupported: framebuffers in a tiled layout or a format that cannot be captured are not captured, and their GEM handles are closed
+//  - flips: flipping between framebuffers maps each buffer once, reuses the mappings, closes the GEM handles, and captures pixels drawn in place
+//  - reused ids: a framebuffer id that is reused for another buffer captures the new buffer
+//  - eviction: flipping between more buffers than are kept mapped keeps the number of mappings bounded
+//  - dumb buffers: buffers that cannot be exported as dma-bufs are mapped as dumb buffers
+//  - display off: nothing is captured while the CRTC shows no framebuffer
+//  - no access: framebuffers without GEM handles, as seen without root, stop the program with an error
+//  - vblanks: on CRTCs 0, 1 and 2, the vblank that is waited for is the one nearest to the requested time, a vblank that has already passed returns
+//    right away, and a failing drmWaitVBlank() falls back to a timer until vblanks work again
+// Each check runs in a process of its own, so that each starts from fresh capture state, and a check that should stop the program can. Exits with 1 if
+// any check failed. The Pi only runs the DRM capture against the real vc4 driver, and vkms on a PC, so this does not show driver specific problems.
+//
+// Usage: fbcp-drm-capture-check
+
+#include <stdio.h>
+#include <stdlib.h> // exit
+#include <string.h> // memset
+#include <sys/wait.h> // waitpid
+#include <unistd.h> // fork
+
+#include "config.h"
+#include "gpu.h"
+#include "drm_capture.h"
+#include "capture_sampler.h"
+#include "util.h"
+#include "host_stubs.h"
+#include "fake_drm_device.h"
+#include <drm_fourcc.h>
+
+// The size of the captured frames, which the modes that the checks use are scaled to
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+#define FRAME_WIDTH 240
+#define FRAME_HEIGHT 320
+#else
+#define FRAME_WIDTH 320
+#define FRAME_HEIGHT 240
+#endif
+
+#define VBLANK_INTERVAL 16683 // Of the 640x480 mode below
+
+static bool failed = false;
+
+#define CHECK(condition, ...) do { if (!(condition)) { printf("  " __VA_ARGS__); printf("\n"); failed = true; } } while(0)
+
+static drmModeModeInfo Mode(int width, int height)
+{
+  // Timings of 640x480@60Hz, so that the vblank interval comes out the same for all sizes
+  drmModeModeInfo mode = {};
+  mode.clock = 25175;
+  mode.hdisplay = width;
+  mode.vdisplay = height;
+  mode.htotal = 800;
+  mode.vtotal = 525;
+  return mode;
+}
+
+static int BytesPerPixel(uint32_t pixelFormat)
+{
+  return (pixelFormat == DRM_FORMAT_RGB565) ? 2 : 4;
+}
+
+static void FillRandom(uint8_t *pixels, size_t size, uint32_t seed)
+{
+  for(size_t i = 0; i < size; ++i)
+  {
+    seed = seed * 1664525u + 1013904223u;
+    pixels[i] = (uint8_t)(seed >> 24);
+  }
+}
+
+// Initializes the DRM capture on the fake device, and sizes the captured frames like InitGPU() does for a mode that fits them without letterboxing
+static void InitCapture()
+{
+  int width, height;
+  InitDrmCapture(&width, &height);
+  InitHostFrameSize(FRAME_WIDTH, FRAME_HEIGHT);
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  SetCaptureRectangle(0, 0, height, width);
+#else
+  SetCaptureRectangle(0, 0, width, height);
+#endif
+}
+
+// Returns the captured pixel at (x, y) when the given mode is scanned out of the given framebuffer at (originX, originY)
+static uint16_t ExpectedPixel(const uint8_t *pixels, uint32_t pixelFormat, uint32_t pitch, uint32_t offset, uint32_t originX, uint32_t originY,
+  const drmModeModeInfo &mode, int x, int y)
+{
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  // The captured frame is transposed
+  const uint32_t sourceX = originX + (uint32_t)((2*y+1) * (uint64_t)mode.hdisplay / (2*FRAME_HEIGHT));
+  const uint32_t sourceY = originY + (uint32_t)((2*x+1) * (uint64_t)mode.vdisplay / (2*FRAME_WIDTH));
+#else
+  const uint32_t sourceX = originX + (uint32_t)((2*x+1) * (uint64_t)mode.hdisplay / (2*FRAME_WIDTH));
+  const uint32_t sourceY = originY + (uint32_t)((2*y+1) * (uint64_t)mode.vdisplay / (2*FRAME_HEIGHT));
+#endif
+  const uint8_t *p = pixels + offset + sourceY*pitch + sourceX*BytesPerPixel(pixelFormat);
+  if (pixelFormat == DRM_FORMAT_RGB565) return (uint16_t)(p[0] | (p[1] << 8));
+  uint8_t r = p[2], g = p[1], b = p[0]; // XRGB8888 is B, G, R, X in memory
+  if (pixelFormat == DRM_FORMAT_XBGR8888 || pixelFormat == DRM_FORMAT_ABGR8888)
+  {
+    r = p[0];
+    b = p[2];
+  }
+  return (uint16_t)(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+}
+
+// Returns the number of pixels of the captured frame that differ from what should have been captured
+static int CountWrongPixels(const uint16_t *frame, int buffer, uint32_t pixelFormat, uint32_t pitch, uint32_t offset, uint32_t originX, uint32_t originY,
+  const drmModeModeInfo &mode)
+{
+  const uint8_t *pixels = FakeDrmBufferPixels(buffer);
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  int wrong = 0;
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    for(int x = 0; x < gpuFrameWidth; ++x)
+      if (frame[y*stride + x] != ExpectedPixel(pixels, pixelFormat, pitch, offset, originX, originY, mode, x, y)) ++wrong;
+  return wrong;
+}
+
+static const char *FormatName(uint32_t pixelFormat)
+{
+  static char name[5];
+  memcpy(name, &pixelFormat, 4);
+  return name;
+}
+
+struct FormatLayout
+{
+  const char *name;
+  uint32_t fbWidth, fbHeight, modeWidth, modeHeight, x, y, pitchPadding, offset;
+};
+
+static const FormatLayout formatLayouts[] = {
+  { "unscaled", 320, 240, 320, 240, 0, 0, 0, 0 },
+  { "scaled", 800, 600, 800, 600, 0, 0, 64, 0 },
+  { "panned", 400, 300, 320, 240, 40, 30, 32, 4096 }
+};
+
+static void CheckFormats(const FormatLayout &layout)
+{
+  const uint32_t formats[] = { DRM_FORMAT_RGB565, DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_XBGR8888, DRM_FORMAT_ABGR8888 };
+  const int numFormats = sizeof(formats) / sizeof(formats[0]);
+  InitFakeDrmDevice(1);
+  int buffers[numFormats];
+  uint32_t fbIds[numFormats];
+  for(int f = 0; f < numFormats; ++f)
+  {
+    const uint32_t pitch = layout.fbWidth * BytesPerPixel(formats[f]) + layout.pitchPadding;
+    const size_t size = layout.offset + pitch * layout.fbHeight;
+    buffers[f] = CreateFakeDrmBuffer(size, true);
+    FillRandom(FakeDrmBufferPixels(buffers[f]), size, 1 + f);
+    fbIds[f] = AddFakeDrmFramebuffer(buffers[f], layout.fbWidth, layout.fbHeight, formats[f], DRM_FORMAT_MOD_LINEAR, pitch, layout.offset);
+  }
+
+  const drmModeModeInfo mode = Mode(layout.modeWidth, layout.modeHeight);
+  SetFakeDrmCrtc(0, fbIds[0], layout.x, layout.y, mode);
+  InitCapture();
+  uint16_t *frame = AllocHostFramebuffer();
+  for(int f = 0; f < numFormats; ++f)
+  {
+    SetFakeDrmCrtc(0, fbIds[f], layout.x, layout.y, mode);
+    memset(frame, 0, gpuFramebufferSizeBytes);
+    const bool captured = SnapshotDrmFramebuffer(frame);
+    const uint32_t pitch = layout.fbWidth * BytesPerPixel(formats[f]) + layout.pitchPadding;
+    const int wrong = captured ? CountWrongPixels(frame, buffers[f], formats[f], pitch, layout.offset, layout.x, layout.y, mode) : -1;
+    CHECK(wrong == 0, "%s: %s", FormatName(formats[f]), captured ? "captured pixels differ from the framebuffer" : "nothing was captured");
+  }
+  DeinitDrmCapture();
+  CHECK(FakeDrmOpenGemHandles() == 0, "%d GEM handles were left open", FakeDrmOpenGemHandles());
+  CHECK(FakeDrmBufferMappings() == 0, "%d mappings were left after DeinitDrmCapture()", FakeDrmBufferMappings());
+}
+
+static void CheckUnsupported()
+{
+  InitFakeDrmDevice(1);
+  const drmModeModeInfo mode = Mode(320, 240);
+  const int buffer = CreateFakeDrmBuffer(320*4*240, true);
+  const uint32_t tiled = AddFakeDrmFramebuffer(buffer, 320, 240, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED, 320*4, 0);
+  const uint32_t nv12 = AddFakeDrmFramebuffer(buffer, 320, 240, DRM_FORMAT_NV12, DRM_FORMAT_MOD_LINEAR, 320, 0);
+  SetFakeDrmCrtc(0, tiled, 0, 0, mode);
+  InitCapture();
+  uint16_t *frame = AllocHostFramebuffer();
+  CHECK(!SnapshotDrmFramebuffer(frame), "a tiled framebuffer was captured");
+  SetFakeDrmCrtc(0, nv12, 0, 0, mode);
+  CHECK(!SnapshotDrmFramebuffer(frame), "an NV12 framebuffer was captured");
+  CHECK(FakeDrmOpenGemHandles() == 0, "%d GEM handles were left open", FakeDrmOpenGemHandles());
+  CHECK(FakeDrmBufferMappings() == 0, "%d framebuffers that cannot be captured were mapped", FakeDrmBufferMappings());
+  DeinitDrmCapture();
+}
+
+// Flips between the framebuffers round robin, and checks that each flip is captured. Returns the largest number of mappings seen.
+static int FlipBetween(const uint32_t *fbIds, const int *buffers, int numFramebuffers, int numFlips, const drmModeModeInfo &mode, uint16_t *frame)
+{
+  int maxMappings = 0;
+  for(int i = 0; i < numFlips; ++i)
+  {
+    const int n = i % numFramebuffers;
+    SetFakeDrmCrtc(0, fbIds[n], 0, 0, mode);
+    const bool captured = SnapshotDrmFramebuffer(frame);
+    const int wrong = captured ? CountWrongPixels(frame, buffers[n], DRM_FORMAT_XRGB8888, 320*4, 0, 0, 0, mode) : -1;
+    CHECK(wrong == 0, "flip %d to framebuffer %u: %s", i, fbIds[n], captured ? "captured pixels differ from the framebuffer" : "nothing was captured");
+    maxMappings = MAX(maxMappings, FakeDrmBufferMappings());
+  }
+  return maxMappings;
+}
+
+static void CheckFlips(bool exportable)
+{
+  InitFakeDrmDevice(1);
+  const drmModeModeInfo mode = Mode(320, 240);
+  int buffers[3];
+  uint32_t fbIds[3];
+  for(int i = 0; i < 3; ++i)
+  {
+    buffers[i] = CreateFakeDrmBuffer(320*4*240, exportable);
+    FillRandom(FakeDrmBufferPixels(buffers[i]), 320*4*240, 10 + i);
+    fbIds[i] = AddFakeDrmFramebuffer(buffers[i], 320, 240, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR, 320*4, 0);
+  }
+  SetFakeDrmCrtc(0, fbIds[0], 0, 0, mode);
+  InitCapture();
+  uint16_t *frame = AllocHostFramebuffer();
+  const int maxMappings = FlipBetween(fbIds, buffers, 3, 30, mode, frame);
+  // Dumb buffers are mapped again when their framebuffer is flipped back to after the mapping was evicted, so only exported buffers are exact
+  if (exportable) CHECK(maxMappings == 3, "flipping between 3 framebuffers mapped %d buffers, not 3", maxMappings);
+  else CHECK(maxMappings <= 4, "flipping between 3 framebuffers kept %d mappings, more than 4", maxMappings);
+  CHECK(FakeDrmOpenGemHandles() == 0, "%d GEM handles were left open", FakeDrmOpenGemHandles());
+
+  // A client that draws into the framebuffer on the screen, without flipping
+  FillRandom(FakeDrmBufferPixels(buffers[2]), 320*4*240, 20);
+  CHECK(SnapshotDrmFramebuffer(frame) && CountWrongPixels(frame, buffers[2], DRM_FORMAT_XRGB8888, 320*4, 0, 0, 0, mode) == 0,
+    "pixels drawn into the framebuffer on the screen were not captured");
+  DeinitDrmCapture();
+}
+
+static void CheckReusedIds()
+{
+  InitFakeDrmDevice(1);
+  const drmModeModeInfo mode = Mode(320, 240);
+  int buffers[3];
+  for(int i = 0; i < 3; ++i)
+  {
+    buffers[i] = CreateFakeDrmBuffer(320*4*240, true);
+    FillRandom(FakeDrmBufferPixels(buffers[i]), 320*4*240, 30 + i);
+  }
+  const uint32_t first = AddFakeDrmFramebuffer(buffers[0], 320, 240, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR, 320*4, 0);
+  const uint32_t second = AddFakeDrmFramebuffer(buffers[1], 320, 240, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR, 320*4, 0);
+  SetFakeDrmCrtc(0, first, 0, 0, mode);
+  InitCapture();
+  uint16_t *frame = AllocHostFramebuffer();
+  SnapshotDrmFramebuffer(frame);
+  SetFakeDrmCrtc(0, second, 0, 0, mode);
+  SnapshotDrmFramebuffer(frame);
+
+  // The client removes the first framebuffer, and adds one for another buffer, which gets the same id
+  RemoveFakeDrmFramebuffer(first);
+  const uint32_t reused = AddFakeDrmFramebuffer(buffers[2], 320, 240, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR, 320*4, 0);
+  CHECK(reused == first, "the fake device did not reuse framebuffer id %u", first);
+  SetFakeDrmCrtc(0, reused, 0, 0, mode);
+  CHECK(SnapshotDrmFramebuffer(frame) && CountWrongPixels(frame, buffers[2], DRM_FORMAT_XRGB8888, 320*4, 0, 0, 0, mode) == 0,
+    "framebuffer id %u was captured from the buffer that it was used for before", reused);
+  DeinitDrmCapture();
+}
+
+static void CheckEviction(bool exportable)
+{
+  InitFakeDrmDevice(1);
+  const drmModeModeInfo mode = Mode(320, 240);
+  int buffers[6];
+  uint32_t fbIds[6];
+  for(int i = 0; i < 6; ++i)
+  {
+    buffers[i] = CreateFakeDrmBuffer(320*4*240, exportable);
+    FillRandom(FakeDrmBufferPixels(buffers[i]), 320*4*240, 40 + i);
+    fbIds[i] = AddFakeDrmFramebuffer(buffers[i], 320, 240, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR, 320*4, 0);
+  }
+  SetFakeDrmCrtc(0, fbIds[0], 0, 0, mode);
+  InitCapture();
+  uint16_t *frame = AllocHostFramebuffer();
+  const int maxMappings = FlipBetween(fbIds, buffers, 6, 36, mode, frame);
+  CHECK(maxMappings <= 4, "flipping between 6 framebuffers kept %d mappings, more than 4", maxMappings);
+  CHECK(FakeDrmOpenGemHandles() == 0, "%d GEM handles were left open", FakeDrmOpenGemHandles());
+  DeinitDrmCapture();
+}
+
+static void CheckDisplayOff()
+{
+  InitFakeDrmDevice(1);
+  const drmModeModeInfo mode = Mode(320, 240);
+  const int buffer = CreateFakeDrmBuffer(320*4*240, true);
+  const uint32_t fbId = AddFakeDrmFramebuffer(buffer, 320, 240, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR, 320*4, 0);
+  SetFakeDrmCrtc(0, fbId, 0, 0, mode);
+  InitCapture();
+  uint16_t *frame = AllocHostFramebuffer();
+  CHECK(SnapshotDrmFramebuffer(frame), "nothing was captured while the display was on");
+  SetFakeDrmCrtc(0, 0, 0, 0, mode);
+  CHECK(!SnapshotDrmFramebuffer(frame), "something was captured while the display was off");
+  SetFakeDrmCrtc(0, fbId, 0, 0, mode);
+  CHECK(SnapshotDrmFramebuffer(frame), "nothing was captured after the display was turned back on");
+  DeinitDrmCapture();
+}
+
+// Stops the program, so the check passes if the process exits with 1
+static void CheckNoAccess()
+{
+  InitFakeDrmDevice(1);
+  const int buffer = CreateFakeDrmBuffer(320*4*240, true);
+  SetFakeDrmCrtc(0, AddFakeDrmFramebuffer(buffer, 320, 240, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR, 320*4, 0), 0, 0, Mode(320, 240));
+  SetFakeDrmHandlesHidden(true);
+  InitCapture();
+  uint16_t *frame = AllocHostFramebuffer();
+  SnapshotDrmFramebuffer(frame);
+  printf("  a framebuffer without GEM handles did not stop the program\n");
+  failed = true;
+}
+
+// Waits for a vblank at the given number of vblank intervals from the most recent one, and checks the vblank that was requested and waited for
+static void CheckVblankWait(double intervalsFromNow, drmVBlankSeqType expectedType, uint32_t expectedSequence)
+{
+  const uint64_t interval = FakeDrmVblankInterval();
+  WaitForDrmVblank(intervalsFromNow < 0 ? 0 : hostClock + (uint64_t)(intervalsFromNow * interval));
+  const drmVBlankReq request = FakeDrmLastVblankRequest();
+  CHECK(request.type == expectedType && request.sequence == expectedSequence, "waiting %.1f vblanks ahead requested vblank %u with type 0x%x, "
+    "expected %u with type 0x%x", intervalsFromNow, request.sequence, (unsigned)request.type, expectedSequence, (unsigned)expectedType);
+}
+
+static void CheckVblanks(int pipe)
+{
+  InitFakeDrmDevice(3);
+  SetFakeDrmVblankInterval(VBLANK_INTERVAL);
+  const int buffer = CreateFakeDrmBuffer(640*4*480, true);
+  SetFakeDrmCrtc(pipe, AddFakeDrmFramebuffer(buffer, 640, 480, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR, 640*4, 0), 0, 0, Mode(640, 480));
+  hostClock = 1000 * VBLANK_INTERVAL + 5000; // Between two vblanks
+  InitCapture();
+
+  const uint32_t pipeBits = (pipe == 0) ? 0 : (pipe == 1) ? DRM_VBLANK_SECONDARY : ((pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK);
+  const drmVBlankSeqType relative = (drmVBlankSeqType)(DRM_VBLANK_RELATIVE | pipeBits), absolute = (drmVBlankSeqType)(DRM_VBLANK_ABSOLUTE | pipeBits);
+  CheckVblankWait(-1, relative, 1); // The first wait does not know the vblank counter yet
+  CHECK(hostClock == 1001 * VBLANK_INTERVAL, "the first wait did not wait for the next vblank");
+  CheckVblankWait(2.4, absolute, 1003); // The nearest vblank to the requested time
+  CheckVblankWait(0.4, absolute, 1004); // But at least the next one
+  CheckVblankWait(-1, absolute, 1005);
+  CheckVblankWait(3.6, absolute, 1009);
+  CHECK(hostClock == 1009 * VBLANK_INTERVAL, "the vblank that was waited for was not reached");
+
+  // Capturing and diffing took longer than 3 vblanks: the requested vblank has passed, and the wait returns right away
+  hostClock += 3 * VBLANK_INTERVAL + 100;
+  CheckVblankWait(-1, absolute, 1010);
+  CHECK(hostClock == 1012 * VBLANK_INTERVAL + 100, "waiting for a vblank that had passed did not return right away");
+  CheckVblankWait(-1, absolute, 1013);
+
+  // The CRTC stops delivering vblanks, and then starts again
+  SetFakeDrmVblankFailing(true);
+  CheckVblankWait(-1, absolute, 1014);
+  CheckVblankWait(-1, relative, 1);
+  SetFakeDrmVblankFailing(false);
+  CheckVblankWait(-1, relative, 1);
+  CheckVblankWait(-1, absolute, FakeDrmVblankSequence() + 1);
+  DeinitDrmCapture();
+}
+
+// Runs the check in a child process. Returns true if it exited with the expected status.
+static bool Run(const char *name, void (*check)(), int expectedStatus = 0)
+{
+  printf("%s\n", name);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    check();
+    exit(failed ? 2 : 0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  const bool passed = WIFEXITED(status) && WEXITSTATUS(status) == expectedStatus;
+  if (!passed) printf("  FAILED\n");
+  return passed;
+}
+
+static void CheckFormatsUnscaled() { CheckFormats(formatLayouts[0]); }
+static void CheckFormatsScaled() { CheckFormats(formatLayouts[1]); }
+static void CheckFormatsPanned() { CheckFormats(formatLayouts[2]); }
+static void CheckFlipsExported() { CheckFlips(true); }
+static void CheckFlipsDumb() { CheckFlips(false); }
+static void CheckEvictionExported() { CheckEviction(true); }
+static void CheckEvictionDumb() { CheckEviction(false); }
+static void CheckVblanksPipe0() { CheckVblanks(0); }
+static void CheckVblanksPipe1() { CheckVblanks(1); }
+static void CheckVblanksPipe2() { CheckVblanks(2); }
+
+int main()
+{
+  int numFailed = 0;
+  numFailed += !Run("formats, unscaled", CheckFormatsUnscaled);
+  numFailed += !Run("formats, scaled", CheckFormatsScaled);
+  numFailed += !Run("formats, panned", CheckFormatsPanned);
+  numFailed += !Run("unsupported", CheckUnsupported);
+  numFailed += !Run("flips", CheckFlipsExported);
+  numFailed += !Run("flips, dumb buffers", CheckFlipsDumb);
+  numFailed += !Run("reused ids", CheckReusedIds);
+  numFailed += !Run("eviction", CheckEvictionExported);
+  numFailed += !Run("eviction, dumb buffers", CheckEvictionDumb);
+  numFailed += !Run("display off", CheckDisplayOff);
+  numFailed += !Run("no access", CheckNoAccess, 1);
+  numFailed += !Run("vblanks, CRTC 0", CheckVblanksPipe0);
+  numFailed += !Run("vblanks, CRTC 1", CheckVblanksPipe1);
+  numFailed += !Run("vblanks, CRTC 2", CheckVblanksPipe2);
+  printf("%d checks failed\n", numFailed);
+  return numFailed ? 1 : 0;
+}
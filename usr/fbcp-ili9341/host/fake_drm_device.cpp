@@ -0,0 +1,316 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h> // exit
+#include <string.h> // memset, strstr
+#include <sys/mman.h> // memfd_create, mmap
+#include <unistd.h> // ftruncate, dup
+
+#include "fake_drm_device.h"
+#include "host_stubs.h"
+
+#define FAKE_DRM_MAX_BUFFERS 16
+#define FAKE_DRM_MAX_FRAMEBUFFERS 16
+#define FAKE_DRM_PAGE_SIZE 4096
+
+struct FakeBuffer
+{
+  int fd; // The memfd of the buffer, or of the device for a dumb buffer
+  off_t offset; // Of the buffer in fd
+  size_t size;
+  uint8_t *pixels;
+  bool exportable;
+};
+
+struct FakeFramebuffer
+{
+  bool used;
+  int buffer;
+  uint32_t width, height, pixelFormat, pitch, offset;
+  uint64_t modifier;
+};
+
+struct FakeCrtc
+{
+  uint32_t fbId, x, y;
+  drmModeModeInfo mode;
+};
+
+char fakeDrmDevicePath[64];
+
+static int deviceFd = -1;
+static off_t deviceSize = 0;
+static FakeBuffer buffers[FAKE_DRM_MAX_BUFFERS];
+static int numBuffers = 0;
+static FakeFramebuffer framebuffers[FAKE_DRM_MAX_FRAMEBUFFERS+1]; // Indexed by id, 0 is not a valid id
+static FakeCrtc crtcs[FAKE_DRM_MAX_CRTCS];
+static uint32_t crtcIds[FAKE_DRM_MAX_CRTCS];
+static int numCrtcs = 0;
+static bool handlesHidden = false, vblankFailing = false;
+static uint64_t vblankInterval = 1000000/60;
+static drmVBlankReq lastVblankRequest = {};
+
+// GEM handles are handed out as buffer + 1 + FAKE_DRM_MAX_BUFFERS*n, so that each drmModeGetFB2() call gets new ones
+static uint32_t nextHandleGeneration = 0;
+static int openGemHandles = 0;
+
+static void Fail(const char *msg)
+{
+  printf("Fake DRM device: %s (%s)\n", msg, strerror(errno));
+  exit(1);
+}
+
+void InitFakeDrmDevice(int count)
+{
+  deviceFd = memfd_create("fake-drm-card", 0);
+  if (deviceFd < 0) Fail("memfd_create failed");
+  snprintf(fakeDrmDevicePath, sizeof(fakeDrmDevicePath), "/proc/self/fd/%d", deviceFd);
+  numCrtcs = count;
+  for(int i = 0; i < numCrtcs; ++i)
+    crtcIds[i] = 40 + i; // Not the index, so that mixing up the two shows
+}
+
+int CreateFakeDrmBuffer(size_t size, bool exportable)
+{
+  if (numBuffers == FAKE_DRM_MAX_BUFFERS) Fail("too many buffers");
+  FakeBuffer &b = buffers[numBuffers];
+  b.size = size;
+  b.exportable = exportable;
+  if (exportable)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "fake-drm-buffer-%d", numBuffers);
+    b.fd = memfd_create(name, 0);
+    b.offset = 0;
+    if (b.fd < 0 || ftruncate(b.fd, size) < 0) Fail("failed to create a buffer");
+  }
+  else
+  {
+    b.fd = deviceFd;
+    b.offset = deviceSize;
+    deviceSize += (size + FAKE_DRM_PAGE_SIZE - 1) & ~(size_t)(FAKE_DRM_PAGE_SIZE - 1);
+    if (ftruncate(deviceFd, deviceSize) < 0) Fail("failed to create a dumb buffer");
+  }
+  b.pixels = (uint8_t*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, b.fd, b.offset);
+  if (b.pixels == MAP_FAILED) Fail("failed to map a buffer");
+  return numBuffers++;
+}
+
+uint8_t *FakeDrmBufferPixels(int buffer)
+{
+  return buffers[buffer].pixels;
+}
+
+uint32_t AddFakeDrmFramebuffer(int buffer, uint32_t width, uint32_t height, uint32_t pixelFormat, uint64_t modifier, uint32_t pitch, uint32_t offset)
+{
+  for(uint32_t id = 1; id <= FAKE_DRM_MAX_FRAMEBUFFERS; ++id)
+    if (!framebuffers[id].used)
+    {
+      FakeFramebuffer &fb = framebuffers[id];
+      fb.used = true;
+      fb.buffer = buffer;
+      fb.width = width;
+      fb.height = height;
+      fb.pixelFormat = pixelFormat;
+      fb.modifier = modifier;
+      fb.pitch = pitch;
+      fb.offset = offset;
+      return id;
+    }
+  Fail("too many framebuffers");
+  return 0;
+}
+
+void RemoveFakeDrmFramebuffer(uint32_t fbId)
+{
+  framebuffers[fbId].used = false;
+}
+
+void SetFakeDrmCrtc(int crtc, uint32_t fbId, uint32_t x, uint32_t y, const drmModeModeInfo &mode)
+{
+  crtcs[crtc].fbId = fbId;
+  crtcs[crtc].x = x;
+  crtcs[crtc].y = y;
+  crtcs[crtc].mode = mode;
+}
+
+void SetFakeDrmHandlesHidden(bool hidden)
+{
+  handlesHidden = hidden;
+}
+
+void SetFakeDrmVblankFailing(bool failing)
+{
+  vblankFailing = failing;
+}
+
+void SetFakeDrmVblankInterval(uint64_t usecs)
+{
+  vblankInterval = usecs;
+}
+
+uint64_t FakeDrmVblankInterval()
+{
+  return vblankInterval;
+}
+
+uint32_t FakeDrmVblankSequence()
+{
+  return (uint32_t)(hostClock / vblankInterval);
+}
+
+drmVBlankReq FakeDrmLastVblankRequest()
+{
+  return lastVblankRequest;
+}
+
+int FakeDrmOpenGemHandles()
+{
+  return openGemHandles;
+}
+
+int FakeDrmBufferMappings()
+{
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (!maps) Fail("failed to open /proc/self/maps");
+  int count = 0;
+  char line[512];
+  while(fgets(line, sizeof(line), maps))
+    if (strstr(line, " r--s ") && strstr(line, "/memfd:fake-drm-")) ++count;
+  fclose(maps);
+  return count;
+}
+
+static FakeBuffer *BufferOfHandle(uint32_t handle)
+{
+  if (handle == 0) return 0;
+  return &buffers[(handle - 1) % FAKE_DRM_MAX_BUFFERS];
+}
+
+drmModeResPtr drmModeGetResources(int fd)
+{
+  if (fd < 0) return 0;
+  drmModeRes *res = (drmModeRes*)calloc(1, sizeof(drmModeRes));
+  res->count_crtcs = numCrtcs;
+  res->crtcs = (uint32_t*)calloc(numCrtcs, sizeof(uint32_t));
+  memcpy(res->crtcs, crtcIds, numCrtcs*sizeof(uint32_t));
+  return res;
+}
+
+void drmModeFreeResources(drmModeResPtr ptr)
+{
+  if (!ptr) return;
+  free(ptr->crtcs);
+  free(ptr);
+}
+
+drmModeCrtcPtr drmModeGetCrtc(int fd, uint32_t crtcId)
+{
+  for(int i = 0; i < numCrtcs; ++i)
+    if (crtcIds[i] == crtcId)
+    {
+      drmModeCrtc *crtc = (drmModeCrtc*)calloc(1, sizeof(drmModeCrtc));
+      crtc->crtc_id = crtcId;
+      crtc->buffer_id = crtcs[i].fbId;
+      crtc->x = crtcs[i].x;
+      crtc->y = crtcs[i].y;
+      crtc->mode_valid = crtcs[i].fbId != 0;
+      if (crtc->mode_valid)
+      {
+        crtc->mode = crtcs[i].mode;
+        crtc->width = crtc->mode.hdisplay;
+        crtc->height = crtc->mode.vdisplay;
+      }
+      return crtc;
+    }
+  errno = ENOENT;
+  return 0;
+}
+
+void drmModeFreeCrtc(drmModeCrtcPtr ptr)
+{
+  free(ptr);
+}
+
+drmModeFB2Ptr drmModeGetFB2(int fd, uint32_t bufferId)
+{
+  if (bufferId == 0 || bufferId > FAKE_DRM_MAX_FRAMEBUFFERS || !framebuffers[bufferId].used)
+  {
+    errno = ENOENT;
+    return 0;
+  }
+  const FakeFramebuffer &f = framebuffers[bufferId];
+  drmModeFB2 *fb2 = (drmModeFB2*)calloc(1, sizeof(drmModeFB2));
+  fb2->fb_id = bufferId;
+  fb2->width = f.width;
+  fb2->height = f.height;
+  fb2->pixel_format = f.pixelFormat;
+  fb2->modifier = f.modifier;
+  fb2->flags = DRM_MODE_FB_MODIFIERS;
+  fb2->pitches[0] = f.pitch;
+  fb2->offsets[0] = f.offset;
+  if (!handlesHidden)
+  {
+    fb2->handles[0] = f.buffer + 1 + FAKE_DRM_MAX_BUFFERS*(nextHandleGeneration++ % 1000);
+    ++openGemHandles;
+  }
+  return fb2;
+}
+
+void drmModeFreeFB2(drmModeFB2Ptr ptr)
+{
+  free(ptr);
+}
+
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+  if (request == DRM_IOCTL_GEM_CLOSE)
+  {
+    --openGemHandles;
+    return 0;
+  }
+  if (request == DRM_IOCTL_MODE_MAP_DUMB)
+  {
+    drm_mode_map_dumb *mapDumb = (drm_mode_map_dumb*)arg;
+    FakeBuffer *b = BufferOfHandle(mapDumb->handle);
+    if (!b || b->exportable)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+    mapDumb->offset = b->offset;
+    return 0;
+  }
+  errno = ENOTTY;
+  return -1;
+}
+
+int drmPrimeHandleToFD(int fd, uint32_t handle, uint32_t flags, int *prime_fd)
+{
+  FakeBuffer *b = BufferOfHandle(handle);
+  if (!b || !b->exportable)
+  {
+    errno = ENOSYS;
+    return -1;
+  }
+  *prime_fd = fcntl(b->fd, F_DUPFD_CLOEXEC, 0);
+  return (*prime_fd < 0) ? -1 : 0;
+}
+
+int drmWaitVBlank(int fd, drmVBlankPtr vbl)
+{
+  lastVblankRequest = vbl->request;
+  if (vblankFailing)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  const uint32_t current = FakeDrmVblankSequence();
+  uint32_t target = vbl->request.sequence;
+  if (vbl->request.type & DRM_VBLANK_RELATIVE) target += current;
+  if ((int32_t)(target - current) > 0) hostClock = (uint64_t)target * vblankInterval; // Sleep until the vblank
+  else target = current; // Already passed, reply right away with the current vblank
+  vbl->reply.sequence = target;
+  vbl->reply.tval_sec = (long)(hostClock / 1000000);
+  vbl->reply.tval_usec = (long)(hostClock % 1000000);
+  return 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+// A fake DRM device that implements the libdrm calls of drm_capture.cpp (see fake_libdrm/), for fbcp-drm-capture-check. It has CRTCs that scan out
+// framebuffers of buffers in memory, the way that a KMS driver like vkms does:
+//  - The buffers are memfds. Buffers that can be exported as dma-bufs are exported as a dup of their memfd. The other buffers can only be mapped as
+//    dumb buffers, and live in the memfd that stands for the DRM device itself.
+//  - drmModeGetFB2() creates new GEM handles on each call, like the kernel does. The device counts the handles that were not closed.
+//  - The vblanks of all CRTCs happen every FakeDrmVblankInterval() usecs of hostClock, and drmWaitVBlank() advances hostClock to the vblank that was
+//    waited for.
+
+#define FAKE_DRM_MAX_CRTCS 4
+
+// Creates the device with the given number of CRTCs, all of them off, at fakeDrmDevicePath.
+void InitFakeDrmDevice(int numCrtcs);
+
+// Creates a buffer of the given size, and returns its id. If exportable is false, the buffer can only be mapped as a dumb buffer.
+int CreateFakeDrmBuffer(size_t size, bool exportable);
+
+// Returns a mapping of the buffer, to draw into.
+uint8_t *FakeDrmBufferPixels(int buffer);
+
+// Adds a framebuffer of the given layout over the buffer, and returns its id. Ids of removed framebuffers are reused, like the kernel does.
+uint32_t AddFakeDrmFramebuffer(int buffer, uint32_t width, uint32_t height, uint32_t pixelFormat, uint64_t modifier, uint32_t pitch, uint32_t offset);
+void RemoveFakeDrmFramebuffer(uint32_t fbId);
+
+// Scans out the given framebuffer on the CRTC with the given mode, with the top-left pixel of the mode at (x, y) of the framebuffer. fbId 0 turns the
+// CRTC off.
+void SetFakeDrmCrtc(int crtc, uint32_t fbId, uint32_t x, uint32_t y, const drmModeModeInfo &mode);
+
+// If set, drmModeGetFB2() does not return the GEM handles, as for a caller without CAP_SYS_ADMIN.
+void SetFakeDrmHandlesHidden(bool hidden);
+
+// If set, drmWaitVBlank() fails, as for a CRTC that is off.
+void SetFakeDrmVblankFailing(bool failing);
+
+void SetFakeDrmVblankInterval(uint64_t usecs);
+uint64_t FakeDrmVblankInterval(void);
+
+// Returns the vblank counter at the current hostClock.
+uint32_t FakeDrmVblankSequence(void);
+
+// Returns the request of the most recent drmWaitVBlank() call.
+drmVBlankReq FakeDrmLastVblankRequest(void);
+
+// Returns the number of GEM handles that were not closed.
+int FakeDrmOpenGemHandles(void);
+
+// Returns the number of read-only mappings of the buffers in the process, i.e. the ones that drm_capture.cpp made. FakeDrmBufferPixels() maps them
+// read-write.
+int FakeDrmBufferMappings(void);
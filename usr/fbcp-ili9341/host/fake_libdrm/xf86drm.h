@@ -0,0 +1,74 @@
+#pragma once
+
+// Stands in for the part of libdrm's xf86drm.h that drm_capture.cpp uses, so that fbcp-drm-capture-check can build the DRM capture against the fake
+// DRM device of fake_drm_device.cpp, without libdrm or a DRM driver. The declarations match those of libdrm, the ioctl numbers do not.
+
+#include <inttypes.h>
+#include <fcntl.h> // O_CLOEXEC
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DRM_CLOEXEC O_CLOEXEC
+
+typedef enum
+{
+  DRM_VBLANK_ABSOLUTE = 0x00000000,
+  DRM_VBLANK_RELATIVE = 0x00000001,
+  DRM_VBLANK_HIGH_CRTC_MASK = 0x0000003e,
+  DRM_VBLANK_EVENT = 0x04000000,
+  DRM_VBLANK_FLIP = 0x08000000,
+  DRM_VBLANK_NEXTONMISS = 0x10000000,
+  DRM_VBLANK_SECONDARY = 0x20000000,
+  DRM_VBLANK_SIGNAL = 0x40000000
+} drmVBlankSeqType;
+#define DRM_VBLANK_HIGH_CRTC_SHIFT 1
+
+typedef struct _drmVBlankReq
+{
+  drmVBlankSeqType type;
+  unsigned int sequence;
+  unsigned long signal;
+} drmVBlankReq;
+
+typedef struct _drmVBlankReply
+{
+  drmVBlankSeqType type;
+  unsigned int sequence;
+  long tval_sec;
+  long tval_usec;
+} drmVBlankReply;
+
+typedef union _drmVBlank
+{
+  drmVBlankReq request;
+  drmVBlankReply reply;
+} drmVBlank, *drmVBlankPtr;
+
+struct drm_gem_close
+{
+  uint32_t handle;
+  uint32_t pad;
+};
+
+struct drm_mode_map_dumb
+{
+  uint32_t handle;
+  uint32_t pad;
+  uint64_t offset; // The offset to mmap() the DRM device at
+};
+
+#define DRM_IOCTL_GEM_CLOSE 0x09
+#define DRM_IOCTL_MODE_MAP_DUMB 0xB3
+
+int drmIoctl(int fd, unsigned long request, void *arg);
+int drmWaitVBlank(int fd, drmVBlankPtr vbl);
+int drmPrimeHandleToFD(int fd, uint32_t handle, uint32_t flags, int *prime_fd);
+
+// The path of the fake DRM device. fbcp-drm-capture-check builds drm_capture.cpp with DRM_CAPTURE_DEVICE set to this.
+extern char fakeDrmDevicePath[];
+
+#ifdef __cplusplus
+}
+#endif
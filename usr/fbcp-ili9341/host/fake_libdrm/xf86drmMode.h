@@ -0,0 +1,70 @@
+#pragma once
+
+// Stands in for the part of libdrm's xf86drmMode.h that drm_capture.cpp uses, see xf86drm.h.
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DRM_MODE_FB_MODIFIERS (1<<1) // The modifier field of drmModeFB2 is valid
+
+typedef struct _drmModeModeInfo
+{
+  uint32_t clock; // Pixel clock in kHz
+  uint16_t hdisplay, hsync_start, hsync_end, htotal, hskew;
+  uint16_t vdisplay, vsync_start, vsync_end, vtotal, vscan;
+  uint32_t vrefresh;
+  uint32_t flags;
+  uint32_t type;
+  char name[32];
+} drmModeModeInfo, *drmModeModeInfoPtr;
+
+typedef struct _drmModeRes
+{
+  int count_fbs;
+  uint32_t *fbs;
+  int count_crtcs;
+  uint32_t *crtcs;
+  int count_connectors;
+  uint32_t *connectors;
+  int count_encoders;
+  uint32_t *encoders;
+  uint32_t min_width, max_width;
+  uint32_t min_height, max_height;
+} drmModeRes, *drmModeResPtr;
+
+typedef struct _drmModeCrtc
+{
+  uint32_t crtc_id;
+  uint32_t buffer_id; // The framebuffer that is scanned out, 0 if none
+  uint32_t x, y; // Position of the mode in the framebuffer
+  uint32_t width, height;
+  int mode_valid;
+  drmModeModeInfo mode;
+  int gamma_size;
+} drmModeCrtc, *drmModeCrtcPtr;
+
+typedef struct _drmModeFB2
+{
+  uint32_t fb_id;
+  uint32_t width, height;
+  uint32_t pixel_format; // A DRM_FORMAT_* of drm_fourcc.h
+  uint64_t modifier; // Valid if flags has DRM_MODE_FB_MODIFIERS
+  uint32_t flags;
+  uint32_t handles[4]; // GEM handles of the planes, 0 if the caller may not access them. Close with DRM_IOCTL_GEM_CLOSE
+  uint32_t pitches[4];
+  uint32_t offsets[4];
+} drmModeFB2, *drmModeFB2Ptr;
+
+drmModeResPtr drmModeGetResources(int fd);
+void drmModeFreeResources(drmModeResPtr ptr);
+drmModeCrtcPtr drmModeGetCrtc(int fd, uint32_t crtcId);
+void drmModeFreeCrtc(drmModeCrtcPtr ptr);
+drmModeFB2Ptr drmModeGetFB2(int fd, uint32_t bufferId);
+void drmModeFreeFB2(drmModeFB2Ptr ptr);
+
+#ifdef __cplusplus
+}
+#endif
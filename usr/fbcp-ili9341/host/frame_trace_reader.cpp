@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <string.h> // memcpy
+#include <stdlib.h> // malloc, free
+
+#include "frame_trace_reader.h"
+
+bool OpenFrameTraceReader(FrameTraceReader &reader, const char *filename)
+{
+  memset(&reader, 0, sizeof(reader));
+  reader.file = gzopen(filename, "rb");
+  if (!reader.file)
+  {
+    printf("Failed to open frame trace %s\n", filename);
+    return false;
+  }
+  if (gzread(reader.file, &reader.header, sizeof(reader.header)) != sizeof(reader.header) || reader.header.magic != FRAME_TRACE_MAGIC)
+  {
+    printf("%s is not a frame trace\n", filename);
+    CloseFrameTraceReader(reader);
+    return false;
+  }
+  if (reader.header.version != FRAME_TRACE_VERSION || reader.header.width == 0 || reader.header.height == 0 || reader.header.height >= FRAME_TRACE_NEW_SCANLINE)
+  {
+    printf("Frame trace %s has an unsupported version %u or size %ux%u\n", filename, reader.header.version, reader.header.width, reader.header.height);
+    CloseFrameTraceReader(reader);
+    return false;
+  }
+  reader.prevFrame = (uint16_t*)malloc(reader.header.width*reader.header.height*sizeof(uint16_t));
+  return true;
+}
+
+bool ReadFrameTraceFrame(FrameTraceReader &reader, uint16_t *frame, uint32_t *usecsSincePrevFrame)
+{
+  const int W = reader.header.width, H = reader.header.height;
+  if (gzread(reader.file, usecsSincePrevFrame, sizeof(uint32_t)) != sizeof(uint32_t)) return false;
+  for(int y = 0; y < H; ++y)
+  {
+    uint16_t ref;
+    if (gzread(reader.file, &ref, sizeof(ref)) != sizeof(ref)) return false;
+    if (ref == FRAME_TRACE_NEW_SCANLINE)
+    {
+      if (gzread(reader.file, frame + y*W, W*sizeof(uint16_t)) != (int)(W*sizeof(uint16_t))) return false;
+    }
+    else if (ref < H && reader.numFrames > 0)
+      memcpy(frame + y*W, reader.prevFrame + ref*W, W*sizeof(uint16_t));
+    else
+    {
+      printf("Frame %d of the frame trace refers to scanline %d that does not exist\n", reader.numFrames, ref);
+      return false;
+    }
+  }
+  memcpy(reader.prevFrame, frame, W*H*sizeof(uint16_t));
+  ++reader.numFrames;
+  return true;
+}
+
+void CloseFrameTraceReader(FrameTraceReader &reader)
+{
+  if (reader.file) gzclose(reader.file);
+  free(reader.prevFrame);
+  memset(&reader, 0, sizeof(reader));
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <inttypes.h>
+#include <zlib.h>
+
+#include "frame_trace.h"
+
+// Reads the frame traces that RECORD_FRAME_TRACE and fbcp-trace-generator write (see frame_trace.h), either as is, or compressed with gzip.
+struct FrameTraceReader
+{
+  gzFile file;
+  FrameTraceHeader header;
+  int numFrames;
+  uint16_t *prevFrame; // The previously read frame, header.width*header.height pixels
+};
+
+// Opens the given trace and reads its header. Prints the reason and returns false if the file is not a frame trace.
+bool OpenFrameTraceReader(FrameTraceReader &reader, const char *filename);
+
+// Reads the next frame of the trace to frame, header.width*header.height pixels packed without padding. Returns false at the end of the trace.
+bool ReadFrameTraceFrame(FrameTraceReader &reader, uint16_t *frame, uint32_t *usecsSincePrevFrame);
+
+void CloseFrameTraceReader(FrameTraceReader &reader);
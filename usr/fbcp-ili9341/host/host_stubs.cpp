@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h> // posix_memalign, exit
+#include <string.h> // memset, memcpy
+#include <time.h> // clock_gettime
+
+#include "config.h"
+#include "host_stubs.h"
+#include "display.h"
+#include "gpu.h"
+#include "spi.h"
+
+volatile uint64_t hostClock = 0;
+volatile uint64_t *systemTimerRegister = &hostClock;
+
+int displayXOffset = 0;
+int displayYOffset = 0;
+int gpuFrameWidth = 0;
+int gpuFrameHeight = 0;
+int gpuFramebufferScanlineStrideBytes = 0;
+int gpuFramebufferSizeBytes = 0;
+int excessPixelsLeft = 0, excessPixelsRight = 0, excessPixelsTop = 0, excessPixelsBottom = 0;
+int gpuDisplayWidth = 0, gpuDisplayHeight = 0;
+
+double spiUsecsPerByte = 0;
+SharedMemory *spiTaskMemory = 0;
+
+void InitHostFrameSize(int width, int height)
+{
+  gpuFrameWidth = width;
+  gpuFrameHeight = height;
+  gpuFramebufferScanlineStrideBytes = (width*2 + 31) & ~31;
+  gpuFramebufferSizeBytes = gpuFramebufferScanlineStrideBytes * height;
+  gpuDisplayWidth = width; // The frames are taken to be captured unscaled and uncropped from a source display of the same size
+  gpuDisplayHeight = height;
+  displayXOffset = DISPLAY_COVERED_LEFT_SIDE + (DISPLAY_DRAWABLE_WIDTH - width) / 2;
+  displayYOffset = DISPLAY_COVERED_TOP_SIDE + (DISPLAY_DRAWABLE_HEIGHT - height) / 2;
+}
+
+void InitHostSPIBusSpeed(double busMhz)
+{
+  spiUsecsPerByte = 8.0 / busMhz;
+}
+
+void InitHostSPITaskQueue()
+{
+  // The queue is used the same way as in the driver, so give it the size that the driver maps for it
+  spiTaskMemory = (SharedMemory*)calloc(1, SHARED_MEMORY_SIZE);
+  if (!spiTaskMemory)
+  {
+    printf("Failed to allocate the SPI task queue\n");
+    exit(1);
+  }
+}
+
+void ClearHostSPITaskQueue()
+{
+  spiTaskMemory->queueHead = spiTaskMemory->queueTail = 0;
+  spiTaskMemory->spiBytesQueued = 0;
+}
+
+// The queued tasks are never run: the panel model of VERIFY_HARDWARE_SCROLLING sees them as they are committed.
+void RunSPITask(SPITask *task) {}
+void DoneTask(SPITask *task) {}
+
+uint16_t *AllocHostFramebuffer()
+{
+  void *framebuffer = 0;
+  if (posix_memalign(&framebuffer, 32, gpuFramebufferSizeBytes))
+  {
+    printf("Failed to allocate a framebuffer of %d bytes\n", gpuFramebufferSizeBytes);
+    exit(1);
+  }
+  memset(framebuffer, 0, gpuFramebufferSizeBytes);
+  return (uint16_t*)framebuffer;
+}
+
+void CopyToHostFramebuffer(uint16_t *framebuffer, const uint16_t *packedFrame)
+{
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    memcpy(framebuffer + y*(gpuFramebufferScanlineStrideBytes>>1), packedFrame + y*gpuFrameWidth, gpuFrameWidth*sizeof(uint16_t));
+}
+
+uint64_t HostNsecs()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <inttypes.h>
+
+// The host tools build the differs, span merging and hardware scrolling of the driver for the development machine, without the GPU capture and the
+// SPI backend. These stand in for the parts of gpu.cpp and spi.cpp that the built sources refer to.
+
+// The clock that tick() reads. The tools advance it by the recorded time between the frames of the trace that they replay, so that the driver code
+// sees the frames arrive at their recorded pace.
+extern volatile uint64_t hostClock;
+
+// Sets the size globals of gpu.cpp for frames of the given size, with the scanline stride padded like InitGPU() does, and centers the frames on the display.
+// The source display that the frames are captured from is taken to be the size of the frames.
+void InitHostFrameSize(int width, int height);
+
+// Sets spiUsecsPerByte for the given SPI bus clock, in MHz.
+void InitHostSPIBusSpeed(double busMhz);
+
+// Allocates an empty SPI task queue. The queued tasks are never run: call ClearHostSPITaskQueue() to drop them when done with them.
+void InitHostSPITaskQueue(void);
+void ClearHostSPITaskQueue(void);
+
+// Allocates a zeroed framebuffer of gpuFramebufferSizeBytes, aligned like the frames of the frame pool.
+uint16_t *AllocHostFramebuffer(void);
+
+// Copies a frame of gpuFrameWidth x gpuFrameHeight pixels, packed without any padding, to the given framebuffer.
+void CopyToHostFramebuffer(uint16_t *framebuffer, const uint16_t *packedFrame);
+
+// Returns the time of the monotonic clock in nanoseconds, for timing the code under test.
+uint64_t HostNsecs(void);
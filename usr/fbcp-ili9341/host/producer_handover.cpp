@@ -0,0 +1,187 @@
+// fbcp-producer-handover: hands frames over from the producer library (producer/fbcp_producer.h) to the consumer side of CAPTURE_FROM_PRODUCER
+// through the shared memory triple buffer, the same way that an application and fbcp-ili9341 do. A producer thread renders numbered frames at the
+// given rate, while the main thread plays the GPU polling thread: it sleeps on the doorbell with WaitForProducerFrame(), and takes each frame with
+// SnapshotProducerFramebuffer(). Each taken frame is checked to hold one whole frame (not parts of two), with the sequence number that the producer
+// submitted it with, and newer than the previously taken one. Prints how many frames were dropped (or failed the checks), how long the taken frames
+// took from being submitted to being taken, and how long taking and sampling a frame took. Exits with 1 if any taken frame failed the checks.
+//
+// The tool creates the shared memory segment FBCP_PRODUCER_SHM_NAME, and removes it when done, so do not run it while fbcp-ili9341 is running with
+// CAPTURE_FROM_PRODUCER.
+//
+// Usage: fbcp-producer-handover [-f fps] [-n frames]
+// -f 0 submits the frames as fast as the producer thread can draw them, which drops most of them.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h> // strcmp
+#include <sys/mman.h> // shm_unlink
+#include <syslog.h> // FATAL_ERROR
+#include <unistd.h> // usleep
+
+#include "config.h"
+#include "gpu.h"
+#include "producer/fbcp_producer.h"
+#include "producer_capture.h"
+#include "capture_sampler.h"
+#include "util.h"
+#include "host_stubs.h"
+
+volatile bool programRunning = true; // Read by WaitForProducerFrame(). Cleared once the producer has submitted all of its frames
+
+static int framesPerSecond = 60;
+static int numFrames = 600;
+static uint64_t *submitUsecs = 0; // The time that each frame was submitted at
+
+static uint64_t MonotonicUsecs()
+{
+  return HostNsecs() / 1000;
+}
+
+// The pixel at (x, y) of the frame with the given index. Every pixel changes from one frame to the next, and the top-left pixel holds the index.
+static uint16_t FramePixel(int index, int x, int y)
+{
+  return (uint16_t)(index + x*7 + y*13);
+}
+
+static void *ProducerThread(void *unused)
+{
+  fbcp_producer *producer = fbcp_producer_open(0);
+  if (!producer) FATAL_ERROR("Failed to open the shared memory segment as the producer!");
+  int width, height, stride;
+  fbcp_producer_get_size(producer, &width, &height, &stride);
+
+  uint64_t nextFrame = MonotonicUsecs();
+  for(int i = 0; i < numFrames; ++i)
+  {
+    uint16_t *buffer = fbcp_producer_back_buffer(producer);
+    for(int y = 0; y < height; ++y)
+      for(int x = 0; x < width; ++x)
+        buffer[y*(stride>>1) + x] = FramePixel(i, x, y);
+    submitUsecs[i] = MonotonicUsecs(); // Before submitting, since the frame may be taken right away
+    fbcp_producer_submit(producer, 0, 0);
+
+    if (framesPerSecond > 0)
+    {
+      nextFrame += 1000000 / framesPerSecond;
+      uint64_t now = MonotonicUsecs();
+      if (nextFrame > now) usleep(nextFrame - now);
+      else nextFrame = now;
+    }
+  }
+  // Let the consumer take the last frame before telling it to stop
+  usleep(100000);
+  programRunning = false;
+  fbcp_producer_close(producer);
+  return 0;
+}
+
+// Returns true if the captured frame holds the whole source frame with the given index
+static bool FrameIsWhole(const uint16_t *framebuffer, int index)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    for(int x = 0; x < gpuFrameWidth; ++x)
+    {
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+      const uint16_t expected = FramePixel(index, y, x); // The captured frame is transposed from the source
+#else
+      const uint16_t expected = FramePixel(index, x, y);
+#endif
+      if (framebuffer[y*stride + x] != expected) return false;
+    }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  int arg = 1;
+  for(; arg+1 < argc; arg += 2)
+  {
+    if (!strcmp(argv[arg], "-f")) framesPerSecond = atoi(argv[arg+1]);
+    else if (!strcmp(argv[arg], "-n")) numFrames = atoi(argv[arg+1]);
+    else break;
+  }
+  // The top-left pixel of a frame holds its index, so the index must fit in 16 bits
+  if (arg < argc || framesPerSecond < 0 || numFrames <= 0 || numFrames > 65536)
+  {
+    printf("Usage: %s [-f fps] [-n frames]\n", argv[0]);
+    return 1;
+  }
+
+  shm_unlink(FBCP_PRODUCER_SHM_NAME); // Start from a fresh triple buffer, not from one that a previous run left behind
+  int width, height;
+  InitProducerCapture(&width, &height);
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  InitHostFrameSize(height, width);
+#else
+  InitHostFrameSize(width, height);
+#endif
+  SetCaptureRectangle(0, 0, gpuFrameWidth, gpuFrameHeight);
+  uint16_t *framebuffer = AllocHostFramebuffer();
+  submitUsecs = new uint64_t[numFrames];
+
+  // A second handle to the segment, only to read the sequence number and time that the consumer side reports for each taken frame
+  fbcp_producer *observer = fbcp_producer_open(0);
+  if (!observer) FATAL_ERROR("Failed to open the shared memory segment!");
+
+  pthread_t producerThread;
+  if (pthread_create(&producerThread, 0, ProducerThread, 0) != 0) FATAL_ERROR("Failed to create the producer thread!");
+
+  int numTaken = 0, numTorn = 0, numWrongSequence = 0, numOutOfOrder = 0, prevIndex = -1;
+  uint32_t firstSequence = 0;
+  uint64_t totalLatency = 0, maxLatency = 0, snapshotNsecs = 0;
+  for(;;)
+  {
+    WaitForProducerFrame(0);
+    uint64_t t0 = HostNsecs();
+    if (!SnapshotProducerFramebuffer(framebuffer))
+    {
+      if (!programRunning) break;
+      continue;
+    }
+    snapshotNsecs += HostNsecs() - t0;
+    uint64_t takenUsecs;
+    const uint32_t sequence = fbcp_producer_last_taken(observer, &takenUsecs);
+
+    const int index = framebuffer[0];
+    if (numTaken++ == 0) firstSequence = sequence - index;
+    if (index >= numFrames || !FrameIsWhole(framebuffer, index))
+    {
+      if (numTorn++ == 0) printf("Taken frame %d does not hold one whole frame\n", numTaken);
+      continue;
+    }
+    if (sequence - index != firstSequence)
+    {
+      if (numWrongSequence++ == 0) printf("Frame %d was taken with sequence number %u, expected %u\n", index, sequence, firstSequence + index);
+      continue;
+    }
+    if (index <= prevIndex)
+    {
+      if (numOutOfOrder++ == 0) printf("Frame %d was taken after frame %d\n", index, prevIndex);
+      continue;
+    }
+    prevIndex = index;
+
+    const uint64_t latency = takenUsecs - submitUsecs[index];
+    totalLatency += latency;
+    maxLatency = MAX(maxLatency, latency);
+  }
+  pthread_join(producerThread, 0);
+
+  const int numMeasured = numTaken - numTorn - numWrongSequence - numOutOfOrder; // The frames that passed the checks
+  printf("%d frames of %dx%d submitted", numFrames, width, height);
+  if (framesPerSecond > 0) printf(" at %d fps", framesPerSecond);
+  else printf(" as fast as they were drawn");
+  printf(", %d taken, %d dropped. Submit to take: average %.3f msecs, max %.3f msecs. Taking and sampling a frame: %.3f msecs\n", numTaken,
+    numFrames - numMeasured, totalLatency / 1000.0 / MAX(1, numMeasured), maxLatency / 1000.0, snapshotNsecs / 1e6 / MAX(1, numTaken));
+  if (numTorn || numWrongSequence || numOutOfOrder)
+    printf("%d torn frames, %d frames with the wrong sequence number, %d frames out of order\n", numTorn, numWrongSequence, numOutOfOrder);
+
+  fbcp_producer_close(observer);
+  DeinitProducerCapture();
+  shm_unlink(FBCP_PRODUCER_SHM_NAME);
+  delete[] submitUsecs;
+  free(framebuffer);
+  return (numTaken == 0 || numTorn || numWrongSequence || numOutOfOrder) ? 1 : 0;
+}
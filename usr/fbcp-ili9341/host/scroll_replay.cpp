@@ -0,0 +1,166 @@
+// fbcp-scroll-replay: replays frame traces through the hardware scrolling of USE_HARDWARE_SCROLLING, and checks after each frame, with the panel model
+// of VERIFY_HARDWARE_SCROLLING, that the display would show what the driver believes it shows. Each frame is diffed against the previous frame like the
+// main loop does: detect and apply a vertical scroll, diff, merge the spans of a progressive update, split them at the scroll wrap, and queue them to
+// the display. Exits with 1 if the display would show stale pixels on any frame.
+//
+// To check that the panel model does catch the bugs that it is there for, -m seeds one of them into the replay, after which the tool exits with 1 if
+// the model did NOT report a mismatch:
+//   -m 1: after each scroll, send the display a scroll start that is off by one row from what the previous frame was shifted by
+//   -m 2: write the spans to the display rows of the unscrolled display, as if DISPLAY_SCANLINE_Y() did not apply the scroll
+//   -m 3: do not split the spans at the scroll wrap, so that the spans that cross it write past the end of the scroll area. Only spans that are
+//         merged across scanlines can cross the wrap, so this goes unnoticed on builds whose span merging keeps the scanlines apart.
+//
+// Usage: fbcp-scroll-replay [-i] [-m mutation] <trace> [<trace> ...]
+// -i updates the frames interlaced, alternating between the even and the odd field, rather than progressively.
+
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h> // memset, strcmp
+
+#include "config.h"
+#include "display.h"
+#include "diff.h"
+#include "gpu.h"
+#include "spi.h"
+#include "scroll.h"
+#include "panel_model.h"
+#include "util.h"
+#include "host_stubs.h"
+#include "frame_trace_reader.h"
+
+#define MUTATION_OFF_BY_ONE_SCROLL_START 1
+#define MUTATION_UNSCROLLED_DISPLAY_ROWS 2
+#define MUTATION_NO_SPLIT_AT_WRAP 3
+
+static int mutation = 0;
+
+static int bytesTransferred = 0; // Counted by the QUEUE_* macros of spi.h
+
+// Clears the whole display like ClearScreen() does at startup, so that the panel model starts out equal to the zeroed previous framebuffer.
+static void QueueClearDisplay()
+{
+  QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_X, 0, DISPLAY_WIDTH-1);
+  QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_Y, 0, DISPLAY_HEIGHT-1);
+  SPITask *task = AllocTask(DISPLAY_WIDTH*DISPLAY_HEIGHT*SPI_BYTESPERPIXEL);
+  task->cmd = DISPLAY_WRITE_PIXELS;
+  memset(task->data, 0, task->size);
+  CommitTask(task);
+  ClearHostSPITaskQueue();
+}
+
+// Queues the pixels of the given span of the new frame to the display, and copies them over to the previous frame, like the submit loop of the main
+// loop does. Always sets the full write window, which is what MUST_SEND_FULL_CURSOR_WINDOW displays do.
+static void QueueSpan(const Span &span, const uint16_t *framebuffer, uint16_t *prevFramebuffer)
+{
+  if (mutation == MUTATION_UNSCROLLED_DISPLAY_ROWS)
+    QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_Y, displayYOffset + span.y, DISPLAY_SCANLINE_END_Y);
+  else
+    QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_Y, DISPLAY_SCANLINE_Y(span.y), DISPLAY_SCANLINE_END_Y);
+  QUEUE_SET_WRITE_WINDOW_TASK(DISPLAY_SET_CURSOR_X, displayXOffset + span.x, displayXOffset + span.endX - 1);
+  SPITask *task = AllocTask(span.Size()*SPI_BYTESPERPIXEL);
+  task->cmd = DISPLAY_WRITE_PIXELS;
+  uint8_t *data = task->data;
+  const int stride = gpuFramebufferScanlineStrideBytes >> 1;
+  for(int y = span.y; y < span.endY; ++y)
+    for(int x = span.x, endX = (y + 1 == span.endY) ? span.lastScanEndX : span.endX; x < endX; ++x)
+    {
+      uint16_t pixel = framebuffer[y*stride + x];
+      *data++ = pixel >> 8;
+      *data++ = pixel & 0xFF;
+      prevFramebuffer[y*stride + x] = pixel;
+    }
+  CommitTask(task);
+}
+
+// Queues a scroll start command that shows the display memory one row further than the one that ApplyHardwareScroll() scrolled to.
+static void QueueOffByOneScrollStart()
+{
+  const int row = scrollAreaTop + (scrollOffset + 1) % scrollAreaHeight;
+#ifdef DISPLAY_SET_CURSOR_IS_8_BIT
+  QUEUE_SPI_TRANSFER(DISPLAY_SET_SCROLL_START, (uint8_t)row);
+#else
+  QUEUE_SPI_TRANSFER(DISPLAY_SET_SCROLL_START, (uint8_t)(row >> 8), (uint8_t)(row & 0xFF));
+#endif
+}
+
+int main(int argc, char **argv)
+{
+  bool interlaced = false;
+  int firstTrace = 1;
+  for(; firstTrace < argc && argv[firstTrace][0] == '-'; ++firstTrace)
+  {
+    if (!strcmp(argv[firstTrace], "-i")) interlaced = true;
+    else if (!strcmp(argv[firstTrace], "-m") && firstTrace+1 < argc) mutation = atoi(argv[++firstTrace]);
+    else break;
+  }
+  if (firstTrace >= argc || mutation < 0 || mutation > MUTATION_NO_SPLIT_AT_WRAP)
+  {
+    printf("Usage: %s [-i] [-m mutation] <trace> [<trace> ...]\n", argv[0]);
+    return 1;
+  }
+
+  InitHostSPITaskQueue();
+  int totalFramesWithMismatches = 0;
+  for(int t = firstTrace; t < argc; ++t)
+  {
+    FrameTraceReader trace;
+    if (!OpenFrameTraceReader(trace, argv[t])) return 1;
+    InitHostFrameSize(trace.header.width, trace.header.height);
+    uint16_t *packedFrame = new uint16_t[gpuFrameWidth*gpuFrameHeight];
+    uint16_t *framebuffer = AllocHostFramebuffer(), *prevFramebuffer = AllocHostFramebuffer();
+    InitScanlineHashes(framebuffer, prevFramebuffer);
+    InitDirtyTiles();
+    ComputeScanlineHashes(prevFramebuffer, prevScanlineHashes);
+    QueueClearDisplay();
+    InitHardwareScrolling();
+    ClearHostSPITaskQueue();
+
+    SpanArray spans = {};
+    int numFrames = 0, numScrolls = 0, numFramesWithMismatches = 0;
+    uint32_t usecs;
+    for(int f = 0; ReadFrameTraceFrame(trace, packedFrame, &usecs); ++f, ++numFrames)
+    {
+      CopyToHostFramebuffer(framebuffer, packedFrame);
+      ComputeScanlineHashes(framebuffer, scanlineHashes);
+
+      int scroll = DetectVerticalScroll();
+      if (scroll != 0)
+      {
+        ++numScrolls;
+        ApplyHardwareScroll(scroll, framebuffer, prevFramebuffer);
+        if (mutation == MUTATION_OFF_BY_ONE_SCROLL_START) QueueOffByOneScrollStart();
+      }
+
+      // The previous frame is only partially brought up to date by the interlaced updates, so its dirty tiles are recomputed from scratch each frame.
+      ComputeDirtyTiles(framebuffer, prevFramebuffer, 0);
+      const int interlacedField = interlaced ? (f & 1) : 0;
+      DiffStats stats;
+      DiffFramebuffersToScanlineSpansExact(framebuffer, prevFramebuffer, interlaced, interlacedField, spans, stats);
+      if (!interlaced) MergeScanlineSpanList(spans);
+      if (mutation != MUTATION_NO_SPLIT_AT_WRAP) SplitSpansAtScrollWrap(spans);
+
+      for(int i = 0; i < spans.numSpans; ++i)
+        QueueSpan(spans.spans[i], framebuffer, prevFramebuffer);
+      UpdatePrevScanlineHashes(interlaced ? 2 : 1, interlacedField);
+
+      if (VerifyPanelModel(prevFramebuffer) > 0) ++numFramesWithMismatches;
+      ClearHostSPITaskQueue();
+    }
+
+    printf("%s: %d frames of %dx%d, %s update, %d hardware scrolls, %d frames where the display showed stale pixels\n", argv[t], numFrames,
+      gpuFrameWidth, gpuFrameHeight, interlaced ? "interlaced" : "progressive", numScrolls, numFramesWithMismatches);
+    totalFramesWithMismatches += numFramesWithMismatches;
+
+    CloseFrameTraceReader(trace);
+    delete[] packedFrame;
+    free(framebuffer);
+    free(prevFramebuffer);
+  }
+
+  if (mutation != 0)
+  {
+    printf("Seeded bug %d was %s by the panel model\n", mutation, totalFramesWithMismatches ? "caught" : "NOT caught");
+    return totalFramesWithMismatches ? 0 : 1;
+  }
+  return totalFramesWithMismatches ? 1 : 0;
+}
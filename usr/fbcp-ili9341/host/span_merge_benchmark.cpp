@@ -0,0 +1,156 @@
+// fbcp-span-merge-benchmark: replays frame traces through the span differ, merges the spans of each frame both with MergeScanlineSpanList() and with the
+// old greedy method, and prints the time that submitting the unmerged and the merged spans would take at each of the given SPI bus speeds, along with
+// the CPU time that each merge took, and how much memory the span array grew to. The submit time is estimated with the same model that MergeScanlineSpanList() decides with (see
+// EstimateSpanArrayUsecs()), so this shows how the merge responds to the bus speed and to SPI_POLLED_TASK_OVERHEAD_USECS/SPI_DMA_TASK_OVERHEAD_USECS,
+// not how long the display actually takes. Exits with 1 if a merge leaves some changed pixel uncovered.
+//
+// Usage: fbcp-span-merge-benchmark [-b MHz[,MHz...]] <trace> [<trace> ...]
+// All traces must have the same frame size. Build with -DDRIVER_FLAGS="... -DALL_TASKS_SHOULD_DMA" to see the merge with the DMA task cost.
+
+#include <stdio.h>
+#include <stdlib.h> // strtod
+#include <string.h> // memcpy, memset, strcmp
+
+#include "config.h"
+#include "diff.h"
+#include "gpu.h"
+#include "util.h"
+#include "host_stubs.h"
+#include "frame_trace_reader.h"
+
+#define MAX_BUS_SPEEDS 8
+#define LINKED_LIST_SPAN_BYTES 20 // Size of a span on 32-bit ARM back when spans were a linked list in a preallocated array of gpuFrameWidth*gpuFrameHeight/2 spans
+#define NUM_MERGE_METHODS 3
+
+static const char *mergeMethodNames[NUM_MERGE_METHODS] = { "unmerged", "greedy", "cost model" };
+
+static void CopySpanArray(const SpanArray &src, SpanArray &dst)
+{
+  ReserveSpans(dst, src.numSpans);
+  memcpy(dst.spans, src.spans, src.numSpans*sizeof(Span));
+  dst.numSpans = src.numSpans;
+}
+
+// Returns true if the merged spans cover every pixel of the unmerged spans. coverage is a scratch bitmap of gpuFrameWidth*gpuFrameHeight bytes.
+static bool MergedSpansCoverSpans(const SpanArray &merged, const SpanArray &spans, uint8_t *coverage)
+{
+  memset(coverage, 0, gpuFrameWidth*gpuFrameHeight);
+  for(const Span *s = merged.spans; s < merged.spans + merged.numSpans; ++s)
+    for(int y = s->y; y < s->endY; ++y)
+      memset(coverage + y*gpuFrameWidth + s->x, 1, (y+1 < s->endY ? s->endX : s->lastScanEndX) - s->x);
+  for(const Span *s = spans.spans; s < spans.spans + spans.numSpans; ++s)
+    for(int y = s->y; y < s->endY; ++y)
+      for(int x = s->x; x < (y+1 < s->endY ? s->endX : s->lastScanEndX); ++x)
+        if (!coverage[y*gpuFrameWidth + x]) return false;
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  double busMhz[MAX_BUS_SPEEDS] = { 25, 50, 100 };
+  int numBusSpeeds = 3;
+  int firstTrace = 1;
+  if (argc > 2 && !strcmp(argv[1], "-b"))
+  {
+    numBusSpeeds = 0;
+    for(char *s = argv[2]; *s && numBusSpeeds < MAX_BUS_SPEEDS; )
+    {
+      busMhz[numBusSpeeds++] = strtod(s, &s);
+      if (*s == ',') ++s;
+      else break;
+    }
+    firstTrace = 3;
+  }
+  if (firstTrace >= argc || numBusSpeeds == 0 || busMhz[0] <= 0)
+  {
+    printf("Usage: %s [-b MHz[,MHz...]] <trace> [<trace> ...]\n", argv[0]);
+    return 1;
+  }
+
+  printf("Fixed cost of an SPI task: %.1f usecs%s\n", (double)SPI_TASK_OVERHEAD_USECS,
+#ifdef ALL_TASKS_SHOULD_DMA
+    " (ALL_TASKS_SHOULD_DMA)"
+#else
+    ""
+#endif
+  );
+
+  int numUncovered = 0;
+  for(int t = firstTrace; t < argc; ++t)
+  {
+    FrameTraceReader trace;
+    if (!OpenFrameTraceReader(trace, argv[t])) return 1;
+    InitHostFrameSize(trace.header.width, trace.header.height);
+    uint16_t *packedFrame = new uint16_t[gpuFrameWidth*gpuFrameHeight];
+    uint8_t *coverage = new uint8_t[gpuFrameWidth*gpuFrameHeight];
+    uint16_t *framebuffer = AllocHostFramebuffer(), *prevFramebuffer = AllocHostFramebuffer();
+    InitScanlineHashes(framebuffer, prevFramebuffer);
+    InitDirtyTiles();
+
+    SpanArray spans = {}, mergedSpans = {};
+    ReserveSpans(spans, gpuFrameHeight); // Like main() does for frameSpans
+    int maxSpansPerFrame = 0;
+    double submitUsecs[MAX_BUS_SPEEDS][NUM_MERGE_METHODS] = {};
+    uint64_t mergeNsecs[MAX_BUS_SPEEDS][NUM_MERGE_METHODS] = {};
+    int numSpans[MAX_BUS_SPEEDS][NUM_MERGE_METHODS] = {};
+    int numFramePairs = 0;
+    uint32_t usecs;
+    for(int f = 0; ReadFrameTraceFrame(trace, packedFrame, &usecs); ++f)
+    {
+      uint16_t *tmp = prevFramebuffer; prevFramebuffer = framebuffer; framebuffer = tmp;
+      CopyToHostFramebuffer(framebuffer, packedFrame);
+      if (f == 0) continue;
+
+      ComputeScanlineHashes(framebuffer, scanlineHashes);
+      ComputeScanlineHashes(prevFramebuffer, prevScanlineHashes);
+      ComputeDirtyTiles(framebuffer, prevFramebuffer, 0);
+      DiffStats stats;
+      DiffFramebuffersToScanlineSpansExact(framebuffer, prevFramebuffer, false, 0, spans, stats);
+      if (spans.numSpans == 0) continue;
+      ++numFramePairs;
+      maxSpansPerFrame = MAX(maxSpansPerFrame, spans.numSpans);
+
+      for(int b = 0; b < numBusSpeeds; ++b)
+      {
+        InitHostSPIBusSpeed(busMhz[b]);
+        for(int m = 0; m < NUM_MERGE_METHODS; ++m)
+        {
+          CopySpanArray(spans, mergedSpans);
+          uint64_t t0 = HostNsecs();
+          if (m == 1) MergeScanlineSpanListGreedy(mergedSpans);
+          else if (m == 2) MergeScanlineSpanList(mergedSpans);
+          mergeNsecs[b][m] += HostNsecs() - t0;
+          submitUsecs[b][m] += EstimateSpanArrayUsecs(mergedSpans);
+          numSpans[b][m] += mergedSpans.numSpans;
+          if (m > 0 && !MergedSpansCoverSpans(mergedSpans, spans, coverage))
+          {
+            if (numUncovered++ == 0)
+              printf("%s: the %s merge at %.1f MHz left changed pixels of frame %d uncovered\n", argv[t], mergeMethodNames[m], busMhz[b], f);
+          }
+        }
+      }
+    }
+
+    const int n = MAX(1, numFramePairs);
+    printf("%s: %d frame pairs of %dx%d with changes\n", argv[t], numFramePairs, gpuFrameWidth, gpuFrameHeight);
+    for(int b = 0; b < numBusSpeeds; ++b)
+    {
+      printf("  %.1f MHz:", busMhz[b]);
+      for(int m = 0; m < NUM_MERGE_METHODS; ++m)
+      {
+        printf("%s %s: %.1f spans, %.0f usecs/frame to submit", m ? "," : "", mergeMethodNames[m], (double)numSpans[b][m] / n, submitUsecs[b][m] / n);
+        if (m > 0) printf(" (merged in %llu ns)", (unsigned long long)(mergeNsecs[b][m] / n));
+      }
+      printf("\n");
+    }
+    printf("  span array: up to %d spans per frame, grew to %d spans = %d bytes (a linked list of spans would take %d bytes)\n", maxSpansPerFrame,
+      spans.capacity, spans.capacity*(int)sizeof(Span), gpuFrameWidth*gpuFrameHeight/2*LINKED_LIST_SPAN_BYTES);
+
+    CloseFrameTraceReader(trace);
+    delete[] packedFrame;
+    delete[] coverage;
+    free(framebuffer);
+    free(prevFramebuffer);
+  }
+  return numUncovered ? 1 : 0;
+}
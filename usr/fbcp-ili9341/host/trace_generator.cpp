@@ -0,0 +1,247 @@
+// fbcp-trace-generator: renders synthetic frame traces, for replaying with the other host tools when no trace recorded on a Pi with RECORD_FRAME_TRACE
+// is at hand. The scenes are drawn with a fixed seed, so the same command always produces the same trace.
+//
+// Usage: fbcp-trace-generator <scroll|desktop> <output file> [number of frames] [width height]
+// The frames are the size of the display that the tools are built for by default, which is how the driver captures them.
+//  - scroll: a page of text that is read through like in a terminal or a text editor: it scrolls smoothly by a few scanlines per frame for a while,
+//    sometimes jumps by half a page, and stays still in between. A status bar at the bottom shows the line number.
+//  - desktop: two windows on a patterned desktop: text is typed into one, a progress bar advances in the other, the mouse cursor moves around, a
+//    clock ticks on the taskbar, and every now and then the window with the progress bar is dragged around.
+
+#include <stdio.h>
+#include <stdlib.h> // atoi, exit
+#include <string.h> // strcmp, memcpy, memset
+
+#include "config.h"
+#include "display.h"
+#include "frame_trace.h"
+#include "text.h"
+#include "util.h"
+
+#define FRAME_USECS 16667 // The scenes animate at 60fps
+#define LINE_HEIGHT 10
+#define CHAR_WIDTH (MONACO_WIDTH+1)
+
+static uint32_t rng = 1;
+static int Random(int n)
+{
+  rng = rng * 1664525u + 1013904223u;
+  return (int)((rng >> 8) % (uint32_t)n);
+}
+
+static int W, H;
+static uint16_t *frame;
+
+static void FillRect(int x, int y, int w, int h, uint16_t color)
+{
+  for(int j = MAX(0, y); j < MIN(H, y+h); ++j)
+    for(int i = MAX(0, x); i < MIN(W, x+w); ++i)
+      frame[j*W+i] = color;
+}
+
+// Draws text with the font of the statistics overlay. DrawText() draws in the orientation of the display that the driver is built for, whereas the
+// scenes are drawn in the orientation of the trace, so this draws the glyphs itself.
+static void Text(int x, int y, const char *text, uint16_t color, uint16_t bgColor)
+{
+  for(; *text; ++text, x += CHAR_WIDTH)
+  {
+    uint8_t ch = (uint8_t)*text;
+    ch = (ch < 32 || ch >= 127) ? 0 : ch - 32;
+    const uint8_t *glyph = monaco_font + ch*MONACO_BYTES_PER_CHAR;
+    // Like DrawText(), the glyph rows start monaco_height_adjust[ch] rows down, and the cell has one row of background above it
+    for(int j = -1; j < MONACO_HEIGHT - 1; ++j)
+      for(int i = 0; i < CHAR_WIDTH; ++i)
+      {
+        if (x+i < 0 || x+i >= W || y+j < 0 || y+j >= H) continue;
+        int bit = (j - monaco_height_adjust[ch])*MONACO_WIDTH + i;
+        frame[(y+j)*W + x+i] = (i < MONACO_WIDTH && bit >= 0 && (glyph[bit>>3] & (1 << (bit&7)))) ? color : bgColor;
+      }
+  }
+}
+
+static const char *words[] = { "the", "frame", "is", "diffed", "against", "what", "the", "display", "shows", "and", "only", "changed", "spans", "are",
+  "sent", "over", "SPI", "bus", "to", "panel", "scanline", "pixels", "of", "a", "window", "cursor", "command", "DMA", "task", "queue", "for", "each" };
+
+// Fills the given buffer with a line of random words that fits in maxChars characters
+static void RandomLine(char *line, int maxChars)
+{
+  int len = 0;
+  line[0] = 0;
+  if (Random(8) == 0) return; // An empty line between paragraphs
+  int indent = Random(4) == 0 ? 2 * (1 + Random(3)) : 0;
+  for(; len < indent; ++len) line[len] = ' ';
+  for(;;)
+  {
+    const char *word = words[Random(sizeof(words)/sizeof(words[0]))];
+    int wordLen = strlen(word);
+    if (len + wordLen + 1 > maxChars) break;
+    memcpy(line + len, word, wordLen);
+    len += wordLen;
+    line[len++] = ' ';
+  }
+  line[len] = 0;
+}
+
+static void GenerateScroll(FrameTraceWriter &writer, int numFrames)
+{
+  const int statusBarHeight = LINE_HEIGHT + 2;
+  const int pageHeight = H - statusBarHeight;
+  const int numLines = 400;
+  const int docHeight = numLines * LINE_HEIGHT;
+  const uint16_t bgColor = RGB565(1, 3, 4), textColor = RGB565(24, 52, 24), statusColor = RGB565(6, 12, 20);
+
+  // Render the whole document once, and show a window of it on each frame
+  uint16_t *doc = new uint16_t[W * docHeight];
+  uint16_t *page = frame;
+  frame = doc;
+  H = docHeight;
+  FillRect(0, 0, W, docHeight, bgColor);
+  char line[256];
+  for(int i = 0; i < numLines; ++i)
+  {
+    RandomLine(line, MIN(255, (W - 4) / CHAR_WIDTH));
+    Text(2, i * LINE_HEIGHT + 1, line, textColor, bgColor);
+  }
+  frame = page;
+  H = pageHeight + statusBarHeight;
+
+  int pos = 0, velocity = 0, framesLeftInMove = 0;
+  for(int f = 0; f < numFrames; ++f)
+  {
+    if (framesLeftInMove-- <= 0)
+    {
+      int r = Random(8);
+      if (r < 3) { velocity = 0; framesLeftInMove = 5 + Random(35); } // Reading
+      else if (r < 7) { velocity = (1 + Random(4)) * (Random(3) ? 1 : -1); framesLeftInMove = 10 + Random(50); } // Scrolling with a mouse wheel or a touchpad
+      else { pos += (Random(2) ? pageHeight/2 : -pageHeight/2); velocity = 0; framesLeftInMove = 20; } // Page up or down
+    }
+    pos += velocity;
+    if (pos < 0) { pos = 0; framesLeftInMove = 0; }
+    if (pos > docHeight - pageHeight) { pos = docHeight - pageHeight; framesLeftInMove = 0; }
+
+    memcpy(frame, doc + pos*W, W*pageHeight*sizeof(uint16_t));
+    FillRect(0, pageHeight, W, statusBarHeight, statusColor);
+    sprintf(line, "line %d/%d", pos / LINE_HEIGHT + 1, numLines);
+    Text(2, pageHeight + 2, line, 0xFFFF, statusColor);
+    WriteFrameTraceFrame(writer, frame, W*2, f ? FRAME_USECS : 0);
+  }
+  delete[] doc;
+}
+
+struct Window
+{
+  int x, y, w, h;
+  const char *title;
+};
+
+static void DrawWindow(const Window &win)
+{
+  FillRect(win.x - 1, win.y - 1, win.w + 2, win.h + 2, RGB565(4, 8, 4));
+  FillRect(win.x, win.y, win.w, LINE_HEIGHT + 2, RGB565(4, 16, 20));
+  Text(win.x + 3, win.y + 2, win.title, 0xFFFF, RGB565(4, 16, 20));
+  FillRect(win.x, win.y + LINE_HEIGHT + 2, win.w, win.h - LINE_HEIGHT - 2, RGB565(29, 59, 29));
+}
+
+static void DrawCursor(int x, int y)
+{
+  static const char *arrow[] = { "#", "##", "#.#", "#..#", "#...#", "#....#", "#.....#", "#..####", "#.#", "##", "#" };
+  for(int j = 0; j < (int)(sizeof(arrow)/sizeof(arrow[0])); ++j)
+    for(int i = 0; arrow[j][i]; ++i)
+      if (x+i >= 0 && x+i < W && y+j >= 0 && y+j < H)
+        frame[(y+j)*W + x+i] = (arrow[j][i] == '#') ? 0 : 0xFFFF;
+}
+
+// A value that sweeps back and forth between 0 and range-1 with the given period, for moving the cursor around
+static int Triangle(int t, int period, int range)
+{
+  int phase = t % period;
+  int half = period / 2;
+  return (phase < half ? phase : period - phase) * (range - 1) / half;
+}
+
+static void GenerateDesktop(FrameTraceWriter &writer, int numFrames)
+{
+  const int taskbarHeight = LINE_HEIGHT + 4;
+  Window editor = { W/20, H/12, W*11/20, H*7/12, "notes.txt" };
+  Window progress = { W/2, H/2, W*9/20, H/3, "Copying files" };
+  const int maxCols = (editor.w - 6) / CHAR_WIDTH, maxRows = (editor.h - LINE_HEIGHT - 6) / LINE_HEIGHT;
+  char lines[32][128] = {};
+  int row = 0, col = 0;
+  char nextLine[128];
+  RandomLine(nextLine, MIN(maxCols, 127));
+  int percent = 0, dragFramesLeft = 0, dragX = 0, dragY = 0;
+  char text[64];
+
+  for(int f = 0; f < numFrames; ++f)
+  {
+    // Type a character every few frames, and start over when the window is full
+    if (f % 3 == 0)
+    {
+      if (nextLine[col]) { lines[row][col] = nextLine[col]; ++col; }
+      else
+      {
+        col = 0;
+        RandomLine(nextLine, MIN(maxCols, 127));
+        if (++row >= MIN(maxRows, 32)) { row = 0; memset(lines, 0, sizeof(lines)); }
+      }
+    }
+    if (f % 4 == 0) percent = (percent + 1) % 101;
+    if (f % 300 == 150) { dragFramesLeft = 30; dragX = Random(2) ? 2 : -2; dragY = Random(2) ? 1 : -1; }
+    if (dragFramesLeft > 0)
+    {
+      --dragFramesLeft;
+      progress.x = MAX(0, MIN(W - progress.w, progress.x + dragX));
+      progress.y = MAX(0, MIN(H - taskbarHeight - progress.h, progress.y + dragY));
+    }
+
+    for(int y = 0; y < H; ++y)
+      for(int x = 0; x < W; ++x)
+        frame[y*W+x] = ((x ^ y) & 8) ? RGB565(2, 20, 16) : RGB565(2, 18, 15);
+
+    DrawWindow(editor);
+    for(int i = 0; i <= row && i < 32; ++i)
+      Text(editor.x + 3, editor.y + LINE_HEIGHT + 5 + i*LINE_HEIGHT, lines[i], 0, RGB565(29, 59, 29));
+    if ((f / 30) % 2 == 0) FillRect(editor.x + 3 + col*CHAR_WIDTH, editor.y + LINE_HEIGHT + 4 + row*LINE_HEIGHT, 1, LINE_HEIGHT - 1, 0);
+
+    DrawWindow(progress);
+    FillRect(progress.x + 4, progress.y + progress.h/2, progress.w - 8, LINE_HEIGHT, RGB565(16, 32, 16));
+    FillRect(progress.x + 4, progress.y + progress.h/2, (progress.w - 8) * percent / 100, LINE_HEIGHT, RGB565(4, 40, 8));
+    sprintf(text, "%d%% done", percent);
+    Text(progress.x + 4, progress.y + progress.h/2 + LINE_HEIGHT + 3, text, 0, RGB565(29, 59, 29));
+
+    FillRect(0, H - taskbarHeight, W, taskbarHeight, RGB565(8, 16, 8));
+    Text(3, H - taskbarHeight + 3, "Start", 0xFFFF, RGB565(8, 16, 8));
+    int seconds = 9*3600 + 41*60 + f / 60;
+    sprintf(text, "%02d:%02d:%02d", seconds / 3600, (seconds / 60) % 60, seconds % 60);
+    Text(W - 8*CHAR_WIDTH - 3, H - taskbarHeight + 3, text, 0xFFFF, RGB565(8, 16, 8));
+
+    DrawCursor(Triangle(f, 420, W - 8), Triangle(f, 260, H - taskbarHeight));
+    WriteFrameTraceFrame(writer, frame, W*2, f ? FRAME_USECS : 0);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 3 || (strcmp(argv[1], "scroll") && strcmp(argv[1], "desktop")))
+  {
+    printf("Usage: %s <scroll|desktop> <output file> [number of frames] [width height]\n", argv[0]);
+    return 1;
+  }
+  int numFrames = (argc > 3) ? atoi(argv[3]) : 600;
+  W = (argc > 5) ? atoi(argv[4]) : DISPLAY_DRAWABLE_WIDTH;
+  H = (argc > 5) ? atoi(argv[5]) : DISPLAY_DRAWABLE_HEIGHT;
+  frame = new uint16_t[W*H];
+
+  FrameTraceWriter writer;
+  if (!OpenFrameTraceWriter(writer, argv[2], W, H))
+  {
+    printf("Failed to create %s\n", argv[2]);
+    return 1;
+  }
+  if (!strcmp(argv[1], "scroll")) GenerateScroll(writer, numFrames);
+  else GenerateDesktop(writer, numFrames);
+  CloseFrameTraceWriter(writer);
+  printf("Wrote %d frames of %dx%d to %s\n", numFrames, W, H, argv[2]);
+  delete[] frame;
+  return 0;
+}
@@ -3,6 +3,7 @@
 #if defined(ILI9341) || defined(ILI9340)
 
 #include "spi.h"
+#include "scroll.h"
 
 #include <memory.h>
 #include <stdio.h>
@@ -162,6 +163,9 @@ void TurnDisplayOn()
 
 void DeinitSPIDisplay()
 {
+#ifdef USE_HARDWARE_SCROLLING
+  DeinitHardwareScrolling();
+#endif
   ClearScreen();
   SPI_TRANSFER(/*Display OFF*/0x28);
   TurnBacklightOff();
@@ -28,6 +28,13 @@
 #define DISPLAY_SET_CURSOR_Y 0x2B
 #define DISPLAY_WRITE_PIXELS 0x2C
 
+// The ILI9341 can scroll a band of its display memory rows in hardware: Vertical Scrolling Definition sets the number of fixed rows above
+// the band, the height of the band and the number of fixed rows below it (which sum up to DISPLAY_SCROLL_MEMORY_HEIGHT), and Vertical
+// Scrolling Start Address sets the memory row that is shown at the top of the band.
+#define DISPLAY_SET_SCROLL_AREA 0x33
+#define DISPLAY_SET_SCROLL_START 0x37
+#define DISPLAY_SCROLL_MEMORY_HEIGHT 320
+
 // ILI9341 displays are able to update at any rate between 61Hz to up to 119Hz. Default at power on is 70Hz.
 #define ILI9341_FRAMERATE_61_HZ 0x1F
 #define ILI9341_FRAMERATE_63_HZ 0x1E
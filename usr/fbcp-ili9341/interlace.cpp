@@ -0,0 +1,48 @@
+#include "config.h"
+#include "interlace.h"
+#include "util.h"
+
+// The order to send the fields in on consecutive updates, so that each update fills in the scanlines midway between the ones already sent.
+static const int interlacedFieldOrder[5][4] = { { 0 }, { 0 }, { 0, 1 }, { 0, 1, 2 }, { 0, 2, 1, 3 } };
+
+// For how many updates the changes on each class of scanlines have been waiting to be sent, or 0 if the class has no changes pending.
+static int scanlineClassAge[NUM_SCANLINE_CLASSES] = {};
+
+// The number of consecutive interlaced updates so far, to rotate through interlacedFieldOrder when several fields have waited equally long.
+static int numConsecutiveInterlacedUpdates = 0;
+
+// Returns the field that has the changes that have waited the longest, when the scanlines are split into numFields fields.
+static int StalestField(int numFields)
+{
+  int stalestField = 0, stalestAge = -1;
+  for(int i = 0; i < numFields; ++i)
+  {
+    int field = interlacedFieldOrder[numFields][(numConsecutiveInterlacedUpdates + i) % numFields];
+    int age = 0;
+    for(int c = field; c < NUM_SCANLINE_CLASSES; c += numFields)
+      age = MAX(age, scanlineClassAge[c]);
+    if (age > stalestAge)
+    {
+      stalestField = field;
+      stalestAge = age;
+    }
+  }
+  return stalestField;
+}
+
+int ChooseInterlacedFields(const DiffStats &stats, double maxBytesToSend, int minNumFields, int &field)
+{
+  for(int c = 0; c < NUM_SCANLINE_CLASSES; ++c)
+    scanlineClassAge[c] = stats.scanlineClassBytes[c] ? scanlineClassAge[c] + 1 : 0;
+
+  // Split into more fields until the field to send fits in the budget. If even MAX_INTERLACED_FIELDS fields do not fit, the update will run late.
+  int numFields = MAX(1, minNumFields);
+  field = StalestField(numFields);
+  while(numFields < MAX_INTERLACED_FIELDS && InterlacedFieldBytes(stats, numFields, field) > maxBytesToSend)
+    field = StalestField(++numFields);
+
+  for(int c = field; c < NUM_SCANLINE_CLASSES; c += numFields)
+    scanlineClassAge[c] = 0;
+  numConsecutiveInterlacedUpdates = (numFields > 1) ? numConsecutiveInterlacedUpdates + 1 : 0;
+  return numFields;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "config.h"
+#include "diff.h"
+
+// When the changed pixels of a frame would take too long to send, the scanlines are split into numFields interlaced fields, field f holding the
+// scanlines y with y % numFields == f, and only one field is sent per update. The remaining fields are picked up by the following diffs.
+
+#if MAX_INTERLACED_FIELDS < 2 || MAX_INTERLACED_FIELDS > 4
+#error MAX_INTERLACED_FIELDS must be 2, 3 or 4 (NUM_SCANLINE_CLASSES must be divisible by it)
+#endif
+
+// Chooses how to send the spans of the given progressive diff: returns the number of fields to split the scanlines into (1 for a progressive update),
+// and in field the field to send. The fewest fields, but at least minNumFields, for which the field to send fits in maxBytesToSend are used.
+// The field to send is always the one whose changes have waited the longest, so a changed scanline is sent within MAX_INTERLACED_FIELDS updates
+// while the number of fields stays the same, and within 2*MAX_INTERLACED_FIELDS-2 updates when it varies from update to update.
+int ChooseInterlacedFields(const DiffStats &stats, double maxBytesToSend, int minNumFields, int &field);
@@ -4,6 +4,7 @@
 #include "low_battery.h"
 #include "gpu.h"
 #include "spi.h"
+#include "util.h"
 
 #ifdef LOW_BATTERY_PIN
 
@@ -59,11 +60,14 @@ void PollLowBattery()
   }
 }
 
-void DrawLowBatteryIcon(uint16_t *framebuffer)
+void DrawLowBatteryIcon(uint16_t *framebuffer, int &drawnStartY, int &drawnEndY)
 {
   if (!lowBattery)
     return;
 
+  drawnStartY = MIN(drawnStartY, LOW_BATTERY_ICON_TOP_LEFT_Y);
+  drawnEndY = MAX(drawnEndY, LOW_BATTERY_ICON_TOP_LEFT_Y+LOW_BATTERY_ICON_HEIGHT);
+
   for(int y = 0; y < LOW_BATTERY_ICON_HEIGHT; ++y)
   {
     int framebuffer_start_offset = (LOW_BATTERY_ICON_TOP_LEFT_Y+y)*(gpuFramebufferScanlineStrideBytes>>1)+LOW_BATTERY_ICON_TOP_LEFT_X;
@@ -75,6 +79,6 @@ void DrawLowBatteryIcon(uint16_t *framebuffer)
   
 void InitLowBatterySystem() {}
 void PollLowBattery() {}  
-void DrawLowBatteryIcon(uint16_t *framebuffer) {}
+void DrawLowBatteryIcon(uint16_t *framebuffer, int &drawnStartY, int &drawnEndY) {}
 
 #endif
\ No newline at end of file
@@ -14,6 +14,7 @@ void InitLowBatterySystem();
 void PollLowBattery();
 
 // Draws a low battery icon on the given framebuffer if the last call to
-// pollLowBattery found a low battery state.
-void DrawLowBatteryIcon(uint16_t *framebuffer);
+// pollLowBattery found a low battery state, and widens the range of scanlines
+// [drawnStartY, drawnEndY[ to cover the scanlines that it drew on.
+void DrawLowBatteryIcon(uint16_t *framebuffer, int &drawnStartY, int &drawnEndY);
 
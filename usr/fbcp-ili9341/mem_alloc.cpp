@@ -12,7 +12,7 @@ void *Malloc(size_t bytes, const char *reason)
 	void *ptr = malloc(bytes);
 	if (ptr)
 	{
-		totalCpuMemoryAllocated += bytes; // Currently we don't decrement this, so this only counts up (all allocations are persistent so far, so that's ok for now)
+		totalCpuMemoryAllocated += bytes; // Decremented by Free(). Most allocations are persistent and are never freed.
 //		printf("Allocated %zd bytes of CPU memory for %s. Total memory allocated: %llu bytes\n", bytes, reason, totalCpuMemoryAllocated);
 		return ptr;
 	}
@@ -22,3 +22,10 @@ void *Malloc(size_t bytes, const char *reason)
 		exit(1);
 	}
 }
+
+void Free(void *ptr, size_t bytes)
+{
+	if (!ptr) return;
+	free(ptr);
+	totalCpuMemoryAllocated -= bytes;
+}
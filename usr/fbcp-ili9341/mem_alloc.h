@@ -6,3 +6,6 @@
 extern uint64_t totalCpuMemoryAllocated;
 
 void *Malloc(size_t bytes, const char *reason);
+
+// Frees memory allocated with Malloc(). The size is passed back in to keep totalCpuMemoryAllocated up to date.
+void Free(void *ptr, size_t bytes);
@@ -0,0 +1,263 @@
+#include <stdio.h> // printf
+#include <string.h> // memcpy, memcmp
+
+#include "config.h"
+#include "display.h"
+#include "pack_kernels.h"
+#include "cpu_features.h"
+#include "util.h"
+
+#ifdef BENCHMARK_PACK_KERNELS
+#include "diff.h"
+#include "gpu.h"
+#include "mem_alloc.h"
+#include "tick.h"
+#endif
+
+#ifdef DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
+// Converts from R5G6B5 to R6X2G6X2B6X2. On red and blue color channels, need to expand 5 bits to 6 bits. Do that by duplicating the highest bit as lowest bit.
+static inline uint8_t *PackPixelR6X2G6X2B6X2(uint8_t *dst, uint16_t pixel)
+{
+  uint8_t r = (pixel >> 8) & 0xF8;
+  uint8_t g = (pixel >> 3) & 0xFC;
+  uint8_t b = (pixel << 3) & 0xF8;
+  dst[0] = r | (r >> 5);
+  dst[1] = g;
+  dst[2] = b | (b >> 5);
+  return dst + 3;
+}
+#endif
+
+// Scalar fallback for CPUs without SIMD (Pi Zero/Pi 1 ARMv6): byte swaps two pixels at a time via 32-bit loads. Inlined twice, so that copying to the
+// previous framebuffer is decided once per run of pixels, and not per pixel.
+static inline __attribute__((always_inline)) uint8_t *PackPixelsScalarImpl(uint8_t *dst, const uint16_t *scanline, uint16_t *prevScanline, int numPixels, bool copyToPrev)
+{
+#ifdef DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
+  for(int x = 0; x < numPixels; ++x)
+  {
+    uint16_t pixel = scanline[x];
+    if (copyToPrev) prevScanline[x] = pixel;
+    dst = PackPixelR6X2G6X2B6X2(dst, pixel);
+  }
+  return dst;
+#else
+  uint16_t *data = (uint16_t*)dst;
+  int x = 0;
+  // The two framebuffers share the same stride and alignment, so if the current scanline is 4-byte aligned, then so is the previous scanline.
+  while(x < numPixels && ((uintptr_t)(scanline+x) & 3))
+  {
+    if (copyToPrev) prevScanline[x] = scanline[x];
+    data[x] = __builtin_bswap16(scanline[x]);
+    ++x;
+  }
+  for(; x + 2 <= numPixels; x += 2)
+  {
+    uint32_t u = *(const uint32_t*)(scanline+x);
+    if (copyToPrev) *(uint32_t*)(prevScanline+x) = u;
+    *(uint32_t*)(data+x) = ((u & 0xFF00FF00U) >> 8) | ((u & 0x00FF00FFU) << 8);
+  }
+  if (x < numPixels)
+  {
+    if (copyToPrev) prevScanline[x] = scanline[x];
+    data[x] = __builtin_bswap16(scanline[x]);
+  }
+  return (uint8_t*)(data + numPixels);
+#endif
+}
+
+static uint8_t *PackPixelsScalar(uint8_t *dst, const uint16_t *scanline, uint16_t *prevScanline, int numPixels)
+{
+  if (prevScanline) return PackPixelsScalarImpl(dst, scanline, prevScanline, numPixels, true);
+  else return PackPixelsScalarImpl(dst, scanline, 0, numPixels, false);
+}
+
+#ifdef HAVE_NEON_KERNELS
+
+NEON_KERNELS_BEGIN
+
+static uint8_t *PackPixelsNEON(uint8_t *dst, const uint16_t *scanline, uint16_t *prevScanline, int numPixels)
+{
+  int x = 0;
+#ifdef DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
+  for(; x + 8 <= numPixels; x += 8, dst += 24)
+  {
+    uint16x8_t pixels = vld1q_u16(scanline+x);
+    if (prevScanline) vst1q_u16(prevScanline+x, pixels);
+    uint8x8_t r = vand_u8(vshrn_n_u16(pixels, 8), vdup_n_u8(0xF8));
+    uint8x8_t g = vand_u8(vshrn_n_u16(pixels, 3), vdup_n_u8(0xFC));
+    uint8x8_t b = vand_u8(vmovn_u16(vshlq_n_u16(pixels, 3)), vdup_n_u8(0xF8));
+    uint8x8x3_t rgb;
+    rgb.val[0] = vorr_u8(r, vshr_n_u8(r, 5));
+    rgb.val[1] = g;
+    rgb.val[2] = vorr_u8(b, vshr_n_u8(b, 5));
+    vst3_u8(dst, rgb);
+  }
+#else
+  for(; x + 8 <= numPixels; x += 8, dst += 16)
+  {
+    uint16x8_t pixels = vld1q_u16(scanline+x);
+    if (prevScanline) vst1q_u16(prevScanline+x, pixels);
+    vst1q_u8(dst, vrev16q_u8(vreinterpretq_u8_u16(pixels)));
+  }
+#endif
+  return PackPixelsScalar(dst, scanline+x, prevScanline ? prevScanline+x : 0, numPixels-x);
+}
+
+NEON_KERNELS_END
+
+#endif // ~HAVE_NEON_KERNELS
+
+// The x86 kernels only implement the byte swapped R5G6B5 format, which is what all displays except ILI9486L/ILI9488 use.
+#if !defined(DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2)
+
+#ifdef HAVE_SSE2_KERNELS
+
+__attribute__((target("sse2"))) static uint8_t *PackPixelsSSE2(uint8_t *dst, const uint16_t *scanline, uint16_t *prevScanline, int numPixels)
+{
+  int x = 0;
+  for(; x + 8 <= numPixels; x += 8, dst += 16)
+  {
+    __m128i pixels = _mm_loadu_si128((const __m128i*)(scanline+x));
+    if (prevScanline) _mm_storeu_si128((__m128i*)(prevScanline+x), pixels);
+    _mm_storeu_si128((__m128i*)dst, _mm_or_si128(_mm_slli_epi16(pixels, 8), _mm_srli_epi16(pixels, 8)));
+  }
+  return PackPixelsScalar(dst, scanline+x, prevScanline ? prevScanline+x : 0, numPixels-x);
+}
+
+#endif // ~HAVE_SSE2_KERNELS
+
+#ifdef HAVE_AVX2_KERNELS
+
+__attribute__((target("avx2"))) static uint8_t *PackPixelsAVX2(uint8_t *dst, const uint16_t *scanline, uint16_t *prevScanline, int numPixels)
+{
+  int x = 0;
+  for(; x + 16 <= numPixels; x += 16, dst += 32)
+  {
+    __m256i pixels = _mm256_loadu_si256((const __m256i*)(scanline+x));
+    if (prevScanline) _mm256_storeu_si256((__m256i*)(prevScanline+x), pixels);
+    _mm256_storeu_si256((__m256i*)dst, _mm256_or_si256(_mm256_slli_epi16(pixels, 8), _mm256_srli_epi16(pixels, 8)));
+  }
+  return PackPixelsSSE2(dst, scanline+x, prevScanline ? prevScanline+x : 0, numPixels-x);
+}
+
+#endif // ~HAVE_AVX2_KERNELS
+
+#endif // ~!DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2
+
+PackKernel packKernel = { "scalar", PackPixelsScalar };
+
+int GetSupportedPackKernels(PackKernel *kernels, int maxKernels)
+{
+  int numKernels = 0;
+#define ADD_KERNEL(kernelName, pack) do { \
+    if (numKernels < maxKernels) { PackKernel k = { (kernelName), (pack) }; kernels[numKernels++] = k; } \
+  } while(0)
+
+  ADD_KERNEL("scalar", PackPixelsScalar);
+
+#ifdef HAVE_NEON_KERNELS
+  if (CpuHasNeon()) ADD_KERNEL("NEON", PackPixelsNEON);
+#endif
+
+#if !defined(DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2)
+#ifdef HAVE_SSE2_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) ADD_KERNEL("SSE2", PackPixelsSSE2);
+#endif
+#ifdef HAVE_AVX2_KERNELS
+  if (__builtin_cpu_supports("avx2")) ADD_KERNEL("AVX2", PackPixelsAVX2);
+#endif
+#endif
+
+#undef ADD_KERNEL
+  return numKernels;
+}
+
+void InitPackKernels()
+{
+  PackKernel kernels[4];
+  int numKernels = GetSupportedPackKernels(kernels, sizeof(kernels)/sizeof(kernels[0]));
+  packKernel = kernels[numKernels-1];
+  printf("Using %s pixel packing kernel\n", packKernel.name);
+}
+
+#ifdef BENCHMARK_PACK_KERNELS
+// The method that was used before the fused kernels: first pack the pixels to the task, and then memcpy() them to the previous framebuffer.
+static uint8_t *PackPixelsThenCopyToPrev(uint8_t *dst, const uint16_t *scanline, uint16_t *prevScanline, int numPixels)
+{
+  dst = PackPixelsScalar(dst, scanline, 0, numPixels);
+  memcpy(prevScanline, scanline, numPixels*FRAMEBUFFER_BYTESPERPIXEL);
+  return dst;
+}
+
+// Packs all pixels of the given spans back to back to dst like the span submit loop in main() does, and returns the number of pixels packed.
+static int PackSpans(PackPixelsFunc pack, const SpanArray &spanArray, uint16_t *framebuffer, uint16_t *prevFramebuffer, uint8_t *dst)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  int numPixels = 0;
+  for(const Span *i = spanArray.spans; i < spanArray.spans + spanArray.numSpans; ++i)
+    for(int y = i->y; y < i->endY; ++y)
+    {
+      int endX = (y + 1 == i->endY) ? i->lastScanEndX : i->endX;
+      dst = pack(dst, framebuffer + y*stride + i->x, prevFramebuffer + y*stride + i->x, endX - i->x);
+      numPixels += endX - i->x;
+    }
+  return numPixels;
+}
+
+void BenchmarkPackKernels(const SpanArray &spanArray, uint16_t *framebuffer)
+{
+#define MAX_BENCHMARKED_KERNELS 4
+  static PackKernel kernels[MAX_BENCHMARKED_KERNELS];
+  static int numKernels = 0;
+  static uint8_t *referenceData = 0, *kernelData = 0;
+  static uint16_t *referencePrev = 0, *kernelPrev = 0;
+  static uint64_t referenceUsecs = 0, kernelUsecs[MAX_BENCHMARKED_KERNELS] = {}, numPixels = 0;
+  static int numFrames = 0, numMismatches[MAX_BENCHMARKED_KERNELS] = {};
+  static uint64_t lastPrint = 0;
+  if (!referenceData)
+  {
+    numKernels = GetSupportedPackKernels(kernels, MAX_BENCHMARKED_KERNELS);
+    referenceData = (uint8_t*)Malloc(gpuFrameWidth * gpuFrameHeight * SPI_BYTESPERPIXEL, "BenchmarkPackKernels() reference data");
+    kernelData = (uint8_t*)Malloc(gpuFrameWidth * gpuFrameHeight * SPI_BYTESPERPIXEL, "BenchmarkPackKernels() kernel data");
+    referencePrev = (uint16_t*)Malloc(gpuFramebufferSizeBytes, "BenchmarkPackKernels() reference prev framebuffer");
+    kernelPrev = (uint16_t*)Malloc(gpuFramebufferSizeBytes, "BenchmarkPackKernels() kernel prev framebuffer");
+    memset(referencePrev, 0, gpuFramebufferSizeBytes);
+    lastPrint = tick();
+  }
+
+  uint64_t t0 = tick();
+  int framePixels = PackSpans(PackPixelsThenCopyToPrev, spanArray, framebuffer, referencePrev, referenceData);
+  referenceUsecs += tick() - t0;
+  numPixels += framePixels;
+
+  for(int i = 0; i < numKernels; ++i)
+  {
+    memcpy(kernelPrev, referencePrev, gpuFramebufferSizeBytes); // Both prev framebuffers now hold the already packed pixels, so any pixel the kernel misses will show up as a mismatch below.
+    memset(kernelData, 0, framePixels * SPI_BYTESPERPIXEL);
+    for(const Span *s = spanArray.spans; s < spanArray.spans + spanArray.numSpans; ++s)
+      for(int y = s->y; y < s->endY; ++y)
+        memset(kernelPrev + y*(gpuFramebufferScanlineStrideBytes>>1) + s->x, 0, (((y + 1 == s->endY) ? s->lastScanEndX : s->endX) - s->x)*FRAMEBUFFER_BYTESPERPIXEL);
+    t0 = tick();
+    PackSpans(kernels[i].PackPixels, spanArray, framebuffer, kernelPrev, kernelData);
+    kernelUsecs[i] += tick() - t0;
+    if (memcmp(referenceData, kernelData, framePixels * SPI_BYTESPERPIXEL) || memcmp(referencePrev, kernelPrev, gpuFramebufferSizeBytes)) ++numMismatches[i];
+  }
+  ++numFrames;
+
+  uint64_t now = tick();
+  if (now - lastPrint >= 2000000)
+  {
+    // The fused kernels save reading the pixels a second time for the memcpy() to the previous framebuffer.
+    uint64_t bytesSaved = numPixels * FRAMEBUFFER_BYTESPERPIXEL;
+    printf("Pack kernels over %d frames, %llu pixels/frame: pack+memcpy: %llu ns/frame", numFrames, (unsigned long long)(numPixels / numFrames), (unsigned long long)(referenceUsecs * 1000 / numFrames));
+    for(int i = 0; i < numKernels; ++i)
+      printf(", %s: %llu ns/frame (%d mismatches)", kernels[i].name, (unsigned long long)(kernelUsecs[i] * 1000 / numFrames), numMismatches[i]);
+    printf(". Fused kernels read %llu fewer bytes/frame, %.2f MB/sec\n", (unsigned long long)(bytesSaved / numFrames), bytesSaved / (double)(now - lastPrint));
+    referenceUsecs = numPixels = 0;
+    for(int i = 0; i < numKernels; ++i) kernelUsecs[i] = numMismatches[i] = 0;
+    numFrames = 0;
+    lastPrint = tick();
+  }
+}
+#endif
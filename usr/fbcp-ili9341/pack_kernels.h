@@ -0,0 +1,34 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Pixel packing kernels used when submitting spans to the display. Each kernel converts a run of R5G6B5 framebuffer pixels to the format that is sent
+// over the SPI bus (byte swapped R5G6B5, or R6X2G6X2B6X2 if DISPLAY_COLOR_FORMAT_R6X2G6X2B6X2 is defined), and in the same pass copies the pixels over
+// to the previous framebuffer, so that each submitted pixel is read from memory only once. All kernels produce identical results.
+
+// Packs numPixels pixels from scanline to dst, and copies them to prevScanline, unless prevScanline is null. Returns the address in dst after the last
+// written byte.
+typedef uint8_t *(*PackPixelsFunc)(uint8_t *dst, const uint16_t *scanline, uint16_t *prevScanline, int numPixels);
+
+struct PackKernel
+{
+  const char *name;
+  PackPixelsFunc PackPixels;
+};
+
+// The best kernel for the CPU we are running on, chosen by InitPackKernels().
+extern PackKernel packKernel;
+
+// Detects the CPU features available at runtime, and chooses the widest supported kernel to use.
+void InitPackKernels(void);
+
+// Returns all the kernels that are supported on the current CPU, the scalar fallback first, and the widest kernel last.
+int GetSupportedPackKernels(PackKernel *kernels, int maxKernels);
+
+#ifdef BENCHMARK_PACK_KERNELS
+struct SpanArray;
+
+// Packs the pixels of the given spans with the old separate pack + memcpy() method and with each supported kernel into scratch buffers, verifies
+// that they all agree, and periodically prints their timings, along with the memory traffic that the fused kernels save.
+void BenchmarkPackKernels(const SpanArray &spanArray, uint16_t *framebuffer);
+#endif
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <string.h> // memset
+
+#include "config.h"
+#include "panel_model.h"
+#include "spi.h"
+#include "gpu.h"
+#include "diff.h"
+#include "frame_pool.h"
+#include "mem_alloc.h"
+
+#ifdef VERIFY_HARDWARE_SCROLLING
+
+// Hardware scrolling is only available when the controller does not flip the orientation, so the display memory has the native size of the panel
+#define PANEL_MEMORY_WIDTH DISPLAY_WIDTH
+#define PANEL_MEMORY_HEIGHT DISPLAY_SCROLL_MEMORY_HEIGHT
+
+#ifdef DISPLAY_SET_CURSOR_IS_8_BIT
+#define COORDINATE_BYTES 1
+static inline int Coordinate(const uint8_t *data) { return data[0]; }
+#else
+#define COORDINATE_BYTES 2
+static inline int Coordinate(const uint8_t *data) { return (data[0] << 8) | data[1]; }
+#endif
+
+static uint16_t *panelMemory = 0;
+static int windowX = 0, windowEndX = PANEL_MEMORY_WIDTH-1, windowY = 0, windowEndY = PANEL_MEMORY_HEIGHT-1; // Inclusive, like the controller takes them
+static int cursorX = 0, cursorY = 0;
+static int scrollAreaStart = 0, scrollAreaRows = PANEL_MEMORY_HEIGHT, scrollStartRow = 0; // The power on state: the whole memory scrolls, unscrolled
+static int prevNumMismatches = 0;
+
+// Writes a pixel at the write cursor and advances it like the controller does: along the row to the end of the window, then to the start of the next
+// row of the window, and from the last row of the window back to its first row.
+static inline void WritePixel(uint16_t pixel)
+{
+  if (cursorX < PANEL_MEMORY_WIDTH && cursorY < PANEL_MEMORY_HEIGHT)
+    panelMemory[cursorY*PANEL_MEMORY_WIDTH + cursorX] = pixel;
+  if (cursorX++ < windowEndX) return;
+  cursorX = windowX;
+  cursorY = (cursorY < windowEndY) ? cursorY + 1 : windowY;
+}
+
+static void ReplayPixels(SPITask *task, uint32_t size)
+{
+#ifdef SOLID_FILL_TASKS
+  if (task->fillSize)
+  {
+    const uint16_t color = (task->data[0] << 8) | task->data[1];
+    for(uint32_t i = 0; i < task->fillSize; i += 2) WritePixel(color);
+    return;
+  }
+#endif
+#ifdef LATE_LATCH_PIXEL_TASKS
+  // The SPI thread packs these pixels from the frame later. If the frame is framebuffer[1] by then, the main thread may have copied the pixels of later
+  // spans over them, but those spans are queued to the same display rows afterwards, so the display ends up the same as when replaying the pixels now.
+  // A hardware scroll shifts a copy of framebuffer[1] instead of the frame, so the pixels stay on the scanlines they were queued for.
+  if (task->frame)
+  {
+    const uint16_t *scanline = task->frame->pixels + task->y*(gpuFramebufferScanlineStrideBytes>>1);
+    for(int y = task->y; y < task->endY; ++y, scanline += gpuFramebufferScanlineStrideBytes>>1)
+      for(int x = task->x, endX = (y + 1 == task->endY) ? task->lastScanEndX : task->endX; x < endX; ++x)
+        WritePixel(scanline[x]);
+    return;
+  }
+#endif
+#ifdef OFFLOAD_PIXEL_COPY_TO_DMA_CPP
+  if (task->fb != task->data) // dma.cpp copies these pixels from the framebuffer, task->width pixels per scanline
+  {
+    const uint16_t *scanline = (const uint16_t*)task->fb;
+    for(uint32_t i = 0, x = 0; i < size/2; ++i)
+    {
+      WritePixel(scanline[x]);
+      if (++x == task->width)
+      {
+        x = 0;
+        scanline += gpuFramebufferScanlineStrideBytes>>1;
+      }
+    }
+    return;
+  }
+#endif
+  for(uint32_t i = 0; i+1 < size; i += 2)
+    WritePixel((task->data[i] << 8) | task->data[i+1]);
+}
+
+void ReplayTaskOnPanelModel(SPITask *task)
+{
+  if (!panelMemory)
+  {
+    // The contents of the display memory are not known until they are written to
+    panelMemory = (uint16_t*)Malloc(PANEL_MEMORY_WIDTH*PANEL_MEMORY_HEIGHT*sizeof(uint16_t), "ReplayTaskOnPanelModel() panel memory");
+    memset(panelMemory, 0xFF, PANEL_MEMORY_WIDTH*PANEL_MEMORY_HEIGHT*sizeof(uint16_t));
+  }
+  const uint8_t *data = task->data;
+#ifdef SPI_3WIRE_PROTOCOL
+  const uint32_t size = task->size - task->sizeExpandedTaskWithPadding; // Not yet interleaved to 9 bits
+#else
+  const uint32_t size = task->size;
+#endif
+
+  switch(task->cmd)
+  {
+  case DISPLAY_SET_CURSOR_X:
+    if (size >= COORDINATE_BYTES) windowX = Coordinate(data);
+    if (size >= 2*COORDINATE_BYTES) windowEndX = Coordinate(data + COORDINATE_BYTES);
+#ifdef DISPLAY_WRITE_PIXELS_CMD_DOES_NOT_RESET_WRITE_CURSOR
+    cursorX = windowX;
+#endif
+    break;
+  case DISPLAY_SET_CURSOR_Y:
+    if (size >= COORDINATE_BYTES) windowY = Coordinate(data);
+    if (size >= 2*COORDINATE_BYTES) windowEndY = Coordinate(data + COORDINATE_BYTES);
+#ifdef DISPLAY_WRITE_PIXELS_CMD_DOES_NOT_RESET_WRITE_CURSOR
+    cursorY = windowY;
+#endif
+    break;
+  case DISPLAY_WRITE_PIXELS:
+#ifndef DISPLAY_WRITE_PIXELS_CMD_DOES_NOT_RESET_WRITE_CURSOR
+    cursorX = windowX;
+    cursorY = windowY;
+#endif
+    ReplayPixels(task, size);
+    break;
+#ifdef DISPLAY_SET_SCROLL_AREA
+  case DISPLAY_SET_SCROLL_AREA:
+    if (size >= 4)
+    {
+      scrollAreaStart = (data[0] << 8) | data[1];
+      scrollAreaRows = (data[2] << 8) | data[3];
+    }
+    break;
+#endif
+  case DISPLAY_SET_SCROLL_START:
+    if (size >= COORDINATE_BYTES) scrollStartRow = Coordinate(data);
+    break;
+  default: // Commands that do not change the display memory or how it is shown
+    break;
+  }
+}
+
+// Returns the display memory row that the controller shows on the given row of the panel.
+static int MemoryRowShownAt(int row)
+{
+#ifdef DISPLAY_SET_SCROLL_AREA
+  // The rows above and below the scroll area are fixed. Inside it, scrollStartRow is shown at the top, and the rows after it wrap around within the area.
+  if (row < scrollAreaStart || row >= scrollAreaStart + scrollAreaRows || scrollAreaRows <= 0) return row;
+  int offset = (scrollStartRow - scrollAreaStart + row - scrollAreaStart) % scrollAreaRows;
+  if (offset < 0) offset += scrollAreaRows;
+  return scrollAreaStart + offset;
+#else
+  // The start line scrolls the whole display memory
+  return (row + scrollStartRow) % PANEL_MEMORY_HEIGHT;
+#endif
+}
+
+int VerifyPanelModel(const uint16_t *prevFramebuffer)
+{
+  if (!panelMemory) return 0;
+  int numMismatches = 0, firstY = 0, firstX = 0, firstRow = 0;
+  const uint16_t *scanline = prevFramebuffer;
+  for(int y = 0; y < gpuFrameHeight; ++y, scanline += gpuFramebufferScanlineStrideBytes>>1)
+  {
+    if (scanlineHashes[y] != prevScanlineHashes[y]) continue; // Has changes pending, which the next diff sends
+    const int row = MemoryRowShownAt(displayYOffset + y);
+    const uint16_t *shown = panelMemory + row*PANEL_MEMORY_WIDTH + displayXOffset;
+    for(int x = 0; x < gpuFrameWidth; ++x)
+      if (scanline[x] != shown[x])
+      {
+        if (!numMismatches)
+        {
+          firstY = y;
+          firstX = x;
+          firstRow = row;
+        }
+        ++numMismatches;
+        break;
+      }
+  }
+  // Report when the mismatches change, to not print the same ones every frame
+  if (numMismatches && numMismatches != prevNumMismatches)
+  {
+    const uint16_t *shown = panelMemory + firstRow*PANEL_MEMORY_WIDTH + displayXOffset;
+    printf("Panel model: %d up to date scanlines differ from what the display shows, first at scanline %d (display memory row %d), x=%d: expected 0x%04X, display shows 0x%04X\n",
+      numMismatches, firstY, firstRow, firstX, prevFramebuffer[firstY*(gpuFramebufferScanlineStrideBytes>>1) + firstX], shown[firstX]);
+  }
+  prevNumMismatches = numMismatches;
+  return numMismatches;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+#include "display.h"
+
+#ifdef VERIFY_HARDWARE_SCROLLING
+
+// A model of the display memory of the panel, kept on the host to check hardware scrolling against: every task that is queued to the display is
+// replayed onto the model as the controller would execute it, applying the write windows, the pixel writes, and the scroll area and scroll start
+// commands. The model does not know about scroll.cpp, so it computes the display memory row that each visible row shows on its own.
+
+struct SPITask;
+
+// Applies the given task to the model. Called from CommitTask() for each task that is queued, in queue order, before it is run.
+void ReplayTaskOnPanelModel(SPITask *task);
+
+// Compares the rows that the modeled panel shows against the scanlines of prevFramebuffer that are up to date, i.e. that the next diff will skip
+// since their hashes match the new frame. A mismatch there would stay on the display until the scanline changes again, so it is printed.
+// Returns the number of mismatching scanlines.
+int VerifyPanelModel(const uint16_t *prevFramebuffer);
+
+#endif
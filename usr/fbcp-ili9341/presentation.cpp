@@ -0,0 +1,190 @@
+#include <math.h> // sqrt
+
+#include "config.h"
+#include "presentation.h"
+#include "frame_pool.h"
+#include "gpu.h"
+#include "tick.h"
+#include "util.h"
+
+#ifdef USE_PRESENTATION_SCHEDULER
+
+// Frame intervals at least this long are pauses in the content rather than its frame rate, so they do not drive the presentation clock or count
+// towards the statistics.
+#define PAUSE_INTERVAL_USECS 100000
+
+// Number of the most recent frame intervals that the presentation clock is averaged over
+#define PRESENTATION_CLOCK_SAMPLES 16
+
+#define QUEUE_SIZE (PRESENTATION_JITTER_BUFFER_FRAMES+1)
+
+struct QueuedFrame
+{
+  Frame *frame;
+  uint64_t captureTime;
+};
+
+// The queue is shared between the GPU polling thread and the main thread, and both only hold the lock for a few instructions, so it is a spinlock.
+static volatile int queueLock = 0;
+static QueuedFrame queue[QUEUE_SIZE];
+static int queueHead = 0, queueCount = 0;
+static int numFramesDroppedFromQueue = 0;
+
+// The presentation clock, only accessed by the main thread
+static bool clockRunning = false;
+static uint64_t nextPresentationTime = 0;
+
+#ifdef STATISTICS
+struct IntervalStats
+{
+  uint64_t prevTime;
+  double sum, sumSquares;
+  int count;
+};
+static IntervalStats capturedIntervals = {}, presentedIntervals = {};
+
+static void AddInterval(IntervalStats &stats, uint64_t time)
+{
+  uint64_t interval = time - stats.prevTime;
+  if (stats.prevTime && interval < PAUSE_INTERVAL_USECS)
+  {
+    stats.sum += interval;
+    stats.sumSquares += (double)interval * interval;
+    ++stats.count;
+  }
+  stats.prevTime = time;
+}
+
+static double TakeStandardDeviation(IntervalStats &stats)
+{
+  double deviation = 0;
+  if (stats.count > 1)
+  {
+    double mean = stats.sum / stats.count;
+    deviation = sqrt(MAX(0.0, stats.sumSquares / stats.count - mean*mean));
+  }
+  stats.sum = stats.sumSquares = 0;
+  stats.count = 0;
+  return deviation;
+}
+#endif
+
+static inline void LockQueue()
+{
+  while(__sync_lock_test_and_set(&queueLock, 1))
+    ;
+}
+
+static inline void UnlockQueue()
+{
+  __sync_lock_release(&queueLock);
+}
+
+void QueueFrameForPresentation(Frame *frame, uint64_t captureTime)
+{
+  Frame *droppedFrame = 0;
+  LockQueue();
+  if (queueCount == QUEUE_SIZE)
+  {
+    droppedFrame = queue[queueHead].frame;
+    queueHead = (queueHead + 1) % QUEUE_SIZE;
+    --queueCount;
+    ++numFramesDroppedFromQueue;
+  }
+  QueuedFrame &queued = queue[(queueHead + queueCount) % QUEUE_SIZE];
+  queued.frame = frame;
+  queued.captureTime = captureTime;
+  ++queueCount;
+#ifdef STATISTICS
+  AddInterval(capturedIntervals, captureTime);
+#endif
+  UnlockQueue();
+  if (droppedFrame) ReleaseFrame(droppedFrame);
+}
+
+// The presentation clock ticks at the average interval of the recently captured frames. Unlike the percentile that EstimateFrameRateInterval() follows,
+// the average also holds for content that produces its frames in bursts. The clock never ticks faster than EstimateFrameRateInterval() though.
+static uint64_t PresentationInterval()
+{
+  const uint64_t minInterval = EstimateFrameRateInterval();
+  uint64_t sum = 0;
+  int numIntervals = 0;
+  for(int i = 0; i < MIN(histogramSize-1, PRESENTATION_CLOCK_SAMPLES); ++i)
+  {
+    uint64_t interval = GET_HISTOGRAM(i) - GET_HISTOGRAM(i+1);
+    if (interval < PAUSE_INTERVAL_USECS)
+    {
+      sum += interval;
+      ++numIntervals;
+    }
+  }
+  return (numIntervals > 0) ? MAX(minInterval, sum / numIntervals) : minInterval;
+}
+
+int64_t UsecsUntilNextPresentation()
+{
+  LockQueue();
+  const int numQueued = queueCount;
+  const uint64_t oldestCaptureTime = queue[queueHead].captureTime;
+  UnlockQueue();
+  if (numQueued == 0) return -1;
+
+  const uint64_t now = tick();
+
+  // If the oldest frame was captured only after the clock had already ticked, there was nothing to present on that tick: the buffer ran dry.
+  // (If the frame was captured before, the main thread was just busy, and the clock keeps running.)
+  if (clockRunning && oldestCaptureTime > nextPresentationTime)
+    clockRunning = false;
+
+  uint64_t dueTime = nextPresentationTime;
+  if (!clockRunning)
+  {
+#ifdef PRESENTATION_SMOOTHNESS_FIRST
+    // Restart the clock once the buffer has filled up again, or once the oldest frame has waited as long as a full buffer would have made it wait.
+    const uint64_t interval = PresentationInterval();
+    dueTime = (numQueued > PRESENTATION_JITTER_BUFFER_FRAMES) ? now : oldestCaptureTime + PRESENTATION_JITTER_BUFFER_FRAMES*interval;
+#else
+    // Present the late frame right away, and restart the clock from it.
+    dueTime = now;
+#endif
+  }
+  return (dueTime <= now) ? 0 : (int64_t)(dueTime - now);
+}
+
+Frame *TakePresentableFrame(int *numFramesDropped)
+{
+  *numFramesDropped = 0;
+  if (UsecsUntilNextPresentation() != 0) return 0;
+
+  LockQueue();
+  Frame *frame = queue[queueHead].frame;
+  queueHead = (queueHead + 1) % QUEUE_SIZE;
+  --queueCount;
+  *numFramesDropped = numFramesDroppedFromQueue;
+  numFramesDroppedFromQueue = 0;
+  UnlockQueue();
+
+  // Advance the clock by one interval from when this frame was due, so that it keeps its phase. If the main thread took the frame so late that the
+  // clock would need to catch up, or the clock was stopped, restart it from now instead.
+  const uint64_t now = tick();
+  const uint64_t interval = PresentationInterval();
+  if (clockRunning && now - nextPresentationTime <= interval/2) nextPresentationTime += interval;
+  else nextPresentationTime = now + interval;
+  clockRunning = true;
+#ifdef STATISTICS
+  AddInterval(presentedIntervals, now);
+#endif
+  return frame;
+}
+
+#ifdef STATISTICS
+void TakeFrameIntervalDeviations(double *capturedUsecs, double *presentedUsecs)
+{
+  LockQueue();
+  *capturedUsecs = TakeStandardDeviation(capturedIntervals);
+  UnlockQueue();
+  *presentedUsecs = TakeStandardDeviation(presentedIntervals);
+}
+#endif
+
+#endif
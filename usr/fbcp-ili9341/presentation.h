@@ -0,0 +1,35 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef USE_PRESENTATION_SCHEDULER
+
+// The presentation stage sits between the GPU polling thread and the main thread. Captured frames are queued in a jitter buffer, and the main thread
+// takes them one at a time when they are due on the presentation clock, which ticks at the interval that frames have recently been captured at. If
+// the buffer is full when a frame is captured, the oldest frame in it is dropped.
+
+#if PRESENTATION_JITTER_BUFFER_FRAMES < 0 || PRESENTATION_JITTER_BUFFER_FRAMES > 2
+#error PRESENTATION_JITTER_BUFFER_FRAMES must be between 0 and 2
+#endif
+
+struct Frame;
+
+// Queues a newly captured frame, taking over the reference to it. Called by the GPU polling thread.
+void QueueFrameForPresentation(Frame *frame, uint64_t captureTime);
+
+// Returns 0 if a queued frame is due to be presented, the number of usecs until the oldest queued frame is due, or -1 if no frames are queued.
+int64_t UsecsUntilNextPresentation(void);
+
+// Takes the oldest queued frame along with the reference to it, if it is due to be presented, or returns null. numFramesDropped is set to the number of
+// frames that were dropped from the buffer since the previous frame was taken.
+Frame *TakePresentableFrame(int *numFramesDropped);
+
+#ifdef STATISTICS
+// Standard deviations of the intervals that frames were captured at and were presented at since the last call, in usecs. Pauses in the content
+// longer than a few frames are not counted. Resets the measurements.
+void TakeFrameIntervalDeviations(double *capturedUsecs, double *presentedUsecs);
+#endif
+
+#endif
@@ -0,0 +1,66 @@
+// Sends damage hints to the socket of a running fbcp-ili9341 built with USE_DAMAGE_HINTS, to check that it receives them, or to send hints from
+// a script that knows what it repainted. Exits with an error if nothing is receiving hints at DAMAGE_HINT_SOCKET_PATH.
+// Usage: fbcp-damage-hint [-n count] [-i interval_msecs] [x,y,width,height ...]
+// Sends count datagrams (default 1), one every interval_msecs (default 100), each with the given rectangles in source display pixels. With no
+// rectangles, the datagrams only keep the hints in use while nothing is repainted. The sequence numbers start from 0 on each run, so fbcp-ili9341
+// compares the whole next frame once, as it would after lost hints, and then only the hinted tiles.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../damage_hints.h"
+
+int main(int argc, char **argv)
+{
+  int count = 1, intervalMsecs = 100;
+  static uint8_t datagram[sizeof(DamageHintHeader) + DAMAGE_HINT_MAX_RECTS*sizeof(DamageHintRect)];
+  DamageHintHeader *header = (DamageHintHeader *)datagram;
+  DamageHintRect *rects = (DamageHintRect *)(header + 1);
+  header->magic = DAMAGE_HINT_MAGIC;
+  header->numRects = 0;
+  for(int i = 1; i < argc; ++i)
+  {
+    int x, y, width, height;
+    if (!strcmp(argv[i], "-n") && i+1 < argc) count = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-i") && i+1 < argc) intervalMsecs = atoi(argv[++i]);
+    else if (sscanf(argv[i], "%d,%d,%d,%d", &x, &y, &width, &height) == 4 && x >= 0 && y >= 0 && width >= 0 && height >= 0
+      && x <= 0xFFFF && y <= 0xFFFF && width <= 0xFFFF && height <= 0xFFFF && header->numRects < DAMAGE_HINT_MAX_RECTS)
+      rects[header->numRects++] = { (uint16_t)x, (uint16_t)y, (uint16_t)width, (uint16_t)height };
+    else
+    {
+      printf("Usage: %s [-n count] [-i interval_msecs] [x,y,width,height ...] (at most %d rectangles)\n", argv[0], DAMAGE_HINT_MAX_RECTS);
+      return 1;
+    }
+  }
+
+  int s = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (s < 0)
+  {
+    printf("Failed to create a datagram socket (%s)\n", strerror(errno));
+    return 1;
+  }
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, DAMAGE_HINT_SOCKET_PATH, sizeof(addr.sun_path)-1);
+
+  const size_t size = sizeof(DamageHintHeader) + header->numRects*sizeof(DamageHintRect);
+  for(int i = 0; i < count; ++i)
+  {
+    if (i > 0) usleep(intervalMsecs * 1000);
+    header->sequence = (uint32_t)i;
+    if (sendto(s, datagram, size, MSG_DONTWAIT, (sockaddr*)&addr, sizeof(addr)) != (ssize_t)size)
+    {
+      printf("fbcp-ili9341 is not receiving damage hints at %s (%s)\n", DAMAGE_HINT_SOCKET_PATH, strerror(errno));
+      close(s);
+      return 1;
+    }
+  }
+  printf("Sent %d damage hints of %u rectangles to %s\n", count, header->numRects, DAMAGE_HINT_SOCKET_PATH);
+  close(s);
+  return 0;
+}
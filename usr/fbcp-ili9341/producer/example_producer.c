@@ -0,0 +1,119 @@
+// An example producer that hands frames over to fbcp-ili9341 built with CAPTURE_FROM_PRODUCER: a box bouncing over a gradient, with the two
+// areas that the box moves between reported as damage. Also measures how long fbcp-ili9341 takes to pick up each frame after it was submitted.
+// Usage: fbcp-producer-example [frames per second]
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fbcp_producer.h"
+
+#define BOX_SIZE 40
+#define SUBMIT_TIME_HISTORY 256 // Submit times are remembered for this many most recent frames
+
+static uint64_t monotonic_usecs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void draw_frame(uint16_t *buffer, int width, int height, int stride, int box_x, int box_y)
+{
+  for(int y = 0; y < height; ++y)
+  {
+    uint16_t *row = (uint16_t *)((uint8_t *)buffer + y * stride);
+    for(int x = 0; x < width; ++x)
+      row[x] = (uint16_t)(((x * 31 / width) << 11) | ((y * 63 / height) << 5) | 8);
+    if (y >= box_y && y < box_y + BOX_SIZE)
+      for(int x = box_x; x < box_x + BOX_SIZE; ++x)
+        row[x] = 0xFFFF;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int fps = (argc > 1) ? atoi(argv[1]) : 60;
+  if (fps <= 0) fps = 60;
+
+  struct fbcp_producer *producer;
+  while(!(producer = fbcp_producer_open(NULL)))
+  {
+    if (errno != ENOENT)
+    {
+      printf("Failed to open the shared memory segment of fbcp-ili9341: %s\n", strerror(errno));
+      return 1;
+    }
+    printf("Waiting for fbcp-ili9341 to create %s...\n", FBCP_PRODUCER_SHM_NAME);
+    sleep(1);
+  }
+  int width, height, stride;
+  fbcp_producer_get_size(producer, &width, &height, &stride);
+  if (width < BOX_SIZE || height < BOX_SIZE)
+  {
+    printf("Frames of %dx%d are too small\n", width, height);
+    return 1;
+  }
+  printf("Submitting %dx%d frames at %d fps\n", width, height, fps);
+
+  uint64_t submit_times[SUBMIT_TIME_HISTORY] = {};
+  int box_x = 0, box_y = 0, dx = 2, dy = 1, prev_box_x = 0, prev_box_y = 0;
+  uint32_t last_taken = fbcp_producer_last_taken(producer, NULL);
+  int num_submitted = 0, num_measured = 0;
+  uint64_t total_latency = 0, max_latency = 0;
+  uint64_t next_frame = monotonic_usecs(), next_report = next_frame + 1000000;
+  for(int frame = 0;; ++frame)
+  {
+    // Each buffer is redrawn in full, since the back buffer holds some older frame. The damage is what changed since the previous frame.
+    draw_frame(fbcp_producer_back_buffer(producer), width, height, stride, box_x, box_y);
+    struct fbcp_damage_rect damage[2] = {
+      { (uint16_t)prev_box_x, (uint16_t)prev_box_y, BOX_SIZE, BOX_SIZE },
+      { (uint16_t)box_x, (uint16_t)box_y, BOX_SIZE, BOX_SIZE }
+    };
+    uint64_t submit_time = monotonic_usecs(); // Before submitting, since fbcp-ili9341 may take the frame right away
+    uint32_t sequence = fbcp_producer_submit(producer, frame > 0 ? damage : NULL, 2);
+    submit_times[sequence % SUBMIT_TIME_HISTORY] = submit_time;
+    ++num_submitted;
+
+    prev_box_x = box_x;
+    prev_box_y = box_y;
+    if (box_x + dx < 0 || box_x + dx + BOX_SIZE > width) dx = -dx;
+    if (box_y + dy < 0 || box_y + dy + BOX_SIZE > height) dy = -dy;
+    box_x += dx;
+    box_y += dy;
+
+    next_frame += 1000000 / fps;
+    uint64_t now = monotonic_usecs();
+    if (next_frame > now) usleep(next_frame - now);
+    else next_frame = now; // Fell behind, do not try to catch up
+
+    // Measure the handover latency of the frame that fbcp-ili9341 took most recently. If it took several since the previous check, only the last
+    // one is measured.
+    uint64_t taken_time;
+    uint32_t taken = fbcp_producer_last_taken(producer, &taken_time);
+    if (taken != last_taken && sequence - taken < SUBMIT_TIME_HISTORY && submit_times[taken % SUBMIT_TIME_HISTORY]) // Not one of the previous producer
+    {
+      uint64_t latency = taken_time - submit_times[taken % SUBMIT_TIME_HISTORY];
+      total_latency += latency;
+      if (latency > max_latency) max_latency = latency;
+      ++num_measured;
+    }
+    last_taken = taken;
+
+    if (now >= next_report)
+    {
+      if (num_measured > 0)
+        printf("Submitted %d frames. Latency until fbcp-ili9341 took them: average %.3f msecs, max %.3f msecs\n", num_submitted, total_latency / 1000.0 / num_measured, max_latency / 1000.0);
+      else
+        printf("Submitted %d frames, fbcp-ili9341 took none of them\n", num_submitted);
+      num_submitted = num_measured = 0;
+      total_latency = max_latency = 0;
+      next_report = now + 1000000;
+    }
+  }
+  fbcp_producer_close(producer);
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h> // FUTEX_WAKE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h> // SYS_futex
+#include <unistd.h>
+
+#include "fbcp_producer.h"
+
+struct fbcp_producer
+{
+  struct fbcp_shared_header *header;
+  uint32_t size; // Size of the mapping
+  uint32_t back_buffer; // Index of the buffer that the producer draws into
+  uint32_t sequence; // Sequence number of the next frame
+};
+
+struct fbcp_producer *fbcp_producer_open(const char *shm_name)
+{
+  int fd = shm_open(shm_name ? shm_name : FBCP_PRODUCER_SHM_NAME, O_RDWR | O_CLOEXEC, 0);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct fbcp_shared_header))
+  {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  struct fbcp_shared_header *header = (struct fbcp_shared_header *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); // The mapping keeps the segment open
+  if (header == MAP_FAILED) return NULL;
+
+  int valid = header->magic == FBCP_PRODUCER_MAGIC && header->version == FBCP_PRODUCER_VERSION && header->size <= st.st_size;
+  for(int i = 0; i < FBCP_PRODUCER_NUM_BUFFERS && valid; ++i)
+    valid = (uint64_t)header->buffer_offset[i] + (uint64_t)header->stride * header->height <= header->size;
+  if (!valid)
+  {
+    munmap(header, st.st_size);
+    errno = EPROTO;
+    return NULL;
+  }
+
+  struct fbcp_producer *producer = (struct fbcp_producer *)malloc(sizeof(struct fbcp_producer));
+  if (!producer)
+  {
+    munmap(header, st.st_size);
+    errno = ENOMEM;
+    return NULL;
+  }
+  producer->header = header;
+  producer->size = st.st_size;
+  // Carry on with the back buffer of the previous producer, if there was one: the other two are in use by the triple buffer
+  producer->back_buffer = __atomic_load_n(&header->producer_buffer, __ATOMIC_ACQUIRE) & FBCP_PRODUCER_BUFFER_INDEX_MASK;
+  // Skip a sequence number, so that the first frame is diffed in full: what the previous producer left on the display is not known
+  uint32_t latest = __atomic_load_n(&header->latest_buffer, __ATOMIC_ACQUIRE) & FBCP_PRODUCER_BUFFER_INDEX_MASK;
+  producer->sequence = header->frames[latest].sequence + 2;
+  return producer;
+}
+
+void fbcp_producer_close(struct fbcp_producer *producer)
+{
+  if (!producer) return;
+  munmap(producer->header, producer->size);
+  free(producer);
+}
+
+void fbcp_producer_get_size(const struct fbcp_producer *producer, int *width, int *height, int *stride)
+{
+  if (width) *width = producer->header->width;
+  if (height) *height = producer->header->height;
+  if (stride) *stride = producer->header->stride;
+}
+
+uint16_t *fbcp_producer_back_buffer(struct fbcp_producer *producer)
+{
+  return (uint16_t *)((uint8_t *)producer->header + producer->header->buffer_offset[producer->back_buffer]);
+}
+
+uint32_t fbcp_producer_submit(struct fbcp_producer *producer, const struct fbcp_damage_rect *damage, int num_damage_rects)
+{
+  struct fbcp_shared_header *header = producer->header;
+  struct fbcp_frame_info *frame = &header->frames[producer->back_buffer];
+  uint32_t sequence = producer->sequence++;
+  frame->sequence = sequence;
+  if (!damage || num_damage_rects < 0)
+    frame->num_damage_rects = FBCP_PRODUCER_DAMAGE_UNKNOWN;
+  else
+  {
+    frame->num_damage_rects = num_damage_rects;
+    if (num_damage_rects <= FBCP_PRODUCER_MAX_DAMAGE_RECTS) memcpy(frame->damage, damage, num_damage_rects * sizeof(struct fbcp_damage_rect));
+  }
+
+  // Publish the back buffer, and take the previously published buffer as the new back buffer. If fbcp-ili9341 did not take the frame in it,
+  // it is dropped; fbcp-ili9341 notices the gap in the sequence numbers.
+  uint32_t previous = __atomic_exchange_n(&header->latest_buffer, producer->back_buffer | FBCP_PRODUCER_FRESH, __ATOMIC_SEQ_CST);
+  producer->back_buffer = previous & FBCP_PRODUCER_BUFFER_INDEX_MASK;
+  __atomic_store_n(&header->producer_buffer, producer->back_buffer, __ATOMIC_RELEASE);
+
+  // Ring the doorbell. fbcp-ili9341 sets consumer_waiting before it checks for a fresh frame and goes to sleep, so if it is not seen set here,
+  // fbcp-ili9341 sees the frame that was just published, and the system call can be skipped.
+  __atomic_add_fetch(&header->doorbell, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&header->consumer_waiting, __ATOMIC_SEQ_CST))
+    syscall(SYS_futex, &header->doorbell, FUTEX_WAKE, 1, 0, 0, 0);
+  return sequence;
+}
+
+uint32_t fbcp_producer_last_taken(const struct fbcp_producer *producer, uint64_t *time_usecs)
+{
+  // Retry if fbcp-ili9341 was updating the fields while they were read
+  const struct fbcp_shared_header *header = producer->header;
+  uint32_t generation, sequence;
+  uint64_t time;
+  do
+  {
+    generation = __atomic_load_n(&header->taken_generation, __ATOMIC_ACQUIRE);
+    sequence = __atomic_load_n(&header->taken_sequence, __ATOMIC_RELAXED);
+    time = __atomic_load_n(&header->taken_time_usecs, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while((generation & 1) || generation != __atomic_load_n(&header->taken_generation, __ATOMIC_RELAXED));
+  if (time_usecs) *time_usecs = time;
+  return sequence;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// An application can hand its finished frames straight to fbcp-ili9341 built with CAPTURE_FROM_PRODUCER, instead of having fbcp-ili9341 capture
+// them from a display. fbcp-ili9341 creates a POSIX shared memory segment (FBCP_PRODUCER_SHM_NAME) that holds a header and three RGB565 frame
+// buffers of PRODUCER_FRAME_WIDTH x PRODUCER_FRAME_HEIGHT pixels (see config.h), which are passed between the producer and fbcp-ili9341 as a
+// triple buffer:
+//  - The producer draws into its back buffer, and publishes it by exchanging it with the latest published buffer, with FBCP_PRODUCER_FRESH set.
+//    It never waits for fbcp-ili9341: if the previously published frame was not taken yet, it is dropped, and its buffer becomes the new back buffer.
+//  - fbcp-ili9341 takes a fresh frame by exchanging the buffer that it is done with for the latest published one.
+//  - Each published frame carries a sequence number, one higher than the previous one, and the rectangles that changed since the previous frame.
+//    If a frame is dropped, or the damage is not known, the whole next frame is diffed.
+//  - The doorbell is a futex that the producer increments and wakes after publishing, which fbcp-ili9341 sleeps on.
+// Only one producer at a time is supported. The segment is left in place when fbcp-ili9341 quits, so both sides can be restarted independently.
+// All fields are in the native byte order of the Pi.
+
+#define FBCP_PRODUCER_SHM_NAME "/fbcp-ili9341-frames"
+#define FBCP_PRODUCER_MAGIC 0x50464246 // "FBFP"
+#define FBCP_PRODUCER_VERSION 1
+#define FBCP_PRODUCER_NUM_BUFFERS 3
+#define FBCP_PRODUCER_BUFFER_INDEX_MASK 0x3
+#define FBCP_PRODUCER_FRESH 0x4 // Set in latest_buffer while the frame in it has not been taken by fbcp-ili9341
+#define FBCP_PRODUCER_MAX_DAMAGE_RECTS 32
+#define FBCP_PRODUCER_DAMAGE_UNKNOWN 0xFFFFFFFFu // num_damage_rects of a frame that may have changed anywhere
+
+struct fbcp_damage_rect
+{
+  uint16_t x, y, width, height;
+};
+
+struct fbcp_frame_info
+{
+  uint32_t sequence;
+  uint32_t num_damage_rects; // Or FBCP_PRODUCER_DAMAGE_UNKNOWN, or more than FBCP_PRODUCER_MAX_DAMAGE_RECTS if they did not fit
+  struct fbcp_damage_rect damage[FBCP_PRODUCER_MAX_DAMAGE_RECTS];
+};
+
+struct fbcp_shared_header
+{
+  // Written by fbcp-ili9341 when the segment is created
+  uint32_t magic; // FBCP_PRODUCER_MAGIC
+  uint32_t version; // FBCP_PRODUCER_VERSION
+  uint32_t width, height; // Size of the frames in pixels
+  uint32_t stride; // Bytes from one row of a frame to the next
+  uint32_t size; // Size of the whole segment in bytes
+  uint32_t buffer_offset[FBCP_PRODUCER_NUM_BUFFERS]; // Offsets of the frame buffers from the start of the segment
+
+  // The triple buffer
+  volatile uint32_t latest_buffer; // Index of the most recently published buffer, | FBCP_PRODUCER_FRESH if it has not been taken yet
+  volatile uint32_t producer_buffer; // Index of the back buffer of the producer. Only written by the producer
+  volatile uint32_t consumer_buffer; // Index of the buffer that fbcp-ili9341 took last. Only written by fbcp-ili9341
+
+  volatile uint32_t doorbell; // Incremented by the producer after each published frame, and woken as a futex if consumer_waiting is set
+  volatile uint32_t consumer_waiting; // Nonzero while fbcp-ili9341 sleeps on the doorbell
+
+  // Written by fbcp-ili9341 when it takes a frame, so that the producer can pace itself and measure the latency of the handover
+  volatile uint32_t taken_generation; // Odd while fbcp-ili9341 is updating the two fields below
+  volatile uint32_t taken_sequence;
+  volatile uint64_t taken_time_usecs; // CLOCK_MONOTONIC time of when the frame with taken_sequence was taken
+
+  struct fbcp_frame_info frames[FBCP_PRODUCER_NUM_BUFFERS]; // The frame in each buffer. Written by the producer before publishing it
+};
+
+struct fbcp_producer;
+
+// Opens the shared memory segment of fbcp-ili9341 (shm_name, or FBCP_PRODUCER_SHM_NAME if null). Returns null and sets errno if fbcp-ili9341 has
+// not created the segment, or it is not of a supported version.
+struct fbcp_producer *fbcp_producer_open(const char *shm_name);
+
+void fbcp_producer_close(struct fbcp_producer *producer);
+
+// Returns the size of the frames in pixels, and the bytes from one row of a frame buffer to the next.
+void fbcp_producer_get_size(const struct fbcp_producer *producer, int *width, int *height, int *stride);
+
+// Returns the buffer to draw the next frame into. After each submit the back buffer is a different one, which holds an older frame (or garbage),
+// so redraw all of the frame, or at least everything that changed since the frame that the buffer held.
+uint16_t *fbcp_producer_back_buffer(struct fbcp_producer *producer);
+
+// Publishes the back buffer as a new frame, and rings the doorbell. damage lists the num_damage_rects rectangles that changed since the previously
+// submitted frame; pass null to report that the whole frame may have changed. Returns the sequence number of the frame.
+uint32_t fbcp_producer_submit(struct fbcp_producer *producer, const struct fbcp_damage_rect *damage, int num_damage_rects);
+
+// Returns the sequence number of the frame that fbcp-ili9341 took most recently, and the CLOCK_MONOTONIC time in microseconds of when it took it.
+uint32_t fbcp_producer_last_taken(const struct fbcp_producer *producer, uint64_t *time_usecs);
+
+#ifdef __cplusplus
+}
+#endif
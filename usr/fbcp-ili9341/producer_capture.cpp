@@ -0,0 +1,177 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h> // FUTEX_WAIT
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h> // SYS_futex
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef CAPTURE_FROM_PRODUCER
+
+#include "producer/fbcp_producer.h"
+#include "producer_capture.h"
+#include "capture_sampler.h"
+#include "damage_hints.h"
+#include "gpu.h"
+#include "tick.h"
+#include "util.h"
+
+// While the producer publishes no frames, the GPU polling thread still wakes up this often to notice when the program is quitting
+#define IDLE_WAKEUP_MSECS 500
+
+extern volatile bool programRunning;
+
+static fbcp_shared_header *header = 0;
+static uint32_t segmentSize = 0;
+static uint32_t consumerBuffer = 0; // Index of the buffer that holds the frame that was taken last
+static const uint8_t *buffers[FBCP_PRODUCER_NUM_BUFFERS] = {}; // Not taken from the header, which the producer can write to
+static CaptureSource source = {};
+#ifdef USE_DAMAGE_HINTS
+static bool haveSequence = false;
+static uint32_t nextSequence = 0; // The sequence number that the next frame has, if none were dropped
+#endif
+
+void InitProducerCapture(int *displayWidth, int *displayHeight)
+{
+  // Put each frame buffer on pages of its own
+  const uint32_t stride = ALIGN_UP(PRODUCER_FRAME_WIDTH*2, 32);
+  const uint32_t headerSize = ALIGN_UP(sizeof(fbcp_shared_header), 4096);
+  const uint32_t bufferSize = ALIGN_UP(stride*PRODUCER_FRAME_HEIGHT, 4096);
+  segmentSize = headerSize + FBCP_PRODUCER_NUM_BUFFERS*bufferSize;
+
+  int fd = shm_open(FBCP_PRODUCER_SHM_NAME, O_RDWR | O_CLOEXEC, 0);
+  struct stat st;
+  if (fd >= 0 && (fstat(fd, &st) < 0 || st.st_size != (off_t)segmentSize))
+  {
+    // Left behind by a run with a different frame size. A producer that still has it mapped keeps its mapping, but stops getting its frames shown.
+    close(fd);
+    shm_unlink(FBCP_PRODUCER_SHM_NAME);
+    fd = -1;
+  }
+  bool created = false;
+  if (fd < 0)
+  {
+    fd = shm_open(FBCP_PRODUCER_SHM_NAME, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0 || ftruncate(fd, segmentSize) < 0)
+    {
+      printf("Failed to create shared memory segment %s of %u bytes (%s)\n", FBCP_PRODUCER_SHM_NAME, segmentSize, strerror(errno));
+      FATAL_ERROR("Failed to create the shared memory segment for the producer!");
+    }
+    fchmod(fd, 0666); // Let producers that do not run as root hand over frames
+    created = true;
+  }
+  header = (fbcp_shared_header *)mmap(0, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED) FATAL_ERROR("Failed to map the shared memory segment for the producer!");
+
+  if (!created && header->magic == FBCP_PRODUCER_MAGIC && header->version == FBCP_PRODUCER_VERSION && header->width == PRODUCER_FRAME_WIDTH
+    && header->height == PRODUCER_FRAME_HEIGHT && header->stride == stride && header->size == segmentSize)
+  {
+    // A producer may still be running from before fbcp-ili9341 was restarted, so carry on with the triple buffer where it was left
+    consumerBuffer = header->consumer_buffer % FBCP_PRODUCER_NUM_BUFFERS;
+    printf("Receiving frames from a producer through the existing shared memory segment %s\n", FBCP_PRODUCER_SHM_NAME);
+  }
+  else
+  {
+    memset(header, 0, sizeof(fbcp_shared_header));
+    header->version = FBCP_PRODUCER_VERSION;
+    header->width = PRODUCER_FRAME_WIDTH;
+    header->height = PRODUCER_FRAME_HEIGHT;
+    header->stride = stride;
+    header->size = segmentSize;
+    for(int i = 0; i < FBCP_PRODUCER_NUM_BUFFERS; ++i)
+      header->buffer_offset[i] = headerSize + i*bufferSize;
+    header->producer_buffer = 0;
+    header->latest_buffer = 1;
+    header->consumer_buffer = consumerBuffer = 2;
+    __atomic_store_n(&header->magic, FBCP_PRODUCER_MAGIC, __ATOMIC_RELEASE); // Last, so producers do not open a half initialized segment
+    printf("Receiving frames from a producer through shared memory segment %s\n", FBCP_PRODUCER_SHM_NAME);
+  }
+
+  for(int i = 0; i < FBCP_PRODUCER_NUM_BUFFERS; ++i)
+    buffers[i] = (const uint8_t*)header + headerSize + i*bufferSize;
+  source.pitch = stride;
+  source.width = PRODUCER_FRAME_WIDTH;
+  source.height = PRODUCER_FRAME_HEIGHT;
+  source.bytesPerPixel = 2;
+  *displayWidth = PRODUCER_FRAME_WIDTH;
+  *displayHeight = PRODUCER_FRAME_HEIGHT;
+}
+
+void DeinitProducerCapture()
+{
+  // The segment is left in place for the producer, and reused on the next run
+  if (!header) return;
+  munmap(header, segmentSize);
+  header = 0;
+}
+
+void WaitForProducerFrame(uint64_t earliestTime)
+{
+  // Sleep on the doorbell until the producer publishes a frame. Announce the wait before checking for a fresh frame: the producer checks the
+  // announcement after publishing, so either this sees the frame, or the producer sees the announcement and wakes the futex.
+  while(programRunning)
+  {
+    uint32_t doorbell = __atomic_load_n(&header->doorbell, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&header->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->latest_buffer, __ATOMIC_SEQ_CST) & FBCP_PRODUCER_FRESH) break;
+    timespec timeout = { 0, IDLE_WAKEUP_MSECS * 1000000 };
+    syscall(SYS_futex, &header->doorbell, FUTEX_WAIT, doorbell, &timeout, 0, 0);
+  }
+  __atomic_store_n(&header->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+
+  uint64_t now = tick();
+  if (earliestTime > now && programRunning) usleep(MIN(earliestTime - now, 1000000));
+}
+
+bool SnapshotProducerFramebuffer(uint16_t *destination)
+{
+  if (!(__atomic_load_n(&header->latest_buffer, __ATOMIC_ACQUIRE) & FBCP_PRODUCER_FRESH)) return false;
+
+  // Give the buffer of the previously taken frame back to the producer, and take the most recently published one
+  uint32_t latest = __atomic_exchange_n(&header->latest_buffer, consumerBuffer, __ATOMIC_SEQ_CST);
+  consumerBuffer = (latest & FBCP_PRODUCER_BUFFER_INDEX_MASK) % FBCP_PRODUCER_NUM_BUFFERS; // A misbehaving producer can only make frames tear
+  __atomic_store_n(&header->consumer_buffer, consumerBuffer, __ATOMIC_RELEASE);
+  const fbcp_frame_info &frame = header->frames[consumerBuffer];
+  const uint32_t sequence = frame.sequence;
+
+  // Tell the producer when the frame was taken
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  __atomic_add_fetch(&header->taken_generation, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&header->taken_sequence, sequence, __ATOMIC_RELAXED);
+  __atomic_store_n(&header->taken_time_usecs, (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&header->taken_generation, 1, __ATOMIC_RELEASE);
+
+#ifdef USE_DAMAGE_HINTS
+  // Pass the damage on as hints to only diff what the producer changed. The damage of frames that were dropped in between is not known.
+  const uint32_t numRects = frame.num_damage_rects;
+  DamageHintRect hints[FBCP_PRODUCER_MAX_DAMAGE_RECTS];
+  if (haveSequence && sequence == nextSequence && numRects <= FBCP_PRODUCER_MAX_DAMAGE_RECTS)
+  {
+    for(uint32_t i = 0; i < numRects; ++i)
+      hints[i] = { frame.damage[i].x, frame.damage[i].y, frame.damage[i].width, frame.damage[i].height };
+    AddCapturedDamage(hints, numRects);
+  }
+  else
+  {
+    hints[0] = { 0, 0, PRODUCER_FRAME_WIDTH, PRODUCER_FRAME_HEIGHT };
+    AddCapturedDamage(hints, 1);
+  }
+  haveSequence = true;
+  nextSequence = sequence + 1;
+#endif
+
+  source.pixels = buffers[consumerBuffer];
+  return SampleCaptureSource(source, 0, 0, destination);
+}
+
+#endif
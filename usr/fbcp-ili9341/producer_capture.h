@@ -0,0 +1,24 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef CAPTURE_FROM_PRODUCER
+// Receives the frames that an application renders through the producer API (producer/fbcp_producer.h), instead of capturing them from a display.
+// The frames are passed through a triple buffer in shared memory, so the GPU polling thread sleeps on the doorbell of the producer, and takes each
+// frame as soon as it is finished. The rectangles that the producer reports as changed are passed on as damage hints, so that only they get diffed.
+
+// Creates the shared memory segment (FBCP_PRODUCER_SHM_NAME) with frames of PRODUCER_FRAME_WIDTH x PRODUCER_FRAME_HEIGHT pixels, or reuses the one
+// that a previous run left behind, and returns the size of the frames.
+void InitProducerCapture(int *displayWidth, int *displayHeight);
+
+void DeinitProducerCapture(void);
+
+// Blocks until the producer has published a frame that was not taken yet, and then until the given time.
+void WaitForProducerFrame(uint64_t earliestTime);
+
+// Takes the most recently published frame, and samples the capture rectangle (see SetCaptureRectangle()) of it into destination. Returns false
+// if no new frame was published.
+bool SnapshotProducerFramebuffer(uint16_t *destination);
+#endif
@@ -0,0 +1,136 @@
+#include <string.h> // memset
+
+#include "config.h"
+#include "rolling_refresh.h"
+#include "display.h"
+#include "gpu.h"
+#include "util.h"
+#include "mem_alloc.h"
+
+#ifdef USE_ROLLING_REFRESH
+
+// Scanline ages saturate at this, and a scanline chosen to be sent this update is tagged with SCANLINE_SENT on top of its age.
+#define MAX_TRACKED_AGE 127
+#define SCANLINE_SENT 0x80
+
+static uint8_t *scanlineAge = 0; // For each scanline, the number of updates that its changes have been waiting to be sent, or 0 if none are pending
+static uint32_t *scanlineBytes = 0; // Estimated SPI bus bytes needed to submit the changes on each scanline, valid on the scanlines that have changes
+static int rollingRefreshY = 0; // The scanline to continue sending from among scanlines whose changes are equally old
+#ifdef STATISTICS
+static int maxSentScanlineAge = 0;
+#endif
+
+void InitRollingRefresh()
+{
+  scanlineAge = (uint8_t*)Malloc(gpuFrameHeight, "InitRollingRefresh() scanline ages");
+  scanlineBytes = (uint32_t*)Malloc(gpuFrameHeight*sizeof(uint32_t), "InitRollingRefresh() scanline bytes");
+  memset(scanlineAge, 0, gpuFrameHeight);
+  rollingRefreshY = 0;
+}
+
+int SelectRollingRefreshSpans(SpanArray &spanArray, double maxBytesToSend)
+{
+  // Age the scanlines that have changes, and mark the rest up to date. The bytes are estimated the same way as the differs estimate them in DiffStats.
+  uint32_t ageBytes[MAX_TRACKED_AGE+1] = {}; // Bytes needed to send the scanlines of each age
+  int y = 0;
+  for(int i = 0; i < spanArray.numSpans; ++i)
+  {
+    const Span &span = spanArray.spans[i];
+    if (i == 0 || spanArray.spans[i-1].y != span.y)
+    {
+      for(; y < span.y; ++y) scanlineAge[y] = 0;
+      scanlineAge[y] = MIN(scanlineAge[y] + 1, MAX_TRACKED_AGE);
+      scanlineBytes[y] = SCANLINE_CHANGE_OVERHEAD_BYTES;
+      ++y;
+    }
+    scanlineBytes[span.y] += span.Size()*SPI_BYTESPERPIXEL + SPAN_START_OVERHEAD_BYTES;
+  }
+  for(; y < gpuFrameHeight; ++y) scanlineAge[y] = 0;
+  if (spanArray.numSpans == 0) return 0;
+
+  for(int i = 0; i < spanArray.numSpans; ++i)
+    if (i == 0 || spanArray.spans[i-1].y != spanArray.spans[i].y)
+      ageBytes[scanlineAge[spanArray.spans[i].y]] += scanlineBytes[spanArray.spans[i].y];
+
+  // The scanlines that have waited for too long are sent whether they fit or not. After those, the scanlines are sent oldest first for as long as all
+  // scanlines of the same age fit. The scanlines of the first age that does not fully fit are sent in rolling order up to the first one that does not fit.
+  double budget = maxBytesToSend;
+  bool sendingAny = false;
+  for(int age = ROLLING_REFRESH_MAX_SCANLINE_AGE; age <= MAX_TRACKED_AGE; ++age)
+  {
+    budget -= ageBytes[age];
+    sendingAny = sendingAny || ageBytes[age] > 0;
+  }
+  int partialAge = 0; // Scanlines older than this are sent in full, and younger ones not at all
+  for(int age = ROLLING_REFRESH_MAX_SCANLINE_AGE-1; age > 0; --age)
+  {
+    if (ageBytes[age] > 0 && ageBytes[age] > budget)
+    {
+      partialAge = age;
+      break;
+    }
+    budget -= ageBytes[age];
+    sendingAny = sendingAny || ageBytes[age] > 0;
+  }
+
+  if (partialAge > 0)
+  {
+    // Continue from where the previous partially sent age left off, so that scanlines of the same age take turns. If nothing else is sent, the first
+    // scanline is sent anyway, so that every update makes progress.
+    y = rollingRefreshY;
+    for(int i = 0; i < gpuFrameHeight; ++i, y = (y+1 < gpuFrameHeight) ? y+1 : 0)
+    {
+      if (scanlineAge[y] != partialAge) continue;
+      if (scanlineBytes[y] > budget && sendingAny) break;
+      budget -= scanlineBytes[y];
+      scanlineAge[y] |= SCANLINE_SENT;
+      sendingAny = true;
+    }
+    rollingRefreshY = y;
+  }
+
+  // Keep the spans on the scanlines that are sent, mark those scanlines up to date, and count the scanlines left pending.
+  int numSpans = 0, numScanlinesLeftPending = 0;
+  bool sendScanline = false;
+  for(int i = 0; i < spanArray.numSpans; ++i)
+  {
+    const Span &span = spanArray.spans[i];
+    if (i == 0 || spanArray.spans[i-1].y != span.y)
+    {
+      sendScanline = (scanlineAge[span.y] > partialAge); // Also true for the scanlines of partialAge tagged with SCANLINE_SENT
+      if (sendScanline)
+      {
+#ifdef STATISTICS
+        maxSentScanlineAge = MAX(maxSentScanlineAge, scanlineAge[span.y] & ~SCANLINE_SENT);
+#endif
+        scanlineAge[span.y] = 0;
+      }
+      else
+        ++numScanlinesLeftPending;
+    }
+    if (sendScanline)
+      spanArray.spans[numSpans++] = span;
+  }
+  spanArray.numSpans = numSpans;
+  return numScanlinesLeftPending;
+}
+
+#ifdef USE_SCANLINE_HASHES
+void UpdateRollingRefreshScanlineHashes()
+{
+  for(int y = 0; y < gpuFrameHeight; ++y)
+    if (scanlineAge[y] == 0)
+      prevScanlineHashes[y] = scanlineHashes[y];
+}
+#endif
+
+#ifdef STATISTICS
+int TakeMaxSentScanlineAge()
+{
+  int age = maxSentScanlineAge;
+  maxSentScanlineAge = 0;
+  return age;
+}
+#endif
+
+#endif
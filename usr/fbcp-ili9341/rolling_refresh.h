@@ -0,0 +1,36 @@
+#pragma once
+
+#include "config.h"
+#include "diff.h"
+
+#ifdef USE_ROLLING_REFRESH
+
+// When the changed pixels of a frame would take too long to send, rolling refresh sends as many whole changed scanlines as fit in the time available,
+// and carries the rest over to the following updates. Each scanline has an age: the number of updates that its changes have been waiting to be sent,
+// or 0 if the display is up to date on it. The oldest changes are sent first, and among equally old changes, the scanlines are sent in a rolling order
+// down the frame, continuing from where the previous update left off.
+
+#if ROLLING_REFRESH_MAX_SCANLINE_AGE < 1 || ROLLING_REFRESH_MAX_SCANLINE_AGE > 127
+#error ROLLING_REFRESH_MAX_SCANLINE_AGE must be between 1 and 127
+#endif
+
+// Allocates the per scanline ages. Call after InitGPU().
+void InitRollingRefresh(void);
+
+// Drops the spans from the given array of unmerged single scanline spans that do not fit in maxBytesToSend, and returns the number of changed scanlines
+// that were left pending. At least one changed scanline is always sent, and so are all scanlines that have waited for ROLLING_REFRESH_MAX_SCANLINE_AGE
+// updates, even if they do not fit.
+int SelectRollingRefreshSpans(SpanArray &spanArray, double maxBytesToSend);
+
+#ifdef USE_SCANLINE_HASHES
+// After the selected spans have been copied over to the previous framebuffer, carries over the hashes of the scanlines that the display is up to date on.
+// The pending scanlines keep their old hashes, so that the next diff picks them up again.
+void UpdateRollingRefreshScanlineHashes(void);
+#endif
+
+#ifdef STATISTICS
+// The most updates that any changed scanline sent since the last call waited for, counting the update it was sent on. Resets the count.
+int TakeMaxSentScanlineAge(void);
+#endif
+
+#endif
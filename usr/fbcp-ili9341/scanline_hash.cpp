@@ -0,0 +1,61 @@
+#include <string.h> // memcmp
+
+#include "config.h"
+#include "gpu.h"
+
+// The scanline hashes are kept apart from the rest of gpu.cpp, so that the tools in host/ can build the differs without the capture code.
+
+static inline uint32_t RotateLeft32(uint32_t x, int r)
+{
+  return (x << r) | (x >> (32 - r));
+}
+
+// An xxHash32 style hash: four independent multiply-rotate lanes over 32-bit words, so that the multiplies pipeline well, followed by a final avalanche mix.
+#define HASH_PRIME1 2654435761u
+#define HASH_PRIME2 2246822519u
+#define HASH_PRIME3 3266489917u
+#define HASH_PRIME4 668265263u
+#define HASH_PRIME5 374761393u
+uint32_t HashScanline(const uint16_t *scanline, int width)
+{
+  const uint32_t *p = (const uint32_t *)scanline;
+  const int numWords = width >> 1;
+  uint32_t h0 = HASH_PRIME1 + HASH_PRIME2, h1 = HASH_PRIME2, h2 = 0, h3 = 0 - HASH_PRIME1;
+  int i = 0;
+  for(; i + 4 <= numWords; i += 4)
+  {
+    h0 = RotateLeft32(h0 + p[i]   * HASH_PRIME2, 13) * HASH_PRIME1;
+    h1 = RotateLeft32(h1 + p[i+1] * HASH_PRIME2, 13) * HASH_PRIME1;
+    h2 = RotateLeft32(h2 + p[i+2] * HASH_PRIME2, 13) * HASH_PRIME1;
+    h3 = RotateLeft32(h3 + p[i+3] * HASH_PRIME2, 13) * HASH_PRIME1;
+  }
+  uint32_t h = RotateLeft32(h0, 1) + RotateLeft32(h1, 7) + RotateLeft32(h2, 12) + RotateLeft32(h3, 18) + (uint32_t)width;
+  for(; i < numWords; ++i)
+    h = RotateLeft32(h + p[i] * HASH_PRIME3, 17) * HASH_PRIME4;
+  if (width & 1)
+    h = RotateLeft32(h + scanline[width-1] * HASH_PRIME5, 11) * HASH_PRIME1;
+  h ^= h >> 15;
+  h *= HASH_PRIME2;
+  h ^= h >> 13;
+  h *= HASH_PRIME3;
+  h ^= h >> 16;
+  return h;
+}
+
+#ifdef USE_SCANLINE_HASHES
+void ComputeScanlineHashes(const uint16_t *framebuffer, uint32_t *scanlineHashes)
+{
+  ComputeScanlineHashesInRange(framebuffer, scanlineHashes, 0, gpuFrameHeight);
+}
+
+void ComputeScanlineHashesInRange(const uint16_t *framebuffer, uint32_t *scanlineHashes, int startY, int endY)
+{
+  for(int y = startY; y < endY; ++y)
+    scanlineHashes[y] = HashScanline(framebuffer + y*(gpuFramebufferScanlineStrideBytes>>1), gpuFrameWidth);
+}
+
+bool ScanlineHashesDiffer(const uint32_t *scanlineHashes, const uint32_t *prevScanlineHashes)
+{
+  return memcmp(scanlineHashes, prevScanlineHashes, gpuFrameHeight*sizeof(uint32_t)) != 0;
+}
+#endif
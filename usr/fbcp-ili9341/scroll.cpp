@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "scroll.h"
+#include "diff.h"
+#include "gpu.h"
+#include "spi.h"
+#include "util.h"
+#include "mem_alloc.h"
+
+#ifdef USE_HARDWARE_SCROLLING
+
+int scrollAreaTop = 0, scrollAreaHeight = 0, scrollOffset = 0;
+
+static bool hardwareScrollingEnabled = false;
+static uint8_t *scrollTempRows = 0; // Scratch space for rotating half of the scanlines of the previous framebuffer
+
+// Frames where fewer scanlines than this have changed are not worth looking for a scroll in
+#define MIN_CHANGED_SCANLINES_TO_DETECT_SCROLL 8
+
+// The number of changed scanlines of the new frame that are looked up in the previous frame to find candidate scroll amounts
+#define MAX_SCROLL_ANCHORS 8
+
+// Only scroll if that saves sending at least this many scanlines, to not pay for the scroll command (and the risk of a hash collision) for nothing
+#define MIN_SCANLINES_SAVED_BY_SCROLL 4
+
+static void QueueSetScrollStart(int row)
+{
+#ifdef DISPLAY_SET_CURSOR_IS_8_BIT
+  QUEUE_SPI_TRANSFER(DISPLAY_SET_SCROLL_START, (uint8_t)row);
+#else
+  QUEUE_SPI_TRANSFER(DISPLAY_SET_SCROLL_START, (uint8_t)(row >> 8), (uint8_t)(row & 0xFF));
+#endif
+}
+
+void InitHardwareScrolling()
+{
+  scrollOffset = 0;
+#ifdef DISPLAY_SET_SCROLL_AREA
+  // Scroll only the rows that the framebuffer is drawn to, so that any letterboxing bars above and below stay in place.
+  scrollAreaTop = displayYOffset;
+  scrollAreaHeight = gpuFrameHeight;
+  int scrollAreaBottom = DISPLAY_SCROLL_MEMORY_HEIGHT - scrollAreaTop - scrollAreaHeight;
+  QUEUE_SPI_TRANSFER(DISPLAY_SET_SCROLL_AREA, (uint8_t)(scrollAreaTop >> 8), (uint8_t)(scrollAreaTop & 0xFF), (uint8_t)(scrollAreaHeight >> 8), (uint8_t)(scrollAreaHeight & 0xFF),
+    (uint8_t)(scrollAreaBottom >> 8), (uint8_t)(scrollAreaBottom & 0xFF));
+  hardwareScrollingEnabled = true;
+#else
+  // The whole display memory scrolls, so this only works if the framebuffer starts from the top of the display.
+  hardwareScrollingEnabled = (displayYOffset == 0);
+  scrollAreaTop = 0;
+  scrollAreaHeight = hardwareScrollingEnabled ? DISPLAY_SCROLL_MEMORY_HEIGHT : gpuFrameHeight;
+#endif
+  if (!hardwareScrollingEnabled)
+  {
+    printf("Hardware scrolling is not available, since the framebuffer does not start at the top of the display\n");
+    scrollAreaTop = displayYOffset;
+    return;
+  }
+  QueueSetScrollStart(scrollAreaTop);
+
+  scrollTempRows = (uint8_t*)Malloc(((gpuFrameHeight+1)/2) * gpuFramebufferScanlineStrideBytes, "InitHardwareScrolling() temp rows");
+  printf("Using hardware scrolling over display rows %d-%d\n", scrollAreaTop, scrollAreaTop + scrollAreaHeight - 1);
+}
+
+void DeinitHardwareScrolling()
+{
+  // Restore the power on state, so that whatever uses the display next sees the display memory rows in order.
+#ifdef DISPLAY_SET_SCROLL_AREA
+  SPI_TRANSFER(DISPLAY_SET_SCROLL_AREA, 0, 0, (uint8_t)(DISPLAY_SCROLL_MEMORY_HEIGHT >> 8), (uint8_t)(DISPLAY_SCROLL_MEMORY_HEIGHT & 0xFF), 0, 0);
+#endif
+#ifdef DISPLAY_SET_CURSOR_IS_8_BIT
+  SPI_TRANSFER(DISPLAY_SET_SCROLL_START, 0);
+#else
+  SPI_TRANSFER(DISPLAY_SET_SCROLL_START, 0, 0);
+#endif
+  scrollOffset = 0;
+}
+
+// Returns in hash the hash of the previous frame scanline that would be shown at scanline y if the display was scrolled up by the given amount.
+// Returns false if that scanline would come from display memory rows that are not currently visible, and so have unknown contents.
+static inline bool ScrolledPrevScanlineHash(int y, int scroll, uint32_t &hash)
+{
+  int src = y + scroll;
+  if (src < 0 || src >= gpuFrameHeight)
+  {
+    if (scrollAreaHeight != gpuFrameHeight) return false;
+    src = (src < 0) ? src + gpuFrameHeight : src - gpuFrameHeight; // The scanlines that scroll out of one edge come back in at the other
+  }
+  hash = prevScanlineHashes[src];
+  return true;
+}
+
+static int NumScanlinesToSendAfterScroll(int scroll)
+{
+  int numScanlines = 0;
+  for(int y = 0; y < gpuFrameHeight; ++y)
+  {
+    uint32_t hash;
+    if (!ScrolledPrevScanlineHash(y, scroll, hash) || hash != scanlineHashes[y]) ++numScanlines;
+  }
+  return numScanlines;
+}
+
+int DetectVerticalScroll()
+{
+  if (!hardwareScrollingEnabled) return 0;
+  const int H = gpuFrameHeight;
+  int numChangedScanlines = 0;
+  for(int y = 0; y < H; ++y)
+    if (scanlineHashes[y] != prevScanlineHashes[y]) ++numChangedScanlines;
+  if (numChangedScanlines < MIN_CHANGED_SCANLINES_TO_DETECT_SCROLL) return 0;
+
+  // Pick changed scanlines spread evenly over the frame as anchors, and find where each of them was in the previous frame. Scanlines that are identical
+  // to their neighbours (e.g. empty lines of text) would match at many offsets, so they are skipped as anchors.
+  int candidates[MAX_SCROLL_ANCHORS];
+  int numCandidates = 0;
+  const int anchorStride = MAX(1, numChangedScanlines / MAX_SCROLL_ANCHORS);
+  for(int y = 0, changedIndex = 0, nextAnchorIndex = 0; y < H && numCandidates < MAX_SCROLL_ANCHORS; ++y)
+  {
+    const uint32_t hash = scanlineHashes[y];
+    if (hash == prevScanlineHashes[y]) continue;
+    int index = changedIndex++;
+    if (index < nextAnchorIndex) continue;
+    if ((y > 0 && scanlineHashes[y-1] == hash) || (y+1 < H && scanlineHashes[y+1] == hash)) continue;
+    nextAnchorIndex = index + anchorStride;
+
+    // Find the nearest scanline of the previous frame with the same contents
+    for(int dist = 1; dist < H; ++dist)
+    {
+      int scroll;
+      if (y + dist < H && prevScanlineHashes[y + dist] == hash) scroll = dist;
+      else if (y - dist >= 0 && prevScanlineHashes[y - dist] == hash) scroll = -dist;
+      else continue;
+
+      bool alreadyCandidate = false;
+      for(int i = 0; i < numCandidates; ++i)
+        if (candidates[i] == scroll) alreadyCandidate = true;
+      if (!alreadyCandidate) candidates[numCandidates++] = scroll;
+      break;
+    }
+  }
+
+  // Pick the candidate that leaves the fewest scanlines to send. Counting in scanlines rather than pixels overestimates the cost of scanlines that only
+  // changed a little, but those are rare in scrolling content, and counting them this way only needs the hashes.
+  int bestScroll = 0, bestNumScanlines = numChangedScanlines;
+  for(int i = 0; i < numCandidates; ++i)
+  {
+    int numScanlines = NumScanlinesToSendAfterScroll(candidates[i]);
+    if (numScanlines < bestNumScanlines)
+    {
+      bestScroll = candidates[i];
+      bestNumScanlines = numScanlines;
+    }
+  }
+  return (bestNumScanlines + MIN_SCANLINES_SAVED_BY_SCROLL <= numChangedScanlines) ? bestScroll : 0;
+}
+
+// Rotates numRows rows of rowBytes bytes each up by the given number of rows, so that row i moves to row i-up, and the top rows wrap around to the bottom.
+static void RotateRowsUp(uint8_t *rows, int rowBytes, int numRows, int up)
+{
+  const int down = numRows - up;
+  if (up <= down) // Move whichever part is smaller via the temp buffer
+  {
+    memcpy(scrollTempRows, rows, up*rowBytes);
+    memmove(rows, rows + up*rowBytes, down*rowBytes);
+    memcpy(rows + down*rowBytes, scrollTempRows, up*rowBytes);
+  }
+  else
+  {
+    memcpy(scrollTempRows, rows + up*rowBytes, down*rowBytes);
+    memmove(rows + down*rowBytes, rows, up*rowBytes);
+    memcpy(rows, scrollTempRows, down*rowBytes);
+  }
+}
+
+void ApplyHardwareScroll(int scroll, uint16_t *framebuffer, uint16_t *prevFramebuffer)
+{
+  const int H = gpuFrameHeight;
+  const int stride = gpuFramebufferScanlineStrideBytes;
+  uint8_t *prev = (uint8_t*)prevFramebuffer;
+  if (scrollAreaHeight == H)
+  {
+    int up = (scroll < 0) ? scroll + H : scroll;
+    RotateRowsUp(prev, stride, H, up);
+    RotateRowsUp((uint8_t*)prevScanlineHashes, sizeof(uint32_t), H, up);
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+    RotateRowsUp(scanlineDriftAge, 1, H, up);
+#endif
+  }
+  else
+  {
+    // The scanlines that scroll in come from display memory rows that were not visible, so their contents are not known. Fill them in with the
+    // inverse of the new frame, so that every pixel on them gets sent.
+    int firstUnknown, endUnknown;
+    if (scroll > 0)
+    {
+      memmove(prev, prev + scroll*stride, (H - scroll)*stride);
+      memmove(prevScanlineHashes, prevScanlineHashes + scroll, (H - scroll)*sizeof(uint32_t));
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+      memmove(scanlineDriftAge, scanlineDriftAge + scroll, H - scroll);
+#endif
+      firstUnknown = H - scroll;
+      endUnknown = H;
+    }
+    else
+    {
+      memmove(prev - scroll*stride, prev, (H + scroll)*stride);
+      memmove(prevScanlineHashes - scroll, prevScanlineHashes, (H + scroll)*sizeof(uint32_t));
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+      memmove(scanlineDriftAge - scroll, scanlineDriftAge, H + scroll);
+#endif
+      firstUnknown = 0;
+      endUnknown = -scroll;
+    }
+    for(int y = firstUnknown; y < endUnknown; ++y)
+    {
+      const uint16_t *scanline = framebuffer + y*(stride>>1);
+      uint16_t *prevScanline = prevFramebuffer + y*(stride>>1);
+      for(int x = 0; x < gpuFrameWidth; ++x)
+        prevScanline[x] = ~scanline[x];
+      prevScanlineHashes[y] = HashScanline(prevScanline, gpuFrameWidth);
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+      scanlineDriftAge[y] = PERCEPTUAL_DIFF_DRIFT_CORRECTION_FRAMES; // Some inverted pixels may be close to the originals, so diff exactly to send them all
+#endif
+    }
+  }
+
+  scrollOffset = (scrollOffset + scroll) % scrollAreaHeight;
+  if (scrollOffset < 0) scrollOffset += scrollAreaHeight;
+  QueueSetScrollStart(scrollAreaTop + scrollOffset);
+}
+
+void SplitSpansAtScrollWrap(SpanArray &spanArray)
+{
+  const int wrapY = scrollAreaHeight - scrollOffset; // The first scanline that wraps around to the top of the scroll area
+  if (scrollOffset == 0 || wrapY >= gpuFrameHeight) return;
+
+  int numSplit = 0;
+  for(Span *i = spanArray.spans; i < spanArray.spans + spanArray.numSpans; ++i)
+    if (i->y < wrapY && i->endY > wrapY) ++numSplit;
+  if (!numSplit) return;
+
+  // Move the spans back to make room for the lower halves, inserting each lower half right after its upper half.
+  ReserveSpans(spanArray, spanArray.numSpans + numSplit);
+  Span *src = spanArray.spans + spanArray.numSpans, *dst = src + numSplit;
+  spanArray.numSpans += numSplit;
+  while(dst > src)
+  {
+    *--dst = *--src;
+    if (src->y < wrapY && src->endY > wrapY)
+    {
+      dst->y = wrapY;
+      *--dst = *src;
+      dst->endY = wrapY;
+      dst->lastScanEndX = dst->endX;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+#include "display.h"
+#include "gpu.h"
+
+#ifdef USE_HARDWARE_SCROLLING
+struct SpanArray;
+
+// Display memory rows [scrollAreaTop, scrollAreaTop+scrollAreaHeight[ form a ring that the display controller has scrolled by scrollOffset rows,
+// i.e. scanline y of the framebuffer is held in display memory row scrollAreaTop + (y + scrollOffset) % scrollAreaHeight.
+extern int scrollAreaTop, scrollAreaHeight, scrollOffset;
+
+// Sets up the scroll area of the display controller to cover the rows that the framebuffer is drawn to. Call after InitGPU().
+void InitHardwareScrolling(void);
+
+// Synchronously restores the display controller to its unscrolled state. Called when deinitializing the display.
+void DeinitHardwareScrolling(void);
+
+// Looks for a vertical shift between the scanline hashes of the new frame and those of the previous frame, and returns the number of scanlines
+// that the contents have moved up (positive) or down (negative) by, if scrolling the display by that amount would save sending enough scanlines.
+// Returns 0 if no such scroll was found.
+int DetectVerticalScroll(void);
+
+// Queues a command to scroll the display contents up by the given number of scanlines (down if negative), and shifts the scanlines and scanline hashes
+// of the previous framebuffer to match what the display will show after the scroll. Scanlines whose display contents are not known after the scroll
+// are set to differ from the new frame, so that the next diff sends them.
+void ApplyHardwareScroll(int scroll, uint16_t *framebuffer, uint16_t *prevFramebuffer);
+
+// Splits the spans that cross the scanline where the scrolled display memory wraps around, so that each span covers a contiguous range of display memory rows.
+void SplitSpansAtScrollWrap(SpanArray &spanArray);
+
+static inline int ScrolledDisplayY(int y)
+{
+  int row = y + scrollOffset;
+  return scrollAreaTop + (row >= scrollAreaHeight ? row - scrollAreaHeight : row);
+}
+
+// The display memory row that holds the given framebuffer scanline, and the last row that a write window starting from it may extend to
+#define DISPLAY_SCANLINE_Y(y) ScrolledDisplayY(y)
+#define DISPLAY_SCANLINE_END_Y (scrollAreaTop + scrollAreaHeight - 1)
+#else
+#define DISPLAY_SCANLINE_Y(y) (displayYOffset + (y))
+#define DISPLAY_SCANLINE_END_Y (displayYOffset + gpuFrameHeight - 1)
+#endif
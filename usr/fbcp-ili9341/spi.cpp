@@ -13,6 +13,11 @@
 #include "dma.h"
 #include "mailbox.h"
 #include "mem_alloc.h"
+#ifdef LATE_LATCH_PIXEL_TASKS
+#include "gpu.h"
+#include "frame_pool.h"
+#include "pack_kernels.h"
+#endif
 
 // Uncomment this to print out all bytes sent to the SPI bus
 // #define DEBUG_SPI_BUS_WRITES
@@ -335,6 +340,23 @@ void RunSPITask(SPITask *task)
 }
 #else
 
+#ifdef SOLID_FILL_TASKS
+// Sends the fill color of a solid fill task fillSize bytes over, repeating it from registers instead of reading every byte from the task.
+static void RunPolledSPIFill(const SPITask *task)
+{
+  const uint8_t color[4] = { task->data[0], task->data[1], task->data[2], task->data[3] };
+  const uint32_t prefillEnd = MIN(15, task->fillSize);
+  uint32_t i = 0;
+  while(i < prefillEnd) { WRITE_FIFO(color[i&3]); ++i; }
+  while(i < task->fillSize)
+  {
+    uint32_t cs = spi->cs;
+    if ((cs & BCM2835_SPI0_CS_TXD)) { WRITE_FIFO(color[i&3]); ++i; }
+    if ((cs & (BCM2835_SPI0_CS_RXR|BCM2835_SPI0_CS_RXF))) spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | DISPLAY_SPI_DRIVE_SETTINGS;
+  }
+}
+#endif
+
 void RunSPITask(SPITask *task)
 {
   WaitForPolledSPITransferToFinish();
@@ -380,7 +402,7 @@ void RunSPITask(SPITask *task)
 #define DMA_IS_FASTER_THAN_POLLED_SPI 140
   // Do a DMA transfer if this task is suitable in size for DMA to handle
 #ifdef USE_DMA_TRANSFERS
-  if (tEnd - tStart > DMA_IS_FASTER_THAN_POLLED_SPI)
+  if (task->BusSize() > DMA_IS_FASTER_THAN_POLLED_SPI)
   {
     SPIDMATransfer(task);
 
@@ -388,6 +410,11 @@ void RunSPITask(SPITask *task)
     UNLOCK_FAST_8_CLOCKS_SPI();
   }
   else
+#endif
+#ifdef SOLID_FILL_TASKS
+  if (task->fillSize)
+    RunPolledSPIFill(task);
+  else
 #endif
   {
     while(tStart < tPrefillEnd) WRITE_FIFO(*tStart++);
@@ -425,18 +452,43 @@ SPITask *GetTask() // Returns the first task in the queue, called in worker thre
     if (tail == 0) return 0;
     task = (SPITask*)spiTaskMemory->buffer;
   }
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+  // Now that queueHead points to the task, the main thread no longer starts rewriting it (see supersede.cpp), but it may be in the middle of doing so.
+  while(spiTaskMemory->taskBeingRewritten == (uint32_t)((uint8_t*)task - spiTaskMemory->buffer) + 1)
+    ;
+  __sync_synchronize();
+#endif
   return task;
 }
 
 void DoneTask(SPITask *task) // Frees the first SPI task from the queue, called in worker thread
 {
-  __atomic_fetch_sub(&spiTaskMemory->spiBytesQueued, task->PayloadSize()+1, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&spiTaskMemory->spiBytesQueued, task->BusSize()+1, __ATOMIC_RELAXED);
   spiTaskMemory->queueHead = (uint32_t)((uint8_t*)task - spiTaskMemory->buffer) + sizeof(SPITask) + task->size;
   __sync_synchronize();
 }
 
 extern volatile bool programRunning;
 
+#ifdef LATE_LATCH_PIXEL_TASKS
+// Packs the pixels that the task refers to into the task, right before it is sent. The main thread no longer touches the task after GetTask() has
+// returned it, so the frame it refers to is the newest one that the main thread has chosen for it.
+static void LatchTaskPixels(SPITask *task)
+{
+  Frame *frame = task->frame;
+  if (!frame) return;
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  uint8_t *data = task->data;
+  for(int y = task->y; y < task->endY; ++y)
+  {
+    int endX = (y + 1 == task->endY) ? task->lastScanEndX : task->endX;
+    data = packKernel.PackPixels(data, frame->pixels + y*stride + task->x, 0, endX - task->x);
+  }
+  task->frame = 0;
+  ReleaseFrame(frame);
+}
+#endif
+
 void ExecuteSPITasks()
 {
 #ifndef USE_DMA_TRANSFERS
@@ -448,6 +500,9 @@ void ExecuteSPITasks()
       SPITask *task = GetTask();
       if (task)
       {
+#ifdef LATE_LATCH_PIXEL_TASKS
+        LatchTaskPixels(task);
+#endif
         RunSPITask(task);
         DoneTask(task);
       }
@@ -589,6 +644,9 @@ int InitSPI()
 #endif
 
   spiTaskMemory->queueHead = spiTaskMemory->queueTail = spiTaskMemory->spiBytesQueued = 0;
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+  spiTaskMemory->taskBeingRewritten = 0;
+#endif
 #endif
 
 #ifdef USE_DMA_TRANSFERS
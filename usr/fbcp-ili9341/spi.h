@@ -112,7 +112,14 @@ typedef struct __attribute__((packed)) SPITask
 #else
   uint8_t cmd;
 #endif
-  uint32_t dmaSpiHeader;
+#ifdef LATE_LATCH_PIXEL_TASKS
+  struct Frame *frame; // If not null, the SPI thread packs the pixels of the span below from this frame into data before sending, and releases the frame
+  uint16_t x, endX, y, endY, lastScanEndX; // The span of the frame to send, as in struct Span
+#endif
+#ifdef SOLID_FILL_TASKS
+  uint32_t fillSize; // If not zero, the task is a solid fill: data holds the fill color as a 32-bit word of two pixels, which is sent over and over for this many bytes
+#endif
+  uint32_t dmaSpiHeader; // Without ALL_TASKS_SHOULD_DMA, SPIDMATransfer() copies this and the data after it in one go, so only add fields needed in that mode above this
 #ifdef OFFLOAD_PIXEL_COPY_TO_DMA_CPP
   uint8_t *fb;
   uint8_t *prevFb;
@@ -131,6 +138,11 @@ typedef struct __attribute__((packed)) SPITask
   inline uint32_t PayloadSize() const { return size; }
   inline uint32_t *DmaSpiHeaderAddress() { return &dmaSpiHeader; }
 #endif
+#ifdef SOLID_FILL_TASKS
+  inline uint32_t BusSize() const { return fillSize ? fillSize : PayloadSize(); } // Number of bytes sent on the bus after the command
+#else
+  inline uint32_t BusSize() const { return PayloadSize(); }
+#endif
 
 } SPITask;
 
@@ -245,8 +257,11 @@ typedef struct SharedMemory
 #endif
   volatile uint32_t queueHead;
   volatile uint32_t queueTail;
-  volatile uint32_t spiBytesQueued; // Number of actual payload bytes in the queue
+  volatile uint32_t spiBytesQueued; // Number of bytes in the queue to be sent on the bus
   volatile uint32_t interruptsRaised;
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+  volatile uint32_t taskBeingRewritten; // 1 + offset in buffer of the task that the main thread is rewriting with newer pixels, or 0 if none
+#endif
   volatile uintptr_t sharedMemoryBaseInPhysMemory;
   volatile uint8_t buffer[];
 } SharedMemory;
@@ -351,12 +366,25 @@ static inline SPITask *AllocTask(uint32_t bytes) // Returns a pointer to a new S
 #ifdef OFFLOAD_PIXEL_COPY_TO_DMA_CPP
   task->fb = &task->data[0];
   task->prevFb = 0;
+#endif
+#ifdef LATE_LATCH_PIXEL_TASKS
+  task->frame = 0;
+#endif
+#ifdef SOLID_FILL_TASKS
+  task->fillSize = 0;
 #endif
   return task;
 }
 
+#ifdef VERIFY_HARDWARE_SCROLLING
+void ReplayTaskOnPanelModel(SPITask *task); // See panel_model.h
+#endif
+
 static inline void CommitTask(SPITask *task) // Advertises the given SPI task from main thread to worker, called on main thread
 {
+#ifdef VERIFY_HARDWARE_SCROLLING
+  ReplayTaskOnPanelModel(task);
+#endif
 #ifdef SPI_3WIRE_PROTOCOL
 #ifdef SPI_32BIT_COMMANDS
   Interleave16BitSPITaskTo32Bit(task);
@@ -369,13 +397,22 @@ static inline void CommitTask(SPITask *task) // Advertises the given SPI task fr
   uint32_t tail = spiTaskMemory->queueTail;
 #endif
   spiTaskMemory->queueTail = (uint32_t)((uint8_t*)task - spiTaskMemory->buffer) + sizeof(SPITask) + task->size;
-  __atomic_fetch_add(&spiTaskMemory->spiBytesQueued, task->PayloadSize()+1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&spiTaskMemory->spiBytesQueued, task->BusSize()+1, __ATOMIC_RELAXED);
   __sync_synchronize();
 #if !defined(KERNEL_MODULE_CLIENT) && !defined(KERNEL_MODULE)
   if (spiTaskMemory->queueHead == tail) syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0); // Wake the SPI thread if it was sleeping to get new tasks
 #endif
 }
 
+#ifdef SOLID_FILL_TASKS
+// Sets the color that the solid fill task sends. The task must have been allocated with room for 4 bytes of data.
+static inline void SetFillTaskColor(SPITask *task, uint16_t color)
+{
+  task->data[0] = task->data[2] = color >> 8;
+  task->data[1] = task->data[3] = color & 0xFF;
+}
+#endif
+
 #ifdef USE_SPI_THREAD
 #define IN_SINGLE_THREADED_MODE_RUN_TASK() ((void)0)
 #else
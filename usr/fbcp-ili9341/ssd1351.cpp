@@ -3,6 +3,7 @@
 #ifdef SSD1351
 
 #include "spi.h"
+#include "scroll.h"
 
 #include <memory.h>
 #include <stdio.h>
@@ -90,6 +91,9 @@ void TurnDisplayOn()
 
 void DeinitSPIDisplay()
 {
+#ifdef USE_HARDWARE_SCROLLING
+  DeinitHardwareScrolling();
+#endif
   ClearScreen();
 }
 
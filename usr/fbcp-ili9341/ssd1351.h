@@ -17,6 +17,11 @@
 #define DISPLAY_SET_CURSOR_Y 0x75
 #define DISPLAY_WRITE_PIXELS 0x5C
 
+// Set Display Start Line scrolls the whole display memory in hardware, wrapping around at its 128 rows, of which only the first
+// DISPLAY_NATIVE_HEIGHT rows after the start line are visible.
+#define DISPLAY_SET_SCROLL_START 0xA1
+#define DISPLAY_SCROLL_MEMORY_HEIGHT 128
+
 #define DISPLAY_NATIVE_WIDTH 128
 #define DISPLAY_NATIVE_HEIGHT 96
 
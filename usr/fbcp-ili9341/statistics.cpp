@@ -9,6 +9,7 @@
 #include <memory.h>
 #include <pthread.h>
 #include <syslog.h>
+#include <math.h>
 
 #include "tick.h"
 #include "text.h"
@@ -17,6 +18,9 @@
 #include "mailbox.h"
 #include "mem_alloc.h"
 #include "dma.h"
+#include "rolling_refresh.h"
+#include "diff_strategy.h"
+#include "presentation.h"
 
 volatile uint64_t timeWastedPollingGPU = 0;
 volatile float statsSpiBusSpeed = 0;
@@ -27,6 +31,16 @@ double spiThreadUtilizationRate;
 double spiBusDataRate;
 int statsGpuPollingWasted = 0;
 uint64_t statsBytesTransferred = 0;
+volatile uint64_t statsFrameCopyBytesSaved = 0;
+int statsNewFramesProcessed = 0;
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+uint64_t statsBytesSuperseded = 0;
+#endif
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+uint64_t statsToleratedPixels = 0;
+uint64_t statsToleratedSquaredError[3] = {};
+uint64_t statsToleranceDiffedPixels = 0;
+#endif
 
 int frameSkipTimeHistorySize = 0;
 uint64_t frameSkipTimeHistory[FRAME_HISTORY_MAX_SIZE] = {};
@@ -66,6 +80,22 @@ char cpuTemperatureText[32] = {};
 uint16_t cpuTemperatureColor = 0;
 char gpuPollingWastedText[32] = {};
 uint16_t gpuPollingWastedColor = 0;
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+char toleranceText[32] = {};
+#endif
+#ifdef USE_ROLLING_REFRESH
+char scanlineAgeText[32] = {};
+#endif
+#ifdef ADAPTIVE_DIFF_STRATEGY
+char diffStrategyText[32] = {};
+#endif
+#ifdef USE_PRESENTATION_SCHEDULER
+char frameIntervalDeviationText[32] = {};
+#endif
+char frameCopyText[32] = {};
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+char supersededText[32] = {};
+#endif
 
 char cpuMemoryUsedText[32] = {};
 char gpuMemoryUsedText[32] = {};
@@ -86,31 +116,68 @@ void UpdateStatisticsNumbers()
   statsCpuFrequency = (int)MailboxRet2(0x00030002/*Get Clock Rate*/, 0x3/*ARM*/) / 1000000;
 }
 
-void DrawStatisticsOverlay(uint16_t *framebuffer)
+static void WidenDrawnScanlines(int startY, int endY, int &drawnStartY, int &drawnEndY)
+{
+  startY = MAX(startY, 0);
+  endY = MIN(endY, gpuFrameHeight);
+  if (startY >= endY) return;
+  drawnStartY = MIN(drawnStartY, startY);
+  drawnEndY = MAX(drawnEndY, endY);
+}
+
+static void DrawOverlayText(uint16_t *framebuffer, const char *text, int x, int y, uint16_t color, int &drawnStartY, int &drawnEndY)
 {
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, fpsText, 1, 1, fpsColor, 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, statsFrameSkipText, strlen(fpsText)*6, 1, RGB565(31,0,0), 0);
+  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, text, x, y, color, 0);
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  // The text runs down the framebuffer, each character cell covering 6 scanlines
+  WidenDrawnScanlines(x, x + 6*strlen(text), drawnStartY, drawnEndY);
+#else
+  // The character cells have one scanline of background above the glyphs
+  WidenDrawnScanlines(y - 1, y + MONACO_HEIGHT - 1, drawnStartY, drawnEndY);
+#endif
+}
+
+void DrawStatisticsOverlay(uint16_t *framebuffer, int &drawnStartY, int &drawnEndY)
+{
+  DrawOverlayText(framebuffer, fpsText, 1, 1, fpsColor, drawnStartY, drawnEndY);
+  DrawOverlayText(framebuffer, statsFrameSkipText, strlen(fpsText)*6, 1, RGB565(31,0,0), drawnStartY, drawnEndY);
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+  DrawOverlayText(framebuffer, toleranceText, 1, 19, RGB565(20,50,31), drawnStartY, drawnEndY);
+#endif
+#ifdef USE_ROLLING_REFRESH
+  DrawOverlayText(framebuffer, scanlineAgeText, 1, 19, RGB565(31,50,20), drawnStartY, drawnEndY);
+#endif
+#ifdef ADAPTIVE_DIFF_STRATEGY
+  DrawOverlayText(framebuffer, diffStrategyText, 1, 19, RGB565(20,63,31), drawnStartY, drawnEndY);
+#endif
 
 #if DISPLAY_DRAWABLE_WIDTH > 130
 #ifdef USE_DMA_TRANSFERS
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, dmaChannelsText, 1, 10, RGB565(31, 44, 8), 0);
+  DrawOverlayText(framebuffer, dmaChannelsText, 1, 10, RGB565(31, 44, 8), drawnStartY, drawnEndY);
 #endif
 #ifdef USE_SPI_THREAD
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiUsagePercentageText, 75, 10, spiUsageColor, 0);
+  DrawOverlayText(framebuffer, spiUsagePercentageText, 75, 10, spiUsageColor, drawnStartY, drawnEndY);
 #endif
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiBusDataRateText, 60, 1, 0xFFFF, 0);
+  DrawOverlayText(framebuffer, spiBusDataRateText, 60, 1, 0xFFFF, drawnStartY, drawnEndY);
 #endif
 
 #if DISPLAY_DRAWABLE_WIDTH > 180
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiSpeedText, 120, 1, RGB565(31,14,20), 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiSpeedText2, 120, 10, RGB565(10,24,31), 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, cpuTemperatureText, 190, 1, cpuTemperatureColor, 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, gpuPollingWastedText, 222, 1, gpuPollingWastedColor, 0);
+  DrawOverlayText(framebuffer, spiSpeedText, 120, 1, RGB565(31,14,20), drawnStartY, drawnEndY);
+  DrawOverlayText(framebuffer, spiSpeedText2, 120, 10, RGB565(10,24,31), drawnStartY, drawnEndY);
+  DrawOverlayText(framebuffer, cpuTemperatureText, 190, 1, cpuTemperatureColor, drawnStartY, drawnEndY);
+  DrawOverlayText(framebuffer, gpuPollingWastedText, 222, 1, gpuPollingWastedColor, drawnStartY, drawnEndY);
+  DrawOverlayText(framebuffer, frameCopyText, 120, 19, RGB565(20,63,20), drawnStartY, drawnEndY);
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+  DrawOverlayText(framebuffer, supersededText, 190, 19, RGB565(31,40,10), drawnStartY, drawnEndY);
+#endif
 #endif
 
 #if (defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) && DISPLAY_DRAWABLE_HEIGHT >= 290) || (!defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) && DISPLAY_DRAWABLE_WIDTH >= 290)
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, cpuMemoryUsedText, 250, 1, RGB565(31,50,21), 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, gpuMemoryUsedText, 250, 10, RGB565(31,50,31), 0);
+  DrawOverlayText(framebuffer, cpuMemoryUsedText, 250, 1, RGB565(31,50,21), drawnStartY, drawnEndY);
+  DrawOverlayText(framebuffer, gpuMemoryUsedText, 250, 10, RGB565(31,50,31), drawnStartY, drawnEndY);
+#ifdef USE_PRESENTATION_SCHEDULER
+  DrawOverlayText(framebuffer, frameIntervalDeviationText, 250, 19, RGB565(31,63,20), drawnStartY, drawnEndY);
+#endif
 #endif
 
 #ifdef FRAME_COMPLETION_TIME_STATISTICS
@@ -148,6 +215,11 @@ void DrawStatisticsOverlay(uint16_t *framebuffer)
     framebuffer[AT(x, FRAMERATE_GRAPH_MAX_Y-1)] = RGB565(0,0,0);
     framebuffer[AT(x, FRAMERATE_GRAPH_MAX_Y)] = RGB565(15,30,15);
   }
+#ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
+  WidenDrawnScanlines(FRAMERATE_GRAPH_WIDTH - MIN(statsFrameIntervalsSize, FRAMERATE_GRAPH_WIDTH), FRAMERATE_GRAPH_WIDTH, drawnStartY, drawnEndY);
+#else
+  if (statsFrameIntervalsSize > 0) WidenDrawnScanlines(FRAMERATE_GRAPH_MIN_Y - 3, FRAMERATE_GRAPH_MAX_Y + 4, drawnStartY, drawnEndY); // The curve has 3 scanlines of border on both sides
+#endif
 #endif
 }
 
@@ -208,8 +280,59 @@ void RefreshStatisticsOverlayText()
   //const double gpuPollingWastedScalingFactor = 0.369; // A crude heuristic to scale time spent in useless polling to what Linux 'top' tool shows as % usage percentages
   statsGpuPollingWasted = (int)(wastedTime /** gpuPollingWastedScalingFactor*/ * 100 / (now - statsLastPrint));
 
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+  // Bytes that sending the tolerated pixels would have taken (not counting the cursor commands, so a slight underestimate), out of all bytes that would have
+  // been sent, and the PSNR of what the display showed versus the diffed frames, with each color channel scaled to [0,1]
+  if (statsToleranceDiffedPixels > 0)
+  {
+    uint64_t toleratedBytes = statsToleratedPixels * SPI_BYTESPERPIXEL;
+    int bytesSavedPercentage = (int)(toleratedBytes * 100 / MAX(1, toleratedBytes + statsBytesTransferred));
+    double meanSquaredError = (statsToleratedSquaredError[0] / (31.0*31.0) + statsToleratedSquaredError[1] / (63.0*63.0) + statsToleratedSquaredError[2] / (31.0*31.0))
+      / (3.0 * statsToleranceDiffedPixels);
+    if (meanSquaredError > 0) sprintf(toleranceText, "Tol:-%d%% %.1fdB", bytesSavedPercentage, 10.0 * log10(1.0 / meanSquaredError));
+    else sprintf(toleranceText, "Tol:-%d%% exact", bytesSavedPercentage);
+  }
+  statsToleratedPixels = statsToleranceDiffedPixels = 0;
+  statsToleratedSquaredError[0] = statsToleratedSquaredError[1] = statsToleratedSquaredError[2] = 0;
+#endif
+
+#ifdef USE_ROLLING_REFRESH
+  // The most updates that changed scanlines waited for before being sent
+  int maxSentScanlineAge = TakeMaxSentScanlineAge();
+  if (maxSentScanlineAge > 1) sprintf(scanlineAgeText, "Age:%d", maxSentScanlineAge);
+  else scanlineAgeText[0] = '\0';
+#endif
+
+#ifdef USE_PRESENTATION_SCHEDULER
+  // Standard deviation of the intervals that frames were captured at, and were handed over to be displayed at, in msecs
+  double capturedIntervalDeviation, presentedIntervalDeviation;
+  TakeFrameIntervalDeviations(&capturedIntervalDeviation, &presentedIntervalDeviation);
+  sprintf(frameIntervalDeviationText, "Jit:%.1f>%.1f", capturedIntervalDeviation / 1000.0, presentedIntervalDeviation / 1000.0);
+#endif
+
+#ifdef ADAPTIVE_DIFF_STRATEGY
+  // The update method in use, and how many times per second it changed
+  int diffStrategySwitches = TakeDiffStrategySwitches();
+  if (diffStrategySwitches > 0) sprintf(diffStrategyText, "Diff:%s %d/s", CurrentDiffStrategyName(), (int)(diffStrategySwitches * 1000000 / elapsed));
+  else sprintf(diffStrategyText, "Diff:%s", CurrentDiffStrategyName());
+#endif
+
   statsBytesTransferred = 0;
 
+  // Average number of bytes per new frame that were not copied, since frames were passed by reference instead
+  uint64_t frameCopyBytesSaved = __atomic_load_n(&statsFrameCopyBytesSaved, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&statsFrameCopyBytesSaved, frameCopyBytesSaved, __ATOMIC_RELAXED);
+  if (statsNewFramesProcessed > 0) sprintf(frameCopyText, "Cp:-%dKB/f", (int)(frameCopyBytesSaved / statsNewFramesProcessed / 1024));
+  else frameCopyText[0] = '\0';
+  statsNewFramesProcessed = 0;
+
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+  // Queued pixels that were sent with the contents of a newer frame instead of being sent twice
+  if (statsBytesSuperseded > 0) sprintf(supersededText, "Sup:%dKB/s", (int)(statsBytesSuperseded * 1000000 / elapsed / 1024));
+  else supersededText[0] = '\0';
+  statsBytesSuperseded = 0;
+#endif
+
   if (statsBcmCoreSpeed > 0 && statsCpuFrequency > 0) sprintf(spiSpeedText, "%d/%dMHz", statsCpuFrequency, statsBcmCoreSpeed);
   else spiSpeedText[0] = '\0';
 
@@ -288,5 +411,5 @@ void RefreshStatisticsOverlayText()
 }
 #else
 void RefreshStatisticsOverlayText() {}
-void DrawStatisticsOverlay(uint16_t *) {}
+void DrawStatisticsOverlay(uint16_t *, int &, int &) {}
 #endif // ~STATISTICS
@@ -5,7 +5,8 @@
 #include "gpu.h"
 
 void RefreshStatisticsOverlayText(void);
-void DrawStatisticsOverlay(uint16_t *framebuffer);
+// Draws the overlay on the given frame, and widens the range of scanlines [drawnStartY, drawnEndY[ to cover the scanlines that it drew on.
+void DrawStatisticsOverlay(uint16_t *framebuffer, int &drawnStartY, int &drawnEndY);
 
 #ifdef STATISTICS
 
@@ -18,6 +19,16 @@ extern double spiThreadUtilizationRate;
 extern double spiBusDataRate;
 extern int statsGpuPollingWasted;
 extern uint64_t statsBytesTransferred;
+extern volatile uint64_t statsFrameCopyBytesSaved; // Bytes of frame copies avoided by passing frames by reference since the last overlay refresh
+extern int statsNewFramesProcessed; // Number of new frames the main thread has processed since the last overlay refresh
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+extern uint64_t statsBytesSuperseded; // Bytes of queued pixel tasks rewritten with the pixels of newer frames since the last overlay refresh
+#endif
+#ifdef PERCEPTUAL_DIFF_TOLERANCE
+extern uint64_t statsToleratedPixels; // Changed pixels that the diffs left unsent since the last overlay refresh
+extern uint64_t statsToleratedSquaredError[3]; // Sum of squared red, green and blue differences of those pixels from the frames
+extern uint64_t statsToleranceDiffedPixels; // Number of pixels in the frames diffed since the last overlay refresh
+#endif
 
 extern int frameSkipTimeHistorySize;
 extern uint64_t frameSkipTimeHistory[FRAME_HISTORY_MAX_SIZE];
@@ -0,0 +1,172 @@
+#include <string.h> // memcmp, memcpy, memmove, memset
+
+#include "config.h"
+#include "supersede.h"
+#include "gpu.h"
+#include "pack_kernels.h"
+#include "util.h"
+#include "mem_alloc.h"
+
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+
+struct QueuedPixelTask
+{
+  uint32_t offset; // Where the task is in the SPI task ring buffer
+  // The tail of the ring buffer at the time the task was last known to be queued. Tasks allocated after that lie past this in the ring buffer, so
+  // if the task was sent and its memory reused since, it is no longer found between queueHead and this.
+  uint32_t knownQueuedUntil;
+  Span span;
+};
+
+static QueuedPixelTask *queuedTasks = 0;
+static int numQueuedTasks = 0, queuedTasksCapacity = 0;
+static uint8_t *rewrittenScanlines = 0; // Flags the scanlines of the previous framebuffer that were rewritten, to rehash them
+
+void InitQueuedPixelTaskTracking()
+{
+  queuedTasksCapacity = gpuFrameHeight;
+  queuedTasks = (QueuedPixelTask*)Malloc(queuedTasksCapacity*sizeof(QueuedPixelTask), "InitQueuedPixelTaskTracking() queued tasks");
+  rewrittenScanlines = (uint8_t*)Malloc(gpuFrameHeight, "InitQueuedPixelTaskTracking() rewritten scanlines");
+  memset(rewrittenScanlines, 0, gpuFrameHeight);
+  numQueuedTasks = 0;
+}
+
+void TrackQueuedPixelTask(SPITask *task, const Span &span)
+{
+  if (numQueuedTasks == queuedTasksCapacity)
+  {
+    QueuedPixelTask *tasks = (QueuedPixelTask*)Malloc(queuedTasksCapacity*2*sizeof(QueuedPixelTask), "TrackQueuedPixelTask() queued tasks");
+    memcpy(tasks, queuedTasks, numQueuedTasks*sizeof(QueuedPixelTask));
+    Free(queuedTasks, queuedTasksCapacity*sizeof(QueuedPixelTask));
+    queuedTasks = tasks;
+    queuedTasksCapacity *= 2;
+  }
+  QueuedPixelTask &t = queuedTasks[numQueuedTasks++];
+  t.offset = (uint32_t)((uint8_t*)task - spiTaskMemory->buffer);
+  t.knownQueuedUntil = spiTaskMemory->queueTail;
+  t.span = span;
+}
+
+// Distance from one position to another in the SPI task ring buffer, going forward from the first.
+static inline uint32_t QueueDistance(uint32_t from, uint32_t to)
+{
+  return (to >= from) ? to - from : to + SPI_QUEUE_SIZE - from;
+}
+
+// Returns true if the task is still queued, and the SPI thread has not started on it, given the current head and tail of the queue.
+static inline bool IsUnstarted(const QueuedPixelTask &t, uint32_t head, uint32_t tail)
+{
+  uint32_t offset = QueueDistance(head, t.offset), queuedUntil = QueueDistance(head, t.knownQueuedUntil);
+  return offset > 0 && offset < queuedUntil && queuedUntil <= QueueDistance(head, tail);
+}
+
+static bool SpanDiffers(const Span &span, const uint16_t *framebuffer, const uint16_t *prevFramebuffer)
+{
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  for(int y = span.y; y < span.endY; ++y)
+  {
+    int endX = (y + 1 == span.endY) ? span.lastScanEndX : span.endX;
+    if (memcmp(framebuffer + y*stride + span.x, prevFramebuffer + y*stride + span.x, (endX - span.x)*sizeof(uint16_t)))
+      return true;
+  }
+  return false;
+}
+
+int SupersedeQueuedPixelTasks(Frame *frame, uint16_t *prevFramebuffer)
+{
+  uint16_t *framebuffer = frame->pixels;
+  const int stride = gpuFramebufferScanlineStrideBytes>>1;
+  const uint32_t tail = spiTaskMemory->queueTail; // Only the main thread moves the tail
+  int firstKept = numQueuedTasks, bytesRewritten = 0;
+  bool anyRewritten = false;
+  // Go through the tasks from the newest to the oldest. The previous framebuffer holds what the last task to write each pixel sends, so where a task
+  // overlaps newer ones, it matches the new frame after those have been handled, and only the pixels that the task is the last one to write decide
+  // whether it needs rewriting. The newer tasks are queued after the older ones, so if an older task can still be rewritten, so could the newer ones.
+  for(int i = numQueuedTasks-1; i >= 0; --i)
+  {
+    QueuedPixelTask t = queuedTasks[i];
+    bool unstarted;
+    if (SpanDiffers(t.span, framebuffer, prevFramebuffer))
+    {
+      spiTaskMemory->taskBeingRewritten = t.offset + 1;
+      __sync_synchronize();
+      unstarted = IsUnstarted(t, spiTaskMemory->queueHead, tail);
+      SPITask *task = (SPITask*)(spiTaskMemory->buffer + t.offset);
+#ifdef SOLID_FILL_TASKS
+      uint16_t fillColor;
+      if (unstarted && task->fillSize)
+      {
+        // A fill task has no room for pixels, so it can only be rewritten if the span is still solid in the new frame. If not, the task keeps sending
+        // the old color, so leave it and the older tasks, which the display shows under it, as they are.
+        if (SpanIsSolidColor(framebuffer, t.span, &fillColor))
+        {
+          SetFillTaskColor(task, fillColor);
+          for(int y = t.span.y; y < t.span.endY; ++y)
+          {
+            int endX = (y + 1 == t.span.endY) ? t.span.lastScanEndX : t.span.endX;
+            memcpy(prevFramebuffer + y*stride + t.span.x, framebuffer + y*stride + t.span.x, (endX - t.span.x)*sizeof(uint16_t));
+            rewrittenScanlines[y] = 1;
+          }
+          bytesRewritten += task->fillSize;
+          anyRewritten = true;
+        }
+        else
+          unstarted = false;
+      }
+      else
+#endif
+      if (unstarted)
+      {
+#ifdef LATE_LATCH_PIXEL_TASKS
+        // The SPI thread has not fetched the pixels yet, so have it fetch them from the new frame instead.
+        Frame *oldFrame = task->frame;
+        AddFrameRef(frame);
+        task->frame = frame;
+        ReleaseFrame(oldFrame);
+#else
+        uint8_t *data = task->data;
+#endif
+        for(int y = t.span.y; y < t.span.endY; ++y)
+        {
+          int endX = (y + 1 == t.span.endY) ? t.span.lastScanEndX : t.span.endX;
+#ifdef LATE_LATCH_PIXEL_TASKS
+          memcpy(prevFramebuffer + y*stride + t.span.x, framebuffer + y*stride + t.span.x, (endX - t.span.x)*sizeof(uint16_t));
+#else
+          data = packKernel.PackPixels(data, framebuffer + y*stride + t.span.x, prevFramebuffer + y*stride + t.span.x, endX - t.span.x);
+#endif
+          rewrittenScanlines[y] = 1;
+        }
+        bytesRewritten += task->PayloadSize();
+        anyRewritten = true;
+      }
+      __sync_synchronize();
+      spiTaskMemory->taskBeingRewritten = 0;
+    }
+    else
+      unstarted = IsUnstarted(t, spiTaskMemory->queueHead, tail);
+
+    if (!unstarted) break; // The SPI thread has reached this task, so it has started on all the older ones too (or it is a fill task that stays as it is)
+
+    // Nothing gets allocated in between, so the task is known to stay queued at least until the current tail
+    t.knownQueuedUntil = tail;
+    queuedTasks[--firstKept] = t;
+  }
+  numQueuedTasks -= firstKept;
+  memmove(queuedTasks, queuedTasks + firstKept, numQueuedTasks*sizeof(QueuedPixelTask));
+
+#ifdef USE_SCANLINE_HASHES
+  if (anyRewritten)
+    for(int y = 0; y < gpuFrameHeight; ++y)
+      if (rewrittenScanlines[y])
+        prevScanlineHashes[y] = HashScanline(prevFramebuffer + y*stride, gpuFrameWidth);
+#endif
+  if (anyRewritten) memset(rewrittenScanlines, 0, gpuFrameHeight);
+  return bytesRewritten;
+}
+
+void ForgetQueuedPixelTasks()
+{
+  numQueuedTasks = 0;
+}
+
+#endif
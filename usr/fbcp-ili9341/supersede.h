@@ -0,0 +1,32 @@
+#pragma once
+
+#include "config.h"
+#include "spi.h"
+#include "diff.h"
+#include "frame_pool.h"
+
+#ifdef SUPERSEDE_QUEUED_PIXEL_TASKS
+
+// The main thread keeps track of the pixel tasks that it has queued for the SPI thread, and which span of the framebuffer each one covers. When a new
+// frame arrives, the tasks that the SPI thread has not started on yet are rewritten with the pixels of the new frame, and the previous framebuffer is
+// updated to match, so that the diff of the new frame only picks up the changes that are not already on their way to the display.
+//
+// The SPI thread starts on a task by advancing queueHead to it, and the main thread only starts rewriting a task after announcing it in
+// SharedMemory::taskBeingRewritten, and then seeing that queueHead has not reached it. Both sides write first and read the other's write after a
+// full barrier, so at least one of them sees the other: either the main thread leaves the task alone, or the SPI thread waits for the rewrite to finish.
+
+// Allocates the tracking state. Call after InitGPU().
+void InitQueuedPixelTaskTracking(void);
+
+// Remembers that the given committed pixel task sends the pixels of the given span.
+void TrackQueuedPixelTask(SPITask *task, const Span &span);
+
+// Rewrites the tracked pixel tasks that have not been started yet, and whose span differs between the given frame and prevFramebuffer, with the pixels
+// of the frame, and copies those pixels over to prevFramebuffer. With LATE_LATCH_PIXEL_TASKS, the tasks are pointed to the frame instead. Solid fill
+// tasks are only rewritten with a new color if their span is still solid. Forgets the tasks that have been started. Returns the number of bytes rewritten.
+int SupersedeQueuedPixelTasks(Frame *frame, uint16_t *prevFramebuffer);
+
+// Forgets all tracked tasks, for when the scanlines of the framebuffers no longer correspond to the display rows that the queued tasks write to.
+void ForgetQueuedPixelTasks(void);
+
+#endif
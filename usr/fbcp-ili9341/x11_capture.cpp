@@ -0,0 +1,285 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef CAPTURE_FROM_X11
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/extensions/Xdamage.h>
+
+#include "x11_capture.h"
+#include "capture_sampler.h"
+#include "damage_hints.h"
+#include "gpu.h"
+#include "tick.h"
+#include "util.h"
+
+// While no damage is reported, the GPU polling thread still wakes up this often to notice when the program is quitting
+#define IDLE_WAKEUP_MSECS 500
+
+// Damaged scanlines that are at most this far apart are read from the X server in one request, to save round trips to it
+#define MAX_SCANLINE_GAP_TO_MERGE 16
+
+extern volatile bool programRunning;
+
+static Display *x11Display = 0;
+static Window rootWindow = 0;
+static int damageEventBase = 0;
+static Damage damage = 0;
+static XserverRegion damageRegion = 0;
+static bool damagePending = false; // True if XDamage has reported damage that has not been captured yet
+static bool wholeScreenDamaged = true; // True if the whole screen needs to be read, e.g. at startup or after the screen was resized
+
+static XShmSegmentInfo shmInfo = {};
+static XImage *mirror = 0; // Mirrors the contents of the root window in shared memory
+static CaptureSource source = {};
+static int x11ErrorCode = 0; // Set when the X server reports that a request failed
+
+static int X11ErrorHandler(Display *display, XErrorEvent *error)
+{
+  char text[256];
+  XGetErrorText(display, error->error_code, text, sizeof(text));
+  printf("X request %d failed: %s\n", error->request_code, text);
+  x11ErrorCode = error->error_code;
+  return 0; // The default handler would quit the program
+}
+
+static void DestroyMirror()
+{
+  if (!mirror) return;
+  XShmDetach(x11Display, &shmInfo);
+  XDestroyImage(mirror); // Does not free the pixels of a shared memory image
+  shmdt(shmInfo.shmaddr);
+  mirror = 0;
+}
+
+// Creates the shared memory image that mirrors the root window
+static bool CreateMirror(int width, int height)
+{
+  DestroyMirror();
+  const int screen = DefaultScreen(x11Display);
+  mirror = XShmCreateImage(x11Display, DefaultVisual(x11Display, screen), DefaultDepth(x11Display, screen), ZPixmap, 0, &shmInfo, width, height);
+  if (!mirror) return false;
+  shmInfo.shmid = shmget(IPC_PRIVATE, mirror->bytes_per_line * mirror->height, IPC_CREAT | 0600);
+  shmInfo.shmaddr = (shmInfo.shmid >= 0) ? (char*)shmat(shmInfo.shmid, 0, 0) : (char*)-1;
+  if (shmInfo.shmaddr == (char*)-1)
+  {
+    printf("Failed to allocate %d bytes of shared memory for the X11 capture (%s)\n", mirror->bytes_per_line * mirror->height, strerror(errno));
+    if (shmInfo.shmid >= 0) shmctl(shmInfo.shmid, IPC_RMID, 0);
+    XDestroyImage(mirror);
+    mirror = 0;
+    return false;
+  }
+  mirror->data = shmInfo.shmaddr;
+  shmInfo.readOnly = False;
+  x11ErrorCode = 0;
+  XShmAttach(x11Display, &shmInfo);
+  XSync(x11Display, False); // The X server needs to have attached the segment before it is marked for removal
+  shmctl(shmInfo.shmid, IPC_RMID, 0); // Removed when both have detached, even if the program does not quit gracefully
+  if (x11ErrorCode)
+  {
+    shmdt(shmInfo.shmaddr);
+    XDestroyImage(mirror);
+    mirror = 0;
+    return false;
+  }
+
+  source.pixels = (const uint8_t*)mirror->data;
+  source.pitch = mirror->bytes_per_line;
+  source.width = width;
+  source.height = height;
+  source.bytesPerPixel = mirror->bits_per_pixel / 8;
+  source.bgr = (mirror->red_mask == 0xFF || mirror->red_mask == 0x1F);
+  return true;
+}
+
+static void ProcessEvents()
+{
+  while(XPending(x11Display))
+  {
+    XEvent event;
+    XNextEvent(x11Display, &event);
+    if (event.type == damageEventBase + XDamageNotify)
+      damagePending = true;
+    else if (event.type == ConfigureNotify && event.xconfigure.window == rootWindow && mirror
+      && (event.xconfigure.width != mirror->width || event.xconfigure.height != mirror->height))
+    {
+      // The screen was resized, e.g. with xrandr. The capture rectangle stays as it was, so it is captured for as long as it still fits.
+      printf("X screen was resized to %dx%d\n", event.xconfigure.width, event.xconfigure.height);
+      if (!CreateMirror(event.xconfigure.width, event.xconfigure.height)) printf("Failed to resize the X11 capture image\n");
+      wholeScreenDamaged = true;
+    }
+  }
+}
+
+void InitX11Capture(int *displayWidth, int *displayHeight)
+{
+#ifdef X11_CAPTURE_DISPLAY
+  const char *displayName = X11_CAPTURE_DISPLAY;
+#else
+  const char *displayName = getenv("DISPLAY") ? 0 : ":0"; // Services are started without DISPLAY set
+#endif
+  x11Display = XOpenDisplay(displayName);
+  if (!x11Display) FATAL_ERROR("Failed to connect to the X server! (Set X11_CAPTURE_DISPLAY in config.h, and XAUTHORITY if the X server requires authorization)");
+  XSetErrorHandler(X11ErrorHandler);
+  rootWindow = DefaultRootWindow(x11Display);
+
+  int errorBase, major = 1, minor = 1;
+  if (!XShmQueryExtension(x11Display)) FATAL_ERROR("The X server does not support the MIT-SHM extension, or runs on another computer!");
+  if (!XFixesQueryExtension(x11Display, &errorBase, &errorBase) || !XFixesQueryVersion(x11Display, &major, &minor) || major < 2)
+    FATAL_ERROR("The X server does not support the XFixes extension version 2!");
+  major = minor = 1;
+  if (!XDamageQueryExtension(x11Display, &damageEventBase, &errorBase) || !XDamageQueryVersion(x11Display, &major, &minor))
+    FATAL_ERROR("The X server does not support the XDamage extension!");
+
+  XWindowAttributes attributes;
+  XGetWindowAttributes(x11Display, rootWindow, &attributes);
+  if (!CreateMirror(attributes.width, attributes.height)) FATAL_ERROR("Failed to set up a MIT-SHM image for capturing the X screen!");
+  if (!((mirror->bits_per_pixel == 16 && mirror->green_mask == 0x07E0) || (mirror->bits_per_pixel == 32 && mirror->green_mask == 0xFF00)))
+  {
+    printf("The X screen has %d bits per pixel, with a green mask of 0x%lX. Only 16bpp RGB565 and 24/32bpp XRGB8888 screens (or BGR of either) can be captured\n", mirror->bits_per_pixel, mirror->green_mask);
+    FATAL_ERROR("Unsupported X screen pixel format!");
+  }
+
+  // Only ask to be notified when the damage turns from empty to non-empty: the damaged region is taken and emptied on each capture
+  damage = XDamageCreate(x11Display, rootWindow, XDamageReportNonEmpty);
+  damageRegion = XFixesCreateRegion(x11Display, 0, 0);
+  XSelectInput(x11Display, rootWindow, StructureNotifyMask);
+  XSync(x11Display, False);
+
+  *displayWidth = attributes.width;
+  *displayHeight = attributes.height;
+  printf("Capturing X display %s: %dx%d, %d bits per pixel\n", XDisplayString(x11Display), attributes.width, attributes.height, mirror->bits_per_pixel);
+}
+
+void DeinitX11Capture()
+{
+  if (!x11Display) return;
+  DestroyMirror();
+  if (damage) XDamageDestroy(x11Display, damage);
+  if (damageRegion) XFixesDestroyRegion(x11Display, damageRegion);
+  XCloseDisplay(x11Display);
+  x11Display = 0;
+  damage = 0;
+  damageRegion = 0;
+}
+
+void WaitForX11Damage(uint64_t earliestTime)
+{
+  // Sleep on the connection to the X server until it sends a damage event
+  ProcessEvents();
+  while(!damagePending && !wholeScreenDamaged && programRunning)
+  {
+    pollfd pfd = { ConnectionNumber(x11Display), POLLIN, 0 };
+    poll(&pfd, 1, IDLE_WAKEUP_MSECS);
+    ProcessEvents();
+  }
+
+  uint64_t now = tick();
+  if (earliestTime > now && programRunning) usleep(MIN(earliestTime - now, 1000000));
+}
+
+// Reads the scanlines [y, y+height[ of the root window into the mirror. XShmGetImage() writes an image as wide as the mirror to where the data of the
+// image points to in the shared memory segment, so pointing it at a scanline of the mirror reads whole scanlines in place.
+static bool ReadScanlines(int y, int height)
+{
+  char *data = mirror->data;
+  int mirrorHeight = mirror->height;
+  mirror->data = shmInfo.shmaddr + y * mirror->bytes_per_line;
+  mirror->height = height;
+  x11ErrorCode = 0;
+  bool success = XShmGetImage(x11Display, rootWindow, mirror, 0, y, AllPlanes) && !x11ErrorCode;
+  mirror->data = data;
+  mirror->height = mirrorHeight;
+  return success;
+}
+
+bool SnapshotX11Framebuffer(uint16_t *destination)
+{
+  ProcessEvents();
+  if (!mirror) return false;
+
+  XRectangle *damagedRects = 0;
+  int numDamagedRects = 0;
+  if (damagePending)
+  {
+    // Take the damaged region and empty it, so that XDamage sends an event on the next change
+    damagePending = false;
+    XDamageSubtract(x11Display, damage, None, damageRegion);
+    damagedRects = XFixesFetchRegion(x11Display, damageRegion, &numDamagedRects);
+  }
+  XRectangle wholeScreen = { 0, 0, (unsigned short)mirror->width, (unsigned short)mirror->height };
+  const XRectangle *rects = damagedRects;
+  int numRects = numDamagedRects;
+  if (wholeScreenDamaged)
+  {
+    rects = &wholeScreen;
+    numRects = 1;
+    wholeScreenDamaged = false;
+  }
+
+  // The rectangles of a region are sorted by their top edges, so the scanlines that they cover are merged to bands in one pass
+  bool success = true;
+  int bandTop = 0, bandBottom = 0;
+  int left = mirror->width, top = mirror->height, right = 0, bottom = 0; // Bounding box of the damage
+  for(int i = 0; i < numRects && success; ++i)
+  {
+    int x0 = MAX(0, rects[i].x), y0 = MAX(0, rects[i].y);
+    int x1 = MIN(mirror->width, rects[i].x + rects[i].width), y1 = MIN(mirror->height, rects[i].y + rects[i].height);
+    if (x0 >= x1 || y0 >= y1) continue;
+    left = MIN(left, x0); top = MIN(top, y0); right = MAX(right, x1); bottom = MAX(bottom, y1);
+    if (bandBottom > bandTop && y0 <= bandBottom + MAX_SCANLINE_GAP_TO_MERGE)
+      bandBottom = MAX(bandBottom, y1);
+    else
+    {
+      if (bandBottom > bandTop) success = ReadScanlines(bandTop, bandBottom - bandTop);
+      bandTop = y0;
+      bandBottom = y1;
+    }
+  }
+  if (success && bandBottom > bandTop) success = ReadScanlines(bandTop, bandBottom - bandTop);
+
+  if (!success)
+  {
+    wholeScreenDamaged = true; // Not known what was read, so read everything on the next capture
+    if (damagedRects) XFree(damagedRects);
+    return false;
+  }
+
+#ifdef USE_DAMAGE_HINTS
+  // Pass the damage on as hints to only diff where the screen changed
+  if (right > left)
+  {
+    DamageHintRect hints[DAMAGE_HINT_MAX_RECTS];
+    int numHints = 0;
+    if (numRects <= DAMAGE_HINT_MAX_RECTS)
+      for(int i = 0; i < numRects; ++i)
+      {
+        int x0 = MAX(0, rects[i].x), y0 = MAX(0, rects[i].y);
+        int x1 = MIN(mirror->width, rects[i].x + rects[i].width), y1 = MIN(mirror->height, rects[i].y + rects[i].height);
+        if (x0 >= x1 || y0 >= y1) continue;
+        hints[numHints++] = { (uint16_t)x0, (uint16_t)y0, (uint16_t)(x1 - x0), (uint16_t)(y1 - y0) };
+      }
+    else
+      hints[numHints++] = { (uint16_t)left, (uint16_t)top, (uint16_t)(right - left), (uint16_t)(bottom - top) };
+    AddCapturedDamage(hints, numHints);
+  }
+#endif
+  if (damagedRects) XFree(damagedRects);
+  if (right <= left) return false; // The damage was outside the screen, or already captured
+
+  return SampleCaptureSource(source, 0, 0, destination);
+}
+
+#endif
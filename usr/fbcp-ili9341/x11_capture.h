@@ -0,0 +1,24 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef CAPTURE_FROM_X11
+// Captures frames from the root window of an X server (X11_CAPTURE_DISPLAY), e.g. a kiosk desktop, or Xvfb for testing. XDamage reports which
+// areas of the screen changed, and only those are read from the X server, through a MIT-SHM shared memory image that mirrors the screen. The
+// damaged areas are also passed on as damage hints, so that only they get diffed. The GPU polling thread sleeps until the X server reports damage.
+
+// Connects to the X server and sets up the damage tracking and the shared memory image, and returns the size of the screen.
+void InitX11Capture(int *displayWidth, int *displayHeight);
+
+void DeinitX11Capture(void);
+
+// Blocks until the X server reports that something on the screen changed, and then until the given time, so that damage that follows closely is
+// captured all at once.
+void WaitForX11Damage(uint64_t earliestTime);
+
+// Reads the areas that were damaged since the previous capture into the mirror of the screen, and samples the capture rectangle (see
+// SetCaptureRectangle()) of it into destination. Returns false if nothing changed, or nothing could be captured.
+bool SnapshotX11Framebuffer(uint16_t *destination);
+#endif